@@ -29,6 +29,7 @@ setup(
     author='Quantopian Inc.',
     author_email='opensource@gmail.com',
     packages=find_packages(),
+    package_data={'warp_prism.bench': ['memory_baseline.json']},
     long_description=long_description,
     license='Apache 2.0',
     classifiers=classifiers,
@@ -38,7 +39,8 @@ setup(
             'warp_prism._warp_prism',
             ['warp_prism/_warp_prism.c'],
             include_dirs=[np.get_include()],
-            extra_compile_args=['-std=c99', '-Wall', '-Wextra'],
+            extra_compile_args=['-std=c99', '-Wall', '-Wextra', '-pthread'],
+            extra_link_args=['-pthread'],
         ),
     ],
     install_requires=[
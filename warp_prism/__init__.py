@@ -1,4 +1,7 @@
 from io import BytesIO
+import numbers
+import operator
+import random
 
 from datashape import discover
 from datashape.predicates import istabular
@@ -9,8 +12,25 @@ import sqlalchemy as sa
 from sqlalchemy.ext.compiler import compiles
 from toolz import keymap
 
+from .capture import write_capture
+from .lazy import LazyText
+from ._rss import current_rss, peak_rss, reset_peak_rss
+try:
+    # private, but the only way to build a sparse array from its values
+    from pandas._libs.sparse import IntIndex as _IntIndex
+except ImportError:
+    _IntIndex = None
 from ._warp_prism import (
+    clock as _clock,
+    count_rows as _count_rows,
+    new_sampler as _new_sampler,
     raw_to_arrays as _raw_to_arrays,
+    raw_to_groupby as _raw_to_groupby,
+    raw_to_pivot as _raw_to_pivot,
+    sampler_result as _sampler_result,
+    sampler_write as _sampler_write,
+    sparse_typeid as _sparse_typeid,
+    text_typeid_map as _text_typeid_map,
     typeid_map as _raw_typeid_map,
 )
 
@@ -19,7 +39,9 @@ __version__ = '0.1.1'
 
 
 _typeid_map = keymap(np.dtype, _raw_typeid_map)
+_dtypes_by_typeid = {v: k for k, v in _typeid_map.items()}
 _object_type_id = _raw_typeid_map['object']
+_lazy_text_type_id = _text_typeid_map['lazy']
 
 
 class _CopyToBinary(sa.sql.expression.Executable, sa.sql.ClauseElement):
@@ -80,6 +102,80 @@ def _warp_prism_types(query):
             )
 
 
+def _apply_column_options(column_names,
+                          types,
+                          *,
+                          text_dtypes,
+                          truncate_text,
+                          lazy_text,
+                          sparse):
+    """Replace the type ids of text columns which should be decoded into
+    fixed width numpy columns or lazily, and of columns which should be
+    decoded sparsely.
+
+    Parameters
+    ----------
+    column_names : list[str]
+        The names of the columns.
+    types : tuple[int]
+        The type ids of the columns.
+    text_dtypes : dict[str, str or np.dtype]
+        A map from column name to an ``S<n>`` or ``U<n>`` dtype.
+    truncate_text : bool
+        Truncate values which do not fit instead of raising an error.
+    lazy_text : iterable[str]
+        The names of the columns to decode lazily.
+    sparse : iterable[str]
+        The names of the columns to decode sparsely.
+
+    Returns
+    -------
+    types : tuple[int or tuple]
+        The type ids to pass to ``raw_to_arrays``.
+    """
+    types = list(types)
+    positions = {name: n for n, name in enumerate(column_names)}
+
+    def column(name, option):
+        try:
+            return positions[name]
+        except KeyError:
+            raise ValueError('unknown column in %s: %r' % (option, name))
+
+    def text_column(name, option):
+        n = column(name, option)
+        if types[n] != _object_type_id:
+            raise TypeError('column %r is not a text column' % name)
+        return n
+
+    for name, dtype in text_dtypes.items():
+        n = text_column(name, 'text_dtypes')
+        dtype = np.dtype(dtype)
+        if dtype.kind not in 'SU' or not dtype.itemsize:
+            raise TypeError(
+                'text_dtypes must be S<n> or U<n> dtypes, got %s for'
+                ' column %r' % (dtype, name),
+            )
+        width = dtype.itemsize
+        if dtype.kind == 'U':
+            width //= 4
+        types[n] = _text_typeid_map[dtype.kind], width, truncate_text
+
+    for name in lazy_text:
+        types[text_column(name, 'lazy_text')] = _lazy_text_type_id
+
+    for name in sparse:
+        n = column(name, 'sparse')
+        if not isinstance(types[n], int) or types[n] == _object_type_id:
+            raise TypeError(
+                'column %r cannot be sparse; only numeric, bool, and'
+                ' datetime columns can be' % name,
+            )
+        types[n] = _sparse_typeid, types[n]
+
+    return tuple(types)
+
+
 def _getbind(selectable, bind):
     """Return an explicitly passed connection or infer the connection from
     the selectable.
@@ -104,7 +200,178 @@ def _getbind(selectable, bind):
     return sa.create_engine(bind)
 
 
-def to_arrays(query, *, bind=None):
+def _phase_mark(reset_peak=False):
+    """Read the clocks and memory use at a phase boundary.
+
+    Parameters
+    ----------
+    reset_peak : bool, optional
+        Reset the peak resident set size for the next phase. This resets it
+        for the whole process, which breaks any peak memory monitoring of the
+        caller, so only the benchmarks do it.
+
+    Returns
+    -------
+    mark : (float, float, int or None, int)
+        The wall clock, cpu clock, resident set size, and the peak resident
+        set size. The resident set size is None where ``/proc`` is not
+        available.
+    """
+    wall, cpu = _clock()
+    mark = wall, cpu, current_rss(), peak_rss()
+    if reset_peak:
+        reset_peak_rss()
+    return mark
+
+
+class _FirstWriteBytesIO(BytesIO):
+    """A BytesIO which takes a phase mark at the first write.
+    """
+    first_write = None
+
+    def write(self, data):
+        if self.first_write is None:
+            self.first_write = _phase_mark()
+        return super().write(data)
+
+
+class _RowLimitReached(Exception):
+    """Raised out of ``copy_expert`` once ``max_rows`` rows have arrived.
+    """
+
+
+class _RowLimitBytesIO(BytesIO):
+    """A BytesIO which counts the rows of binary COPY data as it is written
+    and stops the copy by raising ``_RowLimitReached`` once a row past
+    ``max_rows`` starts to arrive. The data is then cut after the last row
+    and ended, so it can be decoded like a complete result. A result with no
+    more than ``max_rows`` rows is copied to the end as usual.
+    """
+    def __init__(self, max_rows):
+        super().__init__()
+        self.max_rows = max_rows
+        self.rows = 0
+        # the start of the first row which has not been counted, or None
+        # until the whole header has arrived
+        self._cursor = None
+
+    def write(self, data):
+        written = super().write(data)
+        if self._cursor is None or self.rows < self.max_rows:
+            with self.getbuffer() as view:
+                cursor, rows, _ = _count_rows(
+                    view,
+                    -1 if self._cursor is None else self._cursor,
+                    self.max_rows - self.rows,
+                )
+            self._cursor = None if cursor == -1 else cursor
+            self.rows += rows
+        if self.rows == self.max_rows and self._cursor is not None:
+            with self.getbuffer() as view:
+                after = bytes(view[self._cursor:self._cursor + 2])
+            if len(after) < 2 or after == b'\xff\xff':
+                # wait for the next row, or let the copy end by itself
+                return written
+            self.truncate(self._cursor)
+            self.seek(self._cursor)
+            BytesIO.write(self, b'\xff\xff')
+            raise _RowLimitReached()
+        return written
+
+
+class _FirstWriteRowLimitBytesIO(_FirstWriteBytesIO, _RowLimitBytesIO):
+    """A ``_RowLimitBytesIO`` which takes a phase mark at the first write.
+    """
+
+
+class _SampleBytesIO(BytesIO):
+    """A BytesIO which samples the rows of binary COPY data as they are
+    written and only keeps the sampled rows. Rows which are split between
+    writes are held until the rest of the row arrives. Once the copy is done
+    ``getbuffer`` returns the sampled rows as complete COPY data.
+
+    Parameters
+    ----------
+    type_ids : tuple
+        The type ids of the columns.
+    sample : tuple
+        The ``sample`` argument of ``raw_to_arrays``.
+    filters : tuple, optional
+        The ``filters`` argument of ``raw_to_arrays``. Only the rows which
+        match are sampled.
+    """
+    def __init__(self, type_ids, sample, filters=None):
+        super().__init__()
+        self._sampler = _new_sampler(type_ids, sample, filters=filters)
+        self._pending = b''
+        self.filtered_rows = None
+
+    def write(self, data):
+        written = len(data)
+        if self._pending:
+            data = self._pending + data
+        used = _sampler_write(self._sampler, data)
+        self._pending = bytes(data[used:])
+        return written
+
+    def getbuffer(self):
+        if self._sampler is not None:
+            data, self.filtered_rows = _sampler_result(self._sampler)
+            self._sampler = None
+            super().write(data)
+        return super().getbuffer()
+
+
+class _FirstWriteSampleBytesIO(_FirstWriteBytesIO, _SampleBytesIO):
+    """A ``_SampleBytesIO`` which takes a phase mark at the first write.
+    """
+
+
+def _record_phase(stats, phase, start, stop):
+    """Record the time and memory spent in a phase.
+
+    Parameters
+    ----------
+    stats : dict
+        The stats dict to write into.
+    phase : str
+        The name of the phase.
+    start, stop : tuple
+        The phase marks at the start and end of the phase.
+    """
+    stats[phase + '_wall_time'] = stop[0] - start[0]
+    stats[phase + '_cpu_time'] = stop[1] - start[1]
+    _record_phase_memory(stats, phase, stop)
+
+
+def _record_phase_memory(stats, phase, stop):
+    stats[phase + '_rss'] = stop[2]
+    stats[phase + '_peak_rss'] = stop[3]
+
+
+def to_arrays(query,
+              *,
+              bind=None,
+              stats=None,
+              capture=None,
+              intern_text=False,
+              text_dtypes=None,
+              truncate_text=False,
+              lazy_text=(),
+              column_stats=False,
+              sparse=(),
+              asof_keys=(),
+              asof_version=None,
+              asof_cutoff=None,
+              split_by=None,
+              sort_by=(),
+              partition_by=None,
+              npartitions=None,
+              max_rows=None,
+              filters=(),
+              sample_size=None,
+              sample_rate=None,
+              sample_seed=None):
     """Run the query returning a the results as np.ndarrays.
 
     Parameters
@@ -114,26 +381,465 @@ def to_arrays(query, *, bind=None):
     bind : sa.Engine, optional
         The engine used to create the connection. If not provided
         ``query.bind`` will be used.
+    stats : dict, optional
+        A dict to fill with statistics about the call:
+
+        - ``rows``, ``input_bytes``: the size of the result.
+        - ``null_counts``: a map from column name to the number of NULLs.
+        - ``grow_count``: the number of times the output columns grew.
+        - ``bytes_copied``: the bytes moved while growing and finalizing the
+          output columns.
+        - ``peak_buffer_bytes``: the most output column memory held at once.
+        - ``output_bytes``: the size of the result arrays and masks.
+        - ``tracked_peak_bytes``: the most memory held at once by the COPY
+          data and the output columns.
+        - ``<phase>_wall_time``, ``<phase>_cpu_time``: the seconds spent in
+          each phase; the phases are ``query`` (until the first COPY data
+          arrives), ``copy``, ``decode``, and ``finalize``.
+        - ``<phase>_rss``, ``<phase>_peak_rss``: the resident set size at the
+          end of the phase and the peak resident set size of the process so
+          far. The ``decode`` phase includes ``finalize`` here. The peak is
+          never reset, so it is not disturbed for other monitoring. The
+          resident set size is None where ``/proc`` is not available.
+    capture : str or file-like, optional
+        A path or binary file to write the raw COPY data, the column types,
+        and the sql to before decoding. The capture can be decoded again
+        without a database with ``warp_prism.capture.read_capture`` or timed
+        with ``python -m warp_prism.bench.replay``.
+    intern_text : bool, optional
+        Create each distinct text value once per column and share it between
+        the rows. This saves time and memory for columns with few distinct
+        values; columns which turn out to be mostly unique fall back to
+        creating a string per row. ``stats['intern_hits']`` counts the shared
+        values.
+    text_dtypes : dict[str, str or np.dtype], optional
+        A map from the name of a text column to an ``S<n>`` or ``U<n>`` dtype.
+        These columns are decoded straight into fixed width numpy storage
+        instead of an object array of strings. ``S`` columns hold the raw
+        utf-8 bytes. NULLs are empty strings.
+    truncate_text : bool, optional
+        Cut values which do not fit in the width given by ``text_dtypes``
+        down to size. By default these raise a ``ValueError``.
+    lazy_text : iterable[str], optional
+        The names of text columns to decode lazily. These columns are
+        returned as ``warp_prism.lazy.LazyText`` objects which record where
+        each value is in the COPY data and only create the strings on
+        element access or ``materialize()``. This is much faster for columns
+        which are only read for a few rows, but the COPY data is kept alive
+        as long as the column.
+    column_stats : bool, optional
+        Summarize each column while decoding. This requires ``stats`` and
+        sets ``stats['column_stats']`` to a map from column name to a dict
+        with the ``null_count`` and, for numeric and datetime columns, the
+        ``min``, ``max``, ``monotonic_increasing``, and
+        ``monotonic_decreasing`` of the non-NULL, non-NaN values. ``min`` and
+        ``max`` are None when there are no such values.
+    sparse : iterable[str], optional
+        The names of numeric, bool, or datetime columns to decode sparsely.
+        Only the non-NULL values are stored, so the memory scales with the
+        number of values instead of the number of rows. These columns are
+        returned as ``(values, indices)`` where ``indices`` holds the int64
+        row number of each value.
+    asof_keys : iterable[str], optional
+        The names of the columns which identify a record, for example
+        ``sid`` and ``asof_date``. Requires ``asof_version``.
+    asof_version : str, optional
+        The name of an integer, datetime, or date column, for example
+        ``timestamp``. Only the row with the latest version of each record is
+        returned; of rows with the same version the last one wins. Rows with a
+        NULL version are dropped. The other rows are dropped before decoding
+        so they never reach the output arrays. ``stats['asof_dropped_rows']``
+        counts them.
+    asof_cutoff : scalar, optional
+        Ignore the versions after this one, giving the records as they were
+        known at the cutoff.
+    split_by : str, optional
+        The name of an integer, datetime, or date column, for example
+        ``sid``. The rows are moved so that the rows of each key are next to
+        each other, in the order they were read, with the keys sorted and the
+        rows with a NULL key last. This replaces a query per key or a
+        ``groupby`` of the results.
+    sort_by : str or iterable[str], optional
+        The names of integer, float, bool, datetime, or date columns to sort
+        the rows by, in ascending order with NULLs and NaNs last. Rows with
+        equal keys keep their order. The sort runs on the COPY data before
+        decoding, so the database does not need an ``ORDER BY``. Large
+        results are radix sorted with one thread per CPU. With ``split_by``
+        the rows of each label are sorted.
+    partition_by : str or iterable[str], optional
+        The names of integer, datetime, or date columns to partition the rows
+        by. Requires ``npartitions``. The rows are grouped by partition while
+        they are decoded and a list with the arrays of each partition is
+        returned instead of one map. The partitions are views of one
+        allocation. A row's partition is
+        ``hash_partitions(keys, npartitions)``, so other processes can find
+        the partition of a key. This cannot be combined with ``split_by``.
+    npartitions : int, optional
+        The number of partitions.
+    max_rows : int, optional
+        Read only the first ``max_rows`` rows of the result. Once the row
+        after them starts to arrive the COPY is stopped and the query is
+        cancelled, so a preview of a huge result does not transfer or
+        allocate the rest of it. The connection is then discarded instead of
+        going back to the pool. The other options apply to these rows only,
+        so ``sort_by`` sorts the first ``max_rows`` rows the database sends.
+        With ``filters`` these are the first ``max_rows`` matching rows, and
+        the COPY is read to the end.
+        With ``sample_size`` the sample has at most ``max_rows`` rows, so it
+        stays uniform; this cannot be combined with ``sample_rate``.
+    filters : iterable[tuple], optional
+        Only return the rows which match every ``(column, op, value)``
+        predicate. The ops are ``==``, ``!=``, ``<``, ``<=``, ``>``, ``>=``,
+        ``between`` with a ``(low, high)`` value, inclusive, ``in`` with a
+        collection of values, and ``is null`` and ``is not null`` with no
+        value. NULLs only match ``is null``, like sql. Text is compared as
+        utf-8 bytes and NaN matches nothing but ``!=``. Integer columns are
+        compared with the exact value, which must be a whole number, even
+        when it is outside of the column's range. Datetime and date values
+        may not have a finer unit than the column. The predicates run on
+        the raw COPY data, so the other rows never reach the output arrays;
+        ``stats['filtered_rows']`` counts them. Filtering in the query
+        is usually better; this is for queries which cannot be changed.
+    sample_size : int, optional
+        Return a uniform random sample of this many rows, or every row when
+        there are fewer, chosen with reservoir sampling. Only the sampled
+        rows are kept; the others are dropped while the COPY data arrives,
+        so only ``sample_size`` rows are held in memory, and ``capture``
+        gets just the sampled rows. ``filters`` are applied first, so the
+        sample is taken from the matching rows. The rows keep the order they
+        were read in. This cannot be combined with ``sample_rate``.
+    sample_rate : float, optional
+        Keep each row with this probability instead.
+    sample_seed : int, optional
+        The seed of the sample. The same seed picks the same rows of the
+        same result. By default the seed is random.
 
     Returns
     -------
+    labels : np.ndarray
+        The sorted distinct keys of the ``split_by`` column, with the dtype of
+        the column. Only returned when ``split_by`` is given.
+    offsets : np.ndarray[int64]
+        The first row of each label followed by the end of the last label, so
+        the rows of ``labels[n]`` are ``offsets[n]:offsets[n + 1]``. The rows
+        with a NULL key start at ``offsets[-1]``. Only returned when
+        ``split_by`` is given.
     arrays : dict[str, (np.ndarray, np.ndarray)]
         A map from column name to the result arrays. The first array holds the
         values and the second array is a boolean mask for NULLs. The values
-        where the mask is False are 0 interpreted by the type.
+        where the mask is False are 0 interpreted by the type. With
+        ``partition_by`` this is a list of ``npartitions`` maps, one per
+        partition, in which the rows keep their order.
+    """
+    arrays, _ = _query_arrays(
+        query,
+        bind=bind,
+        stats=stats,
+        capture=capture,
+        intern_text=intern_text,
+        text_dtypes=text_dtypes,
+        truncate_text=truncate_text,
+        lazy_text=lazy_text,
+        column_stats=column_stats,
+        null_masks=False,
+        sparse=sparse,
+        asof_keys=asof_keys,
+        asof_version=asof_version,
+        asof_cutoff=asof_cutoff,
+        split_by=split_by,
+        sort_by=sort_by,
+        partition_by=partition_by,
+        npartitions=npartitions,
+        max_rows=max_rows,
+        filters=filters,
+        sample_size=sample_size,
+        sample_rate=sample_rate,
+        sample_seed=sample_seed,
+    )
+    return arrays
+
+
+def _query_arrays(query,
+                  *,
+                  bind,
+                  stats,
+                  capture,
+                  intern_text,
+                  text_dtypes,
+                  truncate_text,
+                  lazy_text,
+                  column_stats,
+                  null_masks,
+                  sparse,
+                  asof_keys,
+                  asof_version,
+                  asof_cutoff,
+                  split_by,
+                  sort_by,
+                  partition_by,
+                  npartitions,
+                  max_rows,
+                  filters,
+                  sample_size,
+                  sample_rate,
+                  sample_seed):
+    """Implementation of ``to_arrays`` which also returns the null count of
+    each column. If ``null_masks`` is true the masks are True for NULLs.
     """
+    if column_stats and stats is None:
+        raise TypeError('column_stats requires a stats dict')
+    if max_rows is not None and max_rows < 0:
+        raise ValueError('max_rows must be non-negative: %d' % max_rows)
+
     # check types before doing any work
     types = tuple(_warp_prism_types(query))
+    column_names = query.c.keys()
+    asof = _asof_spec(
+        column_names,
+        types,
+        asof_keys,
+        asof_version,
+        asof_cutoff,
+    )
+    if split_by is None:
+        split = split_dtype = None
+    else:
+        try:
+            split = column_names.index(split_by)
+        except ValueError as e:
+            raise ValueError('unknown split column: %s' % e)
+        split_dtype = _dtypes_by_typeid.get(types[split])
+    if isinstance(sort_by, str):
+        sort_by = [sort_by]
+    try:
+        sort = tuple(column_names.index(key) for key in sort_by) or None
+    except ValueError as e:
+        raise ValueError('unknown sort column: %s' % e)
+    partition = _partition_spec(column_names, partition_by, npartitions)
+    filters = _filter_spec(column_names, types, filters)
+    sample = _sample_spec(sample_size, sample_rate, sample_seed, max_rows)
+    if text_dtypes or lazy_text or sparse:
+        types = _apply_column_options(
+            column_names,
+            types,
+            text_dtypes=text_dtypes or {},
+            truncate_text=truncate_text,
+            lazy_text=lazy_text,
+            sparse=sparse,
+        )
 
-    buf = BytesIO()
-    bind = _getbind(query, bind)
+    buf = _copy_query(
+        query,
+        bind,
+        stats,
+        capture,
+        column_names,
+        types,
+        # the limit counts the kept rows, so every row must be read
+        max_rows=max_rows if filters is None and sample is None else None,
+        sample=sample,
+        filters=filters,
+    )
+    # the rows were filtered and sampled as they arrived
+    streamed_filters = sample is not None and bool(filters)
+    if sample is not None:
+        filters = sample = None
+    # the null counts are always kept so this costs nothing extra
+    raw_stats = stats if stats is not None else {}
+    out = _raw_to_arrays(
+        buf.getbuffer(),
+        types,
+        stats=raw_stats,
+        intern_text=intern_text,
+        column_stats=column_stats,
+        null_masks=null_masks,
+        asof=asof,
+        split=split,
+        sort=sort,
+        partition=partition,
+        max_rows=max_rows,
+        filters=filters,
+        sample=sample,
+    )
+    null_counts = dict(zip(column_names, raw_stats['null_counts']))
+    if stats is not None:
+        if streamed_filters:
+            # ``getbuffer`` counted the rows which did not match
+            stats['filtered_rows'] = buf.filtered_rows
+        _record_phase_memory(stats, 'decode', _phase_mark())
+        stats['null_counts'] = null_counts
+        if column_stats:
+            stats['column_stats'] = dict(
+                zip(column_names, stats['column_stats']),
+            )
+        stats['tracked_peak_bytes'] = (
+            stats['input_bytes'] + stats['peak_buffer_bytes']
+        )
+    return (
+        _split_columns(
+            column_names,
+            types,
+            out,
+            split,
+            split_dtype,
+            partition,
+        ),
+        null_counts,
+    )
 
-    stmt = _CopyToBinary(query, bind)
-    with bind.connect() as conn:
-        conn.connection.cursor().copy_expert(literal_compile(stmt), buf)
-    out = _raw_to_arrays(buf.getbuffer(), types)
-    column_names = query.c.keys()
-    return {column_names[n]: v for n, v in enumerate(out)}
+
+def _asof_spec(column_names, types, keys, version, cutoff):
+    """Build the ``asof`` argument of ``raw_to_arrays`` from the column names
+    passed to ``to_arrays``.
+    """
+    keys = tuple(keys)
+    if version is None:
+        if keys or cutoff is not None:
+            raise TypeError('asof_keys and asof_cutoff require asof_version')
+        return None
+
+    try:
+        key_ixs = tuple(column_names.index(key) for key in keys)
+        version_ix = column_names.index(version)
+    except ValueError as e:
+        raise ValueError('unknown asof column: %s' % e)
+
+    if cutoff is not None:
+        dtype = _dtypes_by_typeid.get(types[version_ix])
+        if dtype is None or dtype not in _int_key_dtypes:
+            raise TypeError(
+                'the asof version column must be an integer, datetime, or date'
+                ' column',
+            )
+        cutoff = _int_key(cutoff, dtype)
+    return key_ixs, version_ix, cutoff
+
+
+def _partition_spec(column_names, keys, npartitions):
+    """Build the ``partition`` argument of ``raw_to_arrays`` from the column
+    names passed to ``to_arrays``.
+    """
+    if keys is None:
+        if npartitions is not None:
+            raise TypeError('npartitions requires partition_by')
+        return None
+    if npartitions is None:
+        raise TypeError('partition_by requires npartitions')
+
+    if isinstance(keys, str):
+        keys = [keys]
+    try:
+        key_ixs = tuple(column_names.index(key) for key in keys)
+    except ValueError as e:
+        raise ValueError('unknown partition column: %s' % e)
+    return key_ixs, npartitions
+
+
+def _filter_value(value, dtype):
+    """Convert a filter value to the type ``raw_to_arrays`` compares a column
+    of the given dtype against.
+    """
+    if dtype == 'object':
+        return value.encode('utf-8') if isinstance(value, str) else value
+    if dtype in ('float32', 'float64'):
+        return float(value)
+    return _int_key(value, dtype)
+
+
+def _filter_spec(column_names, types, filters):
+    """Build the ``filters`` argument of ``raw_to_arrays`` from the column
+    names passed to ``to_arrays``.
+    """
+    out = []
+    for name, op, *value in filters:
+        try:
+            ix = column_names.index(name)
+        except ValueError as e:
+            raise ValueError('unknown filter column: %s' % e)
+        if not value:
+            out.append((ix, op))
+            continue
+
+        value, = value
+        dtype = _dtypes_by_typeid.get(types[ix])
+        if op in ('in', 'between'):
+            value = tuple(_filter_value(v, dtype) for v in value)
+        else:
+            value = _filter_value(value, dtype)
+        out.append((ix, op, value))
+    return tuple(out) or None
+
+
+def _sample_spec(size, rate, seed, max_rows):
+    """Build the ``sample`` argument of ``raw_to_arrays`` from the sample
+    options passed to ``to_arrays``. The first rows of a sample are not a
+    uniform sample, so ``max_rows`` shrinks the reservoir instead.
+    """
+    if size is None and rate is None:
+        if seed is not None:
+            raise TypeError('sample_seed requires sample_size or sample_rate')
+        return None
+    if size is not None and rate is not None:
+        raise TypeError('sample_size and sample_rate cannot be combined')
+    if rate is not None and max_rows is not None:
+        raise TypeError('sample_rate and max_rows cannot be combined')
+
+    if seed is None:
+        seed = random.getrandbits(64)
+    if size is not None:
+        if max_rows is not None:
+            size = min(size, max_rows)
+        return 'reservoir', size, seed
+    return 'bernoulli', rate, seed
+
+
+def _split_columns(column_names, types, out, split, dtype, partition):
+    """Name the output of ``raw_to_arrays``, keeping the labels and offsets
+    returned with ``split`` or cutting the columns into the partitions
+    returned with ``partition``.
+    """
+    if partition is not None:
+        offsets, out = out
+        columns = _named_columns(column_names, types, out)
+        return [
+            {
+                name: _slice_rows(types[n], column, start, stop)
+                for n, (name, column) in enumerate(columns.items())
+            }
+            for start, stop in zip(offsets[:-1], offsets[1:])
+        ]
+
+    if split is None:
+        return _named_columns(column_names, types, out)
+
+    labels, offsets, out = out
+    return (
+        labels.astype(dtype, copy=False),
+        offsets,
+        _named_columns(column_names, types, out),
+    )
+
+
+def _slice_rows(type_id, column, start, stop):
+    """Take the rows ``start:stop`` of a named column.
+    """
+    values, mask = column
+    if isinstance(type_id, tuple) and type_id[0] == _sparse_typeid:
+        # sparse columns are ``(values, indices)``
+        low, high = mask.searchsorted([start, stop])
+        return values[low:high], mask[low:high] - start
+    return values[start:stop], mask[start:stop]
+
+
+def _named_columns(column_names, types, out):
+    """Name the output of ``raw_to_arrays``, wrapping lazy text columns.
+    """
+    columns = {}
+    for name, type_id, (array, mask) in zip(column_names, types, out):
+        if type_id == _lazy_text_type_id:
+            array = LazyText(array, mask)
+        columns[name] = array, mask
+    return columns
 
 
 null_values = keymap(np.dtype, {
@@ -151,7 +857,407 @@ null_values = keymap(np.dtype, {
 _default_null_values_for_type = null_values
 
 
-def to_dataframe(query, *, bind=None, null_values=None):
+def _copy_query(query,
+                bind,
+                stats,
+                capture,
+                column_names,
+                types,
+                max_rows=None,
+                sample=None,
+                filters=None):
+    """Run the query, copying the results into a buffer in postgres' binary
+    format.
+
+    Parameters
+    ----------
+    query : sa.sql.Selectable
+        The query to run.
+    bind : sa.Engine or None
+        The engine used to create the connection.
+    stats : dict or None
+        A dict to record the ``query`` and ``copy`` phases in.
+    capture : str or file-like or None
+        A path or binary file to write the COPY data to.
+    column_names : list[str]
+        The names of the columns, for the capture.
+    types : tuple
+        The type ids of the columns, for the capture.
+    max_rows : int, optional
+        Stop the copy and cancel the query once a row past this many rows
+        starts to arrive.
+    sample : tuple, optional
+        The ``sample`` argument of ``raw_to_arrays``. Only the sampled rows
+        are kept while the data arrives; ``filters`` are applied first.
+    filters : tuple, optional
+        The ``filters`` argument of ``raw_to_arrays``, used with ``sample``.
+
+    Returns
+    -------
+    buf : BytesIO
+        The binary COPY data.
+    """
+    if sample is not None:
+        buf = (_SampleBytesIO if stats is None else _FirstWriteSampleBytesIO)(
+            types,
+            sample,
+            filters,
+        )
+    elif max_rows is None:
+        buf = BytesIO() if stats is None else _FirstWriteBytesIO()
+    elif stats is None:
+        buf = _RowLimitBytesIO(max_rows)
+    else:
+        buf = _FirstWriteRowLimitBytesIO(max_rows)
+    bind = _getbind(query, bind)
+
+    stmt = _CopyToBinary(query, bind)
+    sql = literal_compile(stmt)
+    if stats is not None:
+        start = _phase_mark()
+    with bind.connect() as conn:
+        try:
+            conn.connection.cursor().copy_expert(sql, buf)
+        except _RowLimitReached:
+            # stop the server from producing the rest of the result; the
+            # connection is still in the middle of the COPY so it cannot go
+            # back to the pool
+            conn.connection.cancel()
+            conn.invalidate()
+
+    if capture is not None:
+        write_capture(capture, sql, column_names, types, buf.getbuffer())
+
+    if stats is not None:
+        copied = _phase_mark()
+        first_write = buf.first_write or copied
+        _record_phase(stats, 'query', start, first_write)
+        _record_phase(stats, 'copy', first_write, copied)
+    return buf
+
+
+def to_pivot(query,
+             *,
+             row_key,
+             column_key,
+             row_labels=None,
+             column_labels=None,
+             bind=None,
+             stats=None,
+             capture=None):
+    """Run a query which returns long ``(row_key, column_key, values...)``
+    rows, returning each value column pivoted into a 2-D array.
+
+    Each value is written straight into its cell so the long columns are
+    never built.
+
+    Parameters
+    ----------
+    query : sa.sql.Selectable
+        The query to run. This can be a select or a table. All of the columns
+        must be numeric, bool, or datetime columns.
+    row_key, column_key : str
+        The names of the integer, datetime, or date columns which give the row
+        and column of each value, for example ``asof_date`` and ``sid``.
+    row_labels, column_labels : array-like, optional
+        The labels of the rows or columns of the output, in any order. Rows
+        whose key is not a label are dropped. By default the labels are the
+        sorted distinct keys, which costs an extra pass over the data.
+    bind : sa.Engine, optional
+        The engine used to create the connection. If not provided
+        ``query.bind`` will be used.
+    stats : dict, optional
+        A dict to fill with statistics about the call: the ``rows`` read, the
+        ``dropped_rows`` which had a NULL key or a key which is not a label,
+        the ``input_bytes``, and the times of the ``query``, ``copy``, and
+        ``decode`` phases. See ``to_arrays``.
+    capture : str or file-like, optional
+        A path or binary file to write the raw COPY data to. See
+        ``to_arrays``.
+
+    Returns
+    -------
+    row_labels, column_labels : np.ndarray
+        The labels of the rows and columns of the output, with the dtype of
+        the key columns.
+    arrays : dict[str, (np.ndarray, np.ndarray)]
+        A map from the name of each value column to a pair of
+        ``(len(row_labels), len(column_labels))`` arrays: the values and a
+        mask which is False for missing cells and NULLs. When more than one
+        row has the same keys the last one is kept.
+    """
+    types = tuple(_warp_prism_types(query))
+    column_names = query.c.keys()
+    try:
+        row_ix = column_names.index(row_key)
+        column_ix = column_names.index(column_key)
+    except ValueError as e:
+        raise ValueError('unknown key column: %s' % e)
+    row_dtype = _dtypes_by_typeid[types[row_ix]]
+    column_dtype = _dtypes_by_typeid[types[column_ix]]
+
+    buf = _copy_query(query, bind, stats, capture, column_names, types)
+    if stats is not None:
+        start = _phase_mark()
+    row_labels, column_labels, columns = _raw_to_pivot(
+        buf.getbuffer(),
+        types,
+        row_ix,
+        column_ix,
+        row_labels=_int_keys(row_labels, row_dtype),
+        column_labels=_int_keys(column_labels, column_dtype),
+        stats=stats,
+    )
+    if stats is not None:
+        _record_phase(stats, 'decode', start, _phase_mark())
+
+    value_names = [
+        name for name in column_names if name not in (row_key, column_key)
+    ]
+    return (
+        row_labels.astype(row_dtype, copy=False),
+        column_labels.astype(column_dtype, copy=False),
+        dict(zip(value_names, columns)),
+    )
+
+
+# the dtypes of the columns which may be pivot or asof keys
+_int_key_dtypes = frozenset(map(np.dtype, {
+    'int16',
+    'int32',
+    'int64',
+    'datetime64[us]',
+    'datetime64[D]',
+}))
+
+
+def _int_key(value, dtype):
+    """Convert a value to the int64 which is compared with the values of an
+    integer, bool, datetime, or date column of the given dtype.
+
+    Integers keep their value instead of being cast to the column's dtype, so
+    values outside of its range still compare correctly. Fractional values,
+    and datetimes with a time of day for date columns, raise a
+    ``ValueError`` instead of being truncated.
+    """
+    if dtype.kind == 'M' and not isinstance(value, numbers.Integral):
+        unit, _ = np.datetime_data(dtype)
+        out = np.datetime64(value, unit)
+        if np.isnat(out):
+            raise ValueError('cannot compare with NaT, use "is null"')
+        if out != np.datetime64(value):
+            raise ValueError(
+                '%r is not a whole number of %s' % (value, unit),
+            )
+        return int(out.astype('int64'))
+
+    try:
+        return operator.index(value)
+    except TypeError:
+        if not isinstance(value, numbers.Real):
+            raise TypeError('expected an integer, got %r' % (value,))
+    if not float(value).is_integer():
+        raise ValueError('%r is not an integer' % (value,))
+    return int(value)
+
+
+def _int_keys(values, dtype):
+    """Convert labels to the int64 values of a key column of the given dtype.
+    The labels are returned with the column's dtype, so they must fit in it.
+    """
+    if values is None:
+        return None
+    values = np.asarray(values)
+    if values.dtype.kind == 'M' and dtype.kind == 'M':
+        out = values.astype(dtype)
+        if np.isnat(out).any():
+            raise ValueError('cannot use NaT as a label')
+        if (out != values).any():
+            unit, _ = np.datetime_data(dtype)
+            raise ValueError('labels must be whole numbers of %s' % unit)
+        return out.astype('int64')
+    if values.dtype.kind in 'iu':
+        if values.size and values.max() > np.iinfo('int64').max:
+            raise OverflowError('labels must fit in an int64')
+        out = values.astype('int64')
+    else:
+        out = np.array(
+            [_int_key(value, dtype) for value in values.tolist()],
+            dtype='int64',
+        )
+    if dtype.kind == 'i':
+        info = np.iinfo(dtype)
+        outside = (out < info.min) | (out > info.max)
+        if outside.any():
+            raise ValueError(
+                'label %d does not fit in the %s key column' % (
+                    out[outside][0],
+                    dtype,
+                ),
+            )
+    return out
+
+
+def _mix_partition_hash(hash_):
+    """The splitmix64 finalizer, as in ``mix_partition_hash``.
+    """
+    hash_ = (hash_ ^ (hash_ >> np.uint64(30))) * np.uint64(0xbf58476d1ce4e5b9)
+    hash_ = (hash_ ^ (hash_ >> np.uint64(27))) * np.uint64(0x94d049bb133111eb)
+    return hash_ ^ (hash_ >> np.uint64(31))
+
+
+def hash_partitions(keys, npartitions):
+    """Find the partition of each row like ``to_arrays`` with
+    ``partition_by``.
+
+    Parameters
+    ----------
+    keys : iterable[array-like]
+        The values of each ``partition_by`` column, in the same order. Integer
+        keys may have any integer dtype. Datetime keys must be
+        ``datetime64[us]`` and date keys must be ``datetime64[D]``, the dtypes
+        returned by ``to_arrays``. NaT is NULL.
+    npartitions : int
+        The number of partitions.
+
+    Returns
+    -------
+    partitions : np.ndarray[int64]
+        The partition of each row.
+    """
+    hash_ = None
+    for key in keys:
+        key = np.asarray(key)
+        if key.dtype.kind == 'M':
+            # NULL keys hash like 0
+            key = np.where(np.isnat(key), 0, key.view('int64'))
+        key = key.astype('int64').view('uint64')
+        if hash_ is None:
+            hash_ = np.zeros(key.shape, dtype='uint64')
+        hash_ = _mix_partition_hash(hash_ ^ key)
+    if hash_ is None:
+        raise ValueError('hash_partitions requires at least one key')
+    return (hash_ % np.uint64(npartitions)).astype('int64')
+
+
+def to_groupby(query,
+               *,
+               by,
+               aggregations,
+               sort=True,
+               bind=None,
+               stats=None,
+               capture=None):
+    """Run a query, aggregating the rows by key while decoding.
+
+    Each row is folded into the aggregates of its group instead of being
+    written out, so the memory used scales with the number of groups instead
+    of the number of rows.
+
+    Parameters
+    ----------
+    query : sa.sql.Selectable
+        The query to run. This can be a select or a table.
+    by : str or iterable[str]
+        The names of the integer, datetime, or date columns to group by. Rows
+        with NULL keys form their own groups.
+    aggregations : dict[str, (str, str)]
+        A map from output name to a ``(column, op)`` pair. The ops are
+        ``count``, ``sum``, ``mean``, ``min``, and ``max``. ``count`` counts
+        the non-NULL values of any column. ``sum`` and ``mean`` take numeric or
+        bool columns, and ``min`` and ``max`` also take datetime and date
+        columns. NULLs and NaNs are skipped. Integer sums are exact int64s and
+        raise an ``OverflowError`` if they do not fit.
+    sort : bool, optional
+        Sort the groups by their keys, with NULLs last. Otherwise the groups
+        are in the order they were first seen.
+    bind : sa.Engine, optional
+        The engine used to create the connection. If not provided
+        ``query.bind`` will be used.
+    stats : dict, optional
+        A dict to fill with statistics about the call: the ``rows`` read, the
+        number of ``groups``, the ``input_bytes``, and the times of the
+        ``query``, ``copy``, and ``decode`` phases. See ``to_arrays``.
+    capture : str or file-like, optional
+        A path or binary file to write the raw COPY data to. See
+        ``to_arrays``.
+
+    Returns
+    -------
+    keys : dict[str, (np.ndarray, np.ndarray)]
+        A map from the name of each key column to its values for each group
+        and a mask which is False for NULLs.
+    aggregates : dict[str, (np.ndarray, np.ndarray)]
+        A map from output name to the aggregate of each group and a mask
+        which is False for groups without any values. ``count`` is always
+        valid.
+    """
+    if isinstance(by, str):
+        by = [by]
+    else:
+        by = list(by)
+
+    types = tuple(_warp_prism_types(query))
+    column_names = query.c.keys()
+    try:
+        key_ixs = tuple(column_names.index(key) for key in by)
+        agg_specs = tuple(
+            (column_names.index(column), op)
+            for column, op in aggregations.values()
+        )
+    except ValueError as e:
+        raise ValueError('unknown column: %s' % e)
+
+    buf = _copy_query(query, bind, stats, capture, column_names, types)
+    if stats is not None:
+        start = _phase_mark()
+    keys, aggregates = _raw_to_groupby(
+        buf.getbuffer(),
+        types,
+        key_ixs,
+        agg_specs,
+        stats=stats,
+    )
+    if stats is not None:
+        _record_phase(stats, 'decode', start, _phase_mark())
+
+    if sort and keys:
+        # the last key passed to lexsort is the primary one, and NULLs sort
+        # after the values of their key
+        order = np.lexsort([
+            array
+            for values, mask in reversed(keys)
+            for array in (values, ~mask)
+        ])
+        keys = [(values[order], mask[order]) for values, mask in keys]
+        aggregates = [
+            (values[order], mask[order]) for values, mask in aggregates
+        ]
+
+    return dict(zip(by, keys)), dict(zip(aggregations, aggregates))
+
+
+def to_dataframe(query,
+                 *,
+                 bind=None,
+                 null_values=None,
+                 stats=None,
+                 capture=None,
+                 intern_text=False,
+                 text_dtypes=None,
+                 truncate_text=False,
+                 column_stats=False,
+                 nullable=False,
+                 sparse=(),
+                 sparse_threshold=None,
+                 asof_keys=(),
+                 asof_version=None,
+                 asof_cutoff=None,
+                 max_rows=None,
+                 filters=(),
+                 sample_size=None,
+                 sample_rate=None,
+                 sample_seed=None):
     """Run the query returning a the results as a pd.DataFrame.
 
     Parameters
@@ -164,6 +1270,62 @@ def to_dataframe(query, *, bind=None, null_values=None):
     null_values : dict[str, any]
         The null values to use for each column. This falls back to
         ``warp_prism.null_values`` for columns that are not specified.
+    stats : dict, optional
+        A dict to fill with statistics about the call. This has the same keys
+        as ``to_arrays`` with an additional ``postprocess`` phase for filling
+        NULLs and building the DataFrame. ``tracked_peak_bytes`` also covers
+        the converted copies of the columns and the DataFrame, and
+        ``frame_bytes`` is the size of the DataFrame.
+    capture : str or file-like, optional
+        A path or binary file to write the raw COPY data to. See
+        ``to_arrays``.
+    intern_text : bool, optional
+        Share the string objects for repeated text values. See
+        ``to_arrays``.
+    text_dtypes : dict[str, str or np.dtype], optional
+        Decode text columns into fixed width numpy storage. See
+        ``to_arrays``. pandas has no fixed width string dtype so the
+        DataFrame holds these columns as objects; their NULLs are filled
+        like any other text column.
+    truncate_text : bool, optional
+        Cut values which do not fit in their fixed width down to size. See
+        ``to_arrays``.
+    column_stats : bool, optional
+        Fill ``stats['column_stats']`` with the null count, range, and order
+        of each column. See ``to_arrays``.
+    nullable : bool, optional
+        Build pandas' nullable ``IntegerArray``, ``FloatingArray``, and
+        ``BooleanArray`` columns from the decoded values and masks without
+        copying them. Integer columns with NULLs then keep their exact values
+        instead of becoming float64. ``null_values`` does not apply to these
+        columns.
+    sparse : iterable[str], optional
+        The names of numeric, bool, or datetime columns to decode sparsely
+        into ``pd.arrays.SparseArray`` columns. Only the non-NULL values are
+        decoded and kept, and the NULLs are never filled. The fill value is
+        the column's null value.
+    sparse_threshold : float, optional
+        Also build a ``SparseArray`` for any other numeric, bool, or datetime
+        column where at least this fraction of the values are NULL. These
+        columns are decoded densely first but their NULLs are not filled.
+    asof_keys : iterable[str], optional
+        The columns which identify a record. See ``to_arrays``.
+    asof_version : str, optional
+        Keep only the latest version of each record. See ``to_arrays``.
+    asof_cutoff : scalar, optional
+        Ignore the versions after this one. See ``to_arrays``.
+    max_rows : int, optional
+        Read only the first ``max_rows`` rows of the result and cancel the
+        rest of the query. See ``to_arrays``.
+    filters : iterable[tuple], optional
+        Only return the rows which match every ``(column, op, value)``
+        predicate. See ``to_arrays``.
+    sample_size : int, optional
+        Return a uniform random sample of this many rows. See ``to_arrays``.
+    sample_rate : float, optional
+        Keep each row with this probability. See ``to_arrays``.
+    sample_seed : int, optional
+        The seed of the sample. See ``to_arrays``.
 
     Returns
     -------
@@ -172,14 +1334,159 @@ def to_dataframe(query, *, bind=None, null_values=None):
         of the DataFrame will be named the same and be in the same order as the
         query.
     """
-    arrays = to_arrays(query, bind=bind)
+    arrays, null_counts = _query_arrays(
+        query,
+        bind=bind,
+        stats=stats,
+        capture=capture,
+        intern_text=intern_text,
+        text_dtypes=text_dtypes,
+        truncate_text=truncate_text,
+        lazy_text=(),
+        column_stats=column_stats,
+        null_masks=nullable,
+        sparse=sparse,
+        asof_keys=asof_keys,
+        asof_version=asof_version,
+        asof_cutoff=asof_cutoff,
+        split_by=None,
+        sort_by=(),
+        partition_by=None,
+        npartitions=None,
+        max_rows=max_rows,
+        filters=filters,
+        sample_size=sample_size,
+        sample_rate=sample_rate,
+        sample_seed=sample_seed,
+    )
+    return _arrays_to_dataframe(
+        arrays,
+        [column.name for column in query.c],
+        null_values=null_values,
+        stats=stats,
+        null_counts=null_counts,
+        nullable=nullable,
+        sparse=sparse,
+        sparse_threshold=sparse_threshold,
+    )
+
+
+def _arrays_to_dataframe(arrays,
+                         columns,
+                         *,
+                         null_values=None,
+                         stats=None,
+                         null_counts=None,
+                         nullable=False,
+                         sparse=(),
+                         sparse_threshold=None):
+    """Fill the NULLs in the output of ``to_arrays`` and build a DataFrame.
+
+    Parameters
+    ----------
+    arrays : dict[str, (np.ndarray, np.ndarray)]
+        The output of ``to_arrays``. This is consumed.
+    columns : list[str]
+        The order of the columns.
+    null_values : dict[str, any], optional
+        The null values to use for each column.
+    stats : dict, optional
+        The stats dict filled by ``to_arrays``.
+    null_counts : dict[str, int], optional
+        The number of NULLs in each column, from the decoder. Columns without
+        NULLs skip scanning and inverting the mask. If not given, the masks
+        are scanned.
+    nullable : bool, optional
+        The masks are True for NULLs; build nullable extension arrays for the
+        integer, float, and bool columns.
+    sparse : iterable[str], optional
+        The columns which were decoded sparsely as ``(values, indices)``.
+        These need ``null_counts`` to know their length.
+    sparse_threshold : float, optional
+        Build sparse arrays for the dense columns where at least this
+        fraction of the values are NULL.
+
+    Returns
+    -------
+    df : pd.DataFrame
+        The DataFrame.
+    """
+    if stats is not None:
+        start = _phase_mark()
+        # the bytes held by the columns while building the DataFrame
+        live_bytes = peak_bytes = stats['output_bytes']
 
     if null_values is None:
         null_values = {}
 
+    if nullable:
+        nullable_array_types = {
+            'i': pd.arrays.IntegerArray,
+            'f': pd.arrays.FloatingArray,
+            'b': pd.arrays.BooleanArray,
+        }
+
+    sparse = set(sparse)
     for name, (array, mask) in arrays.items():
+        if name in sparse:
+            # ``array`` holds the values and ``mask`` holds the row numbers
+            arrays[name] = _sparse_array(
+                array,
+                mask,
+                len(array) + null_counts[name],
+                null_values.get(name),
+            )
+            if stats is not None:
+                live_bytes += arrays[name].nbytes
+                peak_bytes = max(peak_bytes, live_bytes)
+                live_bytes -= array.nbytes + mask.nbytes
+            continue
+
+        original = array
+        if null_counts is not None:
+            null_count = null_counts[name]
+        elif nullable:
+            null_count = int(mask.sum())
+        else:
+            null_count = len(mask) - int(mask.sum())
+        has_nulls = null_count > 0
+
+        if (sparse_threshold is not None and
+                array.dtype.kind in _sparse_kinds and
+                has_nulls and
+                null_count >= sparse_threshold * len(mask)):
+            indices = np.flatnonzero(~mask if nullable else mask)
+            arrays[name] = _sparse_array(
+                array[indices],
+                indices,
+                len(mask),
+                null_values.get(name),
+            )
+            if stats is not None:
+                live_bytes += arrays[name].nbytes
+                peak_bytes = max(peak_bytes, live_bytes + indices.nbytes)
+                live_bytes -= original.nbytes + mask.nbytes
+            continue
+
+        if nullable:
+            # the mask is already True for NULLs
+            nulls = mask
+            try:
+                array_type = nullable_array_types[array.dtype.kind]
+            except KeyError:
+                pass
+            else:
+                # the array keeps the values and mask without copying
+                arrays[name] = array_type(array, mask)
+                if stats is not None:
+                    # nothing was copied, the column now belongs to the frame
+                    live_bytes -= array.nbytes + mask.nbytes
+                continue
+        elif has_nulls:
+            nulls = ~mask
+
         if array.dtype.kind == 'i':
-            if not mask.all():
+            if has_nulls:
                 try:
                     null = null_values[name]
                 except KeyError:
@@ -187,24 +1494,111 @@ def to_dataframe(query, *, bind=None, null_values=None):
                     array = array.astype('float64')
                     null = np.nan
 
-                array[~mask] = null
+                array[nulls] = null
+        else:
+            if array.dtype.kind == 'M':
+                # pandas needs datetime64[ns], not ``us`` or ``D``
+                array = array.astype('datetime64[ns]')
+            elif array.dtype.kind in 'SU':
+                # fixed width text cannot hold ``None``; pandas would convert
+                # this to object anyway
+                array = array.astype(object)
 
-            arrays[name] = array
-            continue
+            if has_nulls:
+                try:
+                    null = null_values[name]
+                except KeyError:
+                    null = _default_null_values_for_type[array.dtype]
 
-        if array.dtype.kind == 'M':
-            # pandas needs datetime64[ns], not ``us`` or ``D``
-            array = array.astype('datetime64[ns]')
+                array[nulls] = null
 
-        try:
-            null = null_values[name]
-        except KeyError:
-            null = _default_null_values_for_type[array.dtype]
+        if stats is not None:
+            # the converted copy and the inverted mask are alive at the same
+            # time as the original column
+            if array is not original:
+                live_bytes += array.nbytes
+            inverted_bytes = mask.nbytes if has_nulls and not nullable else 0
+            peak_bytes = max(peak_bytes, live_bytes + inverted_bytes)
+            if array is not original:
+                live_bytes -= original.nbytes
+            live_bytes -= mask.nbytes
 
-        array[~mask] = null
         arrays[name] = array
 
-    return pd.DataFrame(arrays, columns=[column.name for column in query.c])
+    # the arrays are ours, don't let pandas copy them
+    df = pd.DataFrame(arrays, columns=columns, copy=False)
+    if stats is not None:
+        stats['frame_bytes'] = frame_bytes = int(
+            df.memory_usage(index=False).sum(),
+        )
+        stats['tracked_peak_bytes'] = max(
+            stats['tracked_peak_bytes'],
+            peak_bytes,
+            live_bytes + frame_bytes,
+        )
+        _record_phase(stats, 'postprocess', start, _phase_mark())
+    return df
+
+
+# the dtype kinds which can be stored in a ``SparseArray``
+_sparse_kinds = frozenset('iufbM')
+
+
+def _sparse_array(values, indices, length, fill_value):
+    """Build a ``pd.arrays.SparseArray`` from the non-NULL values of a
+    column without building the dense column.
+
+    Parameters
+    ----------
+    values : np.ndarray
+        The non-NULL values.
+    indices : np.ndarray[int]
+        The row number of each value.
+    length : int
+        The number of rows.
+    fill_value : any
+        The value of the NULLs, or None for the default null value.
+
+    Returns
+    -------
+    array : pd.arrays.SparseArray
+        The sparse column.
+
+    Notes
+    -----
+    pandas stores the row numbers of a sparse array as int32, so ``length``
+    must be less than ``2 ** 31``. If pandas' private sparse index type cannot
+    be imported the array is built from a dense column of the fill value.
+    """
+    if length > _max_sparse_length:
+        raise OverflowError(
+            'pandas sparse arrays cannot hold %d rows' % length,
+        )
+    if values.dtype.kind == 'M':
+        # pandas needs datetime64[ns], not ``us`` or ``D``
+        values = values.astype('datetime64[ns]')
+    if fill_value is None:
+        fill_value = _default_null_values_for_type.get(values.dtype, np.nan)
+    dtype = pd.SparseDtype(values.dtype, fill_value)
+
+    if _IntIndex is not None:
+        return pd.arrays.SparseArray(
+            values,
+            sparse_index=_IntIndex(length, indices.astype(np.int32)),
+            dtype=dtype,
+        )
+
+    if values.dtype.kind in 'iub' and pd.isna(fill_value):
+        # integers and bools cannot hold the NaN fill value exactly
+        dense = np.full(length, fill_value, dtype=object)
+    else:
+        dense = np.full(length, fill_value, dtype=values.dtype)
+    dense[indices] = values
+    return pd.arrays.SparseArray(dense, dtype=dtype)
+
+
+# the row numbers of a ``SparseArray`` are int32
+_max_sparse_length = np.iinfo(np.int32).max
 
 
 def register_odo_dataframe_edge():
@@ -0,0 +1,56 @@
+"""Resident set size measurements.
+"""
+import resource
+
+
+def _read_status(field):
+    """Read a memory field from ``/proc/self/status`` in bytes.
+    """
+    with open('/proc/self/status') as f:
+        for line in f:
+            if line.startswith(field + ':'):
+                # the values are always reported in kB
+                return int(line.split()[1]) * 1024
+    raise KeyError(field)
+
+
+def current_rss():
+    """The current resident set size of this process in bytes, or None where
+    ``/proc`` is not available.
+    """
+    try:
+        return _read_status('VmRSS')
+    except (OSError, KeyError):
+        return None
+
+
+def reset_peak_rss():
+    """Reset the peak resident set size to the current resident set size.
+
+    This resets the peak for the whole process, so only the benchmarks call
+    it; the library never does.
+
+    Returns
+    -------
+    reset : bool
+        Whether the peak could be reset. This requires linux 4.0 or newer. If
+        the peak could not be reset, ``peak_rss`` is the peak over the life of
+        the process.
+    """
+    try:
+        with open('/proc/self/clear_refs', 'w') as f:
+            f.write('5')
+    except OSError:
+        return False
+    return True
+
+
+def peak_rss():
+    """The peak resident set size of this process in bytes since the last call
+    to ``reset_peak_rss``.
+    """
+    try:
+        return _read_status('VmHWM')
+    except (OSError, KeyError):
+        # ru_maxrss is in kB on linux
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
@@ -1,7 +1,21 @@
+/* for clock_gettime, pthreads, sysconf, and sched_getaffinity */
+#define _GNU_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Python.h"
 #include "numpy/arrayobject.h"
@@ -41,6 +55,20 @@ static inline bool mul_overflow(size_t a, size_t b, size_t* out) {
 #define unlikely(p) __builtin_expect(!!(p), 0)
 #endif
 
+/* Allocate from PyMem but never ask for an empty allocation, so that a NULL
+   result always means the allocation failed. */
+static inline void* malloc_nonempty(size_t size) {
+    return PyMem_Malloc(size ? size : 1);
+}
+
+static inline void* calloc_nonempty(size_t nelem, size_t elsize) {
+    return PyMem_Calloc(nelem ? nelem : 1, elsize);
+}
+
+static inline void* realloc_nonempty(void* ptr, size_t size) {
+    return PyMem_Realloc(ptr, size ? size : 1);
+}
+
 #define TYPE(size) uint ## size ## _t
 
 #define DEFINE_READ(size)                                               \
@@ -73,16 +101,31 @@ DEFINE_WRITE(64)
 typedef int (*parse_function)(char* column_buffer,
                               const char * const input_buffer,
                               size_t len);
+typedef void (*parse_gather_function)(char* column_buffer,
+                                      const char* input_buffer,
+                                      const size_t* offsets,
+                                      size_t count);
 typedef void (*free_function)(void* colbuffer, size_t rowcount);
 typedef int (*write_null_function)(char* dst, size_t size);
 
 typedef struct {
     const char* const dtype_name;
     parse_function parse;
+    /* Parse `count` values located at `input_buffer + offsets[n]` into
+       consecutive cells of `column_buffer`. This is only used for fixed width
+       types once every field is known to have the correct size; see
+       `read_fixed_width_results`. The implementation is picked at import time
+       based on the instruction sets the CPU supports. */
+    parse_gather_function parse_gather;
     free_function free;
     write_null_function write_null;
     size_t size;
+    /* The size of a field in the input or 0 for variable width types. */
+    size_t wire_size;
     PyArray_Descr* dtype;
+    /* For fixed width text: cut overlong values down to size instead of
+       raising an error. */
+    bool truncate;
 } warp_prism_type;
 
 static int parse_int16(char* column_buffer,
@@ -191,10 +234,56 @@ static int parse_bool(char* column_buffer,
     return 0;
 }
 
+/* Check whether a value is entirely ASCII by or-ing together 16 bytes at a
+   time and then checking the high bit of every byte at once. */
+static inline bool is_ascii(const char* data, size_t len) {
+    uint64_t word;
+    uint64_t bits = 0;
+
+#ifdef __SSE2__
+    __m128i vector_bits = _mm_setzero_si128();
+    for (; len >= sizeof(__m128i); data += sizeof(__m128i),
+             len -= sizeof(__m128i)) {
+        vector_bits = _mm_or_si128(vector_bits,
+                                   _mm_loadu_si128((const __m128i*) data));
+    }
+    if (_mm_movemask_epi8(vector_bits)) {
+        return false;
+    }
+#endif
+    for (; len >= sizeof(word); data += sizeof(word), len -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        bits |= word;
+    }
+    if (len) {
+        word = 0;
+        memcpy(&word, data, len);
+        bits |= word;
+    }
+    return !(bits & 0x8080808080808080ull);
+}
+
+/* Create a str from UTF-8 bytes. Nearly all text is ASCII, which can be
+   copied directly into a compact string without decoding it or finding the
+   widest character. */
+static inline PyObject* new_text(const char* data, size_t len) {
+    PyObject* value;
+
+    if (unlikely(!is_ascii(data, len))) {
+        return PyUnicode_DecodeUTF8(data, len, NULL);
+    }
+
+    if (unlikely(!(value = PyUnicode_New(len, 127)))) {
+        return NULL;
+    }
+    memcpy(PyUnicode_1BYTE_DATA(value), data, len);
+    return value;
+}
+
 static int parse_text(char* column_buffer,
                       const char* const input_buffer,
                       size_t len) {
-    PyObject* value = PyUnicode_FromStringAndSize(input_buffer, len);
+    PyObject* value = new_text(input_buffer, len);
     if (unlikely(!value)) {
         return -1;
     }
@@ -203,6 +292,560 @@ static int parse_text(char* column_buffer,
     return 0;
 }
 
+/* Text may also be decoded into fixed width numpy bytes or unicode columns.
+   These types are parameterized by their width, so each decoder makes its own
+   copy of `fixed_bytes_type` or `fixed_unicode_type`; see `new_decoder`. The
+   values are padded with NULs like numpy does. */
+static inline int text_too_long(const warp_prism_type* type,
+                                size_t len,
+                                size_t width) {
+    PyErr_Format(PyExc_ValueError,
+                 "text value of length %zu does not fit in %s%zu",
+                 len,
+                 type->dtype_name,
+                 width);
+    return -1;
+}
+
+static inline int parse_fixed_bytes(const warp_prism_type* type,
+                                    char* column_buffer,
+                                    const char* const input_buffer,
+                                    size_t len) {
+    if (len > type->size) {
+        if (!type->truncate) {
+            return text_too_long(type, len, type->size);
+        }
+        len = type->size;
+    }
+
+    memcpy(column_buffer, input_buffer, len);
+    memset(&column_buffer[len], 0, type->size - len);
+    return 0;
+}
+
+static inline int parse_fixed_unicode(const warp_prism_type* type,
+                                      char* column_buffer,
+                                      const char* const input_buffer,
+                                      size_t len) {
+    size_t width = type->size / sizeof(Py_UCS4);
+    Py_UCS4* codepoints = (Py_UCS4*) column_buffer;
+    PyObject* value;
+    size_t value_len;
+    int kind;
+    const void* data;
+
+    if (likely(is_ascii(input_buffer, len))) {
+        /* each byte is a codepoint, widen them in place */
+        if (len > width) {
+            if (!type->truncate) {
+                return text_too_long(type, len, width);
+            }
+            len = width;
+        }
+        for (size_t n = 0; n < len; ++n) {
+            codepoints[n] = (unsigned char) input_buffer[n];
+        }
+        memset(&codepoints[len], 0, (width - len) * sizeof(Py_UCS4));
+        return 0;
+    }
+
+    if (!(value = PyUnicode_DecodeUTF8(input_buffer, len, NULL))) {
+        return -1;
+    }
+    value_len = PyUnicode_GET_LENGTH(value);
+    if (value_len > width) {
+        if (!type->truncate) {
+            Py_DECREF(value);
+            return text_too_long(type, value_len, width);
+        }
+        value_len = width;
+    }
+    kind = PyUnicode_KIND(value);
+    data = PyUnicode_DATA(value);
+    for (size_t n = 0; n < value_len; ++n) {
+        codepoints[n] = PyUnicode_READ(kind, data, n);
+    }
+    memset(&codepoints[value_len], 0, (width - value_len) * sizeof(Py_UCS4));
+    Py_DECREF(value);
+    return 0;
+}
+
+/* Text columns with few distinct values can be decoded with an intern table
+   so that each distinct value is only created once. The table is a bounded
+   open addressing hash table keyed on the raw bytes. A lookup probes at most
+   `intern_probe_length` slots; if none of them hold the value and none are
+   empty, the value replaces the entry in its first slot. The keys point into
+   the input buffer so a table may not outlive the call that created it. */
+#define INTERN_TABLE_SHIFT 14
+const size_t intern_table_size = 1 << INTERN_TABLE_SHIFT;
+const size_t intern_probe_length = 8;
+
+/* A table is dropped if fewer than a quarter of the first
+   `intern_probation_lookups` lookups were hits, because the column is
+   probably close to unique. */
+const size_t intern_probation_lookups = 1 << 14;
+
+typedef struct {
+    PyObject* value; /* NULL if the slot is empty */
+    const char* key;
+    size_t len;
+    uint64_t hash;
+} intern_entry;
+
+typedef struct {
+    intern_entry* entries; /* NULL until the first lookup or once dropped */
+    size_t lookups;
+    size_t hits;
+    bool dropped;
+} intern_table;
+
+static inline uint64_t hash_bytes(const char* data, size_t len) {
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = len * k;
+    uint64_t word;
+
+    for (; len >= sizeof(word); data += sizeof(word), len -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        h = (h ^ word) * k;
+        h ^= h >> 29;
+    }
+    if (len) {
+        word = 0;
+        memcpy(&word, data, len);
+        h = (h ^ word) * k;
+    }
+    h ^= h >> 32;
+    h *= k;
+    return h ^ (h >> 29);
+}
+
+static void clear_intern_table(intern_table* table) {
+    if (!table->entries) {
+        return;
+    }
+    for (size_t n = 0; n < intern_table_size; ++n) {
+        Py_XDECREF(table->entries[n].value);
+    }
+    PyMem_Free(table->entries);
+    table->entries = NULL;
+}
+
+static void free_intern_tables(intern_table* tables, uint16_t ncolumns) {
+    if (!tables) {
+        return;
+    }
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        clear_intern_table(&tables[n]);
+    }
+    PyMem_Free(tables);
+}
+
+static int parse_interned_text(intern_table* table,
+                               char* column_buffer,
+                               const char* const input_buffer,
+                               size_t len) {
+    uint64_t hash;
+    size_t home;
+    intern_entry* slot = NULL;
+    PyObject* value;
+
+    if (table->dropped) {
+        return parse_text(column_buffer, input_buffer, len);
+    }
+
+    if (unlikely(table->lookups == intern_probation_lookups &&
+                 table->hits < intern_probation_lookups / 4)) {
+        clear_intern_table(table);
+        table->dropped = true;
+        return parse_text(column_buffer, input_buffer, len);
+    }
+
+    if (unlikely(!table->entries)) {
+        if (!(table->entries = PyMem_Calloc(intern_table_size,
+                                            sizeof(intern_entry)))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    ++table->lookups;
+    hash = hash_bytes(input_buffer, len);
+    home = hash >> (64 - INTERN_TABLE_SHIFT);
+    for (size_t probe = 0; probe < intern_probe_length; ++probe) {
+        intern_entry* entry =
+            &table->entries[(home + probe) & (intern_table_size - 1)];
+
+        if (!entry->value) {
+            slot = entry;
+            break;
+        }
+        if (entry->hash == hash &&
+            entry->len == len &&
+            !memcmp(entry->key, input_buffer, len)) {
+            ++table->hits;
+            Py_INCREF(entry->value);
+            *(PyObject**) column_buffer = entry->value;
+            return 0;
+        }
+    }
+
+    if (!slot) {
+        /* every probed slot is taken; evict the value in the first one */
+        slot = &table->entries[home];
+        Py_CLEAR(slot->value);
+    }
+
+    if (unlikely(!(value = new_text(input_buffer, len)))) {
+        return -1;
+    }
+    Py_INCREF(value);
+    slot->value = value;
+    slot->key = input_buffer;
+    slot->len = len;
+    slot->hash = hash;
+    *(PyObject**) column_buffer = value;
+    return 0;
+}
+
+#define DEFINE_PARSE_GATHER(name, insize, outsize, offset)              \
+    static void parse_gather_ ## name(char* column_buffer,              \
+                                      const char* input_buffer,         \
+                                      const size_t* offsets,            \
+                                      size_t count) {                   \
+        for (size_t n = 0; n < count; ++n) {                            \
+            write ## outsize(&column_buffer[n * (outsize / 8)],         \
+                             read ## insize(&input_buffer[offsets[n]]) + \
+                             offset);                                   \
+        }                                                               \
+    }
+
+DEFINE_PARSE_GATHER(int16, 16, 16, 0)
+DEFINE_PARSE_GATHER(int32, 32, 32, 0)
+DEFINE_PARSE_GATHER(int64, 64, 64, 0)
+DEFINE_PARSE_GATHER(float32, 32, 32, 0)
+DEFINE_PARSE_GATHER(float64, 64, 64, 0)
+DEFINE_PARSE_GATHER(bool, 8, 8, 0)
+DEFINE_PARSE_GATHER(datetime, 64, 64, datetime_offset)
+DEFINE_PARSE_GATHER(date, 32, 64, date_offset)
+
+#undef DEFINE_PARSE_GATHER
+
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSSE3,
+    SIMD_AVX2,
+    SIMD_AVX512,
+} simd_level;
+
+const char* const simd_level_names[] = {"scalar", "ssse3", "avx2", "avx512"};
+const size_t simd_level_count = sizeof(simd_level_names) / sizeof(char*);
+
+/* The SIMD kernels rely on the `target` attribute and
+   `__builtin_cpu_supports` to pick an implementation at runtime. */
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define WARP_PRISM_X86_SIMD
+#if defined(__clang__) || __GNUC__ >= 6
+#define WARP_PRISM_AVX512
+#endif
+
+#include <immintrin.h>
+
+/* x86 is little endian so every value needs to be byte swapped. Each kernel
+   decodes as many full vectors as it can and then hands the remaining values
+   to the scalar kernel. The `offset` is added to each value after the swap
+   to move datetimes to the numpy epoch.
+
+   The 32 bit values are zero extended to 64 bits for dates to match
+   `parse_date`. */
+
+#define BSWAP64_SHUFFLE                                                 \
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+#define BSWAP32_SHUFFLE                                                 \
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+
+static inline __m128i load64_ssse3(const char* buffer) {
+    return _mm_loadl_epi64((const __m128i*) buffer);
+}
+
+static inline __m128i load32_ssse3(const char* buffer) {
+    return _mm_cvtsi32_si128(*(const int32_t*) buffer);
+}
+
+#define DEFINE_PARSE_GATHER64_SSSE3(name, offset)                       \
+    __attribute__((target("ssse3")))                                    \
+    static void parse_gather_ ## name ## _ssse3(char* column_buffer,    \
+                                                const char* input_buffer, \
+                                                const size_t* offsets,  \
+                                                size_t count) {         \
+        const __m128i shuffle = _mm_setr_epi8(BSWAP64_SHUFFLE);         \
+        const __m128i add = _mm_set1_epi64x(offset);                    \
+        size_t n = 0;                                                   \
+                                                                        \
+        for (; n + 2 <= count; n += 2) {                                \
+            __m128i v = _mm_unpacklo_epi64(                             \
+                load64_ssse3(&input_buffer[offsets[n]]),                \
+                load64_ssse3(&input_buffer[offsets[n + 1]]));           \
+            v = _mm_add_epi64(_mm_shuffle_epi8(v, shuffle), add);       \
+            _mm_storeu_si128((__m128i*) &column_buffer[n * 8], v);      \
+        }                                                               \
+        parse_gather_ ## name(&column_buffer[n * 8],                    \
+                              input_buffer,                             \
+                              &offsets[n],                              \
+                              count - n);                               \
+    }
+
+#define DEFINE_PARSE_GATHER32_SSSE3(name)                               \
+    __attribute__((target("ssse3")))                                    \
+    static void parse_gather_ ## name ## _ssse3(char* column_buffer,    \
+                                                const char* input_buffer, \
+                                                const size_t* offsets,  \
+                                                size_t count) {         \
+        const __m128i shuffle = _mm_setr_epi8(BSWAP32_SHUFFLE);         \
+        size_t n = 0;                                                   \
+                                                                        \
+        for (; n + 4 <= count; n += 4) {                                \
+            __m128i v = _mm_unpacklo_epi64(                             \
+                _mm_unpacklo_epi32(                                     \
+                    load32_ssse3(&input_buffer[offsets[n]]),            \
+                    load32_ssse3(&input_buffer[offsets[n + 1]])),       \
+                _mm_unpacklo_epi32(                                     \
+                    load32_ssse3(&input_buffer[offsets[n + 2]]),        \
+                    load32_ssse3(&input_buffer[offsets[n + 3]])));      \
+            v = _mm_shuffle_epi8(v, shuffle);                           \
+            _mm_storeu_si128((__m128i*) &column_buffer[n * 4], v);      \
+        }                                                               \
+        parse_gather_ ## name(&column_buffer[n * 4],                    \
+                              input_buffer,                             \
+                              &offsets[n],                              \
+                              count - n);                               \
+    }
+
+DEFINE_PARSE_GATHER64_SSSE3(int64, 0)
+DEFINE_PARSE_GATHER64_SSSE3(float64, 0)
+DEFINE_PARSE_GATHER64_SSSE3(datetime, datetime_offset)
+DEFINE_PARSE_GATHER32_SSSE3(int32)
+DEFINE_PARSE_GATHER32_SSSE3(float32)
+
+#undef DEFINE_PARSE_GATHER64_SSSE3
+#undef DEFINE_PARSE_GATHER32_SSSE3
+
+__attribute__((target("ssse3")))
+static void parse_gather_date_ssse3(char* column_buffer,
+                                    const char* input_buffer,
+                                    const size_t* offsets,
+                                    size_t count) {
+    const __m128i shuffle = _mm_setr_epi8(BSWAP32_SHUFFLE);
+    const __m128i add = _mm_set1_epi32(date_offset);
+    const __m128i zero = _mm_setzero_si128();
+    size_t n = 0;
+
+    for (; n + 4 <= count; n += 4) {
+        __m128i v = _mm_unpacklo_epi64(
+            _mm_unpacklo_epi32(load32_ssse3(&input_buffer[offsets[n]]),
+                               load32_ssse3(&input_buffer[offsets[n + 1]])),
+            _mm_unpacklo_epi32(load32_ssse3(&input_buffer[offsets[n + 2]]),
+                               load32_ssse3(&input_buffer[offsets[n + 3]])));
+        v = _mm_add_epi32(_mm_shuffle_epi8(v, shuffle), add);
+        _mm_storeu_si128((__m128i*) &column_buffer[n * 8],
+                         _mm_unpacklo_epi32(v, zero));
+        _mm_storeu_si128((__m128i*) &column_buffer[(n + 2) * 8],
+                         _mm_unpackhi_epi32(v, zero));
+    }
+    parse_gather_date(&column_buffer[n * 8],
+                      input_buffer,
+                      &offsets[n],
+                      count - n);
+}
+
+#define DEFINE_PARSE_GATHER64_AVX2(name, offset)                        \
+    __attribute__((target("avx2")))                                     \
+    static void parse_gather_ ## name ## _avx2(char* column_buffer,     \
+                                               const char* input_buffer, \
+                                               const size_t* offsets,   \
+                                               size_t count) {          \
+        const __m256i shuffle = _mm256_setr_epi8(BSWAP64_SHUFFLE,       \
+                                                 BSWAP64_SHUFFLE);      \
+        const __m256i add = _mm256_set1_epi64x(offset);                 \
+        size_t n = 0;                                                   \
+                                                                        \
+        for (; n + 4 <= count; n += 4) {                                \
+            __m256i ix = _mm256_loadu_si256((const __m256i*) &offsets[n]); \
+            __m256i v = _mm256_i64gather_epi64(                         \
+                (const long long*) input_buffer,                        \
+                ix,                                                     \
+                1);                                                     \
+            v = _mm256_add_epi64(_mm256_shuffle_epi8(v, shuffle), add); \
+            _mm256_storeu_si256((__m256i*) &column_buffer[n * 8], v);   \
+        }                                                               \
+        parse_gather_ ## name(&column_buffer[n * 8],                    \
+                              input_buffer,                             \
+                              &offsets[n],                              \
+                              count - n);                               \
+    }
+
+#define DEFINE_PARSE_GATHER32_AVX2(name)                                \
+    __attribute__((target("avx2")))                                     \
+    static void parse_gather_ ## name ## _avx2(char* column_buffer,     \
+                                               const char* input_buffer, \
+                                               const size_t* offsets,   \
+                                               size_t count) {          \
+        const __m256i shuffle = _mm256_setr_epi8(BSWAP32_SHUFFLE,       \
+                                                 BSWAP32_SHUFFLE);      \
+        size_t n = 0;                                                   \
+                                                                        \
+        for (; n + 8 <= count; n += 8) {                                \
+            __m128i lo = _mm256_i64gather_epi32(                        \
+                (const int*) input_buffer,                              \
+                _mm256_loadu_si256((const __m256i*) &offsets[n]),       \
+                1);                                                     \
+            __m128i hi = _mm256_i64gather_epi32(                        \
+                (const int*) input_buffer,                              \
+                _mm256_loadu_si256((const __m256i*) &offsets[n + 4]),   \
+                1);                                                     \
+            __m256i v = _mm256_inserti128_si256(                        \
+                _mm256_castsi128_si256(lo),                             \
+                hi,                                                     \
+                1);                                                     \
+            v = _mm256_shuffle_epi8(v, shuffle);                        \
+            _mm256_storeu_si256((__m256i*) &column_buffer[n * 4], v);   \
+        }                                                               \
+        parse_gather_ ## name(&column_buffer[n * 4],                    \
+                              input_buffer,                             \
+                              &offsets[n],                              \
+                              count - n);                               \
+    }
+
+DEFINE_PARSE_GATHER64_AVX2(int64, 0)
+DEFINE_PARSE_GATHER64_AVX2(float64, 0)
+DEFINE_PARSE_GATHER64_AVX2(datetime, datetime_offset)
+DEFINE_PARSE_GATHER32_AVX2(int32)
+DEFINE_PARSE_GATHER32_AVX2(float32)
+
+#undef DEFINE_PARSE_GATHER64_AVX2
+#undef DEFINE_PARSE_GATHER32_AVX2
+
+__attribute__((target("avx2")))
+static void parse_gather_date_avx2(char* column_buffer,
+                                   const char* input_buffer,
+                                   const size_t* offsets,
+                                   size_t count) {
+    const __m128i shuffle = _mm_setr_epi8(BSWAP32_SHUFFLE);
+    const __m128i add = _mm_set1_epi32(date_offset);
+    size_t n = 0;
+
+    for (; n + 4 <= count; n += 4) {
+        __m128i v = _mm256_i64gather_epi32(
+            (const int*) input_buffer,
+            _mm256_loadu_si256((const __m256i*) &offsets[n]),
+            1);
+        v = _mm_add_epi32(_mm_shuffle_epi8(v, shuffle), add);
+        _mm256_storeu_si256((__m256i*) &column_buffer[n * 8],
+                            _mm256_cvtepu32_epi64(v));
+    }
+    parse_gather_date(&column_buffer[n * 8],
+                      input_buffer,
+                      &offsets[n],
+                      count - n);
+}
+
+#ifdef WARP_PRISM_AVX512
+
+#define DEFINE_PARSE_GATHER64_AVX512(name, offset)                      \
+    __attribute__((target("avx512f,avx512bw")))                         \
+    static void parse_gather_ ## name ## _avx512(char* column_buffer,   \
+                                                 const char* input_buffer, \
+                                                 const size_t* offsets, \
+                                                 size_t count) {        \
+        const __m512i shuffle = _mm512_broadcast_i32x4(                 \
+            _mm_setr_epi8(BSWAP64_SHUFFLE));                            \
+        const __m512i add = _mm512_set1_epi64(offset);                  \
+        size_t n = 0;                                                   \
+                                                                        \
+        for (; n + 8 <= count; n += 8) {                                \
+            __m512i v = _mm512_i64gather_epi64(                         \
+                _mm512_loadu_si512(&offsets[n]),                        \
+                input_buffer,                                           \
+                1);                                                     \
+            v = _mm512_add_epi64(_mm512_shuffle_epi8(v, shuffle), add); \
+            _mm512_storeu_si512(&column_buffer[n * 8], v);              \
+        }                                                               \
+        parse_gather_ ## name(&column_buffer[n * 8],                    \
+                              input_buffer,                             \
+                              &offsets[n],                              \
+                              count - n);                               \
+    }
+
+#define DEFINE_PARSE_GATHER32_AVX512(name)                              \
+    __attribute__((target("avx512f,avx512bw")))                         \
+    static void parse_gather_ ## name ## _avx512(char* column_buffer,   \
+                                                 const char* input_buffer, \
+                                                 const size_t* offsets, \
+                                                 size_t count) {        \
+        const __m512i shuffle = _mm512_broadcast_i32x4(                 \
+            _mm_setr_epi8(BSWAP32_SHUFFLE));                            \
+        size_t n = 0;                                                   \
+                                                                        \
+        for (; n + 16 <= count; n += 16) {                              \
+            __m256i lo = _mm512_i64gather_epi32(                        \
+                _mm512_loadu_si512(&offsets[n]),                        \
+                input_buffer,                                           \
+                1);                                                     \
+            __m256i hi = _mm512_i64gather_epi32(                        \
+                _mm512_loadu_si512(&offsets[n + 8]),                    \
+                input_buffer,                                           \
+                1);                                                     \
+            __m512i v = _mm512_inserti64x4(                             \
+                _mm512_castsi256_si512(lo),                             \
+                hi,                                                     \
+                1);                                                     \
+            v = _mm512_shuffle_epi8(v, shuffle);                        \
+            _mm512_storeu_si512(&column_buffer[n * 4], v);              \
+        }                                                               \
+        parse_gather_ ## name(&column_buffer[n * 4],                    \
+                              input_buffer,                             \
+                              &offsets[n],                              \
+                              count - n);                               \
+    }
+
+DEFINE_PARSE_GATHER64_AVX512(int64, 0)
+DEFINE_PARSE_GATHER64_AVX512(float64, 0)
+DEFINE_PARSE_GATHER64_AVX512(datetime, datetime_offset)
+DEFINE_PARSE_GATHER32_AVX512(int32)
+DEFINE_PARSE_GATHER32_AVX512(float32)
+
+#undef DEFINE_PARSE_GATHER64_AVX512
+#undef DEFINE_PARSE_GATHER32_AVX512
+
+__attribute__((target("avx512f,avx512bw")))
+static void parse_gather_date_avx512(char* column_buffer,
+                                     const char* input_buffer,
+                                     const size_t* offsets,
+                                     size_t count) {
+    const __m256i shuffle = _mm256_setr_epi8(BSWAP32_SHUFFLE,
+                                             BSWAP32_SHUFFLE);
+    const __m256i add = _mm256_set1_epi32(date_offset);
+    size_t n = 0;
+
+    for (; n + 8 <= count; n += 8) {
+        __m256i v = _mm512_i64gather_epi32(_mm512_loadu_si512(&offsets[n]),
+                                           input_buffer,
+                                           1);
+        v = _mm256_add_epi32(_mm256_shuffle_epi8(v, shuffle), add);
+        _mm512_storeu_si512(&column_buffer[n * 8], _mm512_cvtepu32_epi64(v));
+    }
+    parse_gather_date(&column_buffer[n * 8],
+                      input_buffer,
+                      &offsets[n],
+                      count - n);
+}
+
+#endif  /* WARP_PRISM_AVX512 */
+
+#undef BSWAP64_SHUFFLE
+#undef BSWAP32_SHUFFLE
+
+#endif  /* WARP_PRISM_X86_SIMD */
+
 static void simple_free(void* colbuffer,
                         size_t rowcount __attribute__((unused))) {
     PyMem_Free(colbuffer);
@@ -251,98 +894,327 @@ static int object_write_null(char* dst, size_t size) {
 warp_prism_type int16_type = {
     "int16",
     (parse_function) parse_int16,
+    parse_gather_int16,
     simple_free,
     simple_write_null,
     sizeof(int16_t),
+    sizeof(int16_t),
     NULL,
+    false,
 };
 
 warp_prism_type int32_type = {
     "int32",
     (parse_function) parse_int32,
+    parse_gather_int32,
     simple_free,
     simple_write_null,
     sizeof(uint32_t),
+    sizeof(int32_t),
     NULL,
+    false,
 };
 
 warp_prism_type int64_type = {
     "int64",
     (parse_function) parse_int64,
+    parse_gather_int64,
     simple_free,
     simple_write_null,
     sizeof(int64_t),
+    sizeof(int64_t),
     NULL,
+    false,
 };
 
 warp_prism_type float32_type = {
     "float32",
     (parse_function) parse_float32,
+    parse_gather_float32,
     simple_free,
     simple_write_null,
     sizeof(float),
+    sizeof(float),
     NULL,
+    false,
 };
 
 warp_prism_type float64_type = {
     "float64",
     (parse_function) parse_float64,
+    parse_gather_float64,
     simple_free,
     simple_write_null,
     sizeof(double),
+    sizeof(double),
     NULL,
+    false,
 };
 
 warp_prism_type bool_type = {
     "bool",
     (parse_function) parse_bool,
+    parse_gather_bool,
     simple_free,
     simple_write_null,
     sizeof(bool),
+    sizeof(uint8_t),
     NULL,
+    false,
 };
 
 warp_prism_type string_type = {
     "object",
     (parse_function) parse_text,
+    NULL,
     (free_function) free_object,
     object_write_null,
     sizeof(PyObject*),
+    0,
+    NULL,
+    false,
+};
+
+/* The parse function is NULL because these are parsed with the column's type
+   by `parse_field`. The size and dtype are filled in by `new_decoder`. */
+warp_prism_type fixed_bytes_type = {
+    "S",
+    NULL,
+    NULL,
+    simple_free,
+    simple_write_null,
+    0,
+    0,
+    NULL,
+    false,
+};
+
+warp_prism_type fixed_unicode_type = {
+    "U",
+    NULL,
+    NULL,
+    simple_free,
+    simple_write_null,
+    0,
+    0,
+    NULL,
+    false,
+};
+
+/* Lazy text columns hold the offset of each value in the input buffer
+   instead of a string. The length of the value is the 4 bytes before it. The
+   parse function is NULL because the offset is written by `parse_field`. */
+warp_prism_type lazy_text_type = {
+    "int64",
+    NULL,
+    NULL,
+    simple_free,
+    simple_write_null,
+    sizeof(int64_t),
+    0,
+    NULL,
+    false,
+};
+
+/* Sparse columns only keep their non-NULL values, see `sparse_column`. The
+   dense cell is empty; the values are parsed with the column's value type. */
+warp_prism_type sparse_type = {
+    "sparse",
+    NULL,
+    NULL,
+    simple_free,
+    simple_write_null,
+    0,
+    0,
     NULL,
+    false,
 };
 
 warp_prism_type datetime_type = {
     "datetime64[us]",
     (parse_function) parse_datetime,
+    parse_gather_datetime,
     simple_free,
     datetime_write_null,
     sizeof(int64_t),
+    sizeof(int64_t),
     NULL,
+    false,
 };
 
 warp_prism_type date_type = {
     "datetime64[D]",
     (parse_function) parse_date,
+    parse_gather_date,
     simple_free,
     datetime_write_null,
     sizeof(int64_t),
+    sizeof(int32_t),
     NULL,
+    false,
 };
 
+typedef enum {
+    TYPEID_INT16,
+    TYPEID_INT32,
+    TYPEID_INT64,
+    TYPEID_FLOAT32,
+    TYPEID_FLOAT64,
+    TYPEID_BOOL,
+    TYPEID_TEXT,
+    TYPEID_DATETIME,
+    TYPEID_DATE,
+    TYPEID_FIXED_BYTES,
+    TYPEID_FIXED_UNICODE,
+    TYPEID_LAZY_TEXT,
+    TYPEID_SPARSE,
+} typeid;
+
 const warp_prism_type* typeids[] = {
-    &int16_type,
-    &int32_type,
-    &int64_type,
-    &float32_type,
-    &float64_type,
-    &bool_type,
-    &string_type,
-    &datetime_type,
-    &date_type,
+    [TYPEID_INT16] = &int16_type,
+    [TYPEID_INT32] = &int32_type,
+    [TYPEID_INT64] = &int64_type,
+    [TYPEID_FLOAT32] = &float32_type,
+    [TYPEID_FLOAT64] = &float64_type,
+    [TYPEID_BOOL] = &bool_type,
+    [TYPEID_TEXT] = &string_type,
+    [TYPEID_DATETIME] = &datetime_type,
+    [TYPEID_DATE] = &date_type,
+    [TYPEID_FIXED_BYTES] = &fixed_bytes_type,
+    [TYPEID_FIXED_UNICODE] = &fixed_unicode_type,
+    [TYPEID_LAZY_TEXT] = &lazy_text_type,
+    [TYPEID_SPARSE] = &sparse_type,
 };
 
 const size_t max_typeid = sizeof(typeids) / sizeof(warp_prism_type*);
 
+/* Parse a single field. Switching on the type id lets the compiler inline the
+   parser for each of the builtin types into the row loop instead of calling
+   through `warp_prism_type.parse`. `input_offset` is the position of
+   `input_buffer` in the COPY data. */
+static inline int parse_field(uint8_t column_typeid,
+                              const warp_prism_type* column_type,
+                              intern_table* intern,
+                              char* column_buffer,
+                              const char* const input_buffer,
+                              size_t input_offset,
+                              size_t len) {
+    switch (column_typeid) {
+    case TYPEID_INT16:
+        return parse_int16(column_buffer, input_buffer, len);
+    case TYPEID_INT32:
+        return parse_int32(column_buffer, input_buffer, len);
+    case TYPEID_INT64:
+        return parse_int64(column_buffer, input_buffer, len);
+    case TYPEID_FLOAT32:
+        return parse_float32(column_buffer, input_buffer, len);
+    case TYPEID_FLOAT64:
+        return parse_float64(column_buffer, input_buffer, len);
+    case TYPEID_BOOL:
+        return parse_bool(column_buffer, input_buffer, len);
+    case TYPEID_TEXT:
+        if (intern) {
+            return parse_interned_text(intern,
+                                       column_buffer,
+                                       input_buffer,
+                                       len);
+        }
+        return parse_text(column_buffer, input_buffer, len);
+    case TYPEID_DATETIME:
+        return parse_datetime(column_buffer, input_buffer, len);
+    case TYPEID_DATE:
+        return parse_date(column_buffer, input_buffer, len);
+    case TYPEID_FIXED_BYTES:
+        return parse_fixed_bytes(column_type,
+                                 column_buffer,
+                                 input_buffer,
+                                 len);
+    case TYPEID_FIXED_UNICODE:
+        return parse_fixed_unicode(column_type,
+                                   column_buffer,
+                                   input_buffer,
+                                   len);
+    case TYPEID_LAZY_TEXT:
+        *(int64_t*) column_buffer = input_offset;
+        return 0;
+    default:
+        return column_type->parse(column_buffer, input_buffer, len);
+    }
+}
+
+/* Write a NULL into a single cell; see `parse_field`. */
+static inline int write_null_field(uint8_t column_typeid,
+                                   const warp_prism_type* column_type,
+                                   char* column_buffer) {
+    switch (column_typeid) {
+    case TYPEID_INT16:
+    case TYPEID_INT32:
+    case TYPEID_INT64:
+    case TYPEID_FLOAT32:
+    case TYPEID_FLOAT64:
+    case TYPEID_BOOL:
+        return simple_write_null(column_buffer,
+                                 typeids[column_typeid]->size);
+    case TYPEID_TEXT:
+        return object_write_null(column_buffer, sizeof(PyObject*));
+    case TYPEID_DATETIME:
+    case TYPEID_DATE:
+        return datetime_write_null(column_buffer, sizeof(int64_t));
+    default:
+        return column_type->write_null(column_buffer, column_type->size);
+    }
+}
+
+simd_level active_simd_level = SIMD_SCALAR;
+
+/* The most capable instruction set the gather kernels may use on this CPU. */
+static simd_level supported_simd_level(void) {
+#ifdef WARP_PRISM_X86_SIMD
+    __builtin_cpu_init();
+#ifdef WARP_PRISM_AVX512
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+        return SIMD_AVX512;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SIMD_SSSE3;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+static void select_gather_kernels(simd_level level) {
+#ifdef WARP_PRISM_X86_SIMD
+#ifdef WARP_PRISM_AVX512
+#define AVX512_KERNEL(name)                                             \
+    (level == SIMD_AVX512) ? parse_gather_ ## name ## _avx512 :
+#else
+#define AVX512_KERNEL(name)
+#endif
+#define SELECT_KERNEL(name)                                             \
+    name ## _type.parse_gather =                                        \
+        AVX512_KERNEL(name)                                             \
+        (level == SIMD_AVX2) ? parse_gather_ ## name ## _avx2 :         \
+        (level == SIMD_SSSE3) ? parse_gather_ ## name ## _ssse3 :       \
+        parse_gather_ ## name;
+
+    SELECT_KERNEL(int32)
+    SELECT_KERNEL(int64)
+    SELECT_KERNEL(float32)
+    SELECT_KERNEL(float64)
+    SELECT_KERNEL(datetime)
+    SELECT_KERNEL(date)
+
+#undef SELECT_KERNEL
+#undef AVX512_KERNEL
+#endif
+    active_simd_level = level;
+}
+
 static inline bool have_oids(uint32_t flags) {
     return flags & (1 << 16);
 }
@@ -409,6 +1281,103 @@ DEFINE_CHECKED_CONSUME(32)
 #undef DEFINE_CHECKED_CONSUME
 #undef TYPE
 
+typedef struct {
+    double wall;
+    double cpu;
+} warp_prism_time;
+
+/* Read the monotonic wall clock and the process cpu clock, in seconds. */
+static inline void get_time(warp_prism_time* t) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->wall = ts.tv_sec + ts.tv_nsec * 1e-9;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    t->cpu = ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Counters describing a single call to `warp_prism_read_binary_results`. */
+typedef struct {
+    size_t* null_counts;       /* the number of NULLs in each column */
+    size_t grow_count;         /* the number of times the columns grew */
+    size_t bytes_copied;       /* bytes moved to grow or finalize columns */
+    size_t buffer_bytes;       /* column buffer bytes currently allocated */
+    size_t peak_buffer_bytes;  /* the most column buffer bytes allocated */
+    size_t intern_hits;        /* text values found in an intern table */
+    warp_prism_time decode_start;
+    warp_prism_time decode_end;
+} decode_stats;
+
+static inline void track_allocation(decode_stats* stats, size_t bytes) {
+    stats->buffer_bytes += bytes;
+    if (stats->buffer_bytes > stats->peak_buffer_bytes) {
+        stats->peak_buffer_bytes = stats->buffer_bytes;
+    }
+}
+
+static inline void track_free(decode_stats* stats, size_t bytes) {
+    stats->buffer_bytes -= bytes;
+}
+
+/* The output columns are built out of a list of segments so that growing a
+   column never needs to copy the rows which have already been written. The
+   first segment starts at `starting_column_buffer_length` rows, or the row
+   count when it is known ahead of time, and is grown by
+   `column_buffer_growth_factor` until it reaches `column_segment_length` rows;
+   after that, each growth appends a new full size segment. Small results
+   therefore do not pay for a full segment, and large results only copy each
+   row once when the segments are concatenated into the final array. */
+#define COLUMN_SEGMENT_SHIFT 20
+const size_t column_segment_length = (size_t) 1 << COLUMN_SEGMENT_SHIFT;
+
+typedef struct {
+    char** segments;
+    bool** masks;
+} column_segments;
+
+typedef struct {
+    uint16_t ncolumns;
+    const warp_prism_type** column_types;
+    column_segments* columns;
+    size_t nsegments;          /* the number of segments in use */
+    size_t allocated_segments; /* the capacity of the segment lists */
+    size_t allocated_rows;     /* the total row capacity of the segments */
+    decode_stats* stats;
+} outarrays_builder;
+
+static inline size_t segment_index(size_t row_ix) {
+    return row_ix >> COLUMN_SEGMENT_SHIFT;
+}
+
+static inline size_t segment_offset(size_t row_ix) {
+    return row_ix & (column_segment_length - 1);
+}
+
+/* The number of written rows which live in the given segment. */
+static inline size_t segment_rowcount(size_t segment, size_t rowcount) {
+    size_t start = segment * column_segment_length;
+
+    if (rowcount <= start) {
+        return 0;
+    }
+    rowcount -= start;
+    return (rowcount < column_segment_length) ? rowcount : column_segment_length;
+}
+
+static inline void free_column_segments(const outarrays_builder* out,
+                                        uint_fast16_t column,
+                                        size_t rowcount) {
+    const column_segments* c = &out->columns[column];
+
+    for (size_t s = 0; s < out->nsegments; ++s) {
+        out->column_types[column]->free(c->segments[s],
+                                        segment_rowcount(s, rowcount));
+        PyMem_Free(c->masks[s]);
+    }
+    PyMem_Free(c->segments);
+    PyMem_Free(c->masks);
+}
+
 static inline void free_outarrays(uint16_t ncolumns,
                                   size_t rowcount,
                                   const warp_prism_type** column_types,
@@ -420,465 +1389,6540 @@ static inline void free_outarrays(uint16_t ncolumns,
     }
 }
 
-static inline int allocate_outarrays(uint16_t ncolumns,
+static inline void free_outarrays_builder(outarrays_builder* out,
+                                          size_t rowcount) {
+    for (uint_fast16_t n = 0; n < out->ncolumns; ++n) {
+        free_column_segments(out, n, rowcount);
+    }
+    PyMem_Free(out->columns);
+    out->columns = NULL;
+}
+
+static inline int allocate_outarrays(outarrays_builder* out,
+                                     uint16_t ncolumns,
                                      const warp_prism_type** column_types,
-                                     char** outarrays,
-                                     bool** outmasks) {
+                                     size_t starting_rows,
+                                     decode_stats* stats) {
     uint_fast16_t n = 0;
-    size_t mask_allocation_size;
 
-    if (unlikely(mul_overflow(starting_column_buffer_length,
-                              sizeof(bool),
-                              &mask_allocation_size))) {
-        /* this should literally never happen */
-        PyErr_SetString(PyExc_OverflowError,
-                        "allocation size would overflow");
-        goto error;
+    out->stats = stats;
+    out->ncolumns = ncolumns;
+    out->column_types = column_types;
+    out->nsegments = 1;
+    out->allocated_segments = 1;
+    out->allocated_rows = starting_rows;
+
+    if (!(out->columns = PyMem_Malloc(sizeof(column_segments) * ncolumns))) {
+        PyErr_NoMemory();
+        return -1;
     }
 
     for (; n < ncolumns; ++n) {
+        column_segments* c = &out->columns[n];
         size_t allocation_size;
-        if (unlikely(mul_overflow(starting_column_buffer_length,
+
+        if (unlikely(mul_overflow(starting_rows,
                                   column_types[n]->size,
                                   &allocation_size))) {
             PyErr_SetString(PyExc_OverflowError,
                             "allocation size would overflow");
             goto error;
         }
-        outarrays[n] = PyMem_Malloc(allocation_size);
-        if (!outarrays[n]) {
+
+        if (!(c->segments = PyMem_Malloc(sizeof(char*)))) {
             goto error;
         }
-
-        outmasks[n] = PyMem_Malloc(mask_allocation_size);
-        if (!outmasks[n]) {
-            /* free_outarrays expects that both the array and the mask are
-               present but we failed halfway through the allocation. Clean up
-               just the outarray and then, at the error label, feed
-               free_outarrays n - 1 to clean up the allocated columns. */
-            column_types[n]->free(outarrays[n], 0);
+        if (!(c->masks = PyMem_Malloc(sizeof(bool*)))) {
+            PyMem_Free(c->segments);
+            goto error;
+        }
+        if (!(c->segments[0] = PyMem_Malloc(allocation_size))) {
+            PyMem_Free(c->segments);
+            PyMem_Free(c->masks);
             goto error;
         }
+        if (!(c->masks[0] = PyMem_Malloc(starting_rows * sizeof(bool)))) {
+            column_types[n]->free(c->segments[0], 0);
+            PyMem_Free(c->segments);
+            PyMem_Free(c->masks);
+            goto error;
+        }
+        track_allocation(stats,
+                         allocation_size + starting_rows * sizeof(bool));
     }
     return 0;
 
 error:
-    if (n > 0) {
-        /* free the column and mask buffers that have already been allocated */
-        free_outarrays(n - 1,
-                       0,
-                       column_types,
-                       outarrays,
-                       outmasks);
+    if (!PyErr_Occurred()) {
+        PyErr_NoMemory();
     }
+    /* free the columns which have already been allocated */
+    out->ncolumns = n;
+    free_outarrays_builder(out, 0);
     return -1;
 }
 
-static inline int grow_outarrays(uint16_t ncolumns,
-                                 size_t* row_count,
-                                 const warp_prism_type** column_types,
-                                 char** outarrays,
-                                 bool** outmasks) {
-    size_t old_row_count = *row_count;
+/* Grow the first segment in place while it is smaller than a full segment. */
+static inline int grow_first_segment(outarrays_builder* out) {
     size_t new_row_count;
-    size_t new_mask_size;
     uint_fast16_t n;
 
-    if (unlikely(mul_overflow(old_row_count,
+    if (unlikely(mul_overflow(out->allocated_rows,
                               column_buffer_growth_factor,
                               &new_row_count))) {
         PyErr_SetString(PyExc_OverflowError, "row count would overflow");
-        goto error;
+        return -1;
     }
-    *row_count = new_row_count;
-
-    if (unlikely(mul_overflow(new_row_count,
-                              sizeof(bool),
-                              &new_mask_size))) {
-        PyErr_SetString(PyExc_OverflowError, "mask size would overflow");
-        goto error;
+    if (new_row_count > column_segment_length) {
+        new_row_count = column_segment_length;
     }
 
-    for (n = 0; n < ncolumns; ++n) {
-        size_t allocation_size;
+    for (n = 0; n < out->ncolumns; ++n) {
+        column_segments* c = &out->columns[n];
+        size_t size = out->column_types[n]->size;
         char* new;
         bool* newmask;
 
-        if (unlikely(mul_overflow(new_row_count,
-                                  column_types[n]->size,
-                                  &allocation_size))) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "allocation size would overflow");
-            goto error;
-        }
-
-        new = PyMem_Realloc(outarrays[n], allocation_size);
+        /* new_row_count is at most column_segment_length, this cannot
+           overflow */
+        new = PyMem_Realloc(c->segments[0], new_row_count * size);
         if (!new) {
-            goto error;
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (new != c->segments[0]) {
+            out->stats->bytes_copied += out->allocated_rows * size;
         }
-        outarrays[n] = new;
+        c->segments[0] = new;
 
-        newmask = PyMem_Realloc(outmasks[n], new_mask_size);
+        newmask = PyMem_Realloc(c->masks[0], new_row_count * sizeof(bool));
         if (!newmask) {
-            goto error;
+            PyErr_NoMemory();
+            return -1;
         }
-        outmasks[n] = newmask;
+        if (newmask != c->masks[0]) {
+            out->stats->bytes_copied += out->allocated_rows * sizeof(bool);
+        }
+        c->masks[0] = newmask;
+
+        track_allocation(out->stats,
+                         (new_row_count - out->allocated_rows) *
+                         (size + sizeof(bool)));
     }
+    out->allocated_rows = new_row_count;
     return 0;
-error:
-    free_outarrays(ncolumns,
-                   old_row_count,
-                   column_types,
-                   outarrays,
-                   outmasks);
-    return -1;
 }
 
-int warp_prism_read_binary_results(const char* const input_buffer,
-                                   size_t input_len,
-                                   const uint16_t ncolumns,
-                                   const warp_prism_type** column_types,
-                                   size_t* written_rows,
-                                   char** outarrays,
-                                   bool** outmasks) {
-    size_t cursor = 0;
-    uint32_t flags;
-    size_t row_count = 0;
-    size_t allocated_rows = starting_column_buffer_length;
-    uint32_t extension_area;
+/* Append a new full size segment to every column. */
+static inline int append_segment(outarrays_builder* out) {
+    size_t new_allocated_rows;
+    uint_fast16_t n;
 
-    if (input_len < signature_len ||
-        memcmp(input_buffer, signature, signature_len)) {
+    if (unlikely(add_overflow(out->allocated_rows,
+                              column_segment_length,
+                              &new_allocated_rows))) {
+        PyErr_SetString(PyExc_OverflowError, "row count would overflow");
+        return -1;
+    }
 
-        PyErr_SetString(PyExc_ValueError, "missing postgres signature");
+    if (out->nsegments == out->allocated_segments) {
+        size_t new_allocated_segments;
+
+        if (unlikely(mul_overflow(out->allocated_segments,
+                                  2,
+                                  &new_allocated_segments))) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "segment count would overflow");
+            return -1;
+        }
+
+        for (n = 0; n < out->ncolumns; ++n) {
+            column_segments* c = &out->columns[n];
+            char** segments;
+            bool** masks;
+
+            segments = PyMem_Realloc(c->segments,
+                                     new_allocated_segments * sizeof(char*));
+            if (!segments) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            c->segments = segments;
+
+            masks = PyMem_Realloc(c->masks,
+                                  new_allocated_segments * sizeof(bool*));
+            if (!masks) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            c->masks = masks;
+        }
+        out->allocated_segments = new_allocated_segments;
+    }
+
+    for (n = 0; n < out->ncolumns; ++n) {
+        column_segments* c = &out->columns[n];
+        char* segment;
+        bool* mask;
+
+        /* column_segment_length * size is a small constant, this cannot
+           overflow */
+        segment = PyMem_Malloc(column_segment_length *
+                               out->column_types[n]->size);
+        if (!segment) {
+            goto error;
+        }
+
+        if (!(mask = PyMem_Malloc(column_segment_length * sizeof(bool)))) {
+            out->column_types[n]->free(segment, 0);
+            goto error;
+        }
+
+        c->segments[out->nsegments] = segment;
+        c->masks[out->nsegments] = mask;
+        track_allocation(out->stats,
+                         column_segment_length *
+                         (out->column_types[n]->size + sizeof(bool)));
+        continue;
+
+    error:
+        /* Free the new segments from the columns which already got one so
+           that all of the columns have the same number of segments. */
+        while (n--) {
+            c = &out->columns[n];
+            out->column_types[n]->free(c->segments[out->nsegments], 0);
+            PyMem_Free(c->masks[out->nsegments]);
+            track_free(out->stats,
+                       column_segment_length *
+                       (out->column_types[n]->size + sizeof(bool)));
+        }
+        PyErr_NoMemory();
         return -1;
     }
+    ++out->nsegments;
+    out->allocated_rows = new_allocated_rows;
+    return 0;
+}
+
+static inline int grow_outarrays(outarrays_builder* out) {
+    ++out->stats->grow_count;
+    if (out->nsegments == 1 && out->allocated_rows < column_segment_length) {
+        return grow_first_segment(out);
+    }
+    return append_segment(out);
+}
 
-    /* advance the cursor through up to the flags segment */
-    cursor += signature_len;
+/* Concatenate the segments of each column into a single exact size array.
+   Each segment is freed as soon as it has been copied so the peak memory use
+   is the size of the final arrays plus a single segment. On success, `out`
+   no longer owns any memory. */
+static inline int finalize_outarrays(outarrays_builder* out,
+                                     size_t rowcount,
+                                     char** outarrays,
+                                     bool** outmasks) {
+    uint_fast16_t n;
 
-    /* flags field */
-    if (checked_consume32(input_buffer,
-                          &cursor,
-                          input_len,
-                          &flags)) {
+    for (n = 0; n < out->ncolumns; ++n) {
+        column_segments* c = &out->columns[n];
+        size_t size = out->column_types[n]->size;
+        size_t allocation_size;
+
+        if (unlikely(mul_overflow(rowcount, size, &allocation_size))) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "allocation size would overflow");
+            goto error;
+        }
+
+        if (out->nsegments == 1) {
+            /* shrink the only segment down to the number of rows written;
+               this is a no-op if there is no slack */
+            char* array;
+            bool* mask;
+
+            if (!(array = realloc_nonempty(c->segments[0],
+                                           allocation_size))) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            if (array != c->segments[0]) {
+                out->stats->bytes_copied += allocation_size;
+            }
+            c->segments[0] = array;
+
+            if (!(mask = realloc_nonempty(c->masks[0],
+                                          rowcount * sizeof(bool)))) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            if (mask != c->masks[0]) {
+                out->stats->bytes_copied += rowcount * sizeof(bool);
+            }
+            c->masks[0] = mask;
+            track_free(out->stats,
+                       (out->allocated_rows - rowcount) *
+                       (size + sizeof(bool)));
+
+            outarrays[n] = array;
+            outmasks[n] = mask;
+        }
+        else {
+            if (!(outarrays[n] = malloc_nonempty(allocation_size))) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            if (!(outmasks[n] = malloc_nonempty(rowcount * sizeof(bool)))) {
+                PyMem_Free(outarrays[n]);
+                PyErr_NoMemory();
+                goto error;
+            }
+            track_allocation(out->stats, rowcount * (size + sizeof(bool)));
+            out->stats->bytes_copied += rowcount * (size + sizeof(bool));
+
+            for (size_t s = 0; s < out->nsegments; ++s) {
+                size_t segment_rows = segment_rowcount(s, rowcount);
+                size_t start = s * column_segment_length;
+
+                /* move the cells, this transfers ownership of any objects */
+                memcpy(&outarrays[n][start * size],
+                       c->segments[s],
+                       segment_rows * size);
+                memcpy(&outmasks[n][start],
+                       c->masks[s],
+                       segment_rows * sizeof(bool));
+                PyMem_Free(c->segments[s]);
+                PyMem_Free(c->masks[s]);
+                track_free(out->stats,
+                           column_segment_length * (size + sizeof(bool)));
+            }
+        }
+        PyMem_Free(c->segments);
+        PyMem_Free(c->masks);
+    }
+    PyMem_Free(out->columns);
+    out->columns = NULL;
+    return 0;
+
+error:
+    /* free the columns which were already moved into the final arrays */
+    for (uint_fast16_t m = 0; m < n; ++m) {
+        out->column_types[m]->free(outarrays[m], rowcount);
+        PyMem_Free(outmasks[m]);
+    }
+    /* free the columns which are still segmented */
+    for (; n < out->ncolumns; ++n) {
+        free_column_segments(out, n, rowcount);
+    }
+    PyMem_Free(out->columns);
+    out->columns = NULL;
+    return -1;
+}
+
+/* The non-NULL values of a sparse column and the rows they belong to. The
+   memory used scales with the number of values instead of the number of
+   rows. */
+typedef struct {
+    char* values;
+    int64_t* indices;
+    size_t count;
+    size_t allocated;
+} sparse_column;
+
+const size_t starting_sparse_length = 64;
+
+static inline void free_sparse_columns(sparse_column* columns,
+                                       uint16_t ncolumns) {
+    if (!columns) {
+        return;
+    }
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        PyMem_Free(columns[n].values);
+        PyMem_Free(columns[n].indices);
+    }
+    PyMem_Free(columns);
+}
+
+/* Make room for one more value. */
+static inline int grow_sparse_column(sparse_column* column,
+                                     size_t size,
+                                     decode_stats* stats) {
+    size_t new_allocated = starting_sparse_length;
+    size_t allocation_size;
+    char* values;
+    int64_t* indices;
+
+    if (column->allocated &&
+        unlikely(mul_overflow(column->allocated,
+                              column_buffer_growth_factor,
+                              &new_allocated))) {
+        PyErr_SetString(PyExc_OverflowError, "row count would overflow");
+        return -1;
+    }
+    if (unlikely(mul_overflow(new_allocated,
+                              size + sizeof(int64_t),
+                              &allocation_size))) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "allocation size would overflow");
         return -1;
     }
 
-    if (!valid_flags(flags)) {
-        PyErr_SetString(PyExc_ValueError, "invalid flags in header");
+    if (!(values = PyMem_Realloc(column->values, new_allocated * size))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    column->values = values;
+    if (!(indices = PyMem_Realloc(column->indices,
+                                  new_allocated * sizeof(int64_t)))) {
+        PyErr_NoMemory();
         return -1;
     }
+    column->indices = indices;
 
-    /* skip header extension area */
-    if (checked_consume32(input_buffer,
-                          &cursor,
-                          input_len,
-                          &extension_area)) {
+    if (column->allocated) {
+        ++stats->grow_count;
+    }
+    track_allocation(stats,
+                     (new_allocated - column->allocated) *
+                     (size + sizeof(int64_t)));
+    column->allocated = new_allocated;
+    return 0;
+}
+
+/* Shrink a sparse column down to the values written. */
+static inline int finalize_sparse_column(sparse_column* column,
+                                         size_t size,
+                                         decode_stats* stats) {
+    size_t count = column->count;
+    char* values;
+    int64_t* indices;
+
+    if (!(values = realloc_nonempty(column->values, count * size))) {
+        PyErr_NoMemory();
         return -1;
     }
-    cursor += extension_area;
-    if (extension_area) {
-        PyErr_SetString(PyExc_ValueError, "non-zero extension area length");
+    column->values = values;
+    if (!(indices = realloc_nonempty(column->indices,
+                                     count * sizeof(int64_t)))) {
+        PyErr_NoMemory();
         return -1;
     }
+    column->indices = indices;
+    if (column->allocated > count) {
+        track_free(stats,
+                   (column->allocated - count) * (size + sizeof(int64_t)));
+    }
+    column->allocated = count;
+    return 0;
+}
+
+/* Everything about a schema which can be worked out once from its type ids.
+   Decoders are cached by their type id tuple; see `get_decoder`. */
+typedef struct {
+    uint16_t ncolumns;
+    const warp_prism_type** column_types;
+    uint8_t* column_typeids;
+    /* every column is fixed width so the block decoder may be used */
+    bool fixed_width;
+    /* the wire size shared by every column, or 0 if the sizes differ */
+    size_t uniform_wire_size;
+    /* The type id of the values of each sparse column, or NULL if there are
+       no sparse columns. */
+    uint8_t* sparse_value_typeids;
+} warp_prism_decoder;
+
+/* Fixed width columns are decoded a block of rows at a time: first the
+   location of every field in the block is recorded, then each column is
+   decoded with a single `parse_gather` call. This evenly divides
+   `starting_column_buffer_length` so a block never straddles two segments. */
+const size_t decode_block_rows = 256;
+
+/* The rows to allocate before decoding data with `row_count` rows, or
+   `SIZE_MAX` if the count is unknown. A known count is rounded up to whole
+   blocks and capped at a full segment, so the first segment stays a multiple
+   of `decode_block_rows`. */
+static inline size_t starting_rows(size_t row_count) {
+    if (row_count == SIZE_MAX) {
+        return starting_column_buffer_length;
+    }
+    if (row_count >= column_segment_length) {
+        return column_segment_length;
+    }
+    /* an empty result still gets a block */
+    if (!row_count) {
+        return decode_block_rows;
+    }
+    return ((row_count + decode_block_rows - 1) / decode_block_rows *
+            decode_block_rows);
+}
+
+/* When every column is fixed width and there are no NULLs, each row has the
+   same size so field `k` of row `i` is at `cursor + i * stride + offset_k`.
+   In that case we can find the row count up front, allocate the output arrays
+   at their final size, and skip recording the field offsets because they are
+   the same for every block.
+
+   Returns 0 on success, -1 with an exception raised on failure, or 1 if the
+   input does not have a constant stride. */
+static int read_constant_stride_results(const char* const input_buffer,
+                                        size_t input_len,
+                                        size_t cursor,
+                                        const warp_prism_decoder* decoder,
+                                        decode_stats* stats,
+                                        size_t* written_rows,
+                                        char** outarrays,
+                                        bool** outmasks) {
+    const uint16_t ncolumns = decoder->ncolumns;
+    const warp_prism_type** column_types = decoder->column_types;
+    /* each row has a 2 byte field count and a 4 byte length per field */
+    size_t stride = sizeof(int16_t);
+    size_t body_len;
+    size_t rowcount;
+    size_t* offsets;
+    uint_fast16_t n;
+
+    if (!ncolumns) {
+        return 1;
+    }
+
+    for (n = 0; n < ncolumns; ++n) {
+        stride += sizeof(int32_t) + column_types[n]->wire_size;
+    }
+
+    /* the body is everything up to the 2 byte end marker */
+    if (input_len - cursor < sizeof(int16_t)) {
+        return 1;
+    }
+    body_len = input_len - cursor - sizeof(int16_t);
+    if (body_len % stride ||
+        (int16_t) read16(&input_buffer[input_len - sizeof(int16_t)]) != -1) {
+        return 1;
+    }
+    rowcount = body_len / stride;
+
+    /* validate the field count and field sizes of every row */
+    for (size_t row = 0; row < rowcount; ++row) {
+        const char* row_buffer = &input_buffer[cursor + row * stride];
+        size_t offset = sizeof(int16_t);
+
+        if (read16(row_buffer) != ncolumns) {
+            return 1;
+        }
+
+        for (n = 0; n < ncolumns; ++n) {
+            if (read32(&row_buffer[offset]) != column_types[n]->wire_size) {
+                return 1;
+            }
+            offset += sizeof(int32_t) + column_types[n]->wire_size;
+        }
+    }
 
-    if (allocate_outarrays(ncolumns, column_types, outarrays, outmasks)) {
+    /* the offsets of a column's values relative to its value in the first row
+       of the block */
+    if (!(offsets = PyMem_Malloc(decode_block_rows * sizeof(size_t)))) {
+        PyErr_NoMemory();
         return -1;
     }
+    for (size_t row = 0; row < decode_block_rows; ++row) {
+        offsets[row] = row * stride;
+    }
 
+    for (n = 0; n < ncolumns; ++n) {
+        size_t allocation_size;
 
-    while (true) {
-        int16_t field_count;
+        if (unlikely(mul_overflow(rowcount,
+                                  column_types[n]->size,
+                                  &allocation_size))) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "allocation size would overflow");
+            goto error;
+        }
 
-        if (checked_consume16(input_buffer,
-                              &cursor,
+        if (!(outarrays[n] = malloc_nonempty(allocation_size))) {
+            PyErr_NoMemory();
+            goto error;
+        }
+
+        if (!(outmasks[n] = malloc_nonempty(rowcount * sizeof(bool)))) {
+            PyMem_Free(outarrays[n]);
+            PyErr_NoMemory();
+            goto error;
+        }
+        memset(outmasks[n], true, rowcount * sizeof(bool));
+        track_allocation(stats, allocation_size + rowcount * sizeof(bool));
+    }
+
+    for (size_t row = 0; row < rowcount; row += decode_block_rows) {
+        size_t count = rowcount - row;
+        /* the first value of the first column in this block */
+        size_t offset = cursor + row * stride + sizeof(int16_t) +
+            sizeof(int32_t);
+
+        if (count > decode_block_rows) {
+            count = decode_block_rows;
+        }
+
+        for (n = 0; n < ncolumns; ++n) {
+            column_types[n]->parse_gather(
+                &outarrays[n][row * column_types[n]->size],
+                &input_buffer[offset],
+                offsets,
+                count);
+            offset += column_types[n]->wire_size + sizeof(int32_t);
+        }
+    }
+
+    PyMem_Free(offsets);
+    get_time(&stats->decode_end);
+    *written_rows = rowcount;
+    return 0;
+
+error:
+    PyMem_Free(offsets);
+    /* none of the columns hold objects so the row count does not matter */
+    free_outarrays(n, 0, column_types, outarrays, outmasks);
+    return -1;
+}
+
+/* Record the location of each field of a single fixed width row, checking the
+   bounds of every read. The cursor should point just past the row's field
+   count. This is used near the end of the input, and to produce the error for
+   a row that failed the unchecked scan in `read_fixed_width_results`. */
+static inline int scan_fixed_width_row(const char* const input_buffer,
+                                       size_t input_len,
+                                       size_t* cursor,
+                                       const uint16_t ncolumns,
+                                       const warp_prism_type** column_types,
+                                       size_t* offsets) {
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        int32_t datalen;
+
+        if (checked_consume32(input_buffer,
+                              cursor,
                               input_len,
-                              (uint16_t*) &field_count)) {
-            free_outarrays(ncolumns,
-                           row_count,
-                           column_types,
-                           outarrays,
-                           outmasks);
+                              (uint32_t*) &datalen)) {
             return -1;
         }
 
-        if (field_count == -1) {
-            /* field_count == -1 signals the end of the input data */
-            break;
+        if (datalen == -1) {
+            offsets[n * decode_block_rows] = 0;
+            continue;
         }
 
-        if (field_count != ncolumns) {
-            PyErr_Format(PyExc_ValueError,
-                         "mismatched field_count and ncolumns on row %zu:"
-                         " %d != %d",
-                         row_count,
-                         field_count,
-                         ncolumns);
+        if (assert_can_consume(datalen, *cursor, input_len)) {
             return -1;
         }
 
-        if (have_oids(flags)) {
-            uint32_t oid;
-            if (checked_consume32(input_buffer,
-                                  &cursor,
-                                  input_len,
-                                  &oid)) {
-                free_outarrays(ncolumns,
-                               row_count,
-                               column_types,
-                               outarrays,
-                               outmasks);
-                return -1;
-            }
+        if ((size_t) datalen != column_types[n]->wire_size) {
+            /* let the scalar parser raise the size error */
+            char scratch[sizeof(int64_t)];
+            column_types[n]->parse(scratch, &input_buffer[*cursor], datalen);
+            return -1;
         }
 
-        /* advance the row count; grow arrays if needed */
-        if (row_count++ == allocated_rows) {
-            if (grow_outarrays(ncolumns,
-                               &allocated_rows,
-                               column_types,
-                               outarrays,
-                               outmasks)) {
-                return -1;
+        offsets[n * decode_block_rows] = *cursor;
+        *cursor += datalen;
+    }
+    return 0;
+}
+
+/* Record the location of each field of a single fixed width row which is
+   known to be in bounds. A field is either NULL or exactly the size of its
+   type so the fields can be scanned without branching; any other size marks
+   the row as invalid and true is returned.
+
+   `uniform_wire_size` is the wire size of every column, or 0 to read the size
+   of each column from `wire_sizes`. This is always inlined with a constant so
+   that schemas where all of the columns have the same size get a scan with
+   the size folded in. */
+static inline bool scan_fixed_width_row_unchecked(
+    const char* const input_buffer,
+    size_t* cursor,
+    const uint16_t ncolumns,
+    const size_t* wire_sizes,
+    size_t uniform_wire_size,
+    size_t* offsets) {
+
+    bool invalid = false;
+
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        int32_t datalen = consume32(input_buffer, cursor);
+        bool is_null = datalen == -1;
+        size_t wire_size = uniform_wire_size ? uniform_wire_size :
+            wire_sizes[n];
+
+        invalid |= !is_null && (size_t) datalen != wire_size;
+        offsets[n * decode_block_rows] = is_null ? 0 : *cursor;
+        *cursor += is_null ? 0 : wire_size;
+    }
+    return invalid;
+}
+
+/* Read results where every column is fixed width but where there may be NULLs
+   which break the constant row stride. The location of each field is recorded
+   for a block of rows and then each column is decoded for the whole block.
+
+   The rows are validated the same way as in `warp_prism_read_binary_results`
+   and produce the same errors. */
+static int read_fixed_width_results(const char* const input_buffer,
+                                    size_t input_len,
+                                    size_t cursor,
+                                    uint32_t flags,
+                                    const warp_prism_decoder* decoder,
+                                    size_t expected_rows,
+                                    decode_stats* stats,
+                                    size_t* written_rows,
+                                    char** outarrays,
+                                    bool** outmasks) {
+    const uint16_t ncolumns = decoder->ncolumns;
+    const warp_prism_type** column_types = decoder->column_types;
+    size_t row_count = 0;
+    /* the most bytes a row (and the next field count) can take up */
+    size_t max_row_size = 2 * sizeof(int16_t) +
+        (have_oids(flags) ? sizeof(uint32_t) : 0);
+    size_t allocation_size;
+    size_t* offsets;
+    size_t* wire_sizes;
+    outarrays_builder out;
+    bool done = false;
+
+    if (unlikely(mul_overflow(decode_block_rows + 1,
+                              ncolumns * sizeof(size_t),
+                              &allocation_size))) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "allocation size would overflow");
+        return -1;
+    }
+    /* `offsets[n * decode_block_rows + row]` is the location of the value for
+       column `n` of the given row in the block. NULLs are recorded with an
+       offset of 0 which points at the signature, so the gather still reads in
+       bounds, and which can never be the location of a real value.
+
+       The wire sizes are stored after the offsets so that the scan does not
+       need to go through the column types. */
+    if (!(offsets = PyMem_Malloc(allocation_size))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    wire_sizes = &offsets[ncolumns * decode_block_rows];
+
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        wire_sizes[n] = column_types[n]->wire_size;
+        max_row_size += sizeof(int32_t) + wire_sizes[n];
+    }
+
+    if (allocate_outarrays(&out,
+                           ncolumns,
+                           column_types,
+                           starting_rows(expected_rows),
+                           stats)) {
+        PyMem_Free(offsets);
+        return -1;
+    }
+
+    while (!done) {
+        size_t block_rows;
+        size_t segment;
+        size_t segment_ix;
+
+        if (row_count == out.allocated_rows) {
+            if (grow_outarrays(&out)) {
+                goto error;
             }
         }
+        segment = segment_index(row_count);
+        segment_ix = segment_offset(row_count);
 
-        for (uint_fast16_t n = 0; n < ncolumns; ++n) {
-            const warp_prism_type* column_type = column_types[n];
-            int32_t datalen;
-            size_t row_ix = row_count - 1;
-            char* column_buffer = &outarrays[n][row_ix * column_type->size];
+        for (block_rows = 0; block_rows < decode_block_rows; ++block_rows) {
+            int16_t field_count;
+            size_t row_start;
+            bool invalid;
 
-            if (checked_consume32(input_buffer,
+            if (checked_consume16(input_buffer,
                                   &cursor,
                                   input_len,
-                                  (uint32_t*) &datalen)) {
+                                  (uint16_t*) &field_count)) {
+                goto error;
+            }
+
+            if (field_count == -1) {
+                /* field_count == -1 signals the end of the input data */
+                done = true;
+                break;
+            }
+
+            if (field_count != ncolumns) {
+                PyErr_Format(PyExc_ValueError,
+                             "mismatched field_count and ncolumns on row %zu:"
+                             " %d != %d",
+                             row_count + block_rows,
+                             field_count,
+                             ncolumns);
                 goto error;
             }
 
-            if (!(outmasks[n][row_ix] = (datalen != -1))) {
-                if (column_type->write_null(column_buffer, column_type->size)) {
+            if (have_oids(flags)) {
+                uint32_t oid;
+                if (checked_consume32(input_buffer,
+                                      &cursor,
+                                      input_len,
+                                      &oid)) {
                     goto error;
                 }
+            }
 
-                /* no value bytes follow a null */
+            if (input_len - cursor < max_row_size) {
+                if (scan_fixed_width_row(input_buffer,
+                                         input_len,
+                                         &cursor,
+                                         ncolumns,
+                                         column_types,
+                                         &offsets[block_rows])) {
+                    goto error;
+                }
                 continue;
             }
 
-            if (assert_can_consume(datalen, cursor, input_len) ||
-                column_type->parse(column_buffer,
-                                   &input_buffer[cursor],
-                                   datalen)) {
+            row_start = cursor;
+            switch (decoder->uniform_wire_size) {
+            case sizeof(int32_t):
+                invalid = scan_fixed_width_row_unchecked(input_buffer,
+                                                         &cursor,
+                                                         ncolumns,
+                                                         wire_sizes,
+                                                         sizeof(int32_t),
+                                                         &offsets[block_rows]);
+                break;
+            case sizeof(int64_t):
+                invalid = scan_fixed_width_row_unchecked(input_buffer,
+                                                         &cursor,
+                                                         ncolumns,
+                                                         wire_sizes,
+                                                         sizeof(int64_t),
+                                                         &offsets[block_rows]);
+                break;
+            default:
+                invalid = scan_fixed_width_row_unchecked(input_buffer,
+                                                         &cursor,
+                                                         ncolumns,
+                                                         wire_sizes,
+                                                         0,
+                                                         &offsets[block_rows]);
+            }
+
+            if (unlikely(invalid)) {
+                /* scan the row again to report the error */
+                cursor = row_start;
+                scan_fixed_width_row(input_buffer,
+                                     input_len,
+                                     &cursor,
+                                     ncolumns,
+                                     column_types,
+                                     &offsets[block_rows]);
                 goto error;
             }
-            cursor += datalen;
-            continue;
+        }
 
-        error:
-            /* Write a NULL of the correct size to all of the columns that
-               have not yet been written. This ensures that we can properly
-               cleanup all of the column arrays with `free_outarrays`. */
-            for (; n < ncolumns; ++n) {
-                const warp_prism_type* type = column_types[n];
-                char* buffer = &outarrays[n][row_ix * column_type->size];
-                memset(buffer, 0, type->size);
+        for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+            const warp_prism_type* column_type = column_types[n];
+            const size_t* column_offsets = &offsets[n * decode_block_rows];
+            char* column_buffer =
+                &out.columns[n].segments[segment][segment_ix *
+                                                  column_type->size];
+            bool* mask = &out.columns[n].masks[segment][segment_ix];
+            size_t nulls = 0;
+
+            column_type->parse_gather(column_buffer,
+                                      input_buffer,
+                                      column_offsets,
+                                      block_rows);
+
+            for (size_t row = 0; row < block_rows; ++row) {
+                nulls += !(mask[row] = column_offsets[row] != 0);
             }
-            free_outarrays(ncolumns,
-                           row_count,
-                           column_types,
-                           outarrays,
-                           outmasks);
-            return -1;
+
+            if (!nulls) {
+                continue;
+            }
+            stats->null_counts[n] += nulls;
+
+            for (size_t row = 0; row < block_rows; ++row) {
+                if (!mask[row] &&
+                    column_type->write_null(&column_buffer[row *
+                                                           column_type->size],
+                                            column_type->size)) {
+                    goto error;
+                }
+            }
+        }
+        row_count += block_rows;
+    }
+
+    PyMem_Free(offsets);
+    get_time(&stats->decode_end);
+    if (finalize_outarrays(&out, row_count, outarrays, outmasks)) {
+        return -1;
+    }
+    *written_rows = row_count;
+    return 0;
+
+error:
+    PyMem_Free(offsets);
+    /* none of the columns hold objects so the row count does not matter */
+    free_outarrays_builder(&out, 0);
+    return -1;
+}
+
+/* Check the header of the COPY data and read its flags. `cursor` is left at
+   the first row. */
+static int read_header(const char* const input_buffer,
+                       size_t input_len,
+                       size_t* cursor,
+                       uint32_t* flags) {
+    uint32_t extension_area;
+
+    if (input_len < signature_len ||
+        memcmp(input_buffer, signature, signature_len)) {
+
+        PyErr_SetString(PyExc_ValueError, "missing postgres signature");
+        return -1;
+    }
+
+    /* advance the cursor through up to the flags segment */
+    *cursor = signature_len;
+
+    /* flags field */
+    if (checked_consume32(input_buffer,
+                          cursor,
+                          input_len,
+                          flags)) {
+        return -1;
+    }
+
+    if (!valid_flags(*flags)) {
+        PyErr_SetString(PyExc_ValueError, "invalid flags in header");
+        return -1;
+    }
+
+    /* skip header extension area */
+    if (checked_consume32(input_buffer,
+                          cursor,
+                          input_len,
+                          &extension_area)) {
+        return -1;
+    }
+    *cursor += extension_area;
+    if (extension_area) {
+        PyErr_SetString(PyExc_ValueError, "non-zero extension area length");
+        return -1;
+    }
+    return 0;
+}
+
+int warp_prism_read_binary_results(const char* const input_buffer,
+                                   size_t input_len,
+                                   const warp_prism_decoder* decoder,
+                                   size_t expected_rows,
+                                   bool intern_text,
+                                   sparse_column* sparse,
+                                   decode_stats* stats,
+                                   size_t* written_rows,
+                                   char** outarrays,
+                                   bool** outmasks) {
+    const uint16_t ncolumns = decoder->ncolumns;
+    const warp_prism_type** column_types = decoder->column_types;
+    const uint8_t* column_typeids = decoder->column_typeids;
+    size_t cursor = 0;
+    uint32_t flags;
+    size_t row_count = 0;
+    outarrays_builder out;
+    intern_table* intern_tables = NULL;
+
+    if (read_header(input_buffer, input_len, &cursor, &flags)) {
+        return -1;
+    }
+
+    if (decoder->fixed_width) {
+        if (!have_oids(flags)) {
+            int status = read_constant_stride_results(input_buffer,
+                                                      input_len,
+                                                      cursor,
+                                                      decoder,
+                                                      stats,
+                                                      written_rows,
+                                                      outarrays,
+                                                      outmasks);
+            if (status <= 0) {
+                return status;
+            }
+        }
+
+        return read_fixed_width_results(input_buffer,
+                                        input_len,
+                                        cursor,
+                                        flags,
+                                        decoder,
+                                        expected_rows,
+                                        stats,
+                                        written_rows,
+                                        outarrays,
+                                        outmasks);
+    }
+
+    if (allocate_outarrays(&out,
+                           ncolumns,
+                           column_types,
+                           starting_rows(expected_rows),
+                           stats)) {
+        return -1;
+    }
+
+    if (intern_text &&
+        !(intern_tables = PyMem_Calloc(ncolumns, sizeof(intern_table)))) {
+        PyErr_NoMemory();
+        free_outarrays_builder(&out, row_count);
+        return -1;
+    }
+
+    while (true) {
+        int16_t field_count;
+        size_t segment;
+        size_t segment_ix;
+
+        if (checked_consume16(input_buffer,
+                              &cursor,
+                              input_len,
+                              (uint16_t*) &field_count)) {
+            free_intern_tables(intern_tables, ncolumns);
+            free_outarrays_builder(&out, row_count);
+            return -1;
+        }
+
+        if (field_count == -1) {
+            /* field_count == -1 signals the end of the input data */
+            break;
+        }
+
+        if (field_count != ncolumns) {
+            PyErr_Format(PyExc_ValueError,
+                         "mismatched field_count and ncolumns on row %zu:"
+                         " %d != %d",
+                         row_count,
+                         field_count,
+                         ncolumns);
+            free_intern_tables(intern_tables, ncolumns);
+            free_outarrays_builder(&out, row_count);
+            return -1;
+        }
+
+        if (have_oids(flags)) {
+            uint32_t oid;
+            if (checked_consume32(input_buffer,
+                                  &cursor,
+                                  input_len,
+                                  &oid)) {
+                free_intern_tables(intern_tables, ncolumns);
+                free_outarrays_builder(&out, row_count);
+                return -1;
+            }
+        }
+
+        /* advance the row count; grow arrays if needed */
+        if (row_count == out.allocated_rows) {
+            if (grow_outarrays(&out)) {
+                free_intern_tables(intern_tables, ncolumns);
+                free_outarrays_builder(&out, row_count);
+                return -1;
+            }
+        }
+        segment = segment_index(row_count);
+        segment_ix = segment_offset(row_count);
+        ++row_count;
+
+        for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+            const warp_prism_type* column_type = column_types[n];
+            int32_t datalen;
+            char* column_buffer =
+                &out.columns[n].segments[segment][segment_ix *
+                                                  column_type->size];
+
+            if (checked_consume32(input_buffer,
+                                  &cursor,
+                                  input_len,
+                                  (uint32_t*) &datalen)) {
+                goto error;
+            }
+
+            if (!(out.columns[n].masks[segment][segment_ix] =
+                  (datalen != -1))) {
+                if (write_null_field(column_typeids[n],
+                                     column_type,
+                                     column_buffer)) {
+                    goto error;
+                }
+                ++stats->null_counts[n];
+
+                /* no value bytes follow a null */
+                continue;
+            }
+
+            if (column_typeids[n] == TYPEID_SPARSE) {
+                uint8_t value_typeid = decoder->sparse_value_typeids[n];
+                const warp_prism_type* value_type = typeids[value_typeid];
+                sparse_column* column = &sparse[n];
+
+                if (assert_can_consume(datalen, cursor, input_len) ||
+                    (column->count == column->allocated &&
+                     grow_sparse_column(column, value_type->size, stats)) ||
+                    parse_field(value_typeid,
+                                value_type,
+                                NULL,
+                                &column->values[column->count *
+                                                value_type->size],
+                                &input_buffer[cursor],
+                                cursor,
+                                datalen)) {
+                    goto error;
+                }
+                column->indices[column->count++] = row_count - 1;
+                cursor += datalen;
+                continue;
+            }
+
+            if (assert_can_consume(datalen, cursor, input_len) ||
+                parse_field(column_typeids[n],
+                            column_type,
+                            intern_tables ? &intern_tables[n] : NULL,
+                            column_buffer,
+                            &input_buffer[cursor],
+                            cursor,
+                            datalen)) {
+                goto error;
+            }
+            cursor += datalen;
+            continue;
+
+        error:
+            /* Write a NULL of the correct size to all of the columns that
+               have not yet been written. This ensures that we can properly
+               cleanup all of the column arrays with
+               `free_outarrays_builder`. */
+            for (; n < ncolumns; ++n) {
+                const warp_prism_type* type = column_types[n];
+                char* buffer =
+                    &out.columns[n].segments[segment][segment_ix * type->size];
+                memset(buffer, 0, type->size);
+            }
+            free_intern_tables(intern_tables, ncolumns);
+            free_outarrays_builder(&out, row_count);
+            return -1;
+        }
+    }
+
+    if (intern_tables) {
+        for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+            stats->intern_hits += intern_tables[n].hits;
+        }
+        free_intern_tables(intern_tables, ncolumns);
+    }
+
+    get_time(&stats->decode_end);
+    if (finalize_outarrays(&out, row_count, outarrays, outmasks)) {
+        return -1;
+    }
+    *written_rows = row_count;
+    return 0;
+}
+
+/* Find the fields of the next row. `offsets[n]` is set to the position of
+   the data of field `n` and `lens[n]` to its length, or -1 for NULL. Returns
+   1 at the end of the data. */
+static int next_row(const char* const input_buffer,
+                    size_t input_len,
+                    size_t* cursor,
+                    uint32_t flags,
+                    uint16_t ncolumns,
+                    size_t row,
+                    size_t* offsets,
+                    int32_t* lens) {
+    int16_t field_count;
+
+    if (checked_consume16(input_buffer,
+                          cursor,
+                          input_len,
+                          (uint16_t*) &field_count)) {
+        return -1;
+    }
+
+    if (field_count == -1) {
+        /* field_count == -1 signals the end of the input data */
+        return 1;
+    }
+
+    if (field_count != ncolumns) {
+        PyErr_Format(PyExc_ValueError,
+                     "mismatched field_count and ncolumns on row %zu:"
+                     " %d != %d",
+                     row,
+                     field_count,
+                     ncolumns);
+        return -1;
+    }
+
+    if (have_oids(flags)) {
+        uint32_t oid;
+        if (checked_consume32(input_buffer, cursor, input_len, &oid)) {
+            return -1;
+        }
+    }
+
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        if (checked_consume32(input_buffer,
+                              cursor,
+                              input_len,
+                              (uint32_t*) &lens[n])) {
+            return -1;
+        }
+        offsets[n] = *cursor;
+        if (lens[n] == -1) {
+            continue;
+        }
+        if (assert_can_consume(lens[n], *cursor, input_len)) {
+            return -1;
+        }
+        *cursor += lens[n];
+    }
+    return 0;
+}
+
+/* The types which are read as int64s for pivot keys and versions. */
+static inline bool is_int_key(uint8_t column_typeid) {
+    return (column_typeid == TYPEID_INT16 ||
+            column_typeid == TYPEID_INT32 ||
+            column_typeid == TYPEID_INT64 ||
+            column_typeid == TYPEID_DATETIME ||
+            column_typeid == TYPEID_DATE);
+}
+
+/* Parse an integer, datetime, or date field and widen it to an int64. */
+static inline int read_int_key(uint8_t column_typeid,
+                               const char* const input_buffer,
+                               size_t len,
+                               int64_t* out) {
+    union {
+        int16_t i16;
+        int32_t i32;
+        int64_t i64;
+    } cell;
+
+    if (parse_field(column_typeid,
+                    typeids[column_typeid],
+                    NULL,
+                    (char*) &cell,
+                    input_buffer,
+                    0,
+                    len)) {
+        return -1;
+    }
+    switch (column_typeid) {
+    case TYPEID_INT16:
+        *out = cell.i16;
+        break;
+    case TYPEID_INT32:
+        *out = cell.i32;
+        break;
+    default:
+        *out = cell.i64;
+    }
+    return 0;
+}
+
+/* Walking rows
+
+   The stages which drop or reorder rows before decoding walk the rows once
+   to find where each row starts and what its keys are. `walk_rows` does the
+   walk and the growth of the per-row arrays, calling a visitor with the
+   fields of each row. */
+
+/* Look at the fields of the row from `row_start` to `row_end` and fill its
+   `record`, which is NULL when the rows are not recorded. Returns 1 to keep
+   the row, 0 to drop it, or -1 with an exception set. */
+typedef int (*row_visitor)(void* state,
+                           const char* const input_buffer,
+                           size_t row,
+                           size_t row_start,
+                           size_t row_end,
+                           const size_t* offsets,
+                           const int32_t* lens,
+                           char* record);
+
+typedef struct {
+    size_t header_len;
+    /* the start of each kept row followed by `end`, or NULL when the rows
+       are not recorded */
+    size_t* row_starts;
+    /* `record_size` bytes for each kept row */
+    char* records;
+    size_t rows;
+    size_t kept_rows;
+    /* where the walk stopped, which is the end marker when `ended` */
+    size_t end;
+    bool ended;
+} row_walk;
+
+static void free_row_walk(row_walk* walk) {
+    PyMem_Free(walk->row_starts);
+    PyMem_Free(walk->records);
+    walk->row_starts = NULL;
+    walk->records = NULL;
+}
+
+/* Walk up to `max_rows` rows of the COPY data, calling `visit`, if given,
+   for each one. With `record_rows` the start and a `record_size` byte record
+   of each kept row are stored in `walk`, which must be freed with
+   `free_row_walk`. Returns 0 or -1 with an exception set. */
+static inline int walk_rows(const char* const input_buffer,
+                            size_t input_len,
+                            const warp_prism_decoder* decoder,
+                            size_t max_rows,
+                            bool record_rows,
+                            size_t record_size,
+                            row_visitor visit,
+                            void* state,
+                            row_walk* walk) {
+    uint16_t ncolumns = decoder->ncolumns;
+    size_t cursor;
+    uint32_t flags;
+    size_t* offsets = NULL;
+    int32_t* lens = NULL;
+    size_t allocated_rows = starting_column_buffer_length;
+    /* the row starts have room for the end too */
+    size_t max_allocated_rows = PY_SSIZE_T_MAX /
+        (record_size > sizeof(size_t) ? record_size : sizeof(size_t)) - 1;
+    int status = 0;
+
+    memset(walk, 0, sizeof(row_walk));
+    if (read_header(input_buffer, input_len, &cursor, &flags)) {
+        return -1;
+    }
+    walk->header_len = cursor;
+
+    if (!(offsets = malloc_nonempty(sizeof(size_t) * ncolumns)) ||
+        !(lens = malloc_nonempty(sizeof(int32_t) * ncolumns)) ||
+        (record_rows &&
+         (!(walk->row_starts = PyMem_Malloc(sizeof(size_t) *
+                                            (allocated_rows + 1))) ||
+          !(walk->records = malloc_nonempty(record_size *
+                                            allocated_rows))))) {
+        PyErr_NoMemory();
+        status = -1;
+        goto done;
+    }
+
+    while (walk->rows < max_rows) {
+        size_t row_start = cursor;
+        char* record = NULL;
+        int keep = 1;
+
+        if ((status = next_row(input_buffer,
+                               input_len,
+                               &cursor,
+                               flags,
+                               ncolumns,
+                               walk->rows,
+                               offsets,
+                               lens))) {
+            cursor = row_start;
+            break;
+        }
+
+        if (record_rows) {
+            if (walk->kept_rows == allocated_rows) {
+                size_t* p;
+                char* q;
+
+                if (unlikely(mul_overflow(allocated_rows,
+                                          column_buffer_growth_factor,
+                                          &allocated_rows)) ||
+                    unlikely(allocated_rows > max_allocated_rows)) {
+                    PyErr_SetString(PyExc_OverflowError,
+                                    "row count would overflow");
+                    status = -1;
+                    break;
+                }
+                if (!(p = PyMem_Realloc(walk->row_starts,
+                                        sizeof(size_t) *
+                                        (allocated_rows + 1)))) {
+                    PyErr_NoMemory();
+                    status = -1;
+                    break;
+                }
+                walk->row_starts = p;
+                if (record_size) {
+                    if (!(q = PyMem_Realloc(walk->records,
+                                            record_size * allocated_rows))) {
+                        PyErr_NoMemory();
+                        status = -1;
+                        break;
+                    }
+                    walk->records = q;
+                }
+            }
+            record = &walk->records[walk->kept_rows * record_size];
+        }
+
+        if (visit && (keep = visit(state,
+                                   input_buffer,
+                                   walk->rows,
+                                   row_start,
+                                   cursor,
+                                   offsets,
+                                   lens,
+                                   record)) < 0) {
+            status = -1;
+            break;
+        }
+        if (keep) {
+            if (record_rows) {
+                walk->row_starts[walk->kept_rows] = row_start;
+            }
+            ++walk->kept_rows;
+        }
+        ++walk->rows;
+    }
+    if (status < 0) {
+        goto done;
+    }
+    walk->ended = status;
+    walk->end = cursor;
+    if (record_rows) {
+        walk->row_starts[walk->kept_rows] = cursor;
+    }
+    status = 0;
+
+done:
+    PyMem_Free(offsets);
+    PyMem_Free(lens);
+    if (status) {
+        free_row_walk(walk);
+    }
+    return status;
+}
+
+/* Row limits
+
+   `raw_to_arrays(..., max_rows=n)` decodes only the first `n` rows. The
+   end of the `n`th row is found by walking the rows, and when there are more
+   rows the first `n` are copied into a shorter COPY buffer.
+
+   `count_rows` counts the rows of COPY data while it is still arriving so
+   that `to_arrays` can stop the copy once it has enough rows. */
+
+/* The signature, the flags, and the length of the header extension area. */
+#define COPY_HEADER_LEN (11 + 2 * sizeof(uint32_t))
+
+/* Find the end of the row at `cursor` in COPY data which may stop part way
+   through a row. Returns 1 and sets `end` when the whole row has arrived, 0
+   when it has not, or -1 at the end of the data. The fields are skipped by
+   their lengths without being read. */
+static inline int arrived_row_end(const char* const input_buffer,
+                                  size_t input_len,
+                                  size_t cursor,
+                                  uint32_t flags,
+                                  size_t* end) {
+    int16_t field_count;
+
+    if (input_len - cursor < sizeof(int16_t)) {
+        return 0;
+    }
+    field_count = (int16_t) read16(&input_buffer[cursor]);
+    if (field_count == -1) {
+        return -1;
+    }
+    cursor += sizeof(int16_t);
+    if (have_oids(flags)) {
+        cursor += sizeof(uint32_t);
+    }
+    for (int16_t n = 0; n < field_count; ++n) {
+        int32_t len;
+
+        if (cursor > input_len || input_len - cursor < sizeof(int32_t)) {
+            return 0;
+        }
+        len = (int32_t) read32(&input_buffer[cursor]);
+        cursor += sizeof(int32_t);
+        if (len > 0) {
+            cursor += len;
+        }
+    }
+    if (cursor > input_len) {
+        return 0;
+    }
+    *end = cursor;
+    return 1;
+}
+
+/* Count the rows of the COPY data, stopping after `max_rows`. Sets `out` to
+   a new bytes object holding only the first `max_rows` rows, or to NULL when
+   there are no more rows than that. Returns the row count or -1 on error. */
+static Py_ssize_t head_rows(const char* const input_buffer,
+                            size_t input_len,
+                            const warp_prism_decoder* decoder,
+                            size_t max_rows,
+                            PyObject** out) {
+    row_walk walk;
+    char* out_buffer;
+
+    *out = NULL;
+    if (walk_rows(input_buffer,
+                  input_len,
+                  decoder,
+                  max_rows,
+                  false,
+                  0,
+                  NULL,
+                  NULL,
+                  &walk)) {
+        return -1;
+    }
+
+    /* the data ended before the limit, or the next row is the end */
+    if (walk.ended ||
+        (input_len - walk.end >= sizeof(int16_t) &&
+         (int16_t) read16(&input_buffer[walk.end]) == -1)) {
+        return walk.rows;
+    }
+
+    if (!(*out = PyBytes_FromStringAndSize(NULL,
+                                           walk.end + sizeof(int16_t)))) {
+        return -1;
+    }
+    out_buffer = PyBytes_AS_STRING(*out);
+    memcpy(out_buffer, input_buffer, walk.end);
+    /* the end of the data */
+    write16(&out_buffer[walk.end], (uint16_t) -1);
+    return walk.rows;
+}
+
+/* Count up to `max_rows` whole rows of the COPY data in `buffer` starting at
+   `cursor`, or after the header when `cursor` is -1. Returns
+   `(cursor, rows, ended)` where `cursor` is the start of the first row which
+   was not counted, or -1 when the header has not all arrived yet, and
+   `ended` is whether the end of the data was reached. */
+static PyObject* warp_prism_count_rows(PyObject* self __attribute__((unused)),
+                                       PyObject* args) {
+    Py_buffer view;
+    Py_ssize_t cursor;
+    Py_ssize_t max_rows;
+    const char* input_buffer;
+    size_t input_len;
+    size_t start;
+    uint32_t flags;
+    Py_ssize_t rows = 0;
+    bool ended = false;
+
+    if (!PyArg_ParseTuple(args,
+                          "y*nn:count_rows",
+                          &view,
+                          &cursor,
+                          &max_rows)) {
+        return NULL;
+    }
+    input_buffer = view.buf;
+    input_len = view.len;
+
+    if (input_len < COPY_HEADER_LEN) {
+        PyBuffer_Release(&view);
+        return Py_BuildValue("nnO", (Py_ssize_t) -1, rows, Py_False);
+    }
+    if (read_header(input_buffer, input_len, &start, &flags)) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    if (cursor == -1) {
+        cursor = start;
+    }
+    else if (cursor < (Py_ssize_t) start || (size_t) cursor > input_len) {
+        PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError, "invalid cursor: %zd", cursor);
+        return NULL;
+    }
+
+    while (rows < max_rows) {
+        size_t end;
+        int status = arrived_row_end(input_buffer,
+                                     input_len,
+                                     cursor,
+                                     flags,
+                                     &end);
+
+        if (status <= 0) {
+            ended = status < 0;
+            break;
+        }
+        cursor = end;
+        ++rows;
+    }
+    PyBuffer_Release(&view);
+    return Py_BuildValue("nnO", cursor, rows, ended ? Py_True : Py_False);
+}
+
+/* As-of deduplication
+
+   Results which hold several versions of each key can keep only the row with
+   the latest version at or before a cutoff. The winning rows are found with a
+   hash table before decoding and copied into a compacted COPY buffer, so the
+   superseded rows never reach the output arrays and the compacted rows still
+   take the fast paths of the decoder. */
+
+typedef struct {
+    /* the key columns */
+    const Py_ssize_t* keys;
+    Py_ssize_t nkeys;
+    /* an integer, datetime, or date column */
+    Py_ssize_t version;
+    bool has_cutoff;
+    int64_t cutoff;
+} asof_spec;
+
+/* Keys which serialize to at most this many bytes are kept in the table;
+   longer keys are compared by reading the row again. */
+#define ASOF_INLINE_KEY 23
+
+typedef struct {
+    uint64_t hash;
+    int64_t version;
+    /* the row number; `SIZE_MAX` marks an empty slot */
+    size_t row;
+    /* the position of the row in the input */
+    size_t row_start;
+    size_t row_len;
+    /* `UINT8_MAX` if the key does not fit in `key` */
+    uint8_t key_len;
+    char key[ASOF_INLINE_KEY];
+} asof_entry;
+
+/* An open addressing hash table of the winning row for each key. */
+typedef struct {
+    asof_entry* entries;
+    /* always a power of 2 */
+    size_t capacity;
+    size_t count;
+} asof_table;
+
+const size_t starting_asof_capacity = 1024;
+
+static int allocate_asof_table(asof_table* table, size_t capacity) {
+    if (unlikely(capacity > PY_SSIZE_T_MAX / sizeof(asof_entry)) ||
+        !(table->entries = PyMem_Malloc(capacity * sizeof(asof_entry)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (size_t n = 0; n < capacity; ++n) {
+        table->entries[n].row = SIZE_MAX;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    return 0;
+}
+
+/* Double the capacity of the table. */
+static int grow_asof_table(asof_table* table) {
+    asof_table grown;
+    size_t capacity;
+
+    if (unlikely(mul_overflow(table->capacity, 2, &capacity))) {
+        PyErr_SetString(PyExc_OverflowError, "key count would overflow");
+        return -1;
+    }
+    if (allocate_asof_table(&grown, capacity)) {
+        return -1;
+    }
+    for (size_t n = 0; n < table->capacity; ++n) {
+        const asof_entry* entry = &table->entries[n];
+        size_t slot;
+
+        if (entry->row == SIZE_MAX) {
+            continue;
+        }
+        slot = entry->hash & (grown.capacity - 1);
+        while (grown.entries[slot].row != SIZE_MAX) {
+            slot = (slot + 1) & (grown.capacity - 1);
+        }
+        grown.entries[slot] = *entry;
+    }
+    grown.count = table->count;
+    PyMem_Free(table->entries);
+    *table = grown;
+    return 0;
+}
+
+/* Hash the key fields of a row and write them to `key` as a 0 byte for NULL
+   or a 1 byte followed by the value; variable width values are prefixed by
+   their length. Sets `key_len` to `UINT8_MAX` if the key is longer than
+   `ASOF_INLINE_KEY`. */
+static inline uint64_t read_asof_key(const char* const input_buffer,
+                                     const warp_prism_decoder* decoder,
+                                     const asof_spec* spec,
+                                     const size_t* offsets,
+                                     const int32_t* lens,
+                                     char* key,
+                                     uint8_t* key_len) {
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = 0;
+    size_t len = 0;
+
+    for (Py_ssize_t n = 0; n < spec->nkeys; ++n) {
+        Py_ssize_t column = spec->keys[n];
+        bool fixed = decoder->column_types[column]->wire_size != 0;
+        size_t field_len = 1;
+        /* NULL hashes differently from an empty value */
+        uint64_t field = ~(uint64_t) 0;
+
+        if (lens[column] != -1) {
+            field = hash_bytes(&input_buffer[offsets[column]], lens[column]);
+            field_len += lens[column] + (fixed ? 0 : sizeof(int32_t));
+        }
+        h = (h ^ field) * k;
+        h ^= h >> 29;
+
+        if (len + field_len > ASOF_INLINE_KEY) {
+            len = UINT8_MAX;
+        }
+        if (len == UINT8_MAX) {
+            continue;
+        }
+        key[len++] = lens[column] != -1;
+        if (lens[column] == -1) {
+            continue;
+        }
+        if (!fixed) {
+            memcpy(&key[len], &lens[column], sizeof(int32_t));
+            len += sizeof(int32_t);
+        }
+        memcpy(&key[len], &input_buffer[offsets[column]], lens[column]);
+        len += lens[column];
+    }
+    *key_len = len;
+    return h;
+}
+
+static inline bool asof_keys_equal(const char* const input_buffer,
+                                   const asof_spec* spec,
+                                   const size_t* offsets,
+                                   const int32_t* lens,
+                                   const size_t* other_offsets,
+                                   const int32_t* other_lens) {
+    for (Py_ssize_t n = 0; n < spec->nkeys; ++n) {
+        Py_ssize_t column = spec->keys[n];
+
+        if (lens[column] != other_lens[column] ||
+            (lens[column] > 0 &&
+             memcmp(&input_buffer[offsets[column]],
+                    &input_buffer[other_offsets[column]],
+                    lens[column]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Copy the winning row of each key, in input order, into a new COPY buffer.
+   A row wins if its version is the latest which is not NULL and not after the
+   cutoff; of equal versions the later row wins. Returns a new bytes object
+   and sets `dropped_rows` to the number of rows left out. */
+static PyObject* asof_compact(const char* const input_buffer,
+                              size_t input_len,
+                              const warp_prism_decoder* decoder,
+                              const asof_spec* spec,
+                              size_t* dropped_rows) {
+    uint16_t ncolumns = decoder->ncolumns;
+    uint8_t version_typeid = decoder->column_typeids[spec->version];
+    size_t cursor;
+    size_t header_len;
+    uint32_t flags;
+    size_t* offsets = NULL;
+    int32_t* lens = NULL;
+    size_t* other_offsets = NULL;
+    int32_t* other_lens = NULL;
+    asof_table table = {0};
+    bool* winners = NULL;
+    size_t row = 0;
+    size_t out_len;
+    char* out_buffer;
+    PyObject* out = NULL;
+    int status;
+
+    if (read_header(input_buffer, input_len, &cursor, &flags)) {
+        return NULL;
+    }
+    header_len = cursor;
+
+    /* the version column means there is at least one column */
+    if (!(offsets = PyMem_Malloc(sizeof(size_t) * ncolumns)) ||
+        !(lens = PyMem_Malloc(sizeof(int32_t) * ncolumns)) ||
+        !(other_offsets = PyMem_Malloc(sizeof(size_t) * ncolumns)) ||
+        !(other_lens = PyMem_Malloc(sizeof(int32_t) * ncolumns))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (allocate_asof_table(&table, starting_asof_capacity)) {
+        goto done;
+    }
+
+    while (true) {
+        size_t row_start = cursor;
+        int64_t version;
+        char key[ASOF_INLINE_KEY];
+        uint8_t key_len;
+        uint64_t hash;
+        size_t slot;
+        asof_entry* entry;
+
+        if ((status = next_row(input_buffer,
+                               input_len,
+                               &cursor,
+                               flags,
+                               ncolumns,
+                               row,
+                               offsets,
+                               lens))) {
+            break;
+        }
+        ++row;
+
+        if (lens[spec->version] == -1) {
+            continue;
+        }
+        if (read_int_key(version_typeid,
+                         &input_buffer[offsets[spec->version]],
+                         lens[spec->version],
+                         &version)) {
+            status = -1;
+            break;
+        }
+        if (spec->has_cutoff && version > spec->cutoff) {
+            continue;
+        }
+
+        /* keep the table at most half full */
+        if (table.count + 1 > table.capacity / 2 && grow_asof_table(&table)) {
+            status = -1;
+            break;
+        }
+
+        hash = read_asof_key(input_buffer,
+                             decoder,
+                             spec,
+                             offsets,
+                             lens,
+                             key,
+                             &key_len);
+        for (slot = hash & (table.capacity - 1);
+             (entry = &table.entries[slot])->row != SIZE_MAX;
+             slot = (slot + 1) & (table.capacity - 1)) {
+            size_t other_cursor;
+
+            if (entry->hash != hash || entry->key_len != key_len) {
+                continue;
+            }
+            if (key_len != UINT8_MAX) {
+                if (!memcmp(entry->key, key, key_len)) {
+                    break;
+                }
+                continue;
+            }
+            /* the row was read once already so this cannot fail */
+            other_cursor = entry->row_start;
+            next_row(input_buffer,
+                     input_len,
+                     &other_cursor,
+                     flags,
+                     ncolumns,
+                     entry->row,
+                     other_offsets,
+                     other_lens);
+            if (asof_keys_equal(input_buffer,
+                                spec,
+                                offsets,
+                                lens,
+                                other_offsets,
+                                other_lens)) {
+                break;
+            }
+        }
+
+        if (entry->row == SIZE_MAX) {
+            ++table.count;
+            entry->hash = hash;
+            entry->key_len = key_len;
+            if (key_len != UINT8_MAX) {
+                memcpy(entry->key, key, key_len);
+            }
+        }
+        else if (version < entry->version) {
+            continue;
+        }
+        entry->version = version;
+        entry->row = row - 1;
+        entry->row_start = row_start;
+        entry->row_len = cursor - row_start;
+    }
+    if (status < 0) {
+        goto done;
+    }
+
+    /* mark the winners so that they can be copied in input order */
+    if (!(winners = calloc_nonempty(row, sizeof(bool)))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    out_len = header_len + sizeof(int16_t);
+    for (size_t n = 0; n < table.capacity; ++n) {
+        if (table.entries[n].row != SIZE_MAX) {
+            winners[table.entries[n].row] = true;
+            out_len += table.entries[n].row_len;
+        }
+    }
+    *dropped_rows = row - table.count;
+    /* the rows are copied by reading them again, so the table can go */
+    PyMem_Free(table.entries);
+    table.entries = NULL;
+
+    if (!(out = PyBytes_FromStringAndSize(NULL, out_len))) {
+        goto done;
+    }
+    out_buffer = PyBytes_AS_STRING(out);
+    memcpy(out_buffer, input_buffer, header_len);
+    out_buffer += header_len;
+
+    cursor = header_len;
+    for (size_t n = 0; n < row; ++n) {
+        size_t row_start = cursor;
+
+        /* the rows were read once already so this cannot fail */
+        next_row(input_buffer,
+                 input_len,
+                 &cursor,
+                 flags,
+                 ncolumns,
+                 n,
+                 offsets,
+                 lens);
+        if (winners[n]) {
+            memcpy(out_buffer, &input_buffer[row_start], cursor - row_start);
+            out_buffer += cursor - row_start;
+        }
+    }
+    /* the end of the data */
+    write16(out_buffer, (uint16_t) -1);
+
+done:
+    PyMem_Free(offsets);
+    PyMem_Free(lens);
+    PyMem_Free(other_offsets);
+    PyMem_Free(other_lens);
+    PyMem_Free(table.entries);
+    PyMem_Free(winners);
+    return out;
+}
+
+typedef struct {
+    char* buffer;
+    /* the free function is stored instead of the type because the type may
+       be owned by a decoder which is freed before the array */
+    free_function free;
+    size_t rowcount;
+    /* The input buffer for lazy text columns, which point into it. */
+    PyObject* owner;
+} capsule_contents;
+
+static void free_acapsule(PyObject* capsule) {
+    capsule_contents* c = PyCapsule_GetPointer(capsule, NULL);
+
+    if (c) {
+        c->free(c->buffer, c->rowcount);
+        Py_XDECREF(c->owner);
+        PyMem_Free(c);
+    }
+}
+
+static void free_mcapsule(PyObject* capsule) {
+    PyMem_Free(PyCapsule_GetPointer(capsule, NULL));
+}
+
+static inline bool is_parameterized(uint8_t column_typeid) {
+    return (column_typeid == TYPEID_FIXED_BYTES ||
+            column_typeid == TYPEID_FIXED_UNICODE);
+}
+
+static void free_decoder(warp_prism_decoder* decoder) {
+    for (uint_fast16_t n = 0; n < decoder->ncolumns; ++n) {
+        if (decoder->column_types[n] &&
+            is_parameterized(decoder->column_typeids[n])) {
+            warp_prism_type* type =
+                (warp_prism_type*) decoder->column_types[n];
+
+            Py_XDECREF(type->dtype);
+            PyMem_Free(type);
+        }
+    }
+    PyMem_Free(decoder->column_types);
+    PyMem_Free(decoder->column_typeids);
+    PyMem_Free(decoder->sparse_value_typeids);
+    PyMem_Free(decoder);
+}
+
+static void free_decoder_capsule(PyObject* capsule) {
+    warp_prism_decoder* decoder = PyCapsule_GetPointer(capsule, NULL);
+
+    if (decoder) {
+        free_decoder(decoder);
+    }
+}
+
+/* Build a fixed width text type from a `(type_id, width, truncate)` tuple. The
+   width is in characters. */
+static warp_prism_type* new_parameterized_type(PyObject* spec,
+                                               unsigned long* id_ix) {
+    unsigned long width;
+    int truncate;
+    const warp_prism_type* template;
+    warp_prism_type* type;
+    PyObject* dtype_name;
+    PyArray_Descr* dtype;
+    size_t size;
+    int ok;
+
+    if (!PyArg_ParseTuple(spec,
+                          "kkp;parameterized type ids must be"
+                          " (type_id, width, truncate)",
+                          id_ix,
+                          &width,
+                          &truncate)) {
+        return NULL;
+    }
+    if (*id_ix >= max_typeid || !is_parameterized(*id_ix)) {
+        PyErr_Format(PyExc_ValueError,
+                     "type id %lu does not take parameters",
+                     *id_ix);
+        return NULL;
+    }
+    template = typeids[*id_ix];
+
+    size = width;
+    if (*id_ix == TYPEID_FIXED_UNICODE &&
+        unlikely(mul_overflow(width, sizeof(Py_UCS4), &size))) {
+        PyErr_SetString(PyExc_OverflowError, "text width would overflow");
+        return NULL;
+    }
+    if (!width || size > INT32_MAX) {
+        PyErr_Format(PyExc_ValueError, "invalid text width: %lu", width);
+        return NULL;
+    }
+
+    if (!(dtype_name = PyUnicode_FromFormat("%s%lu",
+                                            template->dtype_name,
+                                            width))) {
+        return NULL;
+    }
+    ok = PyArray_DescrConverter(dtype_name, &dtype);
+    Py_DECREF(dtype_name);
+    if (!ok) {
+        return NULL;
+    }
+
+    if (!(type = PyMem_Malloc(sizeof(warp_prism_type)))) {
+        Py_DECREF(dtype);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(type, template, sizeof(warp_prism_type));
+    type->size = size;
+    type->truncate = truncate;
+    type->dtype = dtype;
+    return type;
+}
+
+/* Read a `(sparse_type_id, value_type_id)` tuple. The values must be fixed
+   width. */
+static int read_sparse_spec(PyObject* spec, unsigned long* value_id_ix) {
+    unsigned long id_ix;
+
+    if (!PyArg_ParseTuple(spec,
+                          "kk;sparse type ids must be"
+                          " (sparse_type_id, value_type_id)",
+                          &id_ix,
+                          value_id_ix)) {
+        return -1;
+    }
+    if (*value_id_ix >= max_typeid ||
+        !typeids[*value_id_ix]->wire_size) {
+        PyErr_Format(PyExc_ValueError,
+                     "sparse columns need a fixed width value type, got"
+                     " type id %lu",
+                     *value_id_ix);
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether a type id spec is a sparse column. */
+static int is_sparse_spec(PyObject* spec) {
+    unsigned long id_ix;
+
+    if (!PyTuple_Check(spec) || !PyTuple_GET_SIZE(spec)) {
+        return 0;
+    }
+    id_ix = PyLong_AsUnsignedLong(PyTuple_GET_ITEM(spec, 0));
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+    return id_ix == TYPEID_SPARSE;
+}
+
+static warp_prism_decoder* new_decoder(PyObject* pytypeids) {
+    warp_prism_decoder* decoder;
+    Py_ssize_t ncolumns = PyTuple_GET_SIZE(pytypeids);
+
+    if (ncolumns > UINT16_MAX) {
+        PyErr_SetString(PyExc_ValueError, "column count must fit in uint16_t");
+        return NULL;
+    }
+
+    if (!(decoder = PyMem_Malloc(sizeof(warp_prism_decoder)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    decoder->ncolumns = ncolumns;
+    decoder->sparse_value_typeids = NULL;
+    decoder->column_types = calloc_nonempty(ncolumns,
+                                            sizeof(warp_prism_type*));
+    decoder->column_typeids = calloc_nonempty(ncolumns, sizeof(uint8_t));
+    if (!decoder->column_types || !decoder->column_typeids) {
+        PyErr_NoMemory();
+        decoder->ncolumns = 0;
+        free_decoder(decoder);
+        return NULL;
+    }
+    decoder->fixed_width = true;
+    decoder->uniform_wire_size = 0;
+
+    for (Py_ssize_t n = 0; n < ncolumns; ++n) {
+        PyObject* spec = PyTuple_GET_ITEM(pytypeids, n);
+        const warp_prism_type* type;
+        unsigned long id_ix;
+        int sparse;
+
+        if ((sparse = is_sparse_spec(spec)) < 0) {
+            free_decoder(decoder);
+            return NULL;
+        }
+
+        if (sparse) {
+            unsigned long value_id_ix;
+
+            if (read_sparse_spec(spec, &value_id_ix)) {
+                free_decoder(decoder);
+                return NULL;
+            }
+            if (!decoder->sparse_value_typeids &&
+                !(decoder->sparse_value_typeids =
+                  PyMem_Calloc(ncolumns, sizeof(uint8_t)))) {
+                PyErr_NoMemory();
+                free_decoder(decoder);
+                return NULL;
+            }
+            decoder->sparse_value_typeids[n] = value_id_ix;
+            id_ix = TYPEID_SPARSE;
+            type = typeids[id_ix];
+        }
+        else if (PyTuple_Check(spec)) {
+            /* a parameterized type: (type_id, width, truncate) */
+            if (!(type = new_parameterized_type(spec, &id_ix))) {
+                free_decoder(decoder);
+                return NULL;
+            }
+        }
+        else {
+            id_ix = PyLong_AsUnsignedLong(spec);
+            if (PyErr_Occurred()) {
+                free_decoder(decoder);
+                return NULL;
+            }
+            if (id_ix >= max_typeid) {
+                PyErr_Format(PyExc_ValueError, "invalid type id: %lu", id_ix);
+                free_decoder(decoder);
+                return NULL;
+            }
+            if (is_parameterized(id_ix)) {
+                PyErr_Format(PyExc_ValueError,
+                             "type id %lu needs a width, pass"
+                             " (type_id, width, truncate)",
+                             id_ix);
+                free_decoder(decoder);
+                return NULL;
+            }
+            if (id_ix == TYPEID_SPARSE) {
+                PyErr_SetString(PyExc_ValueError,
+                                "sparse columns need a value type, pass"
+                                " (sparse_type_id, value_type_id)");
+                free_decoder(decoder);
+                return NULL;
+            }
+            type = typeids[id_ix];
+        }
+
+        decoder->column_types[n] = type;
+        decoder->column_typeids[n] = id_ix;
+
+        decoder->fixed_width &= type->wire_size != 0;
+        if (!n) {
+            decoder->uniform_wire_size = type->wire_size;
+        }
+        else if (decoder->uniform_wire_size != type->wire_size) {
+            decoder->uniform_wire_size = 0;
+        }
+    }
+
+    return decoder;
+}
+
+/* The decoders which have been built, keyed by their type id tuple. This is
+   cleared when it grows past `max_cached_decoders` entries. */
+PyObject* decoder_cache = NULL;
+const Py_ssize_t max_cached_decoders = 256;
+
+/* Get a new reference to a capsule holding the decoder for the given type id
+   tuple. */
+static PyObject* get_decoder(PyObject* pytypeids) {
+    PyObject* capsule;
+    warp_prism_decoder* decoder;
+
+    if ((capsule = PyDict_GetItemWithError(decoder_cache, pytypeids))) {
+        Py_INCREF(capsule);
+        return capsule;
+    }
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (!(decoder = new_decoder(pytypeids))) {
+        return NULL;
+    }
+
+    if (!(capsule = PyCapsule_New(decoder, NULL, free_decoder_capsule))) {
+        free_decoder(decoder);
+        return NULL;
+    }
+
+    if (PyDict_Size(decoder_cache) >= max_cached_decoders) {
+        PyDict_Clear(decoder_cache);
+    }
+
+    if (PyDict_SetItem(decoder_cache, pytypeids, capsule)) {
+        Py_DECREF(capsule);
+        return NULL;
+    }
+    return capsule;
+}
+
+/* The range and order of the non-NULL values in a column. NaNs are skipped
+   like NULLs. `min` and `max` hold a value of the column's type and are only
+   set when `has_range` is true. */
+typedef struct {
+    bool has_range;
+    bool increasing;
+    bool decreasing;
+    char min[sizeof(int64_t)];
+    char max[sizeof(int64_t)];
+} column_summary;
+
+/* Columns without NULLs or NaNs are summarized with a branch free loop which
+   the compiler can vectorize. */
+#define DEFINE_SUMMARIZE(name, type, has_nan)                           \
+    static void summarize_ ## name(const char* column,                  \
+                                   const bool* mask,                    \
+                                   size_t rowcount,                     \
+                                   bool has_nulls,                      \
+                                   column_summary* out) {               \
+        const type* values = (const type*) column;                      \
+        type min = 0;                                                   \
+        type max = 0;                                                   \
+        type prev = 0;                                                  \
+        bool increasing = true;                                         \
+        bool decreasing = true;                                         \
+        size_t n = 0;                                                   \
+                                                                        \
+        out->has_range = false;                                         \
+        if (!has_nulls && !has_nan) {                                   \
+            if (rowcount) {                                             \
+                out->has_range = true;                                  \
+                min = max = values[0];                                  \
+            }                                                           \
+            for (n = 1; n < rowcount; ++n) {                            \
+                type value = values[n];                                 \
+                                                                        \
+                increasing &= value >= values[n - 1];                   \
+                decreasing &= value <= values[n - 1];                   \
+                min = value < min ? value : min;                        \
+                max = value > max ? value : max;                        \
+            }                                                           \
+        }                                                               \
+        else {                                                          \
+            for (; n < rowcount; ++n) {                                 \
+                type value = values[n];                                 \
+                                                                        \
+                if (!mask[n] || value != value) {                       \
+                    continue;                                           \
+                }                                                       \
+                if (!out->has_range) {                                  \
+                    out->has_range = true;                              \
+                    min = max = prev = value;                           \
+                    continue;                                           \
+                }                                                       \
+                increasing &= value >= prev;                            \
+                decreasing &= value <= prev;                            \
+                min = value < min ? value : min;                        \
+                max = value > max ? value : max;                        \
+                prev = value;                                           \
+            }                                                           \
+        }                                                               \
+        out->increasing = increasing;                                   \
+        out->decreasing = decreasing;                                   \
+        memcpy(out->min, &min, sizeof(type));                           \
+        memcpy(out->max, &max, sizeof(type));                           \
+    }
+
+/* `value != value` is only true for NaN */
+DEFINE_SUMMARIZE(int16, int16_t, false)
+DEFINE_SUMMARIZE(int32, int32_t, false)
+DEFINE_SUMMARIZE(int64, int64_t, false)
+DEFINE_SUMMARIZE(float32, float, true)
+DEFINE_SUMMARIZE(float64, double, true)
+
+#undef DEFINE_SUMMARIZE
+
+/* Summarize the numeric and datetime columns once they are finalized.
+   Returns false for columns which have no order, like text. */
+static bool summarize_column(uint8_t column_typeid,
+                             const char* column,
+                             const bool* mask,
+                             size_t rowcount,
+                             bool has_nulls,
+                             column_summary* out) {
+    switch (column_typeid) {
+    case TYPEID_INT16:
+        summarize_int16(column, mask, rowcount, has_nulls, out);
+        return true;
+    case TYPEID_INT32:
+        summarize_int32(column, mask, rowcount, has_nulls, out);
+        return true;
+    case TYPEID_INT64:
+    case TYPEID_DATETIME:
+    case TYPEID_DATE:
+        /* both datetime types are stored as int64 */
+        summarize_int64(column, mask, rowcount, has_nulls, out);
+        return true;
+    case TYPEID_FLOAT32:
+        summarize_float32(column, mask, rowcount, has_nulls, out);
+        return true;
+    case TYPEID_FLOAT64:
+        summarize_float64(column, mask, rowcount, has_nulls, out);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int set_stat(PyObject* stats, const char* key, PyObject* value) {
+    int status;
+
+    if (!value) {
+        return -1;
+    }
+    status = PyDict_SetItemString(stats, key, value);
+    Py_DECREF(value);
+    return status;
+}
+
+/* Write the counters and timings from a call to `raw_to_arrays` into the
+   user's stats dict. The finalize phase runs from the end of the decode loop
+   through building the output ndarrays. */
+static int fill_stats(PyObject* pystats,
+                      const decode_stats* stats,
+                      const warp_prism_decoder* decoder,
+                      size_t rows,
+                      size_t input_bytes,
+                      const warp_prism_time* finalize_end) {
+    uint16_t ncolumns = decoder->ncolumns;
+    PyObject* null_counts;
+    size_t output_bytes = 0;
+
+    if (!(null_counts = PyTuple_New(ncolumns))) {
+        return -1;
+    }
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        output_bytes += rows * (decoder->column_types[n]->size + sizeof(bool));
+    }
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        PyObject* count = PyLong_FromSize_t(stats->null_counts[n]);
+
+        if (!count) {
+            Py_DECREF(null_counts);
+            return -1;
+        }
+        PyTuple_SET_ITEM(null_counts, n, count);
+    }
+
+    return (set_stat(pystats, "null_counts", null_counts) ||
+            set_stat(pystats, "rows", PyLong_FromSize_t(rows)) ||
+            set_stat(pystats, "input_bytes", PyLong_FromSize_t(input_bytes)) ||
+            set_stat(pystats,
+                     "grow_count",
+                     PyLong_FromSize_t(stats->grow_count)) ||
+            set_stat(pystats,
+                     "bytes_copied",
+                     PyLong_FromSize_t(stats->bytes_copied)) ||
+            set_stat(pystats,
+                     "peak_buffer_bytes",
+                     PyLong_FromSize_t(stats->peak_buffer_bytes)) ||
+            set_stat(pystats,
+                     "output_bytes",
+                     PyLong_FromSize_t(output_bytes)) ||
+            set_stat(pystats,
+                     "intern_hits",
+                     PyLong_FromSize_t(stats->intern_hits)) ||
+            set_stat(pystats,
+                     "decode_wall_time",
+                     PyFloat_FromDouble(stats->decode_end.wall -
+                                        stats->decode_start.wall)) ||
+            set_stat(pystats,
+                     "decode_cpu_time",
+                     PyFloat_FromDouble(stats->decode_end.cpu -
+                                        stats->decode_start.cpu)) ||
+            set_stat(pystats,
+                     "finalize_wall_time",
+                     PyFloat_FromDouble(finalize_end->wall -
+                                        stats->decode_end.wall)) ||
+            set_stat(pystats,
+                     "finalize_cpu_time",
+                     PyFloat_FromDouble(finalize_end->cpu -
+                                        stats->decode_end.cpu))) ? -1 : 0;
+}
+
+/* Wrap a finished sparse column in a `(values, indices)` pair of ndarrays.
+   On success the arrays own the column's buffers. */
+static PyObject* sparse_pair(sparse_column* column,
+                             const warp_prism_type* value_type) {
+    npy_intp count = column->count;
+    capsule_contents* vc;
+    PyObject* vcapsule;
+    PyObject* icapsule;
+    PyObject* values;
+    PyObject* indices;
+
+    Py_INCREF(value_type->dtype);
+    if (!(values = PyArray_NewFromDescr(&PyArray_Type,
+                                        value_type->dtype,
+                                        1,
+                                        &count,
+                                        NULL,
+                                        column->values,
+                                        NPY_ARRAY_CARRAY,
+                                        NULL))) {
+        return NULL;
+    }
+    if (!(vc = PyMem_Malloc(sizeof(capsule_contents)))) {
+        Py_DECREF(values);
+        return PyErr_NoMemory();
+    }
+    vc->buffer = column->values;
+    vc->free = value_type->free;
+    vc->rowcount = column->count;
+    vc->owner = NULL;
+    if (!(vcapsule = PyCapsule_New(vc, NULL, free_acapsule))) {
+        PyMem_Free(vc);
+        Py_DECREF(values);
+        return NULL;
+    }
+    /* the base is stolen even on failure, and freeing it frees the values */
+    column->values = NULL;
+    if (PyArray_SetBaseObject((PyArrayObject*) values, vcapsule)) {
+        Py_DECREF(values);
+        return NULL;
+    }
+
+    if (!(indices = PyArray_SimpleNewFromData(1,
+                                              &count,
+                                              NPY_INT64,
+                                              column->indices))) {
+        Py_DECREF(values);
+        return NULL;
+    }
+    if (!(icapsule = PyCapsule_New(column->indices, NULL, free_mcapsule))) {
+        Py_DECREF(values);
+        Py_DECREF(indices);
+        return NULL;
+    }
+    column->indices = NULL;
+    if (PyArray_SetBaseObject((PyArrayObject*) indices, icapsule)) {
+        Py_DECREF(values);
+        Py_DECREF(indices);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NN)", values, indices);
+}
+
+/* Flip a mask in place so that it is true for NULLs, which is what pandas'
+   nullable arrays expect. The bools are always 0 or 1 so this is a byte-wise
+   xor which the compiler vectorizes. */
+static void invert_mask(bool* mask, size_t rowcount) {
+    uint8_t* bytes = (uint8_t*) mask;
+
+    for (size_t n = 0; n < rowcount; ++n) {
+        bytes[n] ^= 1;
+    }
+}
+
+/* Build `stats["column_stats"]`: a dict for each column with the null count
+   and, for numeric and datetime columns, the min, max, and whether the
+   values are sorted. */
+static int fill_column_stats(PyObject* pystats,
+                             const decode_stats* stats,
+                             const warp_prism_decoder* decoder,
+                             size_t rows,
+                             char** outarrays,
+                             bool** outmasks) {
+    uint16_t ncolumns = decoder->ncolumns;
+    PyObject* column_stats;
+
+    if (!(column_stats = PyTuple_New(ncolumns))) {
+        return -1;
+    }
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        const warp_prism_type* type = decoder->column_types[n];
+        column_summary summary;
+        PyObject* column;
+
+        if (!(column = PyDict_New())) {
+            Py_DECREF(column_stats);
+            return -1;
+        }
+        PyTuple_SET_ITEM(column_stats, n, column);
+
+        if (set_stat(column,
+                     "null_count",
+                     PyLong_FromSize_t(stats->null_counts[n]))) {
+            Py_DECREF(column_stats);
+            return -1;
+        }
+
+        if (!summarize_column(decoder->column_typeids[n],
+                              outarrays[n],
+                              outmasks[n],
+                              rows,
+                              stats->null_counts[n] > 0,
+                              &summary)) {
+            continue;
+        }
+
+        if (summary.has_range) {
+            if (set_stat(column,
+                         "min",
+                         PyArray_Scalar(summary.min, type->dtype, NULL)) ||
+                set_stat(column,
+                         "max",
+                         PyArray_Scalar(summary.max, type->dtype, NULL))) {
+                Py_DECREF(column_stats);
+                return -1;
+            }
+        }
+        else if (PyDict_SetItemString(column, "min", Py_None) ||
+                 PyDict_SetItemString(column, "max", Py_None)) {
+            Py_DECREF(column_stats);
+            return -1;
+        }
+
+        if (set_stat(column,
+                     "monotonic_increasing",
+                     PyBool_FromLong(summary.increasing)) ||
+            set_stat(column,
+                     "monotonic_decreasing",
+                     PyBool_FromLong(summary.decreasing))) {
+            Py_DECREF(column_stats);
+            return -1;
+        }
+    }
+
+    return set_stat(pystats, "column_stats", column_stats);
+}
+
+/* Key indexes
+
+   Integer, datetime, and date keys are numbered with a hash table from the
+   key to its position, which can later be renumbered in sorted order. */
+
+static int compare_int64(const void* a, const void* b) {
+    int64_t lhs = *(const int64_t*) a;
+    int64_t rhs = *(const int64_t*) b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/* A hash table from the keys of one axis to their positions, with linear
+   probing. */
+typedef struct {
+    int64_t* keys;
+    /* `SIZE_MAX` marks an empty slot */
+    size_t* positions;
+    /* always a power of 2 */
+    size_t capacity;
+    size_t count;
+    /* long results are usually grouped by one key and sorted by the other,
+       so the last key and the label after it are checked before hashing */
+    int64_t last_key;
+    /* `SIZE_MAX` when the last key is not in the table */
+    size_t last_position;
+    bool have_last;
+    /* the key at each position, once all of the keys are known */
+    const int64_t* labels;
+} pivot_index;
+
+const size_t starting_pivot_capacity = 64;
+
+static void free_pivot_index(pivot_index* index) {
+    PyMem_Free(index->keys);
+    PyMem_Free(index->positions);
+    index->keys = NULL;
+    index->positions = NULL;
+}
+
+/* Allocate an empty table with room for `count` keys. */
+static int allocate_pivot_index(pivot_index* index, size_t count) {
+    size_t capacity = starting_pivot_capacity;
+
+    /* keep the table at most half full */
+    while (capacity / 2 < count) {
+        if (unlikely(mul_overflow(capacity, 2, &capacity))) {
+            PyErr_SetString(PyExc_OverflowError, "key count would overflow");
+            return -1;
+        }
+    }
+    if (unlikely(capacity > PY_SSIZE_T_MAX / sizeof(int64_t)) ||
+        !(index->keys = PyMem_Malloc(capacity * sizeof(int64_t))) ||
+        !(index->positions = PyMem_Malloc(capacity * sizeof(size_t)))) {
+        free_pivot_index(index);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(index->positions, 0xff, capacity * sizeof(size_t));
+    index->capacity = capacity;
+    index->count = 0;
+    index->have_last = false;
+    index->labels = NULL;
+    return 0;
+}
+
+/* The slot holding `key`, or the empty slot where it would go. */
+static inline size_t pivot_slot(const pivot_index* index, int64_t key) {
+    /* fibonacci hashing spreads out runs of keys like sids and dates */
+    uint64_t hash = (uint64_t) key * UINT64_C(0x9e3779b97f4a7c15);
+    size_t slot = (hash ^ (hash >> 32)) & (index->capacity - 1);
+
+    while (index->positions[slot] != SIZE_MAX && index->keys[slot] != key) {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    return slot;
+}
+
+/* Find the position of a key. Returns false if the key is not in the
+   table. */
+static inline bool pivot_lookup(pivot_index* index,
+                                int64_t key,
+                                size_t* position) {
+    if (!index->have_last || index->last_key != key) {
+        size_t next = index->last_position + 1;
+
+        index->last_position =
+            (index->have_last &&
+             index->labels &&
+             next < index->count &&
+             index->labels[next] == key) ?
+            next : index->positions[pivot_slot(index, key)];
+        index->have_last = true;
+        index->last_key = key;
+    }
+    *position = index->last_position;
+    return *position != SIZE_MAX;
+}
+
+/* Add a key at the next position. Returns 1 if the key was already in the
+   table. */
+static int pivot_insert(pivot_index* index, int64_t key) {
+    size_t position;
+    size_t slot;
+
+    if (pivot_lookup(index, key, &position)) {
+        return 1;
+    }
+
+    if (index->count + 1 > index->capacity / 2) {
+        pivot_index grown = {0};
+
+        if (allocate_pivot_index(&grown, index->count + 1)) {
+            return -1;
+        }
+        for (size_t n = 0; n < index->capacity; ++n) {
+            if (index->positions[n] != SIZE_MAX) {
+                slot = pivot_slot(&grown, index->keys[n]);
+                grown.keys[slot] = index->keys[n];
+                grown.positions[slot] = index->positions[n];
+            }
+        }
+        grown.count = index->count;
+        free_pivot_index(index);
+        *index = grown;
+    }
+
+    slot = pivot_slot(index, key);
+    index->keys[slot] = key;
+    index->positions[slot] = index->count++;
+    index->have_last = true;
+    index->last_key = key;
+    index->last_position = index->positions[slot];
+    return 0;
+}
+
+/* Sort the keys of a table built with `pivot_insert` into `out` and renumber
+   the positions in sorted order. */
+static void sort_pivot_index(pivot_index* index, int64_t* out) {
+    size_t count = 0;
+
+    for (size_t n = 0; n < index->capacity; ++n) {
+        if (index->positions[n] != SIZE_MAX) {
+            out[count++] = index->keys[n];
+        }
+    }
+    qsort(out, count, sizeof(int64_t), compare_int64);
+
+    memset(index->positions, 0xff, index->capacity * sizeof(size_t));
+    for (size_t n = 0; n < count; ++n) {
+        size_t slot = pivot_slot(index, out[n]);
+
+        index->keys[slot] = out[n];
+        index->positions[slot] = n;
+    }
+    index->have_last = false;
+}
+
+/* Wrap a buffer from `PyMem_Malloc` in an ndarray which frees it. Like
+   `PyArray_NewFromDescr` this steals a reference to `dtype`. `*buffer` is set
+   to NULL once the array owns it, even on failure. */
+static PyObject* owned_array(PyArray_Descr* dtype,
+                             int nd,
+                             npy_intp* dims,
+                             char** buffer) {
+    PyObject* array;
+    PyObject* capsule;
+
+    if (!(array = PyArray_NewFromDescr(&PyArray_Type,
+                                       dtype,
+                                       nd,
+                                       dims,
+                                       NULL,
+                                       *buffer,
+                                       NPY_ARRAY_CARRAY,
+                                       NULL))) {
+        return NULL;
+    }
+    if (!(capsule = PyCapsule_New(*buffer, NULL, free_mcapsule))) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    /* the base is stolen even on failure, and freeing it frees the buffer */
+    *buffer = NULL;
+    if (PyArray_SetBaseObject((PyArrayObject*) array, capsule)) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    return array;
+}
+
+/* Splitting
+
+   `raw_to_arrays(..., split=column)` moves the rows of each key of a column
+   next to each other before decoding, so each column holds one contiguous
+   segment per key. The rows are factorized and counted in a first pass, then
+   copied into a reordered COPY buffer with a counting sort which keeps the
+   rows of a key in input order. */
+
+/* Copy the rows into a new COPY buffer grouped by `row_buckets`, keeping
+   the order of the rows in each bucket. `row_starts` holds the start of each
+   row followed by the end of the last row. `offsets` must have room for
+   `nbuckets + 1` values; it is set to the first row of each bucket followed
+   by the number of rows. Returns a new bytes object. */
+static PyObject* scatter_rows(const char* const input_buffer,
+                              size_t header_len,
+                              const size_t* row_starts,
+                              size_t nrows,
+                              const size_t* row_buckets,
+                              size_t nbuckets,
+                              int64_t* offsets) {
+    /* the next byte of each bucket's rows in the output */
+    size_t* byte_cursors;
+    size_t start = header_len;
+    PyObject* out;
+    char* out_buffer;
+
+    if (!(byte_cursors = calloc_nonempty(nbuckets, sizeof(size_t)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    /* count the rows and bytes of each bucket, then turn the counts into the
+       start of each bucket's rows */
+    memset(offsets, 0, sizeof(int64_t) * (nbuckets + 1));
+    for (size_t n = 0; n < nrows; ++n) {
+        byte_cursors[row_buckets[n]] += row_starts[n + 1] - row_starts[n];
+        ++offsets[row_buckets[n] + 1];
+    }
+    for (size_t bucket = 0; bucket < nbuckets; ++bucket) {
+        size_t len = byte_cursors[bucket];
+
+        byte_cursors[bucket] = start;
+        start += len;
+        offsets[bucket + 1] += offsets[bucket];
+    }
+
+    /* the rows keep their length, so the data ends where it did */
+    if (!(out = PyBytes_FromStringAndSize(NULL,
+                                          row_starts[nrows] +
+                                          sizeof(int16_t)))) {
+        PyMem_Free(byte_cursors);
+        return NULL;
+    }
+    out_buffer = PyBytes_AS_STRING(out);
+    memcpy(out_buffer, input_buffer, header_len);
+    for (size_t n = 0; n < nrows; ++n) {
+        size_t len = row_starts[n + 1] - row_starts[n];
+
+        memcpy(&out_buffer[byte_cursors[row_buckets[n]]],
+               &input_buffer[row_starts[n]],
+               len);
+        byte_cursors[row_buckets[n]] += len;
+    }
+    /* the end of the data */
+    write16(&out_buffer[row_starts[nrows]], (uint16_t) -1);
+
+    PyMem_Free(byte_cursors);
+    return out;
+}
+
+typedef struct {
+    uint16_t column;
+    uint8_t column_typeid;
+    pivot_index* index;
+} split_state;
+
+/* Record the key of a row, numbered in the order the keys are first seen,
+   or `SIZE_MAX` for NULL. */
+static int visit_split_row(void* state,
+                           const char* const input_buffer,
+                           size_t row __attribute__((unused)),
+                           size_t row_start __attribute__((unused)),
+                           size_t row_end __attribute__((unused)),
+                           const size_t* offsets,
+                           const int32_t* lens,
+                           char* record) {
+    split_state* split = state;
+    size_t row_key = SIZE_MAX;
+    int64_t key;
+
+    if (lens[split->column] != -1) {
+        if (read_int_key(split->column_typeid,
+                         &input_buffer[offsets[split->column]],
+                         lens[split->column],
+                         &key) ||
+            pivot_insert(split->index, key) < 0) {
+            return -1;
+        }
+        row_key = split->index->last_position;
+    }
+    memcpy(record, &row_key, sizeof(size_t));
+    return 1;
+}
+
+/* Reorder the rows of the COPY data by the sorted keys of `column`, with the
+   rows whose key is NULL last. Returns a new bytes object and sets `labels`
+   to the sorted distinct keys as int64s and `offsets` to the first row of
+   each key followed by the first NULL row. */
+static PyObject* split_rows(const char* const input_buffer,
+                            size_t input_len,
+                            const warp_prism_decoder* decoder,
+                            uint16_t column,
+                            PyObject** labels,
+                            PyObject** offsets) {
+    pivot_index index = {0};
+    split_state state = {column, decoder->column_typeids[column], &index};
+    row_walk walk = {0};
+    size_t* row_keys;
+    size_t row;
+    int64_t* keys_by_position = NULL;
+    size_t* sorted_positions = NULL;
+    char* label_buffer = NULL;
+    char* offset_buffer = NULL;
+    npy_intp count;
+    npy_intp noffsets;
+    PyObject* out = NULL;
+
+    if (allocate_pivot_index(&index, 0)) {
+        goto done;
+    }
+    /* the key of each row */
+    if (walk_rows(input_buffer,
+                  input_len,
+                  decoder,
+                  SIZE_MAX,
+                  true,
+                  sizeof(size_t),
+                  visit_split_row,
+                  &state,
+                  &walk)) {
+        goto done;
+    }
+    row_keys = (size_t*) walk.records;
+    row = walk.rows;
+
+    /* sort the keys, remembering where each key was first seen */
+    count = index.count;
+    if (!(keys_by_position = malloc_nonempty(sizeof(int64_t) * count)) ||
+        !(sorted_positions = malloc_nonempty(sizeof(size_t) * count)) ||
+        !(label_buffer = malloc_nonempty(sizeof(int64_t) * count)) ||
+        /* the NULL rows are a bucket too, but their end is not returned */
+        !(offset_buffer = PyMem_Malloc(sizeof(int64_t) * (count + 2)))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (size_t slot = 0; slot < index.capacity; ++slot) {
+        if (index.positions[slot] != SIZE_MAX) {
+            keys_by_position[index.positions[slot]] = index.keys[slot];
+        }
+    }
+    sort_pivot_index(&index, (int64_t*) label_buffer);
+    for (npy_intp position = 0; position < count; ++position) {
+        sorted_positions[position] =
+            index.positions[pivot_slot(&index, keys_by_position[position])];
+    }
+
+    for (size_t n = 0; n < row; ++n) {
+        row_keys[n] = (row_keys[n] == SIZE_MAX ?
+                       (size_t) count :
+                       sorted_positions[row_keys[n]]);
+    }
+    if (!(out = scatter_rows(input_buffer,
+                             walk.header_len,
+                             walk.row_starts,
+                             row,
+                             row_keys,
+                             count + 1,
+                             (int64_t*) offset_buffer))) {
+        goto done;
+    }
+
+    noffsets = count + 1;
+    if (!(*labels = owned_array(PyArray_DescrFromType(NPY_INT64),
+                                1,
+                                &count,
+                                &label_buffer)) ||
+        !(*offsets = owned_array(PyArray_DescrFromType(NPY_INT64),
+                                 1,
+                                 &noffsets,
+                                 &offset_buffer))) {
+        Py_CLEAR(*labels);
+        Py_CLEAR(out);
+    }
+
+done:
+    free_row_walk(&walk);
+    PyMem_Free(keys_by_position);
+    PyMem_Free(sorted_positions);
+    PyMem_Free(label_buffer);
+    PyMem_Free(offset_buffer);
+    free_pivot_index(&index);
+    return out;
+}
+
+/* Sorting
+
+   `raw_to_arrays(..., sort=columns)` sorts the rows by fixed width key
+   columns before decoding. Each row's keys are encoded into bytes which
+   compare like the values, then the rows are ordered with a least
+   significant digit radix sort and copied into a sorted COPY buffer, so
+   every column, including text, moves with its row. */
+
+typedef struct {
+    uint16_t column;
+    uint8_t column_typeid;
+    /* the size of the field, the key is one byte longer to sort NULLs
+       last */
+    size_t wire_size;
+} sort_key;
+
+/* The types which can be sort keys. */
+static inline bool is_sort_key(uint8_t column_typeid) {
+    return (is_int_key(column_typeid) ||
+            column_typeid == TYPEID_FLOAT32 ||
+            column_typeid == TYPEID_FLOAT64 ||
+            column_typeid == TYPEID_BOOL);
+}
+
+/* Encode a non-NULL field so that comparing the encoded bytes gives the order
+   of the values. The field is big-endian already: signed integers flip the
+   sign bit and floats flip every bit of negative values. -0.0 sorts with 0.0
+   and NaN sorts after infinity, like postgres. */
+static inline void encode_sort_key(const sort_key* key,
+                                   char* out,
+                                   const char* const field) {
+    uint64_t bits;
+    uint64_t sign;
+
+    switch (key->column_typeid) {
+    case TYPEID_FLOAT32:
+        bits = read32(field);
+        sign = UINT64_C(1) << 31;
+        if ((bits & 0x7fffffff) > 0x7f800000) {
+            bits = UINT32_MAX;
+        }
+        else {
+            if (bits == sign) {
+                bits = 0;
+            }
+            bits = (bits & sign) ? ~bits : bits | sign;
+        }
+        write32(out, MAYBE_BSWAP((uint32_t) bits, 32));
+        break;
+    case TYPEID_FLOAT64:
+        bits = read64(field);
+        sign = UINT64_C(1) << 63;
+        if ((bits & ~sign) > UINT64_C(0x7ff0000000000000)) {
+            bits = UINT64_MAX;
+        }
+        else {
+            if (bits == sign) {
+                bits = 0;
+            }
+            bits = (bits & sign) ? ~bits : bits | sign;
+        }
+        write64(out, MAYBE_BSWAP(bits, 64));
+        break;
+    case TYPEID_BOOL:
+        *out = *field;
+        break;
+    default:
+        memcpy(out, field, key->wire_size);
+        *out ^= 0x80;
+    }
+}
+
+/* Read the tuple of column indices passed as `sort` to `raw_to_arrays`.
+   Returns a new array of `nkeys` keys or NULL with an exception set. */
+static sort_key* read_sort_keys(PyObject* pysort,
+                                const warp_prism_decoder* decoder,
+                                Py_ssize_t* nkeys) {
+    sort_key* keys;
+
+    if (!PyTuple_Check(pysort)) {
+        PyErr_SetString(PyExc_TypeError, "sort must be a tuple of columns");
+        return NULL;
+    }
+    *nkeys = PyTuple_GET_SIZE(pysort);
+    if (!(keys = malloc_nonempty(sizeof(sort_key) * *nkeys))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t n = 0; n < *nkeys; ++n) {
+        Py_ssize_t column = PyLong_AsSsize_t(PyTuple_GET_ITEM(pysort, n));
+
+        if (column == -1 && PyErr_Occurred()) {
+            goto error;
+        }
+        if (column < 0 || column >= decoder->ncolumns) {
+            PyErr_Format(PyExc_ValueError, "invalid sort column: %zd", column);
+            goto error;
+        }
+        if (!is_sort_key(decoder->column_typeids[column])) {
+            PyErr_SetString(PyExc_TypeError,
+                            "sort keys must be integer, float, bool,"
+                            " datetime, or date columns");
+            goto error;
+        }
+        keys[n].column = column;
+        keys[n].column_typeid = decoder->column_typeids[column];
+        keys[n].wire_size = typeids[keys[n].column_typeid]->wire_size;
+    }
+    return keys;
+
+error:
+    PyMem_Free(keys);
+    return NULL;
+}
+
+typedef struct {
+    const sort_key* keys;
+    Py_ssize_t nkeys;
+    size_t key_width;
+    size_t stride;
+    /* a histogram of each byte of the keys */
+    size_t* counts;
+} sort_state;
+
+/* Record the encoded keys of a row followed by its row number. */
+static int visit_sort_row(void* state,
+                          const char* const input_buffer,
+                          size_t row,
+                          size_t row_start __attribute__((unused)),
+                          size_t row_end __attribute__((unused)),
+                          const size_t* offsets,
+                          const int32_t* lens,
+                          char* record) {
+    sort_state* sort = state;
+    char* key_record = record;
+
+    for (Py_ssize_t n = 0; n < sort->nkeys; ++n) {
+        const sort_key* key = &sort->keys[n];
+        int32_t len = lens[key->column];
+
+        if (len == -1) {
+            *key_record = 1;
+            memset(key_record + 1, 0, key->wire_size);
+        }
+        else {
+            if (unlikely((size_t) len != key->wire_size)) {
+                char cell[8];
+
+                /* this raises the error for the mismatched size */
+                parse_field(key->column_typeid,
+                            typeids[key->column_typeid],
+                            NULL,
+                            cell,
+                            &input_buffer[offsets[key->column]],
+                            0,
+                            len);
+                return -1;
+            }
+            *key_record = 0;
+            encode_sort_key(key,
+                            key_record + 1,
+                            &input_buffer[offsets[key->column]]);
+        }
+        key_record += 1 + key->wire_size;
+    }
+    memcpy(&record[sort->stride - sizeof(size_t)], &row, sizeof(size_t));
+    for (size_t byte = 0; byte < sort->key_width; ++byte) {
+        ++sort->counts[byte * 256 + (uint8_t) record[byte]];
+    }
+    return 1;
+}
+
+/* Large sorts are split between threads. Each radix pass counts the bytes of
+   each thread's chunk of the records, turns the counts into where each
+   thread writes each digit, then every thread scatters its own chunk. The
+   chunks are in row order, so the passes stay stable. The sorted rows are
+   then copied out in parallel too. The threads only touch C buffers. */
+
+/* the fewest rows worth giving a sort thread */
+const size_t parallel_sort_min_rows = 1 << 16;
+
+/* the most threads to sort with, or 0 for one per available CPU */
+static size_t sort_thread_limit = 0;
+
+typedef struct {
+    /* the records of the chunk */
+    size_t start;
+    size_t stop;
+    const char* records;
+    char* sorted;
+    size_t stride;
+    size_t byte;
+    /* the count of each digit, then where the next record with the digit
+       goes */
+    size_t counts[256];
+    /* copying the rows out: the input rows, and the output, where this
+       chunk's rows start at `out_start` */
+    const char* input_buffer;
+    const size_t* row_starts;
+    char* out_buffer;
+    size_t out_start;
+    pthread_t thread;
+    bool started;
+} sort_chunk;
+
+/* The CPUs this process may use: the CPUs in its affinity mask, limited by
+   the cgroup's CPU quota, so workers pinned to a few CPUs or running in a
+   container with a quota do not start a thread for every CPU of the host. */
+static size_t available_cpus(void) {
+    size_t ncpus;
+#ifdef __linux__
+    cpu_set_t cpus;
+    FILE* f;
+    char quota[32];
+    unsigned long long period;
+
+    if (!sched_getaffinity(0, sizeof(cpus), &cpus)) {
+        ncpus = CPU_COUNT(&cpus);
+    }
+    else {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+        ncpus = online > 0 ? (size_t) online : 1;
+    }
+    /* cgroup v2 writes the quota as `<quota> <period>` or `max <period>` */
+    if ((f = fopen("/sys/fs/cgroup/cpu.max", "r"))) {
+        if (fscanf(f, "%31s %llu", quota, &period) == 2 &&
+            strcmp(quota, "max") &&
+            period) {
+            unsigned long long limit = (strtoull(quota, NULL, 10) +
+                                        period - 1) / period;
+
+            if (limit && limit < ncpus) {
+                ncpus = limit;
+            }
+        }
+        fclose(f);
+    }
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ncpus = online > 0 ? (size_t) online : 1;
+#endif
+    return ncpus ? ncpus : 1;
+}
+
+static size_t sort_thread_count(size_t rows) {
+    size_t nthreads = sort_thread_limit;
+    size_t useful = rows / parallel_sort_min_rows;
+
+    if (useful <= 1) {
+        return 1;
+    }
+    if (!nthreads) {
+        nthreads = available_cpus();
+    }
+    return useful < nthreads ? useful : nthreads;
+}
+
+/* Run `work` on every chunk, each on its own thread. The first chunk, and
+   any chunk whose thread cannot be started, runs on the calling thread. */
+static void run_sort_chunks(void* (*work)(void*),
+                            sort_chunk* chunks,
+                            size_t nchunks) {
+    for (size_t n = 1; n < nchunks; ++n) {
+        chunks[n].started = !pthread_create(&chunks[n].thread,
+                                            NULL,
+                                            work,
+                                            &chunks[n]);
+    }
+    work(&chunks[0]);
+    for (size_t n = 1; n < nchunks; ++n) {
+        if (chunks[n].started) {
+            pthread_join(chunks[n].thread, NULL);
+        }
+        else {
+            work(&chunks[n]);
+        }
+    }
+}
+
+static void* count_radix_chunk(void* arg) {
+    sort_chunk* chunk = arg;
+
+    memset(chunk->counts, 0, sizeof(chunk->counts));
+    for (size_t n = chunk->start; n < chunk->stop; ++n) {
+        ++chunk->counts[(uint8_t) chunk->records[n * chunk->stride +
+                                                 chunk->byte]];
+    }
+    return NULL;
+}
+
+static void* scatter_radix_chunk(void* arg) {
+    sort_chunk* chunk = arg;
+    size_t stride = chunk->stride;
+
+    for (size_t n = chunk->start; n < chunk->stop; ++n) {
+        const char* record = &chunk->records[n * stride];
+
+        memcpy(&chunk->sorted[chunk->counts[(uint8_t) record[chunk->byte]]++ *
+                              stride],
+               record,
+               stride);
+    }
+    return NULL;
+}
+
+/* The row number stored at the end of a sorted record. */
+static inline size_t sorted_row(const sort_chunk* chunk, size_t n) {
+    size_t row;
+
+    memcpy(&row,
+           &chunk->records[n * chunk->stride + chunk->stride - sizeof(size_t)],
+           sizeof(size_t));
+    return row;
+}
+
+/* Set `out_start` to the bytes of the chunk's rows. */
+static void* measure_sorted_chunk(void* arg) {
+    sort_chunk* chunk = arg;
+
+    chunk->out_start = 0;
+    for (size_t n = chunk->start; n < chunk->stop; ++n) {
+        size_t row = sorted_row(chunk, n);
+
+        chunk->out_start += chunk->row_starts[row + 1] -
+            chunk->row_starts[row];
+    }
+    return NULL;
+}
+
+static void* copy_sorted_chunk(void* arg) {
+    sort_chunk* chunk = arg;
+    char* out_buffer = &chunk->out_buffer[chunk->out_start];
+
+    for (size_t n = chunk->start; n < chunk->stop; ++n) {
+        size_t row = sorted_row(chunk, n);
+        size_t len = chunk->row_starts[row + 1] - chunk->row_starts[row];
+
+        memcpy(out_buffer, &chunk->input_buffer[chunk->row_starts[row]], len);
+        out_buffer += len;
+    }
+    return NULL;
+}
+
+/* Reorder the rows of the COPY data by `keys`, with NULLs after the values.
+   Rows with equal keys keep their order. Returns a new bytes object. */
+static PyObject* sort_rows(const char* const input_buffer,
+                           size_t input_len,
+                           const warp_prism_decoder* decoder,
+                           const sort_key* keys,
+                           Py_ssize_t nkeys) {
+    sort_state state = {keys, nkeys, 0, 0, NULL};
+    row_walk walk = {0};
+    /* each row's encoded keys followed by its row number */
+    char* records = NULL;
+    char* sorted = NULL;
+    size_t key_width = 0;
+    size_t stride;
+    size_t row;
+    size_t* counts = NULL;
+    sort_chunk* chunks = NULL;
+    size_t nchunks;
+    PyObject* out = NULL;
+    char* out_buffer;
+
+    for (Py_ssize_t n = 0; n < nkeys; ++n) {
+        key_width += 1 + keys[n].wire_size;
+    }
+    stride = (key_width + sizeof(size_t) - 1) / sizeof(size_t) *
+        sizeof(size_t) + sizeof(size_t);
+
+    if (!(counts = calloc_nonempty(key_width * 256, sizeof(size_t)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    state.key_width = key_width;
+    state.stride = stride;
+    state.counts = counts;
+    if (walk_rows(input_buffer,
+                  input_len,
+                  decoder,
+                  SIZE_MAX,
+                  true,
+                  stride,
+                  visit_sort_row,
+                  &state,
+                  &walk)) {
+        goto done;
+    }
+    /* the passes swap the records with the sorted buffer */
+    records = walk.records;
+    walk.records = NULL;
+    row = walk.rows;
+
+    nchunks = sort_thread_count(row);
+    if (!(sorted = malloc_nonempty(stride * row)) ||
+        !(chunks = PyMem_Calloc(nchunks, sizeof(sort_chunk)))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (size_t n = 0; n < nchunks; ++n) {
+        chunks[n].start = n * (row / nchunks) +
+            (n < row % nchunks ? n : row % nchunks);
+        chunks[n].stop = chunks[n].start + row / nchunks +
+            (n < row % nchunks);
+        chunks[n].stride = stride;
+    }
+    /* the threads only touch C buffers, so the sort runs without the GIL */
+    Py_BEGIN_ALLOW_THREADS
+    /* stable passes from the last byte to the first; a byte which is the same
+       for every row leaves the order as it is */
+    for (size_t byte = key_width; byte-- > 0;) {
+        size_t* byte_counts = &counts[byte * 256];
+        size_t start = 0;
+        char* swap;
+
+        if (!row || byte_counts[(uint8_t) records[byte]] == row) {
+            continue;
+        }
+        for (size_t n = 0; n < nchunks; ++n) {
+            chunks[n].records = records;
+            chunks[n].sorted = sorted;
+            chunks[n].byte = byte;
+        }
+        if (nchunks == 1) {
+            /* the counts of the whole walk are the counts of the chunk */
+            memcpy(chunks[0].counts, byte_counts, sizeof(chunks[0].counts));
+        }
+        else {
+            run_sort_chunks(count_radix_chunk, chunks, nchunks);
+        }
+        /* each digit's records go after the smaller digits, and each chunk's
+           after the earlier chunks' */
+        for (size_t digit = 0; digit < 256; ++digit) {
+            for (size_t n = 0; n < nchunks; ++n) {
+                size_t count = chunks[n].counts[digit];
+
+                chunks[n].counts[digit] = start;
+                start += count;
+            }
+        }
+        run_sort_chunks(scatter_radix_chunk, chunks, nchunks);
+        swap = records;
+        records = sorted;
+        sorted = swap;
+    }
+    Py_END_ALLOW_THREADS
+
+    /* the rows keep their length, so the data ends where it did */
+    if (!(out = PyBytes_FromStringAndSize(NULL,
+                                          walk.end + sizeof(int16_t)))) {
+        goto done;
+    }
+    out_buffer = PyBytes_AS_STRING(out);
+    memcpy(out_buffer, input_buffer, walk.header_len);
+    Py_BEGIN_ALLOW_THREADS
+    for (size_t n = 0; n < nchunks; ++n) {
+        chunks[n].records = records;
+        chunks[n].input_buffer = input_buffer;
+        chunks[n].row_starts = walk.row_starts;
+        chunks[n].out_buffer = out_buffer;
+    }
+    if (nchunks == 1) {
+        chunks[0].out_start = walk.header_len;
+    }
+    else {
+        size_t start = walk.header_len;
+
+        run_sort_chunks(measure_sorted_chunk, chunks, nchunks);
+        for (size_t n = 0; n < nchunks; ++n) {
+            size_t len = chunks[n].out_start;
+
+            chunks[n].out_start = start;
+            start += len;
+        }
+    }
+    run_sort_chunks(copy_sorted_chunk, chunks, nchunks);
+    Py_END_ALLOW_THREADS
+    /* the end of the data */
+    write16(&out_buffer[walk.end], (uint16_t) -1);
+
+done:
+    free_row_walk(&walk);
+    PyMem_Free(records);
+    PyMem_Free(sorted);
+    PyMem_Free(counts);
+    PyMem_Free(chunks);
+    return out;
+}
+
+/* Partitioning
+
+   `raw_to_arrays(..., partition=(key_columns, npartitions))` groups the rows
+   by a stable hash of integer, datetime, or date key columns so that each
+   partition is a contiguous block of the output. The hash is the splitmix64
+   finalizer folded over the keys widened to int64s, with NULL hashed as 0,
+   which is easy to compute again in other processes. */
+
+static inline uint64_t mix_partition_hash(uint64_t hash) {
+    hash = (hash ^ (hash >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    hash = (hash ^ (hash >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return hash ^ (hash >> 31);
+}
+
+/* Read the `(key_columns, npartitions)` tuple passed as `partition` to
+   `raw_to_arrays`. Returns the new array of key columns or NULL with an
+   exception set. */
+static Py_ssize_t* read_partition_spec(PyObject* pypartition,
+                                       const warp_prism_decoder* decoder,
+                                       Py_ssize_t* nkeys,
+                                       Py_ssize_t* npartitions) {
+    PyObject* pykeys;
+    Py_ssize_t* keys;
+
+    if (!PyArg_ParseTuple(pypartition,
+                          "O!n;partition must be (key_columns, npartitions)",
+                          &PyTuple_Type,
+                          &pykeys,
+                          npartitions)) {
+        return NULL;
+    }
+    if (*npartitions < 1) {
+        PyErr_Format(PyExc_ValueError,
+                     "npartitions must be positive: %zd",
+                     *npartitions);
+        return NULL;
+    }
+
+    *nkeys = PyTuple_GET_SIZE(pykeys);
+    if (!*nkeys) {
+        PyErr_SetString(PyExc_ValueError,
+                        "partition requires at least one key column");
+        return NULL;
+    }
+    if (!(keys = PyMem_Malloc(sizeof(Py_ssize_t) * *nkeys))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t n = 0; n < *nkeys; ++n) {
+        keys[n] = PyLong_AsSsize_t(PyTuple_GET_ITEM(pykeys, n));
+
+        if (keys[n] == -1 && PyErr_Occurred()) {
+            goto error;
+        }
+        if (keys[n] < 0 || keys[n] >= decoder->ncolumns) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid partition key column: %zd",
+                         keys[n]);
+            goto error;
+        }
+        if (!is_int_key(decoder->column_typeids[keys[n]])) {
+            PyErr_SetString(PyExc_TypeError,
+                            "partition keys must be integer, datetime, or"
+                            " date columns");
+            goto error;
+        }
+    }
+    return keys;
+
+error:
+    PyMem_Free(keys);
+    return NULL;
+}
+
+typedef struct {
+    const warp_prism_decoder* decoder;
+    const Py_ssize_t* keys;
+    Py_ssize_t nkeys;
+    Py_ssize_t npartitions;
+} partition_state;
+
+/* Record the partition of a row. */
+static int visit_partition_row(void* state,
+                               const char* const input_buffer,
+                               size_t row __attribute__((unused)),
+                               size_t row_start __attribute__((unused)),
+                               size_t row_end __attribute__((unused)),
+                               const size_t* offsets,
+                               const int32_t* lens,
+                               char* record) {
+    partition_state* partition = state;
+    uint64_t hash = 0;
+    size_t row_partition;
+
+    for (Py_ssize_t n = 0; n < partition->nkeys; ++n) {
+        Py_ssize_t column = partition->keys[n];
+        int64_t key = 0;
+
+        if (lens[column] != -1 &&
+            read_int_key(partition->decoder->column_typeids[column],
+                         &input_buffer[offsets[column]],
+                         lens[column],
+                         &key)) {
+            return -1;
+        }
+        hash = mix_partition_hash(hash ^ (uint64_t) key);
+    }
+    row_partition = hash % (uint64_t) partition->npartitions;
+    memcpy(record, &row_partition, sizeof(size_t));
+    return 1;
+}
+
+/* Reorder the rows of the COPY data by partition, keeping the order of the
+   rows in each partition. Returns a new bytes object and sets `offsets` to
+   the first row of each partition followed by the number of rows. */
+static PyObject* partition_rows(const char* const input_buffer,
+                                size_t input_len,
+                                const warp_prism_decoder* decoder,
+                                const Py_ssize_t* keys,
+                                Py_ssize_t nkeys,
+                                Py_ssize_t npartitions,
+                                PyObject** offsets) {
+    partition_state state = {decoder, keys, nkeys, npartitions};
+    row_walk walk = {0};
+    char* offset_buffer = NULL;
+    npy_intp noffsets = npartitions + 1;
+    PyObject* out = NULL;
+
+    if (unlikely((size_t) npartitions > PY_SSIZE_T_MAX / sizeof(int64_t) - 1)) {
+        PyErr_SetString(PyExc_OverflowError, "too many partitions");
+        return NULL;
+    }
+    if (!(offset_buffer = PyMem_Malloc(sizeof(int64_t) * noffsets))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    /* the partition of each row */
+    if (walk_rows(input_buffer,
+                  input_len,
+                  decoder,
+                  SIZE_MAX,
+                  true,
+                  sizeof(size_t),
+                  visit_partition_row,
+                  &state,
+                  &walk)) {
+        goto done;
+    }
+
+    if (!(out = scatter_rows(input_buffer,
+                             walk.header_len,
+                             walk.row_starts,
+                             walk.rows,
+                             (size_t*) walk.records,
+                             npartitions,
+                             (int64_t*) offset_buffer))) {
+        goto done;
+    }
+    if (!(*offsets = owned_array(PyArray_DescrFromType(NPY_INT64),
+                                 1,
+                                 &noffsets,
+                                 &offset_buffer))) {
+        Py_CLEAR(out);
+    }
+
+done:
+    free_row_walk(&walk);
+    PyMem_Free(offset_buffer);
+    return out;
+}
+
+/* Filtering
+
+   `raw_to_arrays(..., filters=...)` drops the rows which do not match every
+   predicate before decoding. The predicates are evaluated on the raw fields
+   while walking the rows, and the matching rows are copied into a shorter
+   COPY buffer, so rejected rows never take output capacity or create text
+   objects. When every row matches the data is decoded in place. */
+
+typedef enum {
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE,
+    FILTER_BETWEEN,
+    FILTER_IN,
+    FILTER_IS_NULL,
+    FILTER_NOT_NULL,
+} filter_op;
+
+static const char* const filter_op_names[] = {
+    [FILTER_EQ] = "==",
+    [FILTER_NE] = "!=",
+    [FILTER_LT] = "<",
+    [FILTER_LE] = "<=",
+    [FILTER_GT] = ">",
+    [FILTER_GE] = ">=",
+    [FILTER_BETWEEN] = "between",
+    [FILTER_IN] = "in",
+    [FILTER_IS_NULL] = "is null",
+    [FILTER_NOT_NULL] = "is not null",
+};
+
+typedef enum {
+    /* integer, datetime, date, and bool fields, widened to int64 */
+    FILTER_INT,
+    FILTER_FLOAT,
+    /* text fields, compared bytewise */
+    FILTER_TEXT,
+} filter_kind;
+
+typedef union {
+    int64_t i;
+    double f;
+    struct {
+        const char* data;
+        Py_ssize_t len;
+    } text;
+} filter_value;
+
+typedef struct {
+    Py_ssize_t column;
+    /* the type of the field on the wire, which is the value type of sparse
+       columns */
+    uint8_t field_typeid;
+    filter_kind kind;
+    filter_op op;
+    /* one value for comparisons, the inclusive bounds for between, and the
+       set for in, which is sorted for integers. Text values point into the
+       bytes objects of the filter spec. */
+    filter_value* values;
+    Py_ssize_t nvalues;
+} row_filter;
+
+static void free_filters(row_filter* filters, Py_ssize_t nfilters) {
+    if (!filters) {
+        return;
+    }
+    for (Py_ssize_t n = 0; n < nfilters; ++n) {
+        PyMem_Free(filters[n].values);
+    }
+    PyMem_Free(filters);
+}
+
+static int read_filter_value(const row_filter* filter,
+                             PyObject* pyvalue,
+                             filter_value* out) {
+    switch (filter->kind) {
+    case FILTER_INT:
+        out->i = PyLong_AsLongLong(pyvalue);
+        return (out->i == -1 && PyErr_Occurred()) ? -1 : 0;
+    case FILTER_FLOAT:
+        out->f = PyFloat_AsDouble(pyvalue);
+        return (out->f == -1.0 && PyErr_Occurred()) ? -1 : 0;
+    default:
+        if (!PyBytes_Check(pyvalue)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "text filter values must be bytes");
+            return -1;
+        }
+        out->text.data = PyBytes_AS_STRING(pyvalue);
+        out->text.len = PyBytes_GET_SIZE(pyvalue);
+        return 0;
+    }
+}
+
+/* Read the tuple of `(column, op[, value])` tuples passed as `filters` to
+   `raw_to_arrays`. The text values borrow from `pyfilters`, which must
+   outlive the filters. Returns a new array of `nfilters` filters or NULL with
+   an exception set. */
+static row_filter* read_filters(PyObject* pyfilters,
+                                const warp_prism_decoder* decoder,
+                                Py_ssize_t* nfilters) {
+    row_filter* filters;
+
+    if (!PyTuple_Check(pyfilters)) {
+        PyErr_SetString(PyExc_TypeError, "filters must be a tuple");
+        return NULL;
+    }
+    *nfilters = PyTuple_GET_SIZE(pyfilters);
+    if (!(filters = calloc_nonempty(*nfilters, sizeof(row_filter)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t n = 0; n < *nfilters; ++n) {
+        row_filter* filter = &filters[n];
+        const char* op;
+        PyObject* pyvalue = NULL;
+        PyObject* pyvalues;
+        bool found = false;
+
+        if (!PyArg_ParseTuple(PyTuple_GET_ITEM(pyfilters, n),
+                              "ns|O;filters must be (column, op[, value])"
+                              " tuples",
+                              &filter->column,
+                              &op,
+                              &pyvalue)) {
+            goto error;
+        }
+        if (filter->column < 0 || filter->column >= decoder->ncolumns) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid filter column: %zd",
+                         filter->column);
+            goto error;
+        }
+        for (size_t ix = 0;
+             ix < sizeof(filter_op_names) / sizeof(char*);
+             ++ix) {
+            if (!strcmp(op, filter_op_names[ix])) {
+                filter->op = ix;
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            PyErr_Format(PyExc_ValueError, "unknown filter: %s", op);
+            goto error;
+        }
+
+        filter->field_typeid = decoder->column_typeids[filter->column];
+        if (filter->field_typeid == TYPEID_SPARSE) {
+            filter->field_typeid =
+                decoder->sparse_value_typeids[filter->column];
+        }
+        switch (filter->field_typeid) {
+        case TYPEID_FLOAT32:
+        case TYPEID_FLOAT64:
+            filter->kind = FILTER_FLOAT;
+            break;
+        case TYPEID_TEXT:
+        case TYPEID_FIXED_BYTES:
+        case TYPEID_FIXED_UNICODE:
+        case TYPEID_LAZY_TEXT:
+            filter->kind = FILTER_TEXT;
+            break;
+        case TYPEID_INT16:
+        case TYPEID_INT32:
+        case TYPEID_INT64:
+        case TYPEID_BOOL:
+        case TYPEID_DATETIME:
+        case TYPEID_DATE:
+            filter->kind = FILTER_INT;
+            break;
+        default:
+            PyErr_Format(PyExc_TypeError,
+                         "cannot filter on column %zd",
+                         filter->column);
+            goto error;
+        }
+
+        if (filter->op == FILTER_IS_NULL || filter->op == FILTER_NOT_NULL) {
+            if (pyvalue) {
+                PyErr_Format(PyExc_TypeError, "%s takes no value", op);
+                goto error;
+            }
+            continue;
+        }
+        if (!pyvalue) {
+            PyErr_Format(PyExc_TypeError, "%s needs a value", op);
+            goto error;
+        }
+
+        if (filter->op == FILTER_BETWEEN || filter->op == FILTER_IN) {
+            if (!PyTuple_Check(pyvalue) ||
+                (filter->op == FILTER_BETWEEN &&
+                 PyTuple_GET_SIZE(pyvalue) != 2)) {
+                PyErr_Format(PyExc_TypeError,
+                             "the value of %s must be a tuple%s",
+                             op,
+                             filter->op == FILTER_BETWEEN ?
+                             " of (low, high)" : "");
+                goto error;
+            }
+            pyvalues = pyvalue;
+            filter->nvalues = PyTuple_GET_SIZE(pyvalue);
+        }
+        else {
+            pyvalues = NULL;
+            filter->nvalues = 1;
+        }
+
+        if (!(filter->values = malloc_nonempty(sizeof(filter_value) *
+                                               filter->nvalues))) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (Py_ssize_t ix = 0; ix < filter->nvalues; ++ix) {
+            if (read_filter_value(filter,
+                                  pyvalues ?
+                                  PyTuple_GET_ITEM(pyvalues, ix) :
+                                  pyvalue,
+                                  &filter->values[ix])) {
+                goto error;
+            }
+        }
+        if (filter->op == FILTER_IN && filter->kind == FILTER_INT) {
+            /* `i` is the first member of the union so the values can be
+               sorted as int64s with the stride of the union */
+            qsort(filter->values,
+                  filter->nvalues,
+                  sizeof(filter_value),
+                  compare_int64);
+        }
+    }
+    return filters;
+
+error:
+    free_filters(filters, *nfilters);
+    return NULL;
+}
+
+/* Compare a field to a filter value. Returns -1, 0, or 1, or 2 when either
+   is NaN. */
+static inline int compare_filter_value(filter_kind kind,
+                                       const filter_value* field,
+                                       const filter_value* value) {
+    switch (kind) {
+    case FILTER_INT:
+        return (field->i > value->i) - (field->i < value->i);
+    case FILTER_FLOAT:
+        if (field->f != field->f || value->f != value->f) {
+            return 2;
+        }
+        return (field->f > value->f) - (field->f < value->f);
+    default: {
+        Py_ssize_t len = (field->text.len < value->text.len ?
+                          field->text.len :
+                          value->text.len);
+        int order = memcmp(field->text.data, value->text.data, len);
+
+        if (order) {
+            return (order > 0) - (order < 0);
+        }
+        return ((field->text.len > value->text.len) -
+                (field->text.len < value->text.len));
+    }
+    }
+}
+
+/* Check one field against a filter. NULLs only match `is null`, like SQL.
+   Returns 1 for a match, 0 for a miss, or -1 with an exception set when the
+   field has the wrong size. */
+static inline int filter_matches(const row_filter* filter,
+                                 const char* const field,
+                                 int32_t len) {
+    filter_value value = {.text = {NULL, 0}};
+    union {
+        int16_t i16;
+        int32_t i32;
+        int64_t i64;
+        float f32;
+        double f64;
+        bool b;
+    } cell;
+    int order;
+
+    if (len == -1 || filter->op == FILTER_IS_NULL) {
+        return len == -1 && filter->op == FILTER_IS_NULL;
+    }
+    if (filter->op == FILTER_NOT_NULL) {
+        return 1;
+    }
+
+    switch (filter->kind) {
+    case FILTER_TEXT:
+        value.text.data = field;
+        value.text.len = len;
+        break;
+    default:
+        if (parse_field(filter->field_typeid,
+                        typeids[filter->field_typeid],
+                        NULL,
+                        (char*) &cell,
+                        field,
+                        0,
+                        len)) {
+            return -1;
+        }
+        switch (filter->field_typeid) {
+        case TYPEID_INT16:
+            value.i = cell.i16;
+            break;
+        case TYPEID_INT32:
+            value.i = cell.i32;
+            break;
+        case TYPEID_BOOL:
+            value.i = cell.b;
+            break;
+        case TYPEID_FLOAT32:
+            value.f = cell.f32;
+            break;
+        case TYPEID_FLOAT64:
+            value.f = cell.f64;
+            break;
+        default:
+            value.i = cell.i64;
+        }
+    }
+
+    switch (filter->op) {
+    case FILTER_BETWEEN:
+        order = compare_filter_value(filter->kind, &value, &filter->values[0]);
+        if (order != 0 && order != 1) {
+            return 0;
+        }
+        order = compare_filter_value(filter->kind, &value, &filter->values[1]);
+        return order == 0 || order == -1;
+    case FILTER_IN:
+        if (filter->kind == FILTER_INT) {
+            Py_ssize_t low = 0;
+            Py_ssize_t high = filter->nvalues;
+
+            while (low < high) {
+                Py_ssize_t mid = low + (high - low) / 2;
+
+                if (filter->values[mid].i < value.i) {
+                    low = mid + 1;
+                }
+                else {
+                    high = mid;
+                }
+            }
+            return low < filter->nvalues && filter->values[low].i == value.i;
+        }
+        for (Py_ssize_t n = 0; n < filter->nvalues; ++n) {
+            if (!compare_filter_value(filter->kind,
+                                      &value,
+                                      &filter->values[n])) {
+                return 1;
+            }
+        }
+        return 0;
+    default:
+        order = compare_filter_value(filter->kind, &value, &filter->values[0]);
+    }
+
+    switch (filter->op) {
+    case FILTER_EQ:
+        return order == 0;
+    case FILTER_NE:
+        return order != 0;
+    case FILTER_LT:
+        return order == -1;
+    case FILTER_LE:
+        return order == -1 || order == 0;
+    case FILTER_GT:
+        return order == 1;
+    default:
+        return order == 1 || order == 0;
+    }
+}
+
+typedef struct {
+    const row_filter* filters;
+    Py_ssize_t nfilters;
+} filter_state;
+
+/* Keep the rows which match every filter, recording where they end. */
+static int visit_filter_row(void* state,
+                            const char* const input_buffer,
+                            size_t row __attribute__((unused)),
+                            size_t row_start __attribute__((unused)),
+                            size_t row_end,
+                            const size_t* offsets,
+                            const int32_t* lens,
+                            char* record) {
+    filter_state* filtering = state;
+    int matches = 1;
+
+    for (Py_ssize_t n = 0; n < filtering->nfilters && matches > 0; ++n) {
+        const row_filter* filter = &filtering->filters[n];
+
+        matches = filter_matches(filter,
+                                 &input_buffer[offsets[filter->column]],
+                                 lens[filter->column]);
+    }
+    if (matches > 0) {
+        memcpy(record, &row_end, sizeof(size_t));
+    }
+    return matches;
+}
+
+/* Keep the rows of the COPY data which match every filter. Sets `out` to a
+   new bytes object holding the matching rows, or to NULL when every row
+   matches, and `dropped_rows` to the number of rows which did not match.
+   Returns the number of matching rows or -1 with an exception set. */
+static Py_ssize_t filter_rows(const char* const input_buffer,
+                              size_t input_len,
+                              const warp_prism_decoder* decoder,
+                              const row_filter* filters,
+                              Py_ssize_t nfilters,
+                              PyObject** out,
+                              size_t* dropped_rows) {
+    filter_state state = {filters, nfilters};
+    row_walk walk;
+    size_t* row_ends;
+    size_t kept_bytes = 0;
+    char* out_buffer;
+
+    *out = NULL;
+    *dropped_rows = 0;
+    /* the end of each matching row */
+    if (walk_rows(input_buffer,
+                  input_len,
+                  decoder,
+                  SIZE_MAX,
+                  true,
+                  sizeof(size_t),
+                  visit_filter_row,
+                  &state,
+                  &walk)) {
+        return -1;
+    }
+    *dropped_rows = walk.rows - walk.kept_rows;
+    if (!*dropped_rows) {
+        free_row_walk(&walk);
+        return walk.kept_rows;
+    }
+
+    row_ends = (size_t*) walk.records;
+    for (size_t n = 0; n < walk.kept_rows; ++n) {
+        kept_bytes += row_ends[n] - walk.row_starts[n];
+    }
+    if (!(*out = PyBytes_FromStringAndSize(NULL,
+                                           walk.header_len + kept_bytes +
+                                           sizeof(int16_t)))) {
+        free_row_walk(&walk);
+        return -1;
+    }
+    out_buffer = PyBytes_AS_STRING(*out);
+    memcpy(out_buffer, input_buffer, walk.header_len);
+    out_buffer += walk.header_len;
+    /* copy each run of adjacent matching rows at once */
+    for (size_t n = 0; n < walk.kept_rows; ++n) {
+        size_t run_start = walk.row_starts[n];
+        size_t len;
+
+        while (n + 1 < walk.kept_rows &&
+               walk.row_starts[n + 1] == row_ends[n]) {
+            ++n;
+        }
+        len = row_ends[n] - run_start;
+        memcpy(out_buffer, &input_buffer[run_start], len);
+        out_buffer += len;
+    }
+    /* the end of the data */
+    write16(out_buffer, (uint16_t) -1);
+
+    free_row_walk(&walk);
+    return walk.kept_rows;
+}
+
+/* Sampling
+
+   `raw_to_arrays(..., sample=(mode, size_or_rate, seed))` decodes a random
+   sample of the rows. `reservoir` keeps a uniform sample of `size` rows with
+   Vitter's Algorithm L and `bernoulli` keeps each row with probability
+   `rate`. Both draw the gap to the next sampled row up front, so the rows in
+   between are only skipped by their field lengths.
+
+   The sampler takes the COPY data in pieces, so `to_arrays` samples the rows
+   while they arrive and only keeps the sampled rows' bytes instead of the
+   whole result. Each sampled row is copied out of the piece it arrived in,
+   and at the end the rows are joined into a COPY buffer in their original
+   order. Filters are applied before sampling, so the sample is taken from
+   the matching rows. `max_rows` shrinks the reservoir, since the first rows
+   of a sample are biased towards the start of the data, and cannot be used
+   with `bernoulli`. */
+
+typedef struct {
+    bool reservoir;
+    size_t size;
+    double rate;
+    uint64_t seed;
+} sample_spec;
+
+typedef struct {
+    size_t row;
+    char* data;
+    size_t len;
+} sampled_row;
+
+typedef struct {
+    sample_spec spec;
+    const warp_prism_decoder* decoder;
+    const row_filter* filters;
+    Py_ssize_t nfilters;
+    /* the field locations of the current row, for the filters */
+    size_t* offsets;
+    int32_t* lens;
+    uint64_t state;
+    /* the next row to sample, counting the rows which match the filters */
+    size_t next;
+    double weight;
+    double log_miss;
+    size_t row;
+    size_t filtered_rows;
+    /* a copy of the header, NULL until it has arrived */
+    char* header;
+    size_t header_len;
+    uint32_t flags;
+    bool ended;
+    sampled_row* samples;
+    size_t nsamples;
+    size_t allocated_samples;
+    size_t sampled_bytes;
+} row_sampler;
+
+/* splitmix64, which is the sequence of `mix_partition_hash` over a counter */
+static inline uint64_t next_sample_random(uint64_t* state) {
+    return mix_partition_hash(*state += UINT64_C(0x9e3779b97f4a7c15));
+}
+
+/* A uniform double in (0, 1], so that its log is finite. */
+static inline double next_sample_uniform(uint64_t* state) {
+    return ((next_sample_random(state) >> 11) + 1) * 0x1.0p-53;
+}
+
+/* Draw the number of rows to skip before the next sampled row when each row
+   is missed with probability `exp(log_miss)`. The gap is clamped to
+   PY_SSIZE_T_MAX, which is more rows than the data can hold, so adding it to
+   a row number cannot overflow. */
+static inline size_t next_sample_gap(uint64_t* state, double log_miss) {
+    double gap = floor(log(next_sample_uniform(state)) / log_miss);
+
+    if (gap >= (double) PY_SSIZE_T_MAX) {
+        return PY_SSIZE_T_MAX;
+    }
+    /* this is also NaN, which only comes up when every row is sampled */
+    return gap > 0 ? gap : 0;
+}
+
+static int compare_sampled_rows(const void* a, const void* b) {
+    size_t a_row = ((const sampled_row*) a)->row;
+    size_t b_row = ((const sampled_row*) b)->row;
+
+    return (a_row > b_row) - (a_row < b_row);
+}
+
+/* Read the `(mode, size_or_rate, seed)` tuple passed as `sample` to
+   `raw_to_arrays`. Returns 0 or -1 with an exception set. */
+static int read_sample_spec(PyObject* pysample, sample_spec* spec) {
+    const char* mode;
+    PyObject* pyvalue;
+    unsigned long long seed;
+
+    if (!PyTuple_Check(pysample)) {
+        PyErr_SetString(PyExc_TypeError, "sample must be a tuple");
+        return -1;
+    }
+    if (!PyArg_ParseTuple(pysample,
+                          "sOK;sample must be (mode, size_or_rate, seed)",
+                          &mode,
+                          &pyvalue,
+                          &seed)) {
+        return -1;
+    }
+    spec->seed = seed;
+
+    if (!strcmp(mode, "reservoir")) {
+        Py_ssize_t size = PyLong_AsSsize_t(pyvalue);
+
+        if (size == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (size < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "sample size must be non-negative: %zd",
+                         size);
+            return -1;
+        }
+        spec->reservoir = true;
+        spec->size = size;
+        return 0;
+    }
+    if (!strcmp(mode, "bernoulli")) {
+        double rate = PyFloat_AsDouble(pyvalue);
+
+        if (rate == -1.0 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (!(rate >= 0.0 && rate <= 1.0)) {
+            PyErr_Format(PyExc_ValueError,
+                         "sample rate must be in [0, 1]: %R",
+                         pyvalue);
+            return -1;
+        }
+        spec->reservoir = false;
+        spec->rate = rate;
+        return 0;
+    }
+    PyErr_Format(PyExc_ValueError, "unknown sample mode: %s", mode);
+    return -1;
+}
+
+static void free_row_sampler(row_sampler* sampler) {
+    PyMem_Free(sampler->offsets);
+    PyMem_Free(sampler->lens);
+    PyMem_Free(sampler->header);
+    for (size_t n = 0; n < sampler->nsamples; ++n) {
+        PyMem_Free(sampler->samples[n].data);
+    }
+    PyMem_Free(sampler->samples);
+}
+
+/* Set up a sampler. The decoder and filters are borrowed and must outlive
+   the sampler. Returns 0 or -1 with an exception set. */
+static int init_row_sampler(row_sampler* sampler,
+                            const sample_spec* spec,
+                            const warp_prism_decoder* decoder,
+                            const row_filter* filters,
+                            Py_ssize_t nfilters) {
+    uint16_t ncolumns = decoder->ncolumns;
+
+    memset(sampler, 0, sizeof(row_sampler));
+    sampler->spec = *spec;
+    sampler->decoder = decoder;
+    sampler->filters = filters;
+    sampler->nfilters = filters ? nfilters : 0;
+    sampler->state = spec->seed;
+
+    if (spec->reservoir) {
+        if (spec->size) {
+            /* fill the reservoir with the first rows, then jump ahead */
+            sampler->weight = exp(log(next_sample_uniform(&sampler->state)) /
+                                  spec->size);
+            sampler->next = spec->size +
+                next_sample_gap(&sampler->state, log1p(-sampler->weight));
+        }
+        else {
+            sampler->next = SIZE_MAX;
+        }
+    }
+    else {
+        sampler->log_miss = log1p(-spec->rate);
+        sampler->next = (spec->rate ?
+                         next_sample_gap(&sampler->state, sampler->log_miss) :
+                         SIZE_MAX);
+    }
+
+    if (!(sampler->offsets = malloc_nonempty(sizeof(size_t) * ncolumns)) ||
+        !(sampler->lens = malloc_nonempty(sizeof(int32_t) * ncolumns))) {
+        free_row_sampler(sampler);
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy a row into the sample, replacing `sample` if it is not NULL. */
+static int keep_sampled_row(row_sampler* sampler,
+                            sampled_row* sample,
+                            const char* const row_buffer,
+                            size_t len) {
+    char* data;
+
+    if (!(data = malloc_nonempty(len))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(data, row_buffer, len);
+
+    if (sample) {
+        sampler->sampled_bytes -= sample->len;
+        PyMem_Free(sample->data);
+    }
+    else {
+        if (sampler->nsamples == sampler->allocated_samples) {
+            size_t allocated = sampler->allocated_samples;
+            sampled_row* p;
+
+            if (!allocated) {
+                allocated = starting_column_buffer_length;
+            }
+            else if (unlikely(mul_overflow(allocated,
+                                           column_buffer_growth_factor,
+                                           &allocated))) {
+                allocated = SIZE_MAX;
+            }
+            if (sampler->spec.reservoir && allocated > sampler->spec.size) {
+                /* the reservoir grows while it fills, so a large size for a
+                   small result does not allocate up front */
+                allocated = sampler->spec.size;
+            }
+            if (unlikely(allocated > PY_SSIZE_T_MAX / sizeof(sampled_row))) {
+                PyMem_Free(data);
+                PyErr_SetString(PyExc_OverflowError,
+                                "row count would overflow");
+                return -1;
+            }
+            if (!(p = PyMem_Realloc(sampler->samples,
+                                    sizeof(sampled_row) * allocated))) {
+                PyMem_Free(data);
+                PyErr_NoMemory();
+                return -1;
+            }
+            sampler->samples = p;
+            sampler->allocated_samples = allocated;
+        }
+        sample = &sampler->samples[sampler->nsamples++];
+    }
+    sample->row = sampler->row;
+    sample->data = data;
+    sample->len = len;
+    sampler->sampled_bytes += len;
+    return 0;
+}
+
+/* Sample the whole rows at the start of `input_buffer`, which continues the
+   COPY data given to the sampler so far. Returns the number of bytes used;
+   the rest is the start of a row which has not all arrived and must be
+   given again with the data which follows it. Returns -1 with an exception
+   set on error. */
+static Py_ssize_t sampler_write(row_sampler* sampler,
+                                const char* const input_buffer,
+                                size_t input_len) {
+    size_t cursor = 0;
+
+    if (!sampler->header) {
+        if (input_len < COPY_HEADER_LEN) {
+            return 0;
+        }
+        if (read_header(input_buffer,
+                        input_len,
+                        &cursor,
+                        &sampler->flags)) {
+            return -1;
+        }
+        if (!(sampler->header = PyMem_Malloc(cursor))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(sampler->header, input_buffer, cursor);
+        sampler->header_len = cursor;
+    }
+
+    while (!sampler->ended) {
+        const sample_spec* spec = &sampler->spec;
+        size_t end;
+        int status = arrived_row_end(input_buffer,
+                                     input_len,
+                                     cursor,
+                                     sampler->flags,
+                                     &end);
+        size_t row = sampler->row;
+
+        if (!status) {
+            break;
+        }
+        if (status < 0) {
+            sampler->ended = true;
+            cursor += sizeof(int16_t);
+            break;
+        }
+
+        if (sampler->nfilters) {
+            size_t field_cursor = cursor;
+            int matches = 1;
+
+            if (next_row(input_buffer,
+                         end,
+                         &field_cursor,
+                         sampler->flags,
+                         sampler->decoder->ncolumns,
+                         row + sampler->filtered_rows,
+                         sampler->offsets,
+                         sampler->lens)) {
+                return -1;
+            }
+            for (Py_ssize_t n = 0; n < sampler->nfilters && matches > 0; ++n) {
+                const row_filter* filter = &sampler->filters[n];
+
+                matches = filter_matches(
+                    filter,
+                    &input_buffer[sampler->offsets[filter->column]],
+                    sampler->lens[filter->column]);
+            }
+            if (matches < 0) {
+                return -1;
+            }
+            if (!matches) {
+                ++sampler->filtered_rows;
+                cursor = end;
+                continue;
+            }
+        }
+
+        if (spec->reservoir && row < spec->size) {
+            if (keep_sampled_row(sampler,
+                                 NULL,
+                                 &input_buffer[cursor],
+                                 end - cursor)) {
+                return -1;
+            }
+        }
+        else if (row == sampler->next) {
+            if (spec->reservoir) {
+                /* replace a random row of the reservoir */
+                if (keep_sampled_row(
+                        sampler,
+                        &sampler->samples[next_sample_random(&sampler->state) %
+                                          spec->size],
+                        &input_buffer[cursor],
+                        end - cursor)) {
+                    return -1;
+                }
+                sampler->weight *= exp(
+                    log(next_sample_uniform(&sampler->state)) / spec->size);
+                sampler->next = row + 1 +
+                    next_sample_gap(&sampler->state, log1p(-sampler->weight));
+            }
+            else {
+                if (keep_sampled_row(sampler,
+                                     NULL,
+                                     &input_buffer[cursor],
+                                     end - cursor)) {
+                    return -1;
+                }
+                sampler->next = row + 1 +
+                    next_sample_gap(&sampler->state, sampler->log_miss);
+            }
+        }
+        ++sampler->row;
+        cursor = end;
+    }
+    return cursor;
+}
+
+/* Join the sampled rows into COPY data in the order they were read. Returns
+   a new bytes object or NULL with an exception set. */
+static PyObject* sampler_result(row_sampler* sampler) {
+    PyObject* out;
+    char* out_buffer;
+    size_t len;
+
+    if (!sampler->header) {
+        PyErr_SetString(PyExc_ValueError, "missing postgres signature");
+        return NULL;
+    }
+    if (!sampler->ended) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the COPY data ended part way through a row");
+        return NULL;
+    }
+    if (sampler->spec.reservoir) {
+        qsort(sampler->samples,
+              sampler->nsamples,
+              sizeof(sampled_row),
+              compare_sampled_rows);
+    }
+
+    len = sampler->header_len + sampler->sampled_bytes + sizeof(int16_t);
+    if (!(out = PyBytes_FromStringAndSize(NULL, len))) {
+        return NULL;
+    }
+    out_buffer = PyBytes_AS_STRING(out);
+    memcpy(out_buffer, sampler->header, sampler->header_len);
+    out_buffer += sampler->header_len;
+    for (size_t n = 0; n < sampler->nsamples; ++n) {
+        memcpy(out_buffer, sampler->samples[n].data, sampler->samples[n].len);
+        out_buffer += sampler->samples[n].len;
+    }
+    /* the end of the data */
+    write16(out_buffer, (uint16_t) -1);
+    return out;
+}
+
+/* The state behind the capsule returned by `new_sampler`, which owns what
+   the sampler borrows. */
+typedef struct {
+    row_sampler sampler;
+    PyObject* decoder_ob;
+    /* the filter text values point into this */
+    PyObject* pyfilters;
+    row_filter* filters;
+} sampler_capsule;
+
+static void free_sampler_capsule(PyObject* capsule) {
+    sampler_capsule* c = PyCapsule_GetPointer(capsule, NULL);
+
+    free_row_sampler(&c->sampler);
+    free_filters(c->filters, c->sampler.nfilters);
+    Py_XDECREF(c->decoder_ob);
+    Py_XDECREF(c->pyfilters);
+    PyMem_Free(c);
+}
+
+static row_sampler* get_sampler(PyObject* capsule) {
+    if (!PyCapsule_CheckExact(capsule) ||
+        PyCapsule_GetDestructor(capsule) != free_sampler_capsule) {
+        PyErr_SetString(PyExc_TypeError, "expected a sampler");
+        return NULL;
+    }
+    return &((sampler_capsule*) PyCapsule_GetPointer(capsule, NULL))->sampler;
+}
+
+/* Create a sampler for COPY data of the given type ids, which is fed with
+   `sampler_write` and read with `sampler_result`. */
+static PyObject* warp_prism_new_sampler(PyObject* self __attribute__((unused)),
+                                        PyObject* args,
+                                        PyObject* kwargs) {
+    static char* keywords[] = {"type_ids", "sample", "filters", NULL};
+    PyObject* pytypeids;
+    PyObject* pysample;
+    PyObject* pyfilters = Py_None;
+    sample_spec spec;
+    sampler_capsule* c;
+    Py_ssize_t nfilters = 0;
+    PyObject* capsule;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "OO|$O:new_sampler",
+                                     keywords,
+                                     &pytypeids,
+                                     &pysample,
+                                     &pyfilters)) {
+        return NULL;
+    }
+    if (!PyTuple_Check(pytypeids)) {
+        PyErr_SetString(PyExc_TypeError, "type_ids must be a tuple");
+        return NULL;
+    }
+    if (read_sample_spec(pysample, &spec)) {
+        return NULL;
+    }
+    if (!(c = PyMem_Calloc(1, sizeof(sampler_capsule)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (!(c->decoder_ob = get_decoder(pytypeids))) {
+        goto error;
+    }
+    if (pyfilters != Py_None) {
+        if (!(c->filters = read_filters(
+                  pyfilters,
+                  PyCapsule_GetPointer(c->decoder_ob, NULL),
+                  &nfilters))) {
+            goto error;
+        }
+        Py_INCREF(pyfilters);
+        c->pyfilters = pyfilters;
+    }
+    if (init_row_sampler(&c->sampler,
+                         &spec,
+                         PyCapsule_GetPointer(c->decoder_ob, NULL),
+                         c->filters,
+                         nfilters)) {
+        goto error;
+    }
+    if (!(capsule = PyCapsule_New(c, NULL, free_sampler_capsule))) {
+        free_row_sampler(&c->sampler);
+        goto error;
+    }
+    return capsule;
+
+error:
+    free_filters(c->filters, nfilters);
+    Py_XDECREF(c->decoder_ob);
+    Py_XDECREF(c->pyfilters);
+    PyMem_Free(c);
+    return NULL;
+}
+
+/* Sample the whole rows of a piece of COPY data; see `sampler_write`. */
+static PyObject* warp_prism_sampler_write(PyObject* self
+                                          __attribute__((unused)),
+                                          PyObject* args) {
+    PyObject* capsule;
+    row_sampler* sampler;
+    Py_buffer view;
+    Py_ssize_t used;
+
+    if (!PyArg_ParseTuple(args, "Oy*:sampler_write", &capsule, &view)) {
+        return NULL;
+    }
+    if (!(sampler = get_sampler(capsule))) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    used = sampler_write(sampler, view.buf, view.len);
+    PyBuffer_Release(&view);
+    if (used < 0) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(used);
+}
+
+/* Return `(data, filtered_rows)`, the sampled rows as COPY data and the
+   number of rows which did not match the filters. */
+static PyObject* warp_prism_sampler_result(PyObject* self
+                                           __attribute__((unused)),
+                                           PyObject* capsule) {
+    row_sampler* sampler;
+    PyObject* data;
+
+    if (!(sampler = get_sampler(capsule)) ||
+        !(data = sampler_result(sampler))) {
+        return NULL;
+    }
+    return Py_BuildValue("Nn", data, (Py_ssize_t) sampler->filtered_rows);
+}
+
+/* Read the `(key_columns, version_column, cutoff)` tuple passed as `asof` to
+   `raw_to_arrays`. Returns the key columns, which `spec` points to, or NULL
+   on error. */
+static Py_ssize_t* read_asof_spec(PyObject* pyasof,
+                                  const warp_prism_decoder* decoder,
+                                  asof_spec* spec) {
+    PyObject* pykeys;
+    PyObject* pycutoff;
+    Py_ssize_t* keys;
+
+    if (!PyArg_ParseTuple(pyasof,
+                          "O!nO;asof must be (key_columns, version_column,"
+                          " cutoff)",
+                          &PyTuple_Type,
+                          &pykeys,
+                          &spec->version,
+                          &pycutoff)) {
+        return NULL;
+    }
+    if (spec->version < 0 || spec->version >= decoder->ncolumns) {
+        PyErr_Format(PyExc_ValueError,
+                     "invalid asof version column: %zd",
+                     spec->version);
+        return NULL;
+    }
+    if (!is_int_key(decoder->column_typeids[spec->version])) {
+        PyErr_SetString(PyExc_TypeError,
+                        "the asof version column must be an integer,"
+                        " datetime, or date column");
+        return NULL;
+    }
+
+    spec->has_cutoff = pycutoff != Py_None;
+    if (spec->has_cutoff) {
+        spec->cutoff = PyLong_AsLongLong(pycutoff);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    spec->nkeys = PyTuple_GET_SIZE(pykeys);
+    if (!(keys = malloc_nonempty(sizeof(Py_ssize_t) * spec->nkeys))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t n = 0; n < spec->nkeys; ++n) {
+        keys[n] = PyLong_AsSsize_t(PyTuple_GET_ITEM(pykeys, n));
+        if (keys[n] == -1 && PyErr_Occurred()) {
+            PyMem_Free(keys);
+            return NULL;
+        }
+        if (keys[n] < 0 || keys[n] >= decoder->ncolumns) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid asof key column: %zd",
+                         keys[n]);
+            PyMem_Free(keys);
+            return NULL;
+        }
+    }
+    spec->keys = keys;
+    return keys;
+}
+
+/* Make `rewritten`, a new copy of the rows in the binary copy format, the
+   rows the later stages read. A NULL `rewritten` means the stage kept the rows
+   as they were. */
+static inline void replace_rows(PyObject** current,
+                                PyObject* rewritten,
+                                const char** input_buffer,
+                                size_t* input_len) {
+    if (!rewritten) {
+        return;
+    }
+    /* the earlier copy is not needed once the rows are copied again */
+    Py_XSETREF(*current, rewritten);
+    *input_buffer = PyBytes_AS_STRING(rewritten);
+    *input_len = PyBytes_GET_SIZE(rewritten);
+}
+
+static PyObject* warp_prism_to_arrays(PyObject* self __attribute__((unused)),
+                                      PyObject* args,
+                                      PyObject* kwargs) {
+    static char* keywords[] = {
+        "buffer",
+        "type_ids",
+        "stats",
+        "intern_text",
+        "column_stats",
+        "null_masks",
+        "asof",
+        "split",
+        "sort",
+        "partition",
+        "max_rows",
+        "filters",
+        "sample",
+        NULL,
+    };
+    PyObject* pybuffer;
+    Py_buffer view = {0};
+    PyObject* pytypeids;
+    PyObject* pystats = Py_None;
+    int intern_text = false;
+    int column_stats = false;
+    int null_masks = false;
+    PyObject* pyasof = Py_None;
+    asof_spec asof = {0};
+    Py_ssize_t* asof_keys = NULL;
+    size_t asof_dropped_rows = 0;
+    PyObject* pysplit = Py_None;
+    Py_ssize_t split_column = -1;
+    PyObject* split_labels = NULL;
+    PyObject* split_offsets = NULL;
+    PyObject* pysort = Py_None;
+    sort_key* sort_keys = NULL;
+    Py_ssize_t nsort_keys = 0;
+    PyObject* pypartition = Py_None;
+    Py_ssize_t* partition_keys = NULL;
+    Py_ssize_t npartition_keys = 0;
+    Py_ssize_t npartitions = 0;
+    PyObject* pymax_rows = Py_None;
+    Py_ssize_t max_rows = -1;
+    PyObject* pyfilters = Py_None;
+    row_filter* filters = NULL;
+    Py_ssize_t nfilters = 0;
+    size_t filtered_rows = 0;
+    PyObject* pysample = Py_None;
+    sample_spec sample = {0};
+    size_t expected_rows = SIZE_MAX;
+    /* the rows as rewritten by the latest stage, or NULL for the input */
+    PyObject* rewritten = NULL;
+    PyObject* next;
+    const char* input_buffer;
+    size_t input_len;
+    PyObject* owner;
+    PyObject* decoder_ob;
+    const warp_prism_decoder* decoder;
+    Py_ssize_t ncolumns;
+    const warp_prism_type** types;
+    char** outarrays = NULL;
+    bool** outmasks = NULL;
+    decode_stats stats = {0};
+    warp_prism_time finalize_end;
+    Py_ssize_t n;
+    size_t written_rows;
+    size_t input_bytes;
+    sparse_column* sparse = NULL;
+    PyObject* out = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "OO|$OpppOOOOOOO:raw_to_arrays",
+                                     keywords,
+                                     &pybuffer,
+                                     &pytypeids,
+                                     &pystats,
+                                     &intern_text,
+                                     &column_stats,
+                                     &null_masks,
+                                     &pyasof,
+                                     &pysplit,
+                                     &pysort,
+                                     &pypartition,
+                                     &pymax_rows,
+                                     &pyfilters,
+                                     &pysample)) {
+        return NULL;
+    }
+
+    if (!PyTuple_Check(pytypeids)) {
+        PyErr_SetString(PyExc_TypeError, "type_ids must be a tuple");
+        return NULL;
+    }
+
+    if (pystats != Py_None && !PyDict_Check(pystats)) {
+        PyErr_SetString(PyExc_TypeError, "stats must be a dict or None");
+        return NULL;
+    }
+
+    if (pymax_rows != Py_None) {
+        if ((max_rows = PyLong_AsSsize_t(pymax_rows)) == -1 &&
+            PyErr_Occurred()) {
+            return NULL;
+        }
+        if (max_rows < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "max_rows must be non-negative: %zd",
+                         max_rows);
+            return NULL;
+        }
+    }
+
+    if (column_stats && pystats == Py_None) {
+        PyErr_SetString(PyExc_TypeError,
+                        "column_stats requires a stats dict");
+        return NULL;
+    }
+
+    if (!(decoder_ob = get_decoder(pytypeids))) {
+        return NULL;
+    }
+    decoder = PyCapsule_GetPointer(decoder_ob, NULL);
+    ncolumns = decoder->ncolumns;
+    types = decoder->column_types;
+
+    if (pysplit != Py_None) {
+        split_column = PyLong_AsSsize_t(pysplit);
+        if (split_column == -1 && PyErr_Occurred()) {
+            goto done;
+        }
+        if (split_column < 0 || split_column >= ncolumns) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid split column: %zd",
+                         split_column);
+            goto done;
+        }
+        if (!is_int_key(decoder->column_typeids[split_column])) {
+            PyErr_SetString(PyExc_TypeError,
+                            "the split column must be an integer, datetime,"
+                            " or date column");
+            goto done;
+        }
+    }
+
+    if (pyasof != Py_None &&
+        !(asof_keys = read_asof_spec(pyasof, decoder, &asof))) {
+        goto done;
+    }
+
+    if (pysort != Py_None &&
+        !(sort_keys = read_sort_keys(pysort, decoder, &nsort_keys))) {
+        goto done;
+    }
+
+    if (pypartition != Py_None) {
+        if (split_column >= 0) {
+            PyErr_SetString(PyExc_TypeError,
+                            "split and partition cannot be combined");
+            goto done;
+        }
+        if (!(partition_keys = read_partition_spec(pypartition,
+                                                   decoder,
+                                                   &npartition_keys,
+                                                   &npartitions))) {
+            goto done;
+        }
+    }
+
+    if (pyfilters != Py_None &&
+        !(filters = read_filters(pyfilters, decoder, &nfilters))) {
+        goto done;
+    }
+
+    if (pysample != Py_None) {
+        if (read_sample_spec(pysample, &sample)) {
+            goto done;
+        }
+        if (max_rows >= 0) {
+            /* the first rows of a sample are not a uniform sample, so the
+               limit shrinks the reservoir instead */
+            if (!sample.reservoir) {
+                PyErr_SetString(PyExc_ValueError,
+                                "max_rows cannot be combined with a"
+                                " bernoulli sample");
+                goto done;
+            }
+            if ((size_t) max_rows < sample.size) {
+                sample.size = max_rows;
+            }
+        }
+    }
+
+    if (!(outarrays = PyMem_Malloc(sizeof(char*) * ncolumns))) {
+        goto done;
+    }
+    if (!(outmasks = PyMem_Malloc(sizeof(bool*) * ncolumns))) {
+        goto done;
+    }
+    if (!(stats.null_counts = calloc_nonempty(ncolumns, sizeof(size_t)))) {
+        goto done;
+    }
+
+    if (decoder->sparse_value_typeids &&
+        !(sparse = PyMem_Calloc(ncolumns, sizeof(sparse_column)))) {
+        goto done;
+    }
+
+    if (PyObject_GetBuffer(pybuffer, &view, PyBUF_CONTIG_RO)) {
+        goto done;
+    }
+
+    get_time(&stats.decode_start);
+    input_buffer = view.buf;
+    input_len = view.len;
+    if (filters && pysample == Py_None) {
+        Py_ssize_t rows = filter_rows(input_buffer,
+                                      input_len,
+                                      decoder,
+                                      filters,
+                                      nfilters,
+                                      &next,
+                                      &filtered_rows);
+
+        if (rows < 0) {
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+        expected_rows = rows;
+    }
+    if (pysample != Py_None) {
+        /* the sampler applies the filters itself */
+        row_sampler sampler;
+
+        if (init_row_sampler(&sampler, &sample, decoder, filters, nfilters)) {
+            goto done;
+        }
+        next = NULL;
+        if (sampler_write(&sampler, input_buffer, input_len) < 0 ||
+            !(next = sampler_result(&sampler))) {
+            free_row_sampler(&sampler);
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+        filtered_rows = sampler.filtered_rows;
+        expected_rows = sampler.nsamples;
+        free_row_sampler(&sampler);
+    }
+    if (max_rows >= 0) {
+        Py_ssize_t rows = head_rows(input_buffer,
+                                    input_len,
+                                    decoder,
+                                    max_rows,
+                                    &next);
+
+        if (rows < 0) {
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+        /* asof may drop some of these rows but never adds any */
+        expected_rows = rows;
+    }
+    if (asof_keys) {
+        if (!(next = asof_compact(input_buffer,
+                                  input_len,
+                                  decoder,
+                                  &asof,
+                                  &asof_dropped_rows))) {
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+    }
+    if (sort_keys) {
+        if (!(next = sort_rows(input_buffer,
+                               input_len,
+                               decoder,
+                               sort_keys,
+                               nsort_keys))) {
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+    }
+    if (split_column >= 0) {
+        if (!(next = split_rows(input_buffer,
+                                input_len,
+                                decoder,
+                                split_column,
+                                &split_labels,
+                                &split_offsets))) {
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+    }
+    if (partition_keys) {
+        /* the partitions are returned like split without the labels */
+        if (!(next = partition_rows(input_buffer,
+                                    input_len,
+                                    decoder,
+                                    partition_keys,
+                                    npartition_keys,
+                                    npartitions,
+                                    &split_offsets))) {
+            goto done;
+        }
+        replace_rows(&rewritten, next, &input_buffer, &input_len);
+    }
+    /* lazy text columns keep the buffer they point into alive */
+    owner = rewritten ? rewritten : pybuffer;
+    if (warp_prism_read_binary_results(input_buffer,
+                                       input_len,
+                                       decoder,
+                                       expected_rows,
+                                       intern_text,
+                                       sparse,
+                                       &stats,
+                                       &written_rows,
+                                       outarrays,
+                                       outmasks)) {
+        goto done;
+    }
+    input_bytes = view.len;
+    PyBuffer_Release(&view);
+
+    /* summarize before the arrays are handed to numpy, so that a failure
+       still frees them below */
+    if (column_stats && fill_column_stats(pystats,
+                                          &stats,
+                                          decoder,
+                                          written_rows,
+                                          outarrays,
+                                          outmasks)) {
+        goto clear_arrays;
+    }
+
+    if (null_masks) {
+        for (n = 0; n < ncolumns; ++n) {
+            invert_mask(outmasks[n], written_rows);
+        }
+    }
+
+    if (sparse) {
+        for (n = 0; n < ncolumns; ++n) {
+            if (decoder->column_typeids[n] == TYPEID_SPARSE &&
+                finalize_sparse_column(
+                    &sparse[n],
+                    typeids[decoder->sparse_value_typeids[n]]->size,
+                    &stats)) {
+                goto clear_arrays;
+            }
+        }
+    }
+
+    if (!(out = PyTuple_New(ncolumns))) {
+        goto clear_arrays;
+    }
+
+    for (n = 0;n < ncolumns; ++n) {
+        capsule_contents* ac;
+        PyObject* acapsule;
+        PyObject* mcapsule;
+        PyObject* andaray;
+        PyObject* mndarray;
+        PyObject* pair;
+
+        if (decoder->column_typeids[n] == TYPEID_SPARSE) {
+            /* the dense cells are empty, only the mask is dropped */
+            types[n]->free(outarrays[n], written_rows);
+            PyMem_Free(outmasks[n]);
+            outarrays[n] = NULL;
+            outmasks[n] = NULL;
+
+            if (!(pair = sparse_pair(
+                      &sparse[n],
+                      typeids[decoder->sparse_value_typeids[n]]))) {
+                Py_DECREF(out);
+                goto clear_arrays;
+            }
+            PyTuple_SET_ITEM(out, n, pair);
+            continue;
+        }
+
+        Py_INCREF(types[n]->dtype);
+        if (!(andaray = PyArray_NewFromDescr(&PyArray_Type,
+                                             types[n]->dtype,
+                                             1,
+                                             (npy_intp*) &written_rows,
+                                             NULL,
+                                             outarrays[n],
+                                             NPY_ARRAY_CARRAY,
+                                             NULL))) {
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        if (!(ac = PyMem_Malloc(sizeof(capsule_contents)))) {
+            Py_DECREF(andaray);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        ac->buffer = outarrays[n];
+        ac->free = types[n]->free;
+        ac->rowcount = written_rows;
+        ac->owner = NULL;
+        if (decoder->column_typeids[n] == TYPEID_LAZY_TEXT) {
+            Py_INCREF(owner);
+            ac->owner = owner;
+        }
+
+        if (!(acapsule = PyCapsule_New(ac, NULL, free_acapsule))) {
+            Py_XDECREF(ac->owner);
+            PyMem_Free(ac);
+            Py_DECREF(andaray);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        if (PyArray_SetBaseObject((PyArrayObject*) andaray, acapsule)) {
+            Py_DECREF(acapsule);
+            Py_DECREF(andaray);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        if (!(mndarray = PyArray_SimpleNewFromData(1,
+                                                   (npy_intp*) &written_rows,
+                                                   NPY_BOOL,
+                                                   outmasks[n]))) {
+            Py_DECREF(andaray);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        if (!(mcapsule = PyCapsule_New(outmasks[n], NULL, free_mcapsule))) {
+            Py_DECREF(andaray);
+            Py_DECREF(mndarray);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        if (PyArray_SetBaseObject((PyArrayObject*) mndarray, mcapsule)) {
+            Py_DECREF(andaray);
+            Py_DECREF(mndarray);
+            Py_DECREF(mcapsule);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        if (!(pair = PyTuple_New(2))) {
+            Py_DECREF(andaray);
+            Py_DECREF(mndarray);
+            Py_DECREF(out);
+            goto clear_arrays;
+        }
+
+        PyTuple_SET_ITEM(pair, 0, andaray);
+        PyTuple_SET_ITEM(pair, 1, mndarray);
+        PyTuple_SET_ITEM(out, n, pair);
+    }
+
+    if (pystats != Py_None) {
+        get_time(&finalize_end);
+        if (fill_stats(pystats,
+                       &stats,
+                       decoder,
+                       written_rows,
+                       input_bytes,
+                       &finalize_end) ||
+            (asof_keys &&
+             set_stat(pystats,
+                      "asof_dropped_rows",
+                      PyLong_FromSize_t(asof_dropped_rows))) ||
+            (filters &&
+             set_stat(pystats,
+                      "filtered_rows",
+                      PyLong_FromSize_t(filtered_rows)))) {
+            /* the arrays are owned by `out` now */
+            Py_CLEAR(out);
+        }
+    }
+
+    if (out && split_offsets) {
+        PyObject* columns = out;
+
+        out = (split_labels ?
+               PyTuple_Pack(3, split_labels, split_offsets, columns) :
+               PyTuple_Pack(2, split_offsets, columns));
+        Py_DECREF(columns);
+    }
+
+    goto done;
+
+clear_arrays:
+    free_outarrays(ncolumns, written_rows, types, outarrays, outmasks);
+done:
+    PyBuffer_Release(&view);
+    PyMem_Free(outarrays);
+    PyMem_Free(outmasks);
+    PyMem_Free(stats.null_counts);
+    free_sparse_columns(sparse, ncolumns);
+    PyMem_Free(asof_keys);
+    PyMem_Free(sort_keys);
+    PyMem_Free(partition_keys);
+    free_filters(filters, nfilters);
+    Py_XDECREF(rewritten);
+    Py_XDECREF(split_labels);
+    Py_XDECREF(split_offsets);
+    Py_DECREF(decoder_ob);
+    return out;
+}
+
+/* Pivoting
+
+   `raw_to_pivot` reads long results of `(row_key, column_key, values...)`
+   rows and scatters each value straight into a 2-D array indexed by the two
+   keys, so the long columns are never built. */
+
+/* Index an axis. If `pylabels` is NULL the keys were collected into `index`
+   by the first pass; they are sorted into a new labels array. Otherwise
+   `pylabels` is the int64 labels array, in any order. Returns a new
+   reference to the labels array. */
+static PyObject* pivot_axis(PyObject* pylabels,
+                            pivot_index* index,
+                            const char* axis) {
+    npy_intp count;
+    const int64_t* labels;
+    char* buffer;
+    PyObject* out;
+
+    if (!pylabels) {
+        count = index->count;
+        if (!(buffer = malloc_nonempty(sizeof(int64_t) * count))) {
+            return PyErr_NoMemory();
+        }
+        sort_pivot_index(index, (int64_t*) buffer);
+        index->labels = (const int64_t*) buffer;
+        if (!(out = owned_array(PyArray_DescrFromType(NPY_INT64),
+                                1,
+                                &count,
+                                &buffer))) {
+            PyMem_Free(buffer);
+        }
+        return out;
+    }
+
+    count = PyArray_SIZE((PyArrayObject*) pylabels);
+    labels = PyArray_DATA((PyArrayObject*) pylabels);
+    if (allocate_pivot_index(index, count)) {
+        return NULL;
+    }
+    for (npy_intp n = 0; n < count; ++n) {
+        int status = pivot_insert(index, labels[n]);
+
+        if (status) {
+            if (status > 0) {
+                PyErr_Format(PyExc_ValueError,
+                             "duplicate %s label: %lld",
+                             axis,
+                             (long long) labels[n]);
+            }
+            return NULL;
+        }
+    }
+    index->labels = labels;
+    Py_INCREF(pylabels);
+    return pylabels;
+}
+
+static PyObject* warp_prism_to_pivot(PyObject* self __attribute__((unused)),
+                                     PyObject* args,
+                                     PyObject* kwargs) {
+    static char* keywords[] = {
+        "buffer",
+        "type_ids",
+        "row_key",
+        "column_key",
+        "row_labels",
+        "column_labels",
+        "stats",
+        NULL,
+    };
+    PyObject* pybuffer;
+    Py_buffer view;
+    bool have_view = false;
+    PyObject* pytypeids;
+    Py_ssize_t row_key;
+    Py_ssize_t column_key;
+    PyObject* pyrow_labels = Py_None;
+    PyObject* pycolumn_labels = Py_None;
+    PyObject* pystats = Py_None;
+    PyObject* decoder_ob;
+    const warp_prism_decoder* decoder;
+    uint16_t ncolumns;
+    uint16_t row_ix;
+    uint16_t column_ix;
+    uint8_t row_typeid;
+    uint8_t column_typeid;
+    size_t* offsets = NULL;
+    int32_t* lens = NULL;
+    pivot_index row_index = {0};
+    pivot_index column_index = {0};
+    PyObject* row_input = NULL;
+    PyObject* column_input = NULL;
+    PyObject* row_labels = NULL;
+    PyObject* column_labels = NULL;
+    char** values = NULL;
+    bool** masks = NULL;
+    size_t cells;
+    size_t cursor;
+    size_t first_row;
+    uint32_t flags;
+    size_t row = 0;
+    size_t dropped_rows = 0;
+    npy_intp dims[2];
+    PyObject* columns = NULL;
+    PyObject* out = NULL;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "OOnn|$OOO:raw_to_pivot",
+                                     keywords,
+                                     &pybuffer,
+                                     &pytypeids,
+                                     &row_key,
+                                     &column_key,
+                                     &pyrow_labels,
+                                     &pycolumn_labels,
+                                     &pystats)) {
+        return NULL;
+    }
+
+    if (!PyTuple_Check(pytypeids)) {
+        PyErr_SetString(PyExc_TypeError, "type_ids must be a tuple");
+        return NULL;
+    }
+
+    if (pystats != Py_None && !PyDict_Check(pystats)) {
+        PyErr_SetString(PyExc_TypeError, "stats must be a dict or None");
+        return NULL;
+    }
+
+    if (!(decoder_ob = get_decoder(pytypeids))) {
+        return NULL;
+    }
+    decoder = PyCapsule_GetPointer(decoder_ob, NULL);
+    ncolumns = decoder->ncolumns;
+
+    if (row_key < 0 || row_key >= ncolumns ||
+        column_key < 0 || column_key >= ncolumns ||
+        row_key == column_key) {
+        PyErr_Format(PyExc_ValueError,
+                     "invalid key columns for %u columns: %zd, %zd",
+                     ncolumns,
+                     row_key,
+                     column_key);
+        goto error;
+    }
+    row_ix = row_key;
+    column_ix = column_key;
+    row_typeid = decoder->column_typeids[row_ix];
+    column_typeid = decoder->column_typeids[column_ix];
+    if (!is_int_key(row_typeid) || !is_int_key(column_typeid)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "pivot keys must be integer, datetime, or date"
+                        " columns");
+        goto error;
+    }
+    if (!decoder->fixed_width) {
+        PyErr_SetString(PyExc_TypeError,
+                        "pivoted values must be fixed width columns");
+        goto error;
+    }
+
+    if ((pyrow_labels != Py_None &&
+         !(row_input = PyArray_FROMANY(pyrow_labels,
+                                       NPY_INT64,
+                                       1,
+                                       1,
+                                       NPY_ARRAY_IN_ARRAY))) ||
+        (pycolumn_labels != Py_None &&
+         !(column_input = PyArray_FROMANY(pycolumn_labels,
+                                          NPY_INT64,
+                                          1,
+                                          1,
+                                          NPY_ARRAY_IN_ARRAY)))) {
+        goto error;
+    }
+
+    if (!(offsets = PyMem_Malloc(sizeof(size_t) * ncolumns)) ||
+        !(lens = PyMem_Malloc(sizeof(int32_t) * ncolumns)) ||
+        !(values = PyMem_Calloc(ncolumns, sizeof(char*))) ||
+        !(masks = PyMem_Calloc(ncolumns, sizeof(bool*)))) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    if (PyObject_GetBuffer(pybuffer, &view, PyBUF_CONTIG_RO)) {
+        goto error;
+    }
+    have_view = true;
+
+    if (read_header(view.buf, view.len, &cursor, &flags)) {
+        goto error;
+    }
+    first_row = cursor;
+
+    if ((!row_input &&
+         allocate_pivot_index(&row_index, starting_pivot_capacity / 2)) ||
+        (!column_input &&
+         allocate_pivot_index(&column_index, starting_pivot_capacity / 2))) {
+        goto error;
+    }
+
+    if (!row_input || !column_input) {
+        /* the first pass collects the distinct keys */
+        while (!(status = next_row(view.buf,
+                                   view.len,
+                                   &cursor,
+                                   flags,
+                                   ncolumns,
+                                   row++,
+                                   offsets,
+                                   lens))) {
+            int64_t key;
+
+            if (lens[row_ix] == -1 || lens[column_ix] == -1) {
+                continue;
+            }
+            if (!row_input &&
+                (read_int_key(row_typeid,
+                              (char*) view.buf + offsets[row_ix],
+                              lens[row_ix],
+                              &key) ||
+                 pivot_insert(&row_index, key) < 0)) {
+                goto error;
+            }
+            if (!column_input &&
+                (read_int_key(column_typeid,
+                              (char*) view.buf + offsets[column_ix],
+                              lens[column_ix],
+                              &key) ||
+                 pivot_insert(&column_index, key) < 0)) {
+                goto error;
+            }
+        }
+        if (status < 0) {
+            goto error;
+        }
+        cursor = first_row;
+        row = 0;
+    }
+
+    if (!(row_labels = pivot_axis(row_input, &row_index, "row")) ||
+        !(column_labels = pivot_axis(column_input,
+                                     &column_index,
+                                     "column"))) {
+        goto error;
+    }
+
+    if (unlikely(mul_overflow(row_index.count, column_index.count, &cells))) {
+        PyErr_SetString(PyExc_OverflowError, "pivot size would overflow");
+        goto error;
+    }
+    for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+        const warp_prism_type* type = decoder->column_types[n];
+        size_t nbytes;
+
+        if (n == row_ix || n == column_ix) {
+            continue;
+        }
+        if (unlikely(mul_overflow(cells, type->size, &nbytes))) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "allocation size would overflow");
+            goto error;
+        }
+        /* the masks start as all missing and numeric cells as 0 */
+        if (!(values[n] = calloc_nonempty(nbytes, 1)) ||
+            !(masks[n] = calloc_nonempty(cells, sizeof(bool)))) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        if (decoder->column_typeids[n] == TYPEID_DATETIME ||
+            decoder->column_typeids[n] == TYPEID_DATE) {
+            for (size_t cell = 0; cell < cells; ++cell) {
+                datetime_write_null(&values[n][cell * type->size],
+                                    type->size);
+            }
+        }
+    }
+
+    while (!(status = next_row(view.buf,
+                               view.len,
+                               &cursor,
+                               flags,
+                               ncolumns,
+                               row++,
+                               offsets,
+                               lens))) {
+        int64_t row_value;
+        int64_t column_value;
+        size_t row_position;
+        size_t column_position;
+        size_t cell;
+
+        if (lens[row_ix] == -1 || lens[column_ix] == -1) {
+            ++dropped_rows;
+            continue;
+        }
+        if (read_int_key(row_typeid,
+                         (char*) view.buf + offsets[row_ix],
+                         lens[row_ix],
+                         &row_value) ||
+            read_int_key(column_typeid,
+                         (char*) view.buf + offsets[column_ix],
+                         lens[column_ix],
+                         &column_value)) {
+            goto error;
+        }
+        if (!pivot_lookup(&row_index, row_value, &row_position) ||
+            !pivot_lookup(&column_index, column_value, &column_position)) {
+            ++dropped_rows;
+            continue;
+        }
+
+        /* a later row for the same keys replaces the cell */
+        cell = row_position * column_index.count + column_position;
+        for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+            uint8_t value_typeid = decoder->column_typeids[n];
+            const warp_prism_type* type = decoder->column_types[n];
+            char* column_buffer;
+
+            if (n == row_ix || n == column_ix) {
+                continue;
+            }
+            column_buffer = &values[n][cell * type->size];
+            if (!(masks[n][cell] = (lens[n] != -1))) {
+                if (write_null_field(value_typeid, type, column_buffer)) {
+                    goto error;
+                }
+                continue;
+            }
+            if (parse_field(value_typeid,
+                            type,
+                            NULL,
+                            column_buffer,
+                            (char*) view.buf + offsets[n],
+                            offsets[n],
+                            lens[n])) {
+                goto error;
+            }
+        }
+    }
+    if (status < 0) {
+        goto error;
+    }
+    --row;
+
+    if (pystats != Py_None &&
+        (set_stat(pystats, "rows", PyLong_FromSize_t(row)) ||
+         set_stat(pystats, "dropped_rows", PyLong_FromSize_t(dropped_rows)) ||
+         set_stat(pystats, "input_bytes", PyLong_FromSsize_t(view.len)))) {
+        goto error;
+    }
+    PyBuffer_Release(&view);
+    have_view = false;
+
+    if (!(columns = PyTuple_New(ncolumns - 2))) {
+        goto error;
+    }
+    dims[0] = row_index.count;
+    dims[1] = column_index.count;
+    for (uint_fast16_t n = 0, ix = 0; n < ncolumns; ++n) {
+        PyObject* array;
+        PyObject* mask;
+        PyObject* pair;
+
+        if (n == row_ix || n == column_ix) {
+            continue;
+        }
+        Py_INCREF(decoder->column_types[n]->dtype);
+        if (!(array = owned_array(decoder->column_types[n]->dtype,
+                                  2,
+                                  dims,
+                                  &values[n]))) {
+            goto error;
+        }
+        if (!(mask = owned_array(PyArray_DescrFromType(NPY_BOOL),
+                                 2,
+                                 dims,
+                                 (char**) &masks[n]))) {
+            Py_DECREF(array);
+            goto error;
+        }
+        if (!(pair = Py_BuildValue("(NN)", array, mask))) {
+            goto error;
+        }
+        PyTuple_SET_ITEM(columns, ix++, pair);
+    }
+
+    out = Py_BuildValue("(OOO)", row_labels, column_labels, columns);
+
+error:
+    if (have_view) {
+        PyBuffer_Release(&view);
+    }
+    if (values) {
+        for (uint_fast16_t n = 0; n < ncolumns; ++n) {
+            PyMem_Free(values[n]);
+            PyMem_Free(masks[n]);
+        }
+    }
+    PyMem_Free(values);
+    PyMem_Free(masks);
+    PyMem_Free(offsets);
+    PyMem_Free(lens);
+    free_pivot_index(&row_index);
+    free_pivot_index(&column_index);
+    Py_XDECREF(row_input);
+    Py_XDECREF(column_input);
+    Py_XDECREF(row_labels);
+    Py_XDECREF(column_labels);
+    Py_XDECREF(columns);
+    Py_DECREF(decoder_ob);
+    return out;
+}
+
+/* Grouping
+
+   `raw_to_groupby` reads the rows and folds each one into the aggregates of
+   its group instead of writing it out, so the memory used scales with the
+   number of groups instead of the number of rows. */
+
+typedef enum {
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_MEAN,
+} agg_op;
+
+static const char* const agg_op_names[] = {
+    [AGG_COUNT] = "count",
+    [AGG_SUM] = "sum",
+    [AGG_MIN] = "min",
+    [AGG_MAX] = "max",
+    [AGG_MEAN] = "mean",
+};
+
+typedef union {
+    int64_t i;
+    double f;
+} agg_value;
+
+typedef struct {
+    uint16_t column;
+    uint8_t column_typeid;
+    agg_op op;
+    /* the values are accumulated as doubles instead of int64s */
+    bool float_state;
+    /* the words of the group record holding the number of non-NULL, non-NaN
+       values of the column and the sum, min, or max; aggregates of the same
+       column share these, and only the first one updates each */
+    size_t count_word;
+    size_t value_word;
+    bool owns_count;
+    bool owns_value;
+} group_aggregate;
+
+/* The most key columns, so the NULL keys of a group fit in one bitmask. */
+const Py_ssize_t max_group_keys = 64;
+
+/* A hash table from the keys of a row to its group, with linear probing. The
+   groups are numbered in the order they are first seen.
+
+   Each group has a record of `stride` words: its keys with NULLs as 0, a
+   bitmask of its non-NULL keys, then the counts and values of the
+   aggregates. Keeping these together means a row touches one record instead
+   of an array per aggregate. */
+typedef struct {
+    Py_ssize_t nkeys;
+    size_t stride;
+    /* the initial counts and values of a new group */
+    const int64_t* initial_state;
+    size_t state_words;
+    int64_t* records;
+    /* the groups with room in `records` */
+    size_t allocated;
+    /* the group in each slot; `SIZE_MAX` marks an empty slot */
+    size_t* slots;
+    /* always a power of 2 */
+    size_t capacity;
+    size_t count;
+} group_table;
+
+const size_t starting_group_capacity = 64;
+
+/* The rows read before their groups are looked up. */
+#define group_batch_size 32
+
+/* The types whose values can be summed and averaged. */
+static inline bool is_numeric(uint8_t column_typeid) {
+    return (column_typeid == TYPEID_INT16 ||
+            column_typeid == TYPEID_INT32 ||
+            column_typeid == TYPEID_INT64 ||
+            column_typeid == TYPEID_FLOAT32 ||
+            column_typeid == TYPEID_FLOAT64 ||
+            column_typeid == TYPEID_BOOL);
+}
+
+static inline bool is_float(uint8_t column_typeid) {
+    return (column_typeid == TYPEID_FLOAT32 ||
+            column_typeid == TYPEID_FLOAT64);
+}
+
+/* Parse a numeric, bool, datetime, or date field into an aggregate value.
+   Floats are widened to doubles and everything else to int64s. */
+static inline int read_agg_value(uint8_t column_typeid,
+                                 const char* const input_buffer,
+                                 size_t len,
+                                 agg_value* out) {
+    union {
+        bool b;
+        float f32;
+        double f64;
+    } cell;
+
+    switch (column_typeid) {
+    case TYPEID_FLOAT32:
+        if (parse_float32((char*) &cell, input_buffer, len)) {
+            return -1;
+        }
+        out->f = cell.f32;
+        return 0;
+    case TYPEID_FLOAT64:
+        if (parse_float64((char*) &cell, input_buffer, len)) {
+            return -1;
+        }
+        out->f = cell.f64;
+        return 0;
+    case TYPEID_BOOL:
+        if (parse_bool((char*) &cell, input_buffer, len)) {
+            return -1;
+        }
+        out->i = cell.b;
+        return 0;
+    default:
+        return read_int_key(column_typeid, input_buffer, len, &out->i);
+    }
+}
+
+/* Narrow an int64 to a cell of an integer, bool, datetime, or date
+   column. */
+static inline void write_int_value(uint8_t column_typeid,
+                                   char* column_buffer,
+                                   int64_t value) {
+    switch (column_typeid) {
+    case TYPEID_INT16:
+        *(int16_t*) column_buffer = value;
+        break;
+    case TYPEID_INT32:
+        *(int32_t*) column_buffer = value;
+        break;
+    case TYPEID_BOOL:
+        *(bool*) column_buffer = value;
+        break;
+    default:
+        *(int64_t*) column_buffer = value;
+    }
+}
+
+static inline bool add_int64_overflow(int64_t a, int64_t b, int64_t* out) {
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) {
+        return true;
+    }
+    *out = a + b;
+    return false;
+}
+
+/* Fold a value into the sum, min, or max of a group. */
+static inline int update_aggregate(const group_aggregate* agg,
+                                   agg_value* state,
+                                   agg_value value) {
+    if (agg->float_state && !is_float(agg->column_typeid)) {
+        value.f = value.i;
+    }
+
+    switch (agg->op) {
+    case AGG_SUM:
+    case AGG_MEAN:
+        if (agg->float_state) {
+            state->f += value.f;
+        }
+        else if (unlikely(add_int64_overflow(state->i, value.i, &state->i))) {
+            PyErr_SetString(PyExc_OverflowError, "sum would overflow");
+            return -1;
+        }
+        break;
+    case AGG_MIN:
+        if (agg->float_state ? value.f < state->f : value.i < state->i) {
+            *state = value;
+        }
+        break;
+    case AGG_MAX:
+        if (agg->float_state ? value.f > state->f : value.i > state->i) {
+            *state = value;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static inline uint64_t hash_group_keys(const int64_t* keys,
+                                       Py_ssize_t nkeys,
+                                       uint64_t key_mask) {
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t hash = key_mask * k;
+
+    for (Py_ssize_t n = 0; n < nkeys; ++n) {
+        hash = (hash ^ (uint64_t) keys[n]) * k;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static void free_group_table(group_table* table) {
+    PyMem_Free(table->records);
+    PyMem_Free(table->slots);
+}
+
+/* Grow the records to hold `allocated` groups. */
+static int grow_group_records(group_table* table, size_t allocated) {
+    size_t words;
+    int64_t* records;
+
+    if (unlikely(mul_overflow(allocated, table->stride, &words)) ||
+        unlikely(words > PY_SSIZE_T_MAX / sizeof(int64_t)) ||
+        !(records = PyMem_Realloc(table->records,
+                                  words * sizeof(int64_t)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    table->records = records;
+    table->allocated = allocated;
+    return 0;
+}
+
+/* Resize the slots to `capacity` and reinsert the groups. */
+static int rehash_groups(group_table* table, size_t capacity) {
+    size_t* slots;
+
+    if (unlikely(capacity > PY_SSIZE_T_MAX / sizeof(size_t)) ||
+        !(slots = PyMem_Malloc(capacity * sizeof(size_t)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(slots, 0xff, capacity * sizeof(size_t));
+    for (size_t group = 0; group < table->count; ++group) {
+        const int64_t* record = &table->records[group * table->stride];
+        size_t slot = hash_group_keys(record,
+                                      table->nkeys,
+                                      record[table->nkeys]) & (capacity - 1);
+
+        while (slots[slot] != SIZE_MAX) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = group;
+    }
+    PyMem_Free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 0;
+}
+
+/* Find the record of a row's group, adding it if it is new. Returns NULL on
+   error. The records move when the table grows so a record is only valid
+   until the next call. */
+static inline int64_t* find_group(group_table* table,
+                                  const int64_t* keys,
+                                  uint64_t key_mask,
+                                  uint64_t hash) {
+    size_t slot;
+    size_t group;
+    int64_t* record;
+
+    for (slot = hash & (table->capacity - 1);
+         (group = table->slots[slot]) != SIZE_MAX;
+         slot = (slot + 1) & (table->capacity - 1)) {
+        record = &table->records[group * table->stride];
+        if ((uint64_t) record[table->nkeys] == key_mask &&
+            !memcmp(record, keys, table->nkeys * sizeof(int64_t))) {
+            return record;
+        }
+    }
+
+    if (table->count == table->allocated &&
+        grow_group_records(table, table->allocated * 2)) {
+        return NULL;
+    }
+    group = table->count++;
+    table->slots[slot] = group;
+    record = &table->records[group * table->stride];
+    memcpy(record, keys, table->nkeys * sizeof(int64_t));
+    record[table->nkeys] = key_mask;
+    memcpy(&record[1 + table->nkeys],
+           table->initial_state,
+           table->state_words * sizeof(int64_t));
+
+    /* keep the table at most half full */
+    if (table->count > table->capacity / 2 &&
+        rehash_groups(table, table->capacity * 2)) {
+        return NULL;
+    }
+    return record;
+}
+
+/* Read the `(column, op)` pairs passed as `aggregations` to
+   `raw_to_groupby` and lay out their state in the group records. Returns a
+   new array of aggregates or NULL on error. */
+static group_aggregate* read_aggregations(PyObject* pyaggs,
+                                          const warp_prism_decoder* decoder,
+                                          Py_ssize_t nkeys,
+                                          int64_t* initial_state,
+                                          size_t* state_words) {
+    Py_ssize_t naggs = PyTuple_GET_SIZE(pyaggs);
+    group_aggregate* aggs;
+    size_t words = 0;
+
+    if (!(aggs = calloc_nonempty(naggs, sizeof(group_aggregate)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t n = 0; n < naggs; ++n) {
+        group_aggregate* agg = &aggs[n];
+        Py_ssize_t column;
+        const char* op;
+        bool found = false;
+
+        if (!PyArg_ParseTuple(PyTuple_GET_ITEM(pyaggs, n),
+                              "ns;aggregations must be (column, op) pairs",
+                              &column,
+                              &op)) {
+            goto error;
+        }
+        if (column < 0 || column >= decoder->ncolumns) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid aggregation column: %zd",
+                         column);
+            goto error;
+        }
+        agg->column = column;
+        agg->column_typeid = decoder->column_typeids[column];
+        for (size_t ix = 0; ix < sizeof(agg_op_names) / sizeof(char*); ++ix) {
+            if (!strcmp(op, agg_op_names[ix])) {
+                agg->op = ix;
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            PyErr_Format(PyExc_ValueError, "unknown aggregation: %s", op);
+            goto error;
+        }
+
+        if (agg->op != AGG_COUNT &&
+            !(is_numeric(agg->column_typeid) ||
+              ((agg->op == AGG_MIN || agg->op == AGG_MAX) &&
+               is_int_key(agg->column_typeid)))) {
+            PyErr_Format(PyExc_TypeError,
+                         "cannot take the %s of column %zd",
+                         op,
+                         column);
+            goto error;
+        }
+        agg->float_state = (agg->op == AGG_MEAN ||
+                            is_float(agg->column_typeid));
+
+        agg->owns_count = true;
+        agg->owns_value = agg->op != AGG_COUNT;
+        for (Py_ssize_t prev = 0; prev < n; ++prev) {
+            const group_aggregate* other = &aggs[prev];
+            bool same_value = (agg->op == other->op ||
+                               (agg->op == AGG_SUM && other->op == AGG_MEAN) ||
+                               (agg->op == AGG_MEAN && other->op == AGG_SUM));
+
+            if (other->column != agg->column) {
+                continue;
+            }
+            if (agg->owns_count) {
+                agg->owns_count = false;
+                agg->count_word = other->count_word;
+            }
+            if (agg->owns_value &&
+                other->owns_value &&
+                same_value &&
+                other->float_state == agg->float_state) {
+                agg->owns_value = false;
+                agg->value_word = other->value_word;
+            }
+        }
+
+        if (agg->owns_count) {
+            agg->count_word = 1 + nkeys + words;
+            initial_state[words++] = 0;
+        }
+        if (agg->owns_value) {
+            agg_value* initial = (agg_value*) &initial_state[words];
+
+            agg->value_word = 1 + nkeys + words++;
+            if (agg->op == AGG_MIN) {
+                if (agg->float_state) {
+                    initial->f = INFINITY;
+                }
+                else {
+                    initial->i = INT64_MAX;
+                }
+            }
+            else if (agg->op == AGG_MAX) {
+                if (agg->float_state) {
+                    initial->f = -INFINITY;
+                }
+                else {
+                    initial->i = INT64_MIN;
+                }
+            }
+            else if (agg->float_state) {
+                initial->f = 0;
+            }
+            else {
+                initial->i = 0;
+            }
+        }
+    }
+    *state_words = words;
+    return aggs;
+
+error:
+    PyMem_Free(aggs);
+    return NULL;
+}
+
+/* An output column of `raw_to_groupby`. */
+typedef struct {
+    PyArray_Descr* dtype;
+    char* values;
+    bool* mask;
+} group_output;
+
+/* Write one group's key or aggregate into an output column. */
+static inline void write_group_output(const group_table* table,
+                                      const warp_prism_decoder* decoder,
+                                      const uint16_t* key_columns,
+                                      const group_aggregate* aggs,
+                                      Py_ssize_t ix,
+                                      size_t group,
+                                      group_output* output) {
+    const int64_t* record = &table->records[group * table->stride];
+    char* cell = &output->values[group * output->dtype->elsize];
+    const group_aggregate* agg;
+    agg_value value;
+    int64_t count;
+
+    if (ix < table->nkeys) {
+        uint16_t column = key_columns[ix];
+
+        if ((output->mask[group] = (record[table->nkeys] >> ix) & 1)) {
+            write_int_value(decoder->column_typeids[column], cell, record[ix]);
+        }
+        else {
+            write_null_field(decoder->column_typeids[column],
+                             decoder->column_types[column],
+                             cell);
+        }
+        return;
+    }
+
+    agg = &aggs[ix - table->nkeys];
+    count = record[agg->count_word];
+    value = *(const agg_value*) &record[agg->value_word];
+    output->mask[group] = agg->op == AGG_COUNT || count;
+    switch (agg->op) {
+    case AGG_COUNT:
+        *(int64_t*) cell = count;
+        return;
+    case AGG_SUM:
+        *(int64_t*) cell = value.i;
+        return;
+    case AGG_MEAN:
+        *(double*) cell = count ? value.f / count : NAN;
+        return;
+    default:
+        break;
+    }
+
+    if (!count) {
+        write_null_field(agg->column_typeid,
+                         decoder->column_types[agg->column],
+                         cell);
+    }
+    else if (agg->column_typeid == TYPEID_FLOAT32) {
+        *(float*) cell = value.f;
+    }
+    else if (agg->column_typeid == TYPEID_FLOAT64) {
+        *(double*) cell = value.f;
+    }
+    else {
+        write_int_value(agg->column_typeid, cell, value.i);
+    }
+}
+
+/* Build the `(keys, aggregates)` tuples of `(values, mask)` pairs from the
+   group records in one pass. */
+static PyObject* group_outputs(const group_table* table,
+                               const warp_prism_decoder* decoder,
+                               const uint16_t* key_columns,
+                               const group_aggregate* aggs,
+                               Py_ssize_t naggs) {
+    Py_ssize_t noutputs = table->nkeys + naggs;
+    npy_intp dims = table->count;
+    group_output* outputs;
+    PyObject* out_keys = NULL;
+    PyObject* out_aggs = NULL;
+    PyObject* out = NULL;
+
+    if (!(outputs = calloc_nonempty(noutputs, sizeof(group_output)))) {
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t ix = 0; ix < noutputs; ++ix) {
+        group_output* output = &outputs[ix];
+
+        if (ix < table->nkeys) {
+            output->dtype =
+                decoder->column_types[key_columns[ix]]->dtype;
+            Py_INCREF(output->dtype);
+        }
+        else {
+            const group_aggregate* agg = &aggs[ix - table->nkeys];
+
+            switch (agg->op) {
+            case AGG_COUNT:
+                output->dtype = PyArray_DescrFromType(NPY_INT64);
+                break;
+            case AGG_SUM:
+                output->dtype = PyArray_DescrFromType(agg->float_state ?
+                                                      NPY_FLOAT64 :
+                                                      NPY_INT64);
+                break;
+            case AGG_MEAN:
+                output->dtype = PyArray_DescrFromType(NPY_FLOAT64);
+                break;
+            default:
+                output->dtype = decoder->column_types[agg->column]->dtype;
+                Py_INCREF(output->dtype);
+            }
+        }
+        if (!(output->values = malloc_nonempty(dims *
+                                               output->dtype->elsize)) ||
+            !(output->mask = malloc_nonempty(dims))) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    for (size_t group = 0; group < table->count; ++group) {
+        for (Py_ssize_t ix = 0; ix < noutputs; ++ix) {
+            write_group_output(table,
+                               decoder,
+                               key_columns,
+                               aggs,
+                               ix,
+                               group,
+                               &outputs[ix]);
+        }
+    }
+
+    if (!(out_keys = PyTuple_New(table->nkeys)) ||
+        !(out_aggs = PyTuple_New(naggs))) {
+        goto error;
+    }
+    for (Py_ssize_t ix = 0; ix < noutputs; ++ix) {
+        group_output* output = &outputs[ix];
+        PyObject* array;
+        PyObject* mask;
+        PyObject* pair;
+
+        array = owned_array(output->dtype, 1, &dims, &output->values);
+        /* the dtype reference was stolen */
+        output->dtype = NULL;
+        if (!array) {
+            goto error;
+        }
+        if (!(mask = owned_array(PyArray_DescrFromType(NPY_BOOL),
+                                 1,
+                                 &dims,
+                                 (char**) &output->mask))) {
+            Py_DECREF(array);
+            goto error;
+        }
+        if (!(pair = Py_BuildValue("(NN)", array, mask))) {
+            goto error;
+        }
+        if (ix < table->nkeys) {
+            PyTuple_SET_ITEM(out_keys, ix, pair);
+        }
+        else {
+            PyTuple_SET_ITEM(out_aggs, ix - table->nkeys, pair);
         }
     }
-    *written_rows = row_count;
-    return 0;
-}
-
-typedef struct {
-    char* buffer;
-    const warp_prism_type* type;
-    size_t rowcount;
-} capsule_contents;
 
-static void free_acapsule(PyObject* capsule) {
-    capsule_contents* c = PyCapsule_GetPointer(capsule, NULL);
+    out = Py_BuildValue("(OO)", out_keys, out_aggs);
 
-    if (c) {
-        c->type->free(c->buffer, c->rowcount);
-        PyMem_Free(c);
+error:
+    for (Py_ssize_t ix = 0; ix < noutputs; ++ix) {
+        Py_XDECREF(outputs[ix].dtype);
+        PyMem_Free(outputs[ix].values);
+        PyMem_Free(outputs[ix].mask);
     }
+    PyMem_Free(outputs);
+    Py_XDECREF(out_keys);
+    Py_XDECREF(out_aggs);
+    return out;
 }
 
-static void free_mcapsule(PyObject* capsule) {
-    PyMem_Free(PyCapsule_GetPointer(capsule, NULL));
-}
-
-static PyObject* warp_prism_to_arrays(PyObject* self __attribute__((unused)),
-                                      PyObject* args) {
+static PyObject* warp_prism_to_groupby(PyObject* self __attribute__((unused)),
+                                       PyObject* args,
+                                       PyObject* kwargs) {
+    static char* keywords[] = {
+        "buffer",
+        "type_ids",
+        "keys",
+        "aggregations",
+        "stats",
+        NULL,
+    };
+    PyObject* pybuffer;
     Py_buffer view;
+    bool have_view = false;
     PyObject* pytypeids;
-    Py_ssize_t ncolumns;
-    const warp_prism_type** types = NULL;
-    char** outarrays = NULL;
-    bool** outmasks = NULL;;
-    Py_ssize_t n;
-    size_t written_rows;
-    PyObject* out;
-
-    if (PyTuple_GET_SIZE(args) != 2) {
-        PyErr_SetString(PyExc_TypeError,
-                        "expected exactly 2 arguments (buffer, type_ids)");
+    PyObject* pykeys;
+    PyObject* pyaggs;
+    PyObject* pystats = Py_None;
+    PyObject* decoder_ob;
+    const warp_prism_decoder* decoder;
+    uint16_t ncolumns;
+    Py_ssize_t nkeys;
+    Py_ssize_t naggs;
+    uint16_t* key_columns = NULL;
+    group_aggregate* aggs = NULL;
+    int64_t* initial_state = NULL;
+    group_table table = {0};
+    /* the fields and keys of a batch of rows */
+    size_t* offsets = NULL;
+    int32_t* lens = NULL;
+    int64_t* keys = NULL;
+    uint64_t key_masks[group_batch_size];
+    uint64_t hashes[group_batch_size];
+    size_t batch_rows;
+    size_t cursor;
+    uint32_t flags;
+    size_t row = 0;
+    PyObject* out = NULL;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "OOO!O!|$O:raw_to_groupby",
+                                     keywords,
+                                     &pybuffer,
+                                     &pytypeids,
+                                     &PyTuple_Type,
+                                     &pykeys,
+                                     &PyTuple_Type,
+                                     &pyaggs,
+                                     &pystats)) {
         return NULL;
     }
 
-    pytypeids = PyTuple_GET_ITEM(args, 1);
-
     if (!PyTuple_Check(pytypeids)) {
         PyErr_SetString(PyExc_TypeError, "type_ids must be a tuple");
         return NULL;
     }
-    ncolumns = PyTuple_GET_SIZE(pytypeids);
-    if (ncolumns > UINT16_MAX) {
-        PyErr_SetString(PyExc_ValueError, "column count must fit in uint16_t");
+
+    if (pystats != Py_None && !PyDict_Check(pystats)) {
+        PyErr_SetString(PyExc_TypeError, "stats must be a dict or None");
         return NULL;
     }
 
-    if (!(outarrays = PyMem_Malloc(sizeof(char*) * ncolumns))) {
-        goto free_arrays;
-    }
-    if (!(outmasks = PyMem_Malloc(sizeof(bool*) * ncolumns))) {
-        goto free_arrays;
+    if (!(decoder_ob = get_decoder(pytypeids))) {
+        return NULL;
     }
-    if (!(types = PyMem_Malloc(sizeof(warp_prism_type*) * ncolumns))) {
-        goto free_arrays;
+    decoder = PyCapsule_GetPointer(decoder_ob, NULL);
+    ncolumns = decoder->ncolumns;
+    nkeys = PyTuple_GET_SIZE(pykeys);
+    naggs = PyTuple_GET_SIZE(pyaggs);
+
+    if (nkeys > max_group_keys) {
+        PyErr_Format(PyExc_ValueError,
+                     "at most %zd group keys are supported",
+                     max_group_keys);
+        goto error;
     }
 
-    for (n = 0; n < ncolumns; ++n) {
-        unsigned long id_ix;
+    /* each aggregate needs at most two words of state */
+    if (!(key_columns = malloc_nonempty(sizeof(uint16_t) * nkeys)) ||
+        !(initial_state = malloc_nonempty(sizeof(int64_t) * 2 * naggs)) ||
+        !(keys = calloc_nonempty(group_batch_size * nkeys,
+                                 sizeof(int64_t))) ||
+        !(offsets = malloc_nonempty(sizeof(size_t) *
+                                    group_batch_size *
+                                    ncolumns)) ||
+        !(lens = malloc_nonempty(sizeof(int32_t) *
+                                 group_batch_size *
+                                 ncolumns))) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (Py_ssize_t n = 0; n < nkeys; ++n) {
+        Py_ssize_t column = PyLong_AsSsize_t(PyTuple_GET_ITEM(pykeys, n));
 
-        id_ix = PyLong_AsUnsignedLong(PyTuple_GET_ITEM(pytypeids, n));
-        if (PyErr_Occurred() || id_ix > max_typeid) {
-            goto free_arrays;
+        if (column == -1 && PyErr_Occurred()) {
+            goto error;
         }
-
-        types[n] = typeids[id_ix];
-
+        if (column < 0 || column >= ncolumns) {
+            PyErr_Format(PyExc_ValueError, "invalid key column: %zd", column);
+            goto error;
+        }
+        if (!is_int_key(decoder->column_typeids[column])) {
+            PyErr_SetString(PyExc_TypeError,
+                            "group keys must be integer, datetime, or date"
+                            " columns");
+            goto error;
+        }
+        key_columns[n] = column;
+    }
+    if (!(aggs = read_aggregations(pyaggs,
+                                   decoder,
+                                   nkeys,
+                                   initial_state,
+                                   &table.state_words))) {
+        goto error;
     }
 
-    if (!(out = PyTuple_New(ncolumns))) {
-        goto free_arrays;
+    table.nkeys = nkeys;
+    table.stride = 1 + nkeys + table.state_words;
+    table.initial_state = initial_state;
+    if (grow_group_records(&table, starting_group_capacity / 2) ||
+        rehash_groups(&table, starting_group_capacity)) {
+        goto error;
     }
 
-    if (PyObject_GetBuffer(PyTuple_GET_ITEM(args, 0),
-                           &view,
-                           PyBUF_CONTIG_RO)) {
-        return NULL;
+    if (PyObject_GetBuffer(pybuffer, &view, PyBUF_CONTIG_RO)) {
+        goto error;
     }
+    have_view = true;
 
-    if (warp_prism_read_binary_results(view.buf,
-                                       view.len,
-                                       ncolumns,
-                                       types,
-                                       &written_rows,
-                                       outarrays,
-                                       outmasks)) {
-        PyBuffer_Release(&view);
-        goto free_arrays;
+    if (read_header(view.buf, view.len, &cursor, &flags)) {
+        goto error;
     }
-    PyBuffer_Release(&view);
 
-    for (n = 0;n < ncolumns; ++n) {
-        capsule_contents* ac;
-        PyObject* acapsule;
-        PyObject* mcapsule;
-        PyObject* andaray;
-        PyObject* mndarray;
-        PyObject* pair;
+    do {
+        int64_t* record = NULL;
+
+        /* Read a batch of rows, hashing their keys and prefetching their
+           slots, then prefetch their records before folding them into their
+           groups. This overlaps the cache misses of the rows when there are
+           many groups. */
+        for (batch_rows = 0; batch_rows < group_batch_size; ++batch_rows) {
+            size_t* row_offsets = &offsets[batch_rows * ncolumns];
+            int32_t* row_lens = &lens[batch_rows * ncolumns];
+            int64_t* row_keys = &keys[batch_rows * nkeys];
+            uint64_t key_mask = 0;
+
+            if ((status = next_row(view.buf,
+                                   view.len,
+                                   &cursor,
+                                   flags,
+                                   ncolumns,
+                                   row++,
+                                   row_offsets,
+                                   row_lens))) {
+                break;
+            }
+            for (Py_ssize_t n = 0; n < nkeys; ++n) {
+                uint16_t column = key_columns[n];
 
-        Py_INCREF(types[n]->dtype);
-        if (!(andaray = PyArray_NewFromDescr(&PyArray_Type,
-                                             types[n]->dtype,
-                                             1,
-                                             (npy_intp*) &written_rows,
-                                             NULL,
-                                             outarrays[n],
-                                             NPY_ARRAY_CARRAY,
-                                             NULL))) {
-            Py_DECREF(out);
-            goto clear_arrays;
+                row_keys[n] = 0;
+                if (row_lens[column] == -1) {
+                    continue;
+                }
+                if (read_int_key(decoder->column_typeids[column],
+                                 (char*) view.buf + row_offsets[column],
+                                 row_lens[column],
+                                 &row_keys[n])) {
+                    goto error;
+                }
+                key_mask |= (uint64_t) 1 << n;
+            }
+            key_masks[batch_rows] = key_mask;
+            hashes[batch_rows] = hash_group_keys(row_keys, nkeys, key_mask);
+            __builtin_prefetch(
+                &table.slots[hashes[batch_rows] & (table.capacity - 1)]);
         }
-
-        if (!(ac = PyMem_Malloc(sizeof(capsule_contents)))) {
-            Py_DECREF(andaray);
-            Py_DECREF(out);
-            goto clear_arrays;
+        if (status < 0) {
+            goto error;
         }
 
-        ac->buffer = outarrays[n];
-        ac->type = types[n];
-        ac->rowcount = written_rows;
+        for (size_t ix = 0; ix < batch_rows; ++ix) {
+            size_t group = table.slots[hashes[ix] & (table.capacity - 1)];
 
-        if (!(acapsule = PyCapsule_New(ac, NULL, free_acapsule))) {
-            PyMem_Free(ac);
-            Py_DECREF(andaray);
-            Py_DECREF(out);
-            goto clear_arrays;
+            if (group != SIZE_MAX) {
+                __builtin_prefetch(&table.records[group * table.stride], 1);
+            }
         }
 
-        if (PyArray_SetBaseObject((PyArrayObject*) andaray, acapsule)) {
-            Py_DECREF(acapsule);
-            Py_DECREF(andaray);
-            Py_DECREF(out);
-            goto clear_arrays;
-        }
+        for (size_t ix = 0; ix < batch_rows; ++ix) {
+            const size_t* row_offsets = &offsets[ix * ncolumns];
+            const int32_t* row_lens = &lens[ix * ncolumns];
+
+            /* results are often grouped or sorted by the keys, so a run of
+               rows in the same group skips the hash table */
+            if (!(record &&
+                  hashes[ix] == hashes[ix - 1] &&
+                  key_masks[ix] == key_masks[ix - 1] &&
+                  !memcmp(&keys[ix * nkeys],
+                          &keys[(ix - 1) * nkeys],
+                          nkeys * sizeof(int64_t))) &&
+                !(record = find_group(&table,
+                                      &keys[ix * nkeys],
+                                      key_masks[ix],
+                                      hashes[ix]))) {
+                goto error;
+            }
 
-        if (!(mndarray = PyArray_SimpleNewFromData(1,
-                                                   (npy_intp*) &written_rows,
-                                                   NPY_BOOL,
-                                                   outmasks[n]))) {
-            Py_DECREF(andaray);
-            Py_DECREF(out);
-            goto clear_arrays;
-        }
+            for (Py_ssize_t n = 0; n < naggs; ++n) {
+                const group_aggregate* agg = &aggs[n];
+                agg_value value;
 
-        if (!(mcapsule = PyCapsule_New(outmasks[n], NULL, free_mcapsule))) {
-            Py_DECREF(andaray);
-            Py_DECREF(mndarray);
-            Py_DECREF(out);
-            goto clear_arrays;
+                if ((!agg->owns_count && !agg->owns_value) ||
+                    row_lens[agg->column] == -1) {
+                    continue;
+                }
+                if (!is_numeric(agg->column_typeid) &&
+                    !is_int_key(agg->column_typeid)) {
+                    /* any non-NULL value counts */
+                    ++record[agg->count_word];
+                    continue;
+                }
+                if (read_agg_value(agg->column_typeid,
+                                   (char*) view.buf + row_offsets[agg->column],
+                                   row_lens[agg->column],
+                                   &value)) {
+                    goto error;
+                }
+                if (is_float(agg->column_typeid) && isnan(value.f)) {
+                    continue;
+                }
+                if (agg->owns_count) {
+                    ++record[agg->count_word];
+                }
+                if (agg->owns_value &&
+                    update_aggregate(agg,
+                                     (agg_value*) &record[agg->value_word],
+                                     value)) {
+                    goto error;
+                }
+            }
         }
+    } while (!status);
+    --row;
 
-        if (PyArray_SetBaseObject((PyArrayObject*) mndarray, mcapsule)) {
-            Py_DECREF(andaray);
-            Py_DECREF(mndarray);
-            Py_DECREF(mcapsule);
-            Py_DECREF(out);
-            goto clear_arrays;
-        }
+    if (pystats != Py_None &&
+        (set_stat(pystats, "rows", PyLong_FromSize_t(row)) ||
+         set_stat(pystats, "groups", PyLong_FromSize_t(table.count)) ||
+         set_stat(pystats, "input_bytes", PyLong_FromSsize_t(view.len)))) {
+        goto error;
+    }
+    PyBuffer_Release(&view);
+    have_view = false;
 
-        if (!(pair = PyTuple_New(2))) {
-            Py_DECREF(andaray);
-            Py_DECREF(mndarray);
-            Py_DECREF(out);
-            goto clear_arrays;
-        }
+    out = group_outputs(&table, decoder, key_columns, aggs, naggs);
 
-        PyTuple_SET_ITEM(pair, 0, andaray);
-        PyTuple_SET_ITEM(pair, 1, mndarray);
-        PyTuple_SET_ITEM(out, n, pair);
+error:
+    if (have_view) {
+        PyBuffer_Release(&view);
     }
-
+    free_group_table(&table);
+    PyMem_Free(aggs);
+    PyMem_Free(initial_state);
+    PyMem_Free(key_columns);
+    PyMem_Free(keys);
+    PyMem_Free(offsets);
+    PyMem_Free(lens);
+    Py_DECREF(decoder_ob);
     return out;
-
-clear_arrays:
-    free_outarrays(ncolumns, written_rows, types, outarrays, outmasks);
-free_arrays:
-    PyMem_Free(outarrays);
-    PyMem_Free(outmasks);
-    PyMem_Free(types);
-    return NULL;
 }
 
 PyObject* test_overflow_operations(PyObject* self __attribute__((unused))) {
@@ -914,9 +7958,231 @@ PyObject* test_overflow_operations(PyObject* self __attribute__((unused))) {
     Py_RETURN_NONE;
 }
 
+/* Create the strings for rows of a lazy text column. `source` is the column
+   returned by `raw_to_arrays`; its capsule holds the input buffer. `offsets`
+   and `mask` are the rows to materialize, which may be any subset of the
+   column. */
+static PyObject* warp_prism_materialize_text(PyObject* self
+                                             __attribute__((unused)),
+                                             PyObject* args) {
+    PyArrayObject* source;
+    PyArrayObject* offsets_ob;
+    PyArrayObject* mask_ob;
+    PyObject* base;
+    capsule_contents* contents;
+    Py_buffer view;
+    npy_intp rowcount;
+    PyArrayObject* out;
+    PyObject** values;
+    const int64_t* offsets;
+    const bool* mask;
+
+    if (!PyArg_ParseTuple(args,
+                          "O!O&O&:materialize_text",
+                          &PyArray_Type,
+                          &source,
+                          PyArray_Converter,
+                          &offsets_ob,
+                          PyArray_Converter,
+                          &mask_ob)) {
+        return NULL;
+    }
+
+    base = PyArray_BASE(source);
+    if (!base ||
+        !PyCapsule_CheckExact(base) ||
+        PyCapsule_GetDestructor(base) != free_acapsule ||
+        !(contents = PyCapsule_GetPointer(base, NULL))->owner) {
+        PyErr_SetString(PyExc_TypeError,
+                        "source must be a lazy text column returned by"
+                        " raw_to_arrays");
+        goto error;
+    }
+
+    if (PyArray_NDIM(offsets_ob) != 1 ||
+        PyArray_TYPE(offsets_ob) != NPY_INT64 ||
+        PyArray_NDIM(mask_ob) != 1 ||
+        PyArray_TYPE(mask_ob) != NPY_BOOL ||
+        PyArray_DIM(offsets_ob, 0) != PyArray_DIM(mask_ob, 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "offsets and mask must be 1d int64 and bool arrays"
+                        " of the same length");
+        goto error;
+    }
+
+    /* walk the rows in order without caring about the input strides */
+    Py_SETREF(offsets_ob,
+              (PyArrayObject*) PyArray_GETCONTIGUOUS(offsets_ob));
+    Py_SETREF(mask_ob, (PyArrayObject*) PyArray_GETCONTIGUOUS(mask_ob));
+    if (!offsets_ob || !mask_ob) {
+        goto error;
+    }
+
+    if (PyObject_GetBuffer(contents->owner, &view, PyBUF_CONTIG_RO)) {
+        goto error;
+    }
+
+    rowcount = PyArray_DIM(offsets_ob, 0);
+    if (!(out = (PyArrayObject*) PyArray_SimpleNew(1, &rowcount, NPY_OBJECT))) {
+        PyBuffer_Release(&view);
+        goto error;
+    }
+
+    values = PyArray_DATA(out);
+    offsets = PyArray_DATA(offsets_ob);
+    mask = PyArray_DATA(mask_ob);
+    for (npy_intp n = 0; n < rowcount; ++n) {
+        int64_t offset = offsets[n];
+        uint32_t len;
+
+        if (!mask[n]) {
+            Py_INCREF(Py_None);
+            values[n] = Py_None;
+            continue;
+        }
+
+        if (offset < (int64_t) sizeof(uint32_t) || offset > view.len) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid lazy text offset: %lld",
+                         (long long) offset);
+            goto error_release;
+        }
+        len = read32(&((const char*) view.buf)[offset - sizeof(uint32_t)]);
+        if (len > (uint64_t) (view.len - offset)) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid lazy text offset: %lld",
+                         (long long) offset);
+            goto error_release;
+        }
+
+        if (!(values[n] = new_text(&((const char*) view.buf)[offset], len))) {
+            goto error_release;
+        }
+    }
+
+    PyBuffer_Release(&view);
+    Py_DECREF(offsets_ob);
+    Py_DECREF(mask_ob);
+    return (PyObject*) out;
+
+error_release:
+    PyBuffer_Release(&view);
+    /* the cells which were not written are still zeroed */
+    Py_DECREF(out);
+error:
+    Py_XDECREF(offsets_ob);
+    Py_XDECREF(mask_ob);
+    return NULL;
+}
+
+/* Return the (wall, cpu) clocks used to time the phases of `raw_to_arrays`
+   so that callers can time their own phases on the same clocks. */
+static PyObject* warp_prism_clock(PyObject* self __attribute__((unused))) {
+    warp_prism_time t;
+
+    get_time(&t);
+    return Py_BuildValue("(dd)", t.wall, t.cpu);
+}
+
+static PyObject* warp_prism_simd_level(PyObject* self __attribute__((unused))) {
+    return PyUnicode_FromString(simd_level_names[active_simd_level]);
+}
+
+static PyObject* warp_prism_set_simd_level(PyObject* self
+                                           __attribute__((unused)),
+                                           PyObject* level_ob) {
+    const char* name;
+
+    if (!(name = PyUnicode_AsUTF8(level_ob))) {
+        return NULL;
+    }
+
+    for (size_t level = 0; level < simd_level_count; ++level) {
+        if (strcmp(name, simd_level_names[level])) {
+            continue;
+        }
+
+        if (level > supported_simd_level()) {
+            PyErr_Format(PyExc_ValueError,
+                         "simd level %s is not supported on this machine",
+                         name);
+            return NULL;
+        }
+
+        select_gather_kernels(level);
+        Py_RETURN_NONE;
+    }
+
+    PyErr_Format(PyExc_ValueError, "unknown simd level: %R", level_ob);
+    return NULL;
+}
+
+static PyObject* warp_prism_sort_threads(PyObject* self
+                                         __attribute__((unused))) {
+    return PyLong_FromSize_t(sort_thread_limit);
+}
+
+/* Set the most threads used to sort the rows, or 0 for one per CPU. */
+static PyObject* warp_prism_set_sort_threads(PyObject* self
+                                             __attribute__((unused)),
+                                             PyObject* nthreads_ob) {
+    Py_ssize_t nthreads = PyLong_AsSsize_t(nthreads_ob);
+
+    if (nthreads == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (nthreads < 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "sort threads must be non-negative: %zd",
+                     nthreads);
+        return NULL;
+    }
+    sort_thread_limit = nthreads;
+    Py_RETURN_NONE;
+}
+
 PyMethodDef methods[] = {
-    {"raw_to_arrays", (PyCFunction) warp_prism_to_arrays, METH_VARARGS, NULL},
+    {"raw_to_arrays",
+     (PyCFunction) warp_prism_to_arrays,
+     METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"count_rows", (PyCFunction) warp_prism_count_rows, METH_VARARGS, NULL},
+    {"new_sampler",
+     (PyCFunction) warp_prism_new_sampler,
+     METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"sampler_write",
+     (PyCFunction) warp_prism_sampler_write,
+     METH_VARARGS,
+     NULL},
+    {"sampler_result",
+     (PyCFunction) warp_prism_sampler_result,
+     METH_O,
+     NULL},
+    {"raw_to_pivot",
+     (PyCFunction) warp_prism_to_pivot,
+     METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"raw_to_groupby",
+     (PyCFunction) warp_prism_to_groupby,
+     METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"clock", (PyCFunction) warp_prism_clock, METH_NOARGS, NULL},
+    {"materialize_text",
+     (PyCFunction) warp_prism_materialize_text,
+     METH_VARARGS,
+     NULL},
     {"test_overflow_operations", (PyCFunction) test_overflow_operations, METH_NOARGS, NULL},
+    {"simd_level", (PyCFunction) warp_prism_simd_level, METH_NOARGS, NULL},
+    {"set_simd_level", (PyCFunction) warp_prism_set_simd_level, METH_O, NULL},
+    {"sort_threads",
+     (PyCFunction) warp_prism_sort_threads,
+     METH_NOARGS,
+     NULL},
+    {"set_sort_threads",
+     (PyCFunction) warp_prism_set_sort_threads,
+     METH_O,
+     NULL},
     {NULL},
 };
 
@@ -935,23 +8201,58 @@ static struct PyModuleDef _warp_prism_module = {
 PyMODINIT_FUNC PyInit__warp_prism(void) {
     PyObject* m;
     PyObject* typeid_map;
+    PyObject* text_typeid_map;
     PyObject* signature_ob;
 
     /* This is needed to setup the numpy C-API. */
     import_array();
 
+    select_gather_kernels(supported_simd_level());
+
+    if (!decoder_cache && !(decoder_cache = PyDict_New())) {
+        return NULL;
+    }
+
     if (!(typeid_map = PyDict_New())) {
         return NULL;
     }
+    if (!(text_typeid_map = PyDict_New())) {
+        Py_DECREF(typeid_map);
+        return NULL;
+    }
 
     for (size_t n = 0; n < max_typeid; ++n) {
         PyObject* dtype_name_ob;
         PyObject* n_ob;
         int err;
 
+        if (n == TYPEID_SPARSE) {
+            /* sparse columns use the dtype of their values */
+            continue;
+        }
+
+        if (is_parameterized(n)) {
+            /* the dtype is built per decoder once the width is known */
+            if (!(n_ob = PyLong_FromLong(n))) {
+                Py_DECREF(typeid_map);
+                Py_DECREF(text_typeid_map);
+                return NULL;
+            }
+            err = PyDict_SetItemString(text_typeid_map,
+                                       typeids[n]->dtype_name,
+                                       n_ob);
+            Py_DECREF(n_ob);
+            if (err) {
+                Py_DECREF(typeid_map);
+                Py_DECREF(text_typeid_map);
+                return NULL;
+            }
+            continue;
+        }
 
         if (!(dtype_name_ob = PyUnicode_FromString(typeids[n]->dtype_name))) {
             Py_DECREF(typeid_map);
+            Py_DECREF(text_typeid_map);
             return NULL;
         }
 
@@ -959,6 +8260,7 @@ PyMODINIT_FUNC PyInit__warp_prism(void) {
                                     (PyArray_Descr**) &typeids[n]->dtype)) {
             Py_DECREF(dtype_name_ob);
             Py_DECREF(typeid_map);
+            Py_DECREF(text_typeid_map);
             return NULL;
         }
 
@@ -966,25 +8268,46 @@ PyMODINIT_FUNC PyInit__warp_prism(void) {
         if (!(n_ob = PyLong_FromLong(n))) {
             Py_DECREF(dtype_name_ob);
             Py_DECREF(typeid_map);
+            Py_DECREF(text_typeid_map);
             return NULL;
         }
 
-        err = PyDict_SetItem(typeid_map, dtype_name_ob, n_ob);
+        if (n == TYPEID_LAZY_TEXT) {
+            /* the dtype name is shared with int64 */
+            err = PyDict_SetItemString(text_typeid_map, "lazy", n_ob);
+        }
+        else {
+            err = PyDict_SetItem(typeid_map, dtype_name_ob, n_ob);
+        }
         Py_DECREF(dtype_name_ob);
         Py_DECREF(n_ob);
         if (err) {
             Py_DECREF(typeid_map);
+            Py_DECREF(text_typeid_map);
             return NULL;
         }
     }
 
     if (!(m = PyModule_Create(&_warp_prism_module))) {
         Py_DECREF(typeid_map);
+        Py_DECREF(text_typeid_map);
         return NULL;
     }
 
     if (PyModule_AddObject(m, "typeid_map", typeid_map)) {
         Py_DECREF(typeid_map);
+        Py_DECREF(text_typeid_map);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    if (PyModule_AddObject(m, "text_typeid_map", text_typeid_map)) {
+        Py_DECREF(text_typeid_map);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    if (PyModule_AddIntConstant(m, "sparse_typeid", TYPEID_SPARSE)) {
         Py_DECREF(m);
         return NULL;
     }
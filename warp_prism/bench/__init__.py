@@ -0,0 +1,5 @@
+"""Benchmarks for warp_prism which do not need a running postgres server.
+"""
+from .copy_data import CopyData, generate_copy_data
+
+__all__ = ['CopyData', 'generate_copy_data']
@@ -0,0 +1,234 @@
+"""Deterministic synthetic postgres binary COPY data.
+"""
+from collections import namedtuple
+from string import ascii_letters, digits
+import struct
+
+import numpy as np
+
+from .._warp_prism import postgres_signature, typeid_map
+
+
+CopyData = namedtuple('CopyData', 'buffer type_ids columns')
+CopyData.__doc__ = """Generated binary COPY data.
+
+Attributes
+----------
+buffer : bytes
+    The binary COPY data.
+type_ids : tuple[int]
+    The type ids to pass to ``raw_to_arrays`` along with ``buffer``.
+columns : list[(np.ndarray, np.ndarray)]
+    The expected ``(values, mask)`` pair for each column. The values where the
+    mask is False are not specified.
+"""
+
+_header = postgres_signature + struct.pack('>ii', 0, 0)
+_end_marker = struct.pack('>h', -1)
+
+# the big-endian wire format of each fixed width column type
+_wire_dtypes = {
+    'int16': np.dtype('>i2'),
+    'int32': np.dtype('>i4'),
+    'int64': np.dtype('>i8'),
+    'float32': np.dtype('>f4'),
+    'float64': np.dtype('>f8'),
+    'bool': np.dtype('?'),
+    'datetime64[us]': np.dtype('>i8'),
+    'datetime64[D]': np.dtype('>i4'),
+}
+
+# postgres counts from 2000-01-01 instead of the unix epoch
+_epoch_offset = np.datetime64('2000-01-01') - np.datetime64('1970-01-01')
+
+_text_alphabet = np.frombuffer((ascii_letters + digits).encode(), np.uint8)
+
+
+def _scatter(buf, starts, values):
+    """Write one fixed width value at each of the given offsets.
+    """
+    width = values.dtype.itemsize
+    buf[starts[:, np.newaxis] + np.arange(width)] = (
+        values.view(np.uint8).reshape(-1, width)
+    )
+
+
+def _text_lengths(random_state, text_length, size):
+    if isinstance(text_length, int):
+        return np.full(size, text_length, dtype='int64')
+
+    low, high = text_length
+    return random_state.randint(low, high + 1, size=size).astype('int64')
+
+
+def _random_text(random_state, size):
+    return _text_alphabet[
+        random_state.randint(0, len(_text_alphabet), size=size)
+    ]
+
+
+def _text_values(random_state, text_length, text_cardinality, mask):
+    """Generate the lengths and the concatenated bytes of a text column.
+    """
+    if text_cardinality is None:
+        lengths = _text_lengths(random_state, text_length, len(mask))
+        lengths[~mask] = 0
+        return lengths, _random_text(random_state, lengths.sum())
+
+    pool_lengths = _text_lengths(random_state, text_length, text_cardinality)
+    pool_data = _random_text(random_state, pool_lengths.sum())
+    pool_starts = np.cumsum(pool_lengths) - pool_lengths
+
+    choices = random_state.randint(0, text_cardinality, size=len(mask))
+    lengths = pool_lengths[choices]
+    lengths[~mask] = 0
+    # the offset of each byte of text within its value
+    within = np.arange(lengths.sum()) - np.repeat(
+        np.cumsum(lengths) - lengths,
+        lengths,
+    )
+    indices = np.repeat(pool_starts[choices], lengths) + within
+    return lengths, pool_data[indices]
+
+
+def _fixed_width_values(random_state, dtype, size):
+    """Generate the wire values and the expected decoded values of a fixed
+    width column.
+    """
+    if dtype == 'bool':
+        wire = random_state.randint(0, 2, size=size).astype(bool)
+        return wire, wire
+
+    if dtype.startswith('float'):
+        wire = (random_state.standard_normal(size) * 1000).astype(
+            _wire_dtypes[dtype],
+        )
+        return wire, wire.astype(dtype)
+
+    if dtype == 'datetime64[us]':
+        # about 30 years of timestamps
+        wire = random_state.randint(
+            0,
+            30 * 365 * 24 * 60 * 60 * 10 ** 6,
+            size=size,
+            dtype='int64',
+        )
+    elif dtype == 'datetime64[D]':
+        wire = random_state.randint(0, 30 * 365, size=size, dtype='int64')
+    else:
+        info = np.iinfo(dtype)
+        wire = random_state.randint(info.min, info.max, size=size, dtype=dtype)
+
+    wire = wire.astype(_wire_dtypes[dtype])
+    if dtype.startswith('datetime64'):
+        return wire, wire.astype('int64').view(dtype) + _epoch_offset
+    return wire, wire.astype(dtype)
+
+
+def generate_copy_data(rowcount,
+                       dtypes,
+                       *,
+                       null_density=0.0,
+                       text_length=(0, 16),
+                       text_cardinality=None,
+                       seed=0):
+    """Generate deterministic postgres binary COPY data.
+
+    Parameters
+    ----------
+    rowcount : int
+        The number of rows to generate.
+    dtypes : iterable[str]
+        The type of each column. These are the keys of
+        ``warp_prism._warp_prism.typeid_map``.
+    null_density : float, optional
+        The probability that any given cell is NULL.
+    text_length : int or (int, int), optional
+        The length of the text values. This is either a fixed length or
+        the inclusive bounds of a uniform distribution.
+    text_cardinality : int, optional
+        The number of distinct values in each text column. By default every
+        value is drawn independently.
+    seed : int, optional
+        The seed for the random values.
+
+    Returns
+    -------
+    copy_data : CopyData
+        The generated data along with the expected decoded columns.
+    """
+    dtypes = tuple(dtypes)
+    try:
+        type_ids = tuple(typeid_map[dtype] for dtype in dtypes)
+    except KeyError as e:
+        raise ValueError('unknown column type: %r' % e.args[0])
+
+    random_state = np.random.RandomState(seed)
+    columns = []
+    cells = []
+    # each row is the field count followed by the cells
+    row_sizes = np.full(rowcount, 2, dtype='int64')
+    for dtype in dtypes:
+        mask = random_state.random_sample(rowcount) >= null_density
+
+        if dtype == 'object':
+            lengths, data = _text_values(
+                random_state,
+                text_length,
+                text_cardinality,
+                mask,
+            )
+            data_bytes = data.tobytes()
+            ends = np.cumsum(lengths)
+            values = np.empty(rowcount, dtype=object)
+            values[:] = [
+                data_bytes[end - length:end].decode('ascii') if valid else None
+                for end, length, valid in zip(
+                    ends.tolist(),
+                    lengths.tolist(),
+                    mask.tolist(),
+                )
+            ]
+            wire = (lengths, data)
+        else:
+            wire, values = _fixed_width_values(random_state, dtype, rowcount)
+            lengths = np.where(mask, wire.dtype.itemsize, 0)
+
+        row_sizes += 4 + lengths
+        columns.append((values, mask))
+        cells.append((wire, mask, lengths))
+
+    row_starts = np.empty(rowcount, dtype='int64')
+    row_starts[:1] = len(_header)
+    np.cumsum(row_sizes[:-1], out=row_starts[1:])
+    row_starts[1:] += len(_header)
+
+    buf = np.empty(
+        len(_header) + row_sizes.sum() + len(_end_marker),
+        dtype=np.uint8,
+    )
+    buf[:len(_header)] = np.frombuffer(_header, np.uint8)
+    buf[-len(_end_marker):] = np.frombuffer(_end_marker, np.uint8)
+    _scatter(buf, row_starts, np.full(rowcount, len(dtypes), dtype='>i2'))
+
+    cursor = row_starts + 2
+    for dtype, (wire, mask, lengths) in zip(dtypes, cells):
+        _scatter(buf, cursor, np.where(mask, lengths, -1).astype('>i4'))
+        cursor += 4
+
+        if dtype == 'object':
+            lengths, data = wire
+            starts = cursor[mask]
+            text_lengths = lengths[mask]
+            # the offset of each byte of text within its value
+            within = np.arange(len(data)) - np.repeat(
+                np.cumsum(text_lengths) - text_lengths,
+                text_lengths,
+            )
+            buf[np.repeat(starts, text_lengths) + within] = data
+        else:
+            _scatter(buf, cursor[mask], wire[mask])
+
+        cursor += lengths
+
+    return CopyData(buf.tobytes(), type_ids, columns)
@@ -0,0 +1,224 @@
+"""Time ``raw_to_arrays`` on generated binary COPY data.
+
+Usage: python -m warp_prism.bench.decode [options]
+"""
+import argparse
+
+import numpy as np
+
+from .._warp_prism import (
+    clock,
+    raw_to_arrays,
+    set_simd_level,
+    simd_level,
+    typeid_map,
+)
+from .copy_data import generate_copy_data
+
+
+def cpu_frequency():
+    """Read the cpu clock rate from ``/proc/cpuinfo``.
+
+    Returns
+    -------
+    hz : float
+        The fastest clock rate of any core, or nan if it cannot be read.
+    """
+    try:
+        with open('/proc/cpuinfo') as f:
+            mhz = [
+                float(line.split(':')[1])
+                for line in f
+                if line.startswith('cpu MHz')
+            ]
+    except (OSError, ValueError):
+        return np.nan
+
+    if not mhz:
+        return np.nan
+    return max(mhz) * 1e6
+
+
+def time_decode(copy_data, *, repeat=5, intern_text=False):
+    """Time decoding a generated buffer.
+
+    Parameters
+    ----------
+    copy_data : CopyData
+        The data to decode.
+    repeat : int, optional
+        The number of times to decode the data. The fastest run is reported.
+    intern_text : bool, optional
+        Decode the text columns with an intern table.
+
+    Returns
+    -------
+    wall_time, cpu_time : float
+        The seconds taken by the fastest run.
+    """
+    best = None
+    for _ in range(repeat):
+        start = clock()
+        raw_to_arrays(
+            copy_data.buffer,
+            copy_data.type_ids,
+            intern_text=intern_text,
+        )
+        stop = clock()
+        times = stop[0] - start[0], stop[1] - start[1]
+        if best is None or times[0] < best[0]:
+            best = times
+    return best
+
+
+def run(schemas,
+        rowcount,
+        *,
+        null_density=0.0,
+        text_length=(0, 16),
+        text_cardinality=None,
+        intern_text=False,
+        repeat=5,
+        seed=0,
+        cpu_hz=None):
+    """Run the decode benchmark.
+
+    Parameters
+    ----------
+    schemas : dict[str, list[str]]
+        A map from name to the column types to benchmark.
+    rowcount : int
+        The number of rows to decode.
+    null_density : float, optional
+        The probability that any given cell is NULL.
+    text_length : int or (int, int), optional
+        The length of the text values.
+    text_cardinality : int, optional
+        The number of distinct values in each text column.
+    intern_text : bool, optional
+        Decode the text columns with an intern table.
+    repeat : int, optional
+        The number of times to decode each buffer.
+    seed : int, optional
+        The seed for the generated data.
+    cpu_hz : float, optional
+        The cpu clock rate used to compute cycles per byte. By default this is
+        read from ``/proc/cpuinfo``.
+
+    Returns
+    -------
+    results : dict[str, dict[str, float]]
+        The ``rows_per_second``, ``bytes_per_second``, and ``cycles_per_byte``
+        for each schema.
+    """
+    if cpu_hz is None:
+        cpu_hz = cpu_frequency()
+
+    results = {}
+    for name, dtypes in schemas.items():
+        copy_data = generate_copy_data(
+            rowcount,
+            dtypes,
+            null_density=null_density,
+            text_length=text_length,
+            text_cardinality=text_cardinality,
+            seed=seed,
+        )
+        wall_time, cpu_time = time_decode(
+            copy_data,
+            repeat=repeat,
+            intern_text=intern_text,
+        )
+        nbytes = len(copy_data.buffer)
+        results[name] = {
+            'rows_per_second': rowcount / wall_time,
+            'bytes_per_second': nbytes / wall_time,
+            'cycles_per_byte': cpu_time * cpu_hz / nbytes,
+        }
+    return results
+
+
+def _text_length(s):
+    low, sep, high = s.partition(',')
+    if not sep:
+        return int(low)
+    return int(low), int(high)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog='python -m warp_prism.bench.decode',
+        description='Time raw_to_arrays on generated binary COPY data.',
+    )
+    parser.add_argument('--rows', type=int, default=1000000)
+    parser.add_argument(
+        '--types',
+        nargs='+',
+        choices=sorted(typeid_map),
+        default=sorted(typeid_map, key=typeid_map.__getitem__),
+        help='The column types to benchmark one at a time.',
+    )
+    parser.add_argument(
+        '--columns',
+        type=int,
+        default=4,
+        help='The number of columns of each type.',
+    )
+    parser.add_argument('--null-density', type=float, default=0.0)
+    parser.add_argument(
+        '--text-length',
+        type=_text_length,
+        default=(0, 16),
+        help='A fixed text length or an inclusive "low,high" range.',
+    )
+    parser.add_argument(
+        '--text-cardinality',
+        type=int,
+        help='The number of distinct values in each text column.',
+    )
+    parser.add_argument(
+        '--intern-text',
+        action='store_true',
+        help='Decode the text columns with an intern table.',
+    )
+    parser.add_argument('--repeat', type=int, default=5)
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--cpu-ghz', type=float)
+    parser.add_argument(
+        '--simd',
+        choices=['scalar', 'ssse3', 'avx2', 'avx512'],
+        help='The gather kernels to use. Defaults to the best supported.',
+    )
+    args = parser.parse_args(argv)
+
+    if args.simd is not None:
+        set_simd_level(args.simd)
+
+    schemas = {dtype: [dtype] * args.columns for dtype in args.types}
+    schemas['mixed'] = list(args.types)
+
+    results = run(
+        schemas,
+        args.rows,
+        null_density=args.null_density,
+        text_length=args.text_length,
+        text_cardinality=args.text_cardinality,
+        intern_text=args.intern_text,
+        repeat=args.repeat,
+        seed=args.seed,
+        cpu_hz=None if args.cpu_ghz is None else args.cpu_ghz * 1e9,
+    )
+
+    print('simd level: %s' % simd_level())
+    print('%-16s %14s %10s %12s' % ('schema', 'rows/s', 'MB/s', 'cycles/byte'))
+    for name, result in results.items():
+        print('%-16s %14.0f %10.1f %12.2f' % (
+            name,
+            result['rows_per_second'],
+            result['bytes_per_second'] / 1e6,
+            result['cycles_per_byte'],
+        ))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,301 @@
+"""Compare end to end query latency of warp_prism and other postgres readers.
+
+Usage: python -m warp_prism.bench.end_to_end [options]
+
+This needs a postgres server. By default a temporary database is created on
+localhost the same way as the test suite.
+"""
+import argparse
+import asyncio
+from contextlib import contextmanager
+from io import BytesIO
+import json
+import platform
+import statistics
+import sys
+from uuid import uuid4
+
+import numpy as np
+import pandas as pd
+import sqlalchemy as sa
+
+import warp_prism
+from .._warp_prism import clock
+from .copy_data import generate_copy_data
+from .._rss import current_rss, peak_rss, reset_peak_rss
+
+
+# The postgres and sqlalchemy type for each generated column type. The
+# psycopg type names are used to decode binary COPY data with psycopg 3.
+_column_types = {
+    'int16': ('int2', sa.SmallInteger),
+    'int32': ('int4', sa.Integer),
+    'int64': ('int8', sa.BigInteger),
+    'float32': ('float4', sa.REAL),
+    'float64': ('float8', sa.FLOAT),
+    'bool': ('bool', sa.Boolean),
+    'object': ('text', sa.Text),
+    'datetime64[us]': ('timestamp', sa.DateTime),
+    'datetime64[D]': ('date', sa.Date),
+}
+
+# name -> (column types, null density, text length)
+shapes = {
+    'narrow': (['int64', 'float64'], 0.0, (0, 16)),
+    'wide': (['int32', 'int64', 'float64', 'datetime64[us]'] * 8,
+             0.0,
+             (0, 16)),
+    'text_heavy': (['int64'] + ['object'] * 4, 0.0, (16, 128)),
+    'null_heavy': (['int64', 'float64', 'object', 'datetime64[us]'] * 2,
+                   0.5,
+                   (0, 16)),
+}
+
+
+def _to_arrays(table, engine, uri):
+    warp_prism.to_arrays(table, bind=engine)
+
+
+def _to_dataframe(table, engine, uri):
+    warp_prism.to_dataframe(table, bind=engine)
+
+
+def _psycopg2_fetchall(table, engine, uri):
+    conn = engine.raw_connection()
+    try:
+        cursor = conn.cursor()
+        cursor.execute('SELECT * FROM %s' % table.name)
+        cursor.fetchall()
+    finally:
+        conn.close()
+
+
+def _read_sql(table, engine, uri):
+    pd.read_sql(table.select(), engine)
+
+
+def _psycopg3_copy(table, engine, uri):
+    import psycopg
+
+    with psycopg.connect(uri) as conn, conn.cursor() as cursor:
+        with cursor.copy(
+                'COPY %s TO STDOUT (FORMAT BINARY)' % table.name) as copy:
+            copy.set_types(table.info['pg_types'])
+            for _ in copy.rows():
+                pass
+
+
+def _asyncpg_copy(table, engine, uri):
+    import asyncpg
+
+    async def copy():
+        conn = await asyncpg.connect(uri)
+        try:
+            await conn.copy_from_query(
+                'SELECT * FROM %s' % table.name,
+                output=BytesIO(),
+                format='binary',
+            )
+        finally:
+            await conn.close()
+
+    asyncio.run(copy())
+
+
+readers = {
+    'warp_prism.to_arrays': _to_arrays,
+    'warp_prism.to_dataframe': _to_dataframe,
+    'psycopg2.fetchall': _psycopg2_fetchall,
+    'pandas.read_sql': _read_sql,
+    'psycopg3.copy': _psycopg3_copy,
+    'asyncpg.copy_from_query': _asyncpg_copy,
+}
+
+
+@contextmanager
+def _benchmark_table(engine, rowcount, dtypes, null_density, text_length):
+    """Create and fill a table with generated data, dropping it on exit.
+
+    Yields
+    ------
+    table : sa.Table
+        The table.
+    nbytes : int
+        The size of the table as binary COPY data.
+    """
+    copy_data = generate_copy_data(
+        rowcount,
+        dtypes,
+        null_density=null_density,
+        text_length=text_length,
+    )
+    table = sa.Table(
+        'bench_' + uuid4().hex,
+        sa.MetaData(),
+        *(
+            sa.Column('c%d' % n, _column_types[dtype][1])
+            for n, dtype in enumerate(dtypes)
+        )
+    )
+    table.info['pg_types'] = [_column_types[dtype][0] for dtype in dtypes]
+    table.create(engine)
+    try:
+        conn = engine.raw_connection()
+        try:
+            conn.cursor().copy_expert(
+                'COPY %s FROM STDIN (FORMAT BINARY)' % table.name,
+                BytesIO(copy_data.buffer),
+            )
+            conn.commit()
+        finally:
+            conn.close()
+
+        yield table, len(copy_data.buffer)
+    finally:
+        table.drop(engine)
+
+
+def time_reader(reader, table, engine, uri, *, repeat):
+    """Time a reader and measure how much memory it uses.
+
+    Returns
+    -------
+    wall_times : list[float]
+        The seconds taken by each run.
+    peak_rss_bytes : int
+        The most resident memory used by any run, above the resident memory
+        at the start of that run.
+    """
+    wall_times = []
+    peak_rss_bytes = 0
+    for _ in range(repeat):
+        reset_peak_rss()
+        # without /proc the peak is over the life of the process
+        baseline = current_rss() or 0
+        start = clock()
+        reader(table, engine, uri)
+        wall_times.append(clock()[0] - start[0])
+        peak_rss_bytes = max(peak_rss_bytes, peak_rss() - baseline)
+    return wall_times, peak_rss_bytes
+
+
+def run(uri, rowcount, *, shape_names=None, reader_names=None, repeat=3):
+    """Run the end to end benchmark.
+
+    Parameters
+    ----------
+    uri : str
+        The database to create the benchmark tables in.
+    rowcount : int
+        The number of rows in each table.
+    shape_names : list[str], optional
+        The table shapes to benchmark. Defaults to all of ``shapes``.
+    reader_names : list[str], optional
+        The readers to benchmark. Defaults to all of ``readers``.
+    repeat : int, optional
+        The number of times to run each reader.
+
+    Returns
+    -------
+    results : list[dict]
+        One entry per shape and reader. Readers whose library is not installed
+        are reported with a ``skipped`` reason instead of timings.
+    """
+    engine = sa.create_engine(uri)
+    results = []
+    try:
+        for shape_name in shape_names or shapes:
+            dtypes, null_density, text_length = shapes[shape_name]
+            with _benchmark_table(engine,
+                                  rowcount,
+                                  dtypes,
+                                  null_density,
+                                  text_length) as (table, nbytes):
+                for reader_name in reader_names or readers:
+                    result = {
+                        'shape': shape_name,
+                        'reader': reader_name,
+                        'rows': rowcount,
+                        'columns': len(dtypes),
+                        'copy_bytes': nbytes,
+                    }
+                    try:
+                        wall_times, peak_rss_bytes = time_reader(
+                            readers[reader_name],
+                            table,
+                            engine,
+                            uri,
+                            repeat=repeat,
+                        )
+                    except ImportError as e:
+                        result['skipped'] = str(e)
+                    else:
+                        best = min(wall_times)
+                        result.update({
+                            'wall_times': wall_times,
+                            'min_latency': best,
+                            'median_latency': statistics.median(wall_times),
+                            'rows_per_second': rowcount / best,
+                            'bytes_per_second': nbytes / best,
+                            'peak_rss_bytes': peak_rss_bytes,
+                        })
+                    results.append(result)
+    finally:
+        engine.dispose()
+    return results
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog='python -m warp_prism.bench.end_to_end',
+        description='Compare warp_prism with other postgres readers.',
+    )
+    parser.add_argument('--rows', type=int, default=1000000)
+    parser.add_argument('--shapes', nargs='+', choices=sorted(shapes))
+    parser.add_argument('--readers', nargs='+', choices=sorted(readers))
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument(
+        '--db-uri',
+        help='An existing database to use instead of a temporary database.',
+    )
+    parser.add_argument(
+        '--output',
+        help='The file to write the json results to. Defaults to stdout.',
+    )
+    args = parser.parse_args(argv)
+
+    def run_in(uri):
+        return run(
+            uri,
+            args.rows,
+            shape_names=args.shapes,
+            reader_names=args.readers,
+            repeat=args.repeat,
+        )
+
+    if args.db_uri is not None:
+        results = run_in(args.db_uri)
+    else:
+        from ..tests import tmp_db_uri
+
+        with tmp_db_uri() as uri:
+            results = run_in(uri)
+
+    report = {
+        'warp_prism_version': warp_prism.__version__,
+        'python_version': platform.python_version(),
+        'numpy_version': np.__version__,
+        'pandas_version': pd.__version__,
+        'machine': platform.machine(),
+        'results': results,
+    }
+    if args.output is None:
+        json.dump(report, sys.stdout, indent=2)
+        sys.stdout.write('\n')
+    else:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,181 @@
+"""Measure the memory used to decode generated binary COPY data into a
+DataFrame.
+
+Usage: python -m warp_prism.bench.memory [options]
+
+The tracked peak is the most memory held at once by the COPY data, the output
+columns, the converted copies of the columns, and the DataFrame. This does not
+depend on the machine so it is pinned in ``memory_baseline.json``; ``--check``
+fails if any shape uses more memory than its baseline.
+"""
+import argparse
+import json
+import os
+import sys
+
+from .. import _arrays_to_dataframe, _phase_mark, _record_phase_memory
+from .._rss import reset_peak_rss
+from .._warp_prism import raw_to_arrays
+from .copy_data import generate_copy_data
+from .end_to_end import shapes
+
+
+baseline_path = os.path.join(os.path.dirname(__file__), 'memory_baseline.json')
+
+
+def measure(dtypes,
+            rowcount,
+            *,
+            null_density=0.0,
+            text_length=(0, 16),
+            seed=0):
+    """Decode generated data into a DataFrame, measuring the memory used.
+
+    Parameters
+    ----------
+    dtypes : list[str]
+        The column types.
+    rowcount : int
+        The number of rows.
+    null_density : float, optional
+        The probability that any given cell is NULL.
+    text_length : int or (int, int), optional
+        The length of the text values.
+    seed : int, optional
+        The seed for the generated data.
+
+    Returns
+    -------
+    stats : dict
+        The stats dict filled by ``to_dataframe``, without the query and copy
+        phases.
+    """
+    copy_data = generate_copy_data(
+        rowcount,
+        dtypes,
+        null_density=null_density,
+        text_length=text_length,
+        seed=seed,
+    )
+    # drop the expected columns so they are not counted in the rss
+    buffer, type_ids = copy_data.buffer, copy_data.type_ids
+    del copy_data
+
+    stats = {}
+    reset_peak_rss()
+    out = raw_to_arrays(buffer, type_ids, stats=stats)
+    # the next phase's peak starts here
+    _record_phase_memory(stats, 'decode', _phase_mark(reset_peak=True))
+    stats['tracked_peak_bytes'] = (
+        stats['input_bytes'] + stats['peak_buffer_bytes']
+    )
+    del buffer
+
+    names = ['c%d' % n for n in range(len(dtypes))]
+    _arrays_to_dataframe(
+        dict(zip(names, out)),
+        names,
+        stats=stats,
+        null_counts=dict(zip(names, stats['null_counts'])),
+    )
+    return stats
+
+
+def run(rowcount, shape_names=None):
+    """Measure the memory used for each table shape.
+
+    Returns
+    -------
+    results : dict[str, dict]
+        The stats for each shape.
+    """
+    results = {}
+    for name in shape_names or shapes:
+        dtypes, null_density, text_length = shapes[name]
+        results[name] = measure(
+            dtypes,
+            rowcount,
+            null_density=null_density,
+            text_length=text_length,
+        )
+    return results
+
+
+def check(results, baseline, tolerance):
+    """Compare the tracked peaks against the baseline.
+
+    Returns
+    -------
+    regressions : list[str]
+        A message for each shape which used more memory than its baseline.
+    """
+    regressions = []
+    for name, stats in results.items():
+        expected = baseline[name]
+        actual = stats['tracked_peak_bytes']
+        if actual > expected * (1 + tolerance):
+            regressions.append(
+                '%s: tracked peak of %d bytes exceeds the baseline of %d'
+                ' bytes' % (name, actual, expected),
+            )
+    return regressions
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog='python -m warp_prism.bench.memory',
+        description='Measure the memory used to decode into a DataFrame.',
+    )
+    parser.add_argument('--shapes', nargs='+', choices=sorted(shapes))
+    parser.add_argument(
+        '--check',
+        action='store_true',
+        help='Fail if the tracked peaks exceed the pinned baseline.',
+    )
+    parser.add_argument(
+        '--update',
+        action='store_true',
+        help='Write the tracked peaks as the new baseline.',
+    )
+    parser.add_argument('--tolerance', type=float, default=0.01)
+    args = parser.parse_args(argv)
+
+    with open(baseline_path) as f:
+        baseline = json.load(f)
+
+    results = run(baseline['rows'], args.shapes)
+    print('%-12s %14s %14s %14s %14s' % (
+        'shape', 'tracked peak', 'baseline', 'decode rss', 'frame rss',
+    ))
+    for name, stats in results.items():
+        print('%-12s %14d %14d %14d %14d' % (
+            name,
+            stats['tracked_peak_bytes'],
+            baseline['tracked_peak_bytes'].get(name, 0),
+            stats['decode_peak_rss'],
+            stats['postprocess_peak_rss'],
+        ))
+
+    if args.update:
+        baseline['tracked_peak_bytes'].update({
+            name: stats['tracked_peak_bytes']
+            for name, stats in results.items()
+        })
+        with open(baseline_path, 'w') as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write('\n')
+
+    if args.check:
+        regressions = check(
+            results,
+            baseline['tracked_peak_bytes'],
+            args.tolerance,
+        )
+        for regression in regressions:
+            print(regression, file=sys.stderr)
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
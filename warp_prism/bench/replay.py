@@ -0,0 +1,98 @@
+"""Time ``raw_to_arrays`` on captured binary COPY data.
+
+Usage: python -m warp_prism.bench.replay [options] capture [capture ...]
+
+Capture files are written by passing ``capture=path`` to
+``warp_prism.to_arrays`` or ``warp_prism.to_dataframe``.
+"""
+import argparse
+import json
+import sys
+
+from .._warp_prism import raw_to_arrays
+from ..capture import read_capture
+from .decode import cpu_frequency, time_decode
+
+
+def replay(path, *, repeat=5, cpu_hz=None):
+    """Decode a capture file, timing the decoder.
+
+    Parameters
+    ----------
+    path : str
+        The capture file.
+    repeat : int, optional
+        The number of times to decode the data. The fastest run is reported.
+    cpu_hz : float, optional
+        The cpu clock rate used to compute cycles per byte. By default this is
+        read from ``/proc/cpuinfo``.
+
+    Returns
+    -------
+    result : dict
+        The row count, size, and decode speed of the capture.
+    """
+    if cpu_hz is None:
+        cpu_hz = cpu_frequency()
+
+    capture = read_capture(path)
+    stats = {}
+    raw_to_arrays(capture.buffer, capture.type_ids, stats=stats)
+    wall_time, cpu_time = time_decode(capture, repeat=repeat)
+    nbytes = len(capture.buffer)
+    return {
+        'path': path,
+        'sql': capture.sql,
+        'dtypes': capture.dtypes,
+        'rows': stats['rows'],
+        'bytes': nbytes,
+        'null_counts': dict(zip(capture.columns, stats['null_counts'])),
+        'wall_time': wall_time,
+        'cpu_time': cpu_time,
+        'rows_per_second': stats['rows'] / wall_time,
+        'bytes_per_second': nbytes / wall_time,
+        'cycles_per_byte': cpu_time * cpu_hz / nbytes,
+    }
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog='python -m warp_prism.bench.replay',
+        description='Time raw_to_arrays on captured binary COPY data.',
+    )
+    parser.add_argument('captures', nargs='+')
+    parser.add_argument('--repeat', type=int, default=5)
+    parser.add_argument('--cpu-ghz', type=float)
+    parser.add_argument(
+        '--json',
+        action='store_true',
+        help='Write the results as json instead of a table.',
+    )
+    args = parser.parse_args(argv)
+
+    cpu_hz = None if args.cpu_ghz is None else args.cpu_ghz * 1e9
+    results = [
+        replay(path, repeat=args.repeat, cpu_hz=cpu_hz)
+        for path in args.captures
+    ]
+
+    if args.json:
+        json.dump(results, sys.stdout, indent=2)
+        sys.stdout.write('\n')
+        return
+
+    print('%-32s %12s %14s %10s %12s' % (
+        'capture', 'rows', 'rows/s', 'MB/s', 'cycles/byte',
+    ))
+    for result in results:
+        print('%-32s %12d %14.0f %10.1f %12.2f' % (
+            result['path'],
+            result['rows'],
+            result['rows_per_second'],
+            result['bytes_per_second'] / 1e6,
+            result['cycles_per_byte'],
+        ))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,138 @@
+"""Capture the binary COPY data of a query so that the decoder can be replayed
+without a database.
+
+A capture file is:
+
+- the magic bytes ``WARPCAP\\n``
+- a big-endian uint32 with the length of the metadata
+- the metadata as utf-8 json: the sql, the column names, and the column types
+  as the keys of ``typeid_map`` or ``text_typeid_map``, ``[kind, width,
+  truncate]`` for fixed width text columns, or ``['sparse', dtype]`` for
+  sparse columns
+- the binary COPY data, through the end of the file
+"""
+from collections import namedtuple
+import json
+import struct
+
+from ._warp_prism import sparse_typeid, text_typeid_map, typeid_map
+
+
+magic = b'WARPCAP\n'
+_version = 1
+_text_kinds_by_typeid = {v: k for k, v in text_typeid_map.items()}
+_dtypes_by_typeid = {v: k for k, v in typeid_map.items()}
+_dtypes_by_typeid[text_typeid_map['lazy']] = 'lazy'
+
+Capture = namedtuple('Capture', 'sql columns dtypes type_ids buffer')
+Capture.__doc__ = """A captured query.
+
+Attributes
+----------
+sql : str
+    The COPY statement that produced the data.
+columns : list[str]
+    The column names.
+dtypes : list[str or list]
+    The column types as the keys of ``typeid_map``, ``'lazy'`` for lazy text
+    columns, ``[kind, width, truncate]`` for fixed width text columns, or
+    ``['sparse', dtype]`` for sparse columns.
+type_ids : tuple[int or tuple]
+    The type ids to pass to ``raw_to_arrays`` along with ``buffer``.
+buffer : bytes
+    The binary COPY data.
+"""
+
+
+def _dtype_name(type_id):
+    if isinstance(type_id, tuple):
+        if type_id[0] == sparse_typeid:
+            return ['sparse', _dtypes_by_typeid[type_id[1]]]
+        type_id, width, truncate = type_id
+        return [_text_kinds_by_typeid[type_id], width, truncate]
+    return _dtypes_by_typeid[type_id]
+
+
+def _type_id(dtype):
+    if isinstance(dtype, list):
+        if dtype[0] == 'sparse':
+            return sparse_typeid, typeid_map[dtype[1]]
+        kind, width, truncate = dtype
+        return text_typeid_map[kind], width, truncate
+    if dtype == 'lazy':
+        return text_typeid_map[dtype]
+    return typeid_map[dtype]
+
+
+def write_capture(path_or_file, sql, columns, type_ids, buffer):
+    """Write a capture file.
+
+    Parameters
+    ----------
+    path_or_file : str or file-like
+        The path or binary file to write to.
+    sql : str
+        The COPY statement that produced the data.
+    columns : list[str]
+        The column names.
+    type_ids : tuple[int or tuple]
+        The type ids of the columns.
+    buffer : bytes-like
+        The binary COPY data.
+    """
+    metadata = json.dumps({
+        'version': _version,
+        'sql': sql,
+        'columns': list(columns),
+        'dtypes': [_dtype_name(type_id) for type_id in type_ids],
+    }).encode('utf-8')
+
+    if isinstance(path_or_file, str):
+        with open(path_or_file, 'wb') as f:
+            return write_capture(f, sql, columns, type_ids, buffer)
+
+    path_or_file.write(magic)
+    path_or_file.write(struct.pack('>I', len(metadata)))
+    path_or_file.write(metadata)
+    path_or_file.write(buffer)
+
+
+def read_capture(path_or_file):
+    """Read a capture file.
+
+    Parameters
+    ----------
+    path_or_file : str or file-like
+        The path or binary file to read from.
+
+    Returns
+    -------
+    capture : Capture
+        The captured query.
+    """
+    if isinstance(path_or_file, str):
+        with open(path_or_file, 'rb') as f:
+            return read_capture(f)
+
+    if path_or_file.read(len(magic)) != magic:
+        raise ValueError('not a warp_prism capture file')
+
+    (metadata_len,) = struct.unpack('>I', path_or_file.read(4))
+    metadata = json.loads(path_or_file.read(metadata_len).decode('utf-8'))
+    if metadata['version'] != _version:
+        raise ValueError(
+            'unsupported capture version: %r' % metadata['version'],
+        )
+
+    try:
+        type_ids = tuple(_type_id(dtype) for dtype in metadata['dtypes'])
+    except KeyError as e:
+        raise ValueError('unknown column type in capture: %r' % e.args[0])
+
+    return Capture(
+        metadata['sql'],
+        metadata['columns'],
+        metadata['dtypes'],
+        type_ids,
+        path_or_file.read(),
+    )
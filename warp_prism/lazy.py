@@ -0,0 +1,72 @@
+"""Text columns which create their strings on access.
+"""
+import numpy as np
+
+from ._warp_prism import materialize_text
+
+
+class LazyText:
+    """A text column which holds the offset of each value in the binary COPY
+    data instead of the strings.
+
+    The strings are created on element access or by ``materialize``. The
+    offsets array returned by ``raw_to_arrays`` keeps the COPY data alive.
+
+    Parameters
+    ----------
+    offsets : np.ndarray[int64]
+        The offsets returned by ``raw_to_arrays`` for a lazy text column.
+    mask : np.ndarray[bool]
+        The mask returned by ``raw_to_arrays``. False marks a NULL.
+    """
+    def __init__(self, offsets, mask, *, _source=None):
+        self.offsets = offsets
+        self.mask = mask
+        # the column returned by ``raw_to_arrays``, which may be a superset of
+        # ``offsets``
+        self._source = offsets if _source is None else _source
+
+    def __len__(self):
+        return len(self.offsets)
+
+    def __getitem__(self, key):
+        if isinstance(key, (int, np.integer)):
+            if key < 0:
+                key += len(self)
+            if not 0 <= key < len(self):
+                raise IndexError('index out of range: %d' % key)
+            return self._materialize(
+                self.offsets[key:key + 1],
+                self.mask[key:key + 1],
+            )[0]
+
+        return type(self)(
+            self.offsets[key],
+            self.mask[key],
+            _source=self._source,
+        )
+
+    def __iter__(self):
+        return iter(self.materialize())
+
+    def __array__(self, dtype=None, copy=None):
+        out = self.materialize()
+        if dtype is not None:
+            out = out.astype(dtype)
+        return out
+
+    def __repr__(self):
+        return '<%s: %d rows>' % (type(self).__name__, len(self))
+
+    def _materialize(self, offsets, mask):
+        return materialize_text(self._source, offsets, mask)
+
+    def materialize(self):
+        """Create all of the strings.
+
+        Returns
+        -------
+        values : np.ndarray[object]
+            The strings, with None for NULLs.
+        """
+        return self._materialize(self.offsets, self.mask)
@@ -1,3 +1,5 @@
+from io import BytesIO
+import json
 from string import ascii_letters
 import struct
 from uuid import uuid4
@@ -10,14 +12,48 @@ import pytest
 import sqlalchemy as sa
 
 from warp_prism._warp_prism import (
+    count_rows,
     postgres_signature,
     raw_to_arrays,
+    raw_to_groupby,
+    raw_to_pivot,
+    new_sampler,
+    sampler_result,
+    sampler_write,
+    set_simd_level,
+    set_sort_threads,
+    simd_level,
+    sort_threads,
+    sparse_typeid,
     test_overflow_operations as _test_overflow_operations,
+    text_typeid_map,
+    typeid_map,
 )
+from warp_prism.bench import (
+    end_to_end,
+    generate_copy_data,
+    memory,
+    replay,
+)
+from warp_prism.capture import read_capture, write_capture
+from warp_prism.lazy import LazyText
+from warp_prism import _rss
 from warp_prism import (
+    hash_partitions,
     to_arrays,
     to_dataframe,
+    to_groupby,
+    to_pivot,
     null_values as null_values_for_type,
+    _arrays_to_dataframe,
+    _filter_spec,
+    _int_keys,
+    _phase_mark,
+    _RowLimitBytesIO,
+    _RowLimitReached,
+    _sample_spec,
+    _SampleBytesIO,
+    _sparse_array,
     _typeid_map,
 )
 from warp_prism.tests import tmp_db_uri as tmp_db_uri_ctx
@@ -455,3 +491,2719 @@ def test_missing_end_marker():
 def test_overflow_operations():
     # thanks pytest
     _test_overflow_operations()
+
+
+def test_many_rows():
+    # enough rows to grow the first column segment to its full size and then
+    # spill into a second segment
+    rowcount = 2 ** 20 + 4097
+    rows = np.empty(
+        rowcount,
+        dtype=[
+            ('field_count', '>i2'),
+            ('int_size', '>i4'),
+            ('int', '>i4'),
+            ('text_size', '>i4'),
+            ('text', 'S2'),
+        ],
+    )
+    rows['field_count'] = 2
+    rows['int_size'] = 4
+    rows['int'] = np.arange(rowcount)
+    rows['text_size'] = 2
+    rows['text'] = b'ab'
+    input_data = postgres_signature + b''.join((
+        struct.pack('>ii', 0, 0),  # flags, extension area size
+        rows.tobytes(),
+        struct.pack('>h', -1),  # end marker
+    ))
+
+    (ints, int_mask), (text, text_mask) = raw_to_arrays(
+        input_data,
+        (_typeid_map[np.dtype('int32')], _typeid_map[np.dtype(object)]),
+    )
+    assert (ints == np.arange(rowcount)).all()
+    assert int_mask.all()
+    assert len(text) == rowcount
+    assert (text == 'ab').all()
+    assert text_mask.all()
+
+
+def _pack_copy_data(rows, formats):
+    """Pack rows as postgres binary copy data.
+
+    Parameters
+    ----------
+    rows : iterable[tuple]
+        The rows to pack. ``None`` is written as ``NULL`` and ``bytes`` are
+        written as is.
+    formats : tuple[str]
+        The struct format for each column.
+
+    Returns
+    -------
+    binary_data : bytes
+        The binary data to feed to raw_to_arrays.
+    """
+    chunks = [postgres_signature, struct.pack('>ii', 0, 0)]
+    for row in rows:
+        chunks.append(struct.pack('>h', len(row)))
+        for format_, value in zip(formats, row):
+            if value is None:
+                chunks.append(struct.pack('>i', -1))
+            else:
+                if isinstance(value, bytes):
+                    packed = value
+                else:
+                    packed = struct.pack('>' + format_, value)
+                chunks.append(struct.pack('>i', len(packed)) + packed)
+    chunks.append(struct.pack('>h', -1))
+    return b''.join(chunks)
+
+
+_fixed_width_columns = (
+    ('int16', 'h', lambda n: n),
+    ('int32', 'i', lambda n: n * 3),
+    ('int64', 'q', lambda n: n * 2 ** 40),
+    ('float32', 'f', lambda n: n / 2),
+    ('float64', 'd', lambda n: n / 4),
+    ('bool', '?', lambda n: bool(n % 2)),
+    (
+        'datetime64[us]',
+        'q',
+        lambda n: (np.datetime64('2014-01-01', 'us') + n - _epoch_offset).view(
+            'int64',
+        ),
+    ),
+    (
+        'datetime64[D]',
+        'i',
+        lambda n: (np.datetime64('2014-01-01', 'D') + n - _epoch_offset).view(
+            'int64',
+        ),
+    ),
+)
+
+
+def _expected_fixed_width_column(dtype, f, n):
+    values = [f(m) for m in range(n)]
+    if dtype.startswith('datetime64'):
+        return np.array(values, dtype='int64').view(dtype) + _epoch_offset
+    return np.array(values, dtype=dtype)
+
+
+@pytest.fixture(params=['scalar', 'ssse3', 'avx2', 'avx512'])
+def simd(request):
+    old_level = simd_level()
+    try:
+        set_simd_level(request.param)
+    except ValueError:
+        pytest.skip('%s is not supported on this machine' % request.param)
+
+    yield request.param
+    set_simd_level(old_level)
+
+
+@pytest.mark.parametrize('null_row', [None, 0, 7, 300, 999])
+def test_fixed_width_columns(simd, null_row):
+    # enough rows for more than one decode block
+    rowcount = 1000
+    dtypes, formats, fs = zip(*_fixed_width_columns)
+    rows = [tuple(f(n) for f in fs) for n in range(rowcount)]
+    if null_row is not None:
+        # a NULL breaks the constant row stride
+        rows[null_row] = (None,) * len(rows[null_row])
+
+    out = raw_to_arrays(
+        _pack_copy_data(rows, formats),
+        tuple(_typeid_map[np.dtype(dtype)] for dtype in dtypes),
+    )
+    assert len(out) == len(dtypes)
+
+    expected_mask = np.ones(rowcount, dtype=bool)
+    if null_row is not None:
+        expected_mask[null_row] = False
+
+    for dtype, f, (array, mask) in zip(dtypes, fs, out):
+        assert array.dtype == np.dtype(dtype)
+        assert (mask == expected_mask).all()
+        expected = _expected_fixed_width_column(dtype, f, rowcount)
+        assert (array[mask] == expected[mask]).all()
+        if null_row is not None and dtype.startswith('datetime64'):
+            assert np.isnat(array[null_row])
+
+
+@pytest.mark.parametrize('bad_row', [1, 500, 998])
+def test_fixed_width_invalid_size(bad_row):
+    rows = [(float(n), None if n % 3 else n) for n in range(1000)]
+    rows[bad_row] = (b'\0' * 7, 1)
+
+    with pytest.raises(ValueError) as e:
+        raw_to_arrays(
+            _pack_copy_data(rows, ('d', 'q')),
+            (
+                _typeid_map[np.dtype('float64')],
+                _typeid_map[np.dtype('int64')],
+            ),
+        )
+
+    assert str(e.value) == 'mismatched float64 size: 7'
+
+
+def test_unknown_simd_level():
+    with pytest.raises(ValueError) as e:
+        set_simd_level('mmx')
+
+    assert str(e.value) == "unknown simd level: 'mmx'"
+
+
+def test_fixed_width_no_rows():
+    out = raw_to_arrays(
+        _pack_copy_data([], ('d',)),
+        (_typeid_map[np.dtype('float64')],),
+    )
+    assert len(out) == 1
+    array, mask = out[0]
+    assert array.dtype == np.dtype('float64')
+    assert len(array) == 0
+    assert len(mask) == 0
+
+
+def test_mixed_columns():
+    # a text column sends the rows through the row by row decoder
+    rowcount = 1000
+    rows = [
+        (
+            n,
+            None if n % 7 == 0 else ('%d' % n).encode('ascii'),
+            None if n % 5 == 0 else n / 2,
+        )
+        for n in range(rowcount)
+    ]
+    (ints, int_mask), (text, text_mask), (floats, float_mask) = raw_to_arrays(
+        _pack_copy_data(rows, ('q', None, 'd')),
+        (
+            _typeid_map[np.dtype('int64')],
+            _typeid_map[np.dtype(object)],
+            _typeid_map[np.dtype('float64')],
+        ),
+    )
+
+    assert (ints == np.arange(rowcount)).all()
+    assert int_mask.all()
+
+    expected_text_mask = np.arange(rowcount) % 7 != 0
+    assert (text_mask == expected_text_mask).all()
+    assert list(text[text_mask]) == [
+        '%d' % n for n in np.flatnonzero(expected_text_mask)
+    ]
+    assert (text[~text_mask] == None).all()  # noqa
+
+    expected_float_mask = np.arange(rowcount) % 5 != 0
+    assert (float_mask == expected_float_mask).all()
+    assert (floats[float_mask] == np.arange(rowcount)[float_mask] / 2).all()
+    assert (floats[~float_mask] == 0).all()
+
+
+def test_invalid_type_id():
+    invalid = len(_typeid_map) + len(text_typeid_map) + 1
+    with pytest.raises(ValueError) as e:
+        raw_to_arrays(_pack_copy_data([], ()), (invalid,))
+
+    assert str(e.value) == 'invalid type id: %d' % invalid
+
+
+@pytest.mark.parametrize('nulls', [False, True])
+@pytest.mark.parametrize('dtypes,formats', [
+    # constant stride, or the block decoder when there are NULLs
+    (('float64', 'int32'), ('d', 'i')),
+    # the row by row decoder
+    (('float64', 'object'), ('d', None)),
+])
+def test_raw_to_arrays_stats(dtypes, formats, nulls):
+    rowcount = 10000
+    rows = [
+        (
+            None if nulls and n % 3 == 0 else float(n),
+            n if formats[1] == 'i' else b'ab',
+        )
+        for n in range(rowcount)
+    ]
+    input_data = _pack_copy_data(rows, formats)
+
+    stats = {}
+    (floats, float_mask), _ = raw_to_arrays(
+        input_data,
+        tuple(_typeid_map[np.dtype(dtype)] for dtype in dtypes),
+        stats=stats,
+    )
+
+    expected_nulls = (rowcount + 2) // 3 if nulls else 0
+    assert stats['rows'] == rowcount
+    assert stats['input_bytes'] == len(input_data)
+    assert stats['null_counts'] == (expected_nulls, 0)
+    assert (~float_mask).sum() == expected_nulls
+
+    # the output columns hold at least the final arrays at some point
+    final_bytes = rowcount * (8 + np.dtype(dtypes[1]).itemsize + 2)
+    assert stats['peak_buffer_bytes'] >= final_bytes
+    if formats[1] == 'i' and not nulls:
+        # constant stride rows are counted first and decoded in place
+        assert stats['grow_count'] == 0
+        assert stats['bytes_copied'] == 0
+    else:
+        # the first segment doubles from 4096 to 8192 to 16384 rows; a move
+        # by realloc copies the rows held before each grow and the shrink
+        assert stats['grow_count'] == 2
+        row_bytes = sum(
+            np.dtype(dtype).itemsize + 1 for dtype in dtypes
+        )
+        assert stats['bytes_copied'] <= (4096 + 8192 + rowcount) * row_bytes
+    for phase in 'decode', 'finalize':
+        assert stats[phase + '_wall_time'] >= 0
+        assert stats[phase + '_cpu_time'] >= 0
+
+
+def _pack_growth_rows(rowcount, text):
+    """Pack ``rowcount`` rows of ``(float64, int32 or text)`` quickly.
+    """
+    dtype = np.dtype([
+        ('ncolumns', '>i2'),
+        ('float_len', '>i4'),
+        ('float', '>f8'),
+        ('second_len', '>i4'),
+        ('second', 'S2' if text else '>i4'),
+    ])
+    rows = np.zeros(rowcount, dtype=dtype)
+    rows['ncolumns'] = 2
+    rows['float_len'] = 8
+    rows['float'] = np.arange(rowcount)
+    rows['second_len'] = dtype['second'].itemsize
+    rows['second'] = b'ab' if text else np.arange(rowcount)
+    return (
+        postgres_signature +
+        struct.pack('>ii', 0, 0) +
+        rows.tobytes() +
+        struct.pack('>h', -1)
+    )
+
+
+@pytest.mark.parametrize('rowcount,grows', [
+    (10000, 0),
+    (2 ** 20, 0),
+    (2 ** 20 + 1, 1),
+    (2 ** 21 + 5, 2),
+])
+@pytest.mark.parametrize('text', [False, True])
+def test_raw_to_arrays_stats_growth(rowcount, grows, text):
+    # with a known row count the first segment starts at its full size, so
+    # each grow appends a segment without moving any rows; the rows are
+    # copied once when more than one segment is concatenated
+    stats = {}
+    (floats, _), _ = raw_to_arrays(
+        _pack_growth_rows(rowcount, text),
+        (
+            _typeid_map[np.dtype('float64')],
+            _typeid_map[np.dtype(object if text else 'int32')],
+        ),
+        stats=stats,
+        max_rows=rowcount,
+    )
+    assert len(floats) == rowcount
+    if not text:
+        # constant stride rows are decoded straight into the final arrays
+        grows = 0
+    assert stats['grow_count'] == grows
+    row_bytes = (8 + 1) + (np.dtype(object if text else 'int32').itemsize + 1)
+    assert stats['bytes_copied'] == (rowcount * row_bytes if grows else 0)
+
+
+def test_raw_to_arrays_invalid_stats():
+    with pytest.raises(TypeError) as e:
+        raw_to_arrays(_pack_copy_data([], ()), (), stats=[])
+
+    assert str(e.value) == 'stats must be a dict or None'
+
+
+@pytest.mark.parametrize('null_density', [0.0, 0.2, 1.0])
+@pytest.mark.parametrize('order', ['random', 'increasing', 'decreasing'])
+def test_raw_to_arrays_column_stats(null_density, order):
+    dtypes = [
+        'int16',
+        'int32',
+        'int64',
+        'float32',
+        'float64',
+        'datetime64[us]',
+        'datetime64[D]',
+        'bool',
+        'object',
+    ]
+    copy_data = generate_copy_data(1000, dtypes, null_density=null_density)
+    if order != 'random':
+        # rebuild the data with each column sorted
+        columns = []
+        for values, mask in copy_data.columns:
+            if values.dtype.kind in 'ifM':
+                values = np.sort(values)
+                if order == 'decreasing':
+                    values = values[::-1]
+            columns.append((values, mask))
+    else:
+        columns = copy_data.columns
+
+    rows = []
+    for n in range(1000):
+        row = []
+        for dtype, (values, mask) in zip(dtypes, columns):
+            if not mask[n]:
+                row.append(None)
+            elif dtype == 'object':
+                row.append(values[n].encode('ascii'))
+            elif dtype.startswith('datetime64'):
+                epoch = np.datetime64('2000-01-01', dtype[11:-1])
+                row.append(int((values[n] - epoch).astype('int64')))
+            else:
+                row.append(values[n].item())
+        rows.append(tuple(row))
+    formats = ('h', 'i', 'q', 'f', 'd', 'q', 'i', '?', None)
+
+    stats = {}
+    raw_to_arrays(
+        _pack_copy_data(rows, formats),
+        copy_data.type_ids,
+        stats=stats,
+        column_stats=True,
+    )
+    assert len(stats['column_stats']) == len(dtypes)
+    for dtype, (values, mask), column in zip(
+            dtypes,
+            columns,
+            stats['column_stats']):
+        assert column['null_count'] == (~mask).sum()
+        if dtype in ('bool', 'object'):
+            assert set(column) == {'null_count'}
+            continue
+
+        valid = values[mask]
+        if not len(valid):
+            assert column['min'] is None
+            assert column['max'] is None
+        else:
+            assert column['min'] == valid.min()
+            assert column['max'] == valid.max()
+            assert type(column['min']) is type(valid.min())
+        assert column['monotonic_increasing'] == (
+            (np.diff(valid.astype('float64')) >= 0).all()
+        )
+        assert column['monotonic_decreasing'] == (
+            (np.diff(valid.astype('float64')) <= 0).all()
+        )
+
+
+def test_raw_to_arrays_column_stats_nan():
+    stats = {}
+    raw_to_arrays(
+        _pack_copy_data(
+            [(1.0,), (float('nan'),), (None,), (3.0,), (2.0,)],
+            ('d',),
+        ),
+        (typeid_map['float64'],),
+        stats=stats,
+        column_stats=True,
+    )
+    assert stats['column_stats'] == ({
+        'null_count': 1,
+        'min': 1.0,
+        'max': 3.0,
+        'monotonic_increasing': False,
+        'monotonic_decreasing': False,
+    },)
+
+
+def test_raw_to_arrays_column_stats_requires_stats():
+    with pytest.raises(TypeError) as e:
+        raw_to_arrays(_pack_copy_data([], ()), (), column_stats=True)
+
+    assert str(e.value) == 'column_stats requires a stats dict'
+
+
+def test_arrays_to_dataframe_null_counts():
+    copy_data = generate_copy_data(
+        100,
+        ['int64', 'float64', 'object'],
+        null_density=0.5,
+    )
+    names = ['a', 'b', 'c']
+    stats = {}
+    out = raw_to_arrays(copy_data.buffer, copy_data.type_ids, stats=stats)
+    null_counts = dict(zip(names, stats['null_counts']))
+    df = _arrays_to_dataframe(
+        dict(zip(names, out)),
+        names,
+        null_counts=null_counts,
+    )
+
+    for name, (values, mask) in zip(names, copy_data.columns):
+        assert df[name].isnull().sum() == null_counts[name]
+        assert (df[name][mask] == values[mask]).all()
+
+
+def test_raw_to_arrays_null_masks():
+    input_data = _pack_copy_data(
+        [(n if n % 3 else None,) for n in range(1000)],
+        ('q',),
+    )
+    (_, valid), = raw_to_arrays(input_data, (typeid_map['int64'],))
+    (_, nulls), = raw_to_arrays(
+        input_data,
+        (typeid_map['int64'],),
+        null_masks=True,
+    )
+    assert nulls.dtype == np.dtype(bool)
+    assert (nulls == ~valid).all()
+
+
+@pytest.mark.parametrize('null_density', [0.0, 0.3])
+def test_arrays_to_dataframe_nullable(null_density):
+    dtypes = ['int64', 'int16', 'float64', 'bool', 'object', 'datetime64[us]']
+    copy_data = generate_copy_data(100, dtypes, null_density=null_density)
+    names = ['c%d' % n for n in range(len(dtypes))]
+    stats = {}
+    out = raw_to_arrays(
+        copy_data.buffer,
+        copy_data.type_ids,
+        stats=stats,
+        null_masks=True,
+    )
+    values = [array for array, _ in out]
+    df = _arrays_to_dataframe(
+        dict(zip(names, out)),
+        names,
+        null_counts=dict(zip(names, stats['null_counts'])),
+        nullable=True,
+    )
+
+    assert list(df.dtypes) == [
+        pd.Int64Dtype(),
+        pd.Int16Dtype(),
+        pd.Float64Dtype(),
+        pd.BooleanDtype(),
+        np.dtype(object),
+        np.dtype('datetime64[ns]'),
+    ]
+    for name, array, (expected, mask) in zip(
+            names,
+            values,
+            copy_data.columns):
+        column = df[name]
+        assert (column.isnull() == ~mask).all()
+        assert (column[mask] == expected[mask]).all()
+        if name in ('c0', 'c1', 'c2', 'c3'):
+            # the extension arrays use the decoded values in place
+            assert np.shares_memory(column.array._data, array)
+
+
+def test_arrays_to_dataframe_nullable_stats():
+    dtypes = ['int64', 'int16', 'float64', 'bool']
+    copy_data = generate_copy_data(1000, dtypes, null_density=0.3)
+    names = ['c%d' % n for n in range(len(dtypes))]
+    stats = {}
+    out = raw_to_arrays(
+        copy_data.buffer,
+        copy_data.type_ids,
+        stats=stats,
+        null_masks=True,
+    )
+    # only measure the postprocess phase
+    stats['tracked_peak_bytes'] = 0
+    _arrays_to_dataframe(
+        dict(zip(names, out)),
+        names,
+        stats=stats,
+        null_counts=dict(zip(names, stats['null_counts'])),
+        nullable=True,
+    )
+
+    # the extension arrays take the decoded columns without a copy, so they
+    # are only counted once, as part of the frame
+    assert stats['frame_bytes'] == stats['output_bytes']
+    assert stats['tracked_peak_bytes'] == stats['output_bytes']
+
+
+def test_to_dataframe_stats_roundtrip(tmp_table_uri):
+    input_dataframe = pd.DataFrame({'a': [1.0, np.nan, 3.0]})
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': Option('float64')],
+    )
+
+    stats = {}
+    output_dataframe = to_dataframe(table, stats=stats)
+    pd.util.testing.assert_frame_equal(output_dataframe, input_dataframe)
+
+    assert stats['rows'] == 3
+    assert stats['null_counts'] == {'a': 1}
+    assert stats['tracked_peak_bytes'] >= (
+        stats['input_bytes'] + stats['frame_bytes']
+    )
+    for phase in 'query', 'copy', 'decode', 'finalize', 'postprocess':
+        assert stats[phase + '_wall_time'] >= 0
+        assert stats[phase + '_cpu_time'] >= 0
+    for phase in 'query', 'copy', 'decode', 'postprocess':
+        assert stats[phase + '_rss'] > 0
+        assert stats[phase + '_peak_rss'] > 0
+
+
+def test_phase_mark_keeps_peak_rss(monkeypatch):
+    def reset_peak_rss():
+        raise AssertionError('the peak rss was reset')
+
+    monkeypatch.setattr('warp_prism.reset_peak_rss', reset_peak_rss)
+    wall, cpu, rss, peak = _phase_mark()
+    assert rss > 0
+    assert peak > 0
+
+    def read_status(field):
+        raise FileNotFoundError('/proc/self/status')
+
+    # systems without /proc report no rss instead of raising
+    monkeypatch.setattr(_rss, '_read_status', read_status)
+    assert _rss.current_rss() is None
+    assert _phase_mark()[2] is None
+    assert _rss.peak_rss() > 0
+
+
+@pytest.mark.parametrize('null_density', [0.0, 0.2])
+def test_generated_copy_data(null_density):
+    dtypes = sorted(typeid_map, key=typeid_map.__getitem__)
+    copy_data = generate_copy_data(
+        5000,
+        dtypes,
+        null_density=null_density,
+        text_length=(0, 20),
+        seed=1,
+    )
+    # the data only depends on the seed
+    assert copy_data.buffer == generate_copy_data(
+        5000,
+        dtypes,
+        null_density=null_density,
+        text_length=(0, 20),
+        seed=1,
+    ).buffer
+
+    out = raw_to_arrays(copy_data.buffer, copy_data.type_ids)
+    for dtype, (expected, expected_mask), (array, mask) in zip(
+            dtypes,
+            copy_data.columns,
+            out):
+        assert array.dtype == np.dtype(dtype)
+        assert (mask == expected_mask).all()
+        assert (array[mask] == expected[mask]).all()
+        if null_density:
+            assert 0 < (~mask).sum() < len(mask)
+        else:
+            assert mask.all()
+
+
+def test_end_to_end_benchmark(tmp_db_uri):
+    results = end_to_end.run(
+        tmp_db_uri,
+        100,
+        shape_names=['narrow', 'null_heavy'],
+        reader_names=['warp_prism.to_arrays', 'psycopg2.fetchall'],
+        repeat=1,
+    )
+    assert [(r['shape'], r['reader']) for r in results] == [
+        ('narrow', 'warp_prism.to_arrays'),
+        ('narrow', 'psycopg2.fetchall'),
+        ('null_heavy', 'warp_prism.to_arrays'),
+        ('null_heavy', 'psycopg2.fetchall'),
+    ]
+    for result in results:
+        assert result['rows'] == 100
+        assert result['min_latency'] > 0
+        assert result['peak_rss_bytes'] >= 0
+
+
+@pytest.mark.parametrize('shape', sorted(end_to_end.shapes))
+def test_memory_baseline(shape):
+    # the tracked peak does not depend on the machine, this fails if a change
+    # makes decoding into a DataFrame use more memory
+    with open(memory.baseline_path) as f:
+        baseline = json.load(f)
+
+    dtypes, null_density, text_length = end_to_end.shapes[shape]
+    stats = memory.measure(
+        dtypes,
+        baseline['rows'],
+        null_density=null_density,
+        text_length=text_length,
+    )
+    assert stats['tracked_peak_bytes'] <= (
+        baseline['tracked_peak_bytes'][shape]
+    )
+    assert stats['tracked_peak_bytes'] >= (
+        stats['input_bytes'] + stats['output_bytes']
+    )
+
+
+def test_capture_replay(tmpdir):
+    dtypes = ['int64', 'object', 'datetime64[us]']
+    copy_data = generate_copy_data(1000, dtypes, null_density=0.1)
+    path = str(tmpdir.join('capture'))
+    write_capture(
+        path,
+        'COPY t TO STDOUT (FORMAT BINARY)',
+        ['a', 'b', 'c'],
+        copy_data.type_ids,
+        copy_data.buffer,
+    )
+
+    capture = read_capture(path)
+    assert capture.sql == 'COPY t TO STDOUT (FORMAT BINARY)'
+    assert capture.columns == ['a', 'b', 'c']
+    assert capture.dtypes == dtypes
+    assert capture.type_ids == copy_data.type_ids
+    assert capture.buffer == copy_data.buffer
+
+    result = replay.replay(path, repeat=1, cpu_hz=1e9)
+    assert result['rows'] == 1000
+    assert result['bytes'] == len(copy_data.buffer)
+    assert result['null_counts'] == {
+        name: (~mask).sum()
+        for name, (_, mask) in zip(capture.columns, copy_data.columns)
+    }
+
+
+def test_read_capture_invalid_magic():
+    with pytest.raises(ValueError) as e:
+        read_capture(BytesIO(postgres_signature))
+
+    assert str(e.value) == 'not a warp_prism capture file'
+
+
+def test_to_arrays_capture_roundtrip(tmp_table_uri):
+    input_dataframe = pd.DataFrame({'a': [1.0, np.nan, 3.0]})
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': Option('float64')],
+    )
+
+    capture_file = BytesIO()
+    arrays = to_arrays(table, capture=capture_file)
+    capture_file.seek(0)
+    capture = read_capture(capture_file)
+    assert capture.columns == ['a']
+    assert capture.dtypes == ['float64']
+
+    (array, mask), = raw_to_arrays(capture.buffer, capture.type_ids)
+    assert (array == arrays['a'][0]).all()
+    assert (mask == arrays['a'][1]).all()
+
+
+@pytest.mark.parametrize('text_cardinality', [1, 100, 20000, None])
+def test_intern_text(text_cardinality):
+    copy_data = generate_copy_data(
+        50000,
+        ['object', 'int64', 'object'],
+        null_density=0.1,
+        text_length=(0, 12),
+        text_cardinality=text_cardinality,
+    )
+
+    stats = {}
+    out = raw_to_arrays(
+        copy_data.buffer,
+        copy_data.type_ids,
+        stats=stats,
+        intern_text=True,
+    )
+    for (expected, expected_mask), (array, mask) in zip(
+            copy_data.columns,
+            out):
+        assert (mask == expected_mask).all()
+        assert (array[mask] == expected[mask]).all()
+
+    if text_cardinality is None:
+        # every value is unique so the intern tables are dropped
+        assert stats['intern_hits'] < 2 * 2 ** 14
+        return
+
+    assert stats['intern_hits'] > 0
+    if text_cardinality == 100:
+        # every copy of a value is the same object
+        text, mask = out[0]
+        values = {}
+        for value in text[mask]:
+            assert values.setdefault(value, value) is value
+
+
+def test_text_ascii_and_utf8():
+    # put a non-ascii character at every position of values which span the
+    # vector, word, and byte loops of the ascii check
+    values = []
+    for length in range(40):
+        ascii_value = ascii_letters[:length]
+        values.append(ascii_value)
+        for n in range(length):
+            values.append(ascii_value[:n] + '\xe9' + ascii_value[n + 1:])
+            values.append(ascii_value[:n] + '☃' + ascii_value[n + 1:])
+
+    (text, mask), = raw_to_arrays(
+        _pack_copy_data(
+            [(value.encode('utf-8'),) for value in values],
+            (None,),
+        ),
+        (_typeid_map[np.dtype(object)],),
+    )
+    assert mask.all()
+    assert list(text) == values
+
+
+_fixed_text_values = ['', 'ab', 'abcd', 'abcdefgh', 'caf\xe9', '\u2603\u2603']
+
+
+@pytest.mark.parametrize('kind', ['S', 'U'])
+@pytest.mark.parametrize('width', [1, 4, 16])
+def test_fixed_width_text(kind, width):
+    rows = [(value.encode('utf-8'),) for value in _fixed_text_values]
+    rows.append((None,))
+    buf = _pack_copy_data(rows, (None,))
+
+    def expected_value(value):
+        return value.encode('utf-8') if kind == 'S' else value
+
+    dtype = np.dtype('%s%d' % (kind, width))
+    (array, mask), = raw_to_arrays(
+        buf,
+        ((text_typeid_map[kind], width, True),),
+    )
+    assert array.dtype == dtype
+    assert list(mask) == [True] * len(_fixed_text_values) + [False]
+    expected = np.array(
+        [expected_value(value) for value in _fixed_text_values] + [''],
+        dtype=dtype,
+    )
+    np.testing.assert_array_equal(array, expected)
+
+    fits = [
+        value for value in _fixed_text_values
+        if len(expected_value(value)) <= width
+    ]
+    if len(fits) < len(_fixed_text_values):
+        with pytest.raises(ValueError) as e:
+            raw_to_arrays(buf, ((text_typeid_map[kind], width, False),))
+        assert 'does not fit in %s%d' % (kind, width) in str(e.value)
+    else:
+        (array, _), = raw_to_arrays(
+            buf,
+            ((text_typeid_map[kind], width, False),),
+        )
+        np.testing.assert_array_equal(array, expected)
+
+
+@pytest.mark.parametrize('type_ids', [
+    (text_typeid_map['S'],),
+    ((text_typeid_map['U'], 0, True),),
+    ((text_typeid_map['U'], 4),),
+    ((typeid_map['int64'], 4, True),),
+])
+def test_fixed_width_text_invalid_type_id(type_ids):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(_pack_copy_data([], ()), type_ids)
+
+
+def test_fixed_width_text_capture():
+    type_ids = (
+        typeid_map['int64'],
+        (text_typeid_map['U'], 8, True),
+        text_typeid_map['lazy'],
+    )
+    buf = _pack_copy_data(
+        [(1, b'a', b'b'), (2, None, None)],
+        ('q', None, None),
+    )
+    capture_file = BytesIO()
+    write_capture(capture_file, 'COPY', ['a', 'b', 'c'], type_ids, buf)
+    capture_file.seek(0)
+    capture = read_capture(capture_file)
+    assert capture.dtypes == ['int64', ['U', 8, True], 'lazy']
+    assert capture.type_ids == type_ids
+
+
+def test_to_arrays_text_dtypes(tmp_table_uri):
+    input_dataframe = pd.DataFrame({'a': ['ab', None, 'abcdef']})
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': Option('string')],
+    )
+
+    (array, mask), = to_arrays(
+        table,
+        text_dtypes={'a': 'U4'},
+        truncate_text=True,
+    ).values()
+    assert array.dtype == np.dtype('U4')
+    assert list(array) == ['ab', '', 'abcd']
+    assert list(mask) == [True, False, True]
+
+    with pytest.raises(ValueError):
+        to_arrays(table, text_dtypes={'a': 'S4'})
+
+    df = to_dataframe(table, text_dtypes={'a': 'S8'})
+    assert list(df['a']) == [b'ab', None, b'abcdef']
+
+
+def test_lazy_text():
+    values = ['a', None, '', 'caf\xe9', None, ascii_letters, '\u2603']
+    buf = bytearray(_pack_copy_data(
+        [
+            (n, None if value is None else value.encode('utf-8'))
+            for n, value in enumerate(values)
+        ],
+        ('q', None),
+    ))
+    (ints, _), (offsets, mask) = raw_to_arrays(
+        memoryview(buf),
+        (typeid_map['int64'], text_typeid_map['lazy']),
+    )
+    # the offsets keep the COPY data alive
+    del buf
+
+    assert offsets.dtype == np.dtype('int64')
+    assert list(mask) == [value is not None for value in values]
+
+    column = LazyText(offsets, mask)
+    assert len(column) == len(values)
+    assert list(column.materialize()) == values
+    assert list(column) == values
+    assert [column[n] for n in range(len(values))] == values
+    assert column[-1] == values[-1]
+    with pytest.raises(IndexError):
+        column[len(values)]
+
+    subset = column[mask][::2]
+    assert isinstance(subset, LazyText)
+    assert list(np.asarray(subset)) == [
+        value for value in values if value is not None
+    ][::2]
+
+
+def test_lazy_text_invalid_source():
+    with pytest.raises(TypeError):
+        LazyText(np.arange(3), np.ones(3, dtype=bool)).materialize()
+
+    (offsets, mask), = raw_to_arrays(
+        _pack_copy_data([(b'abc',)], (None,)),
+        (text_typeid_map['lazy'],),
+    )
+    with pytest.raises(ValueError):
+        LazyText(offsets + 1000, mask, _source=offsets).materialize()
+
+
+def test_to_arrays_lazy_text(tmp_table_uri):
+    input_dataframe = pd.DataFrame({'a': ['ab', None, 'abcdef']})
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': Option('string')],
+    )
+
+    (column, mask), = to_arrays(table, lazy_text=['a']).values()
+    assert isinstance(column, LazyText)
+    assert list(mask) == [True, False, True]
+    assert column[2] == 'abcdef'
+    assert list(column.materialize()) == ['ab', None, 'abcdef']
+
+
+def test_to_dataframe_nullable(tmp_table_uri):
+    # values above 2 ** 53 which do not survive a trip through float64
+    values = [2 ** 62 + 1, None, -2 ** 62 - 1]
+    input_dataframe = pd.DataFrame({'a': pd.array(values, dtype='Int64')})
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': Option('int64')],
+    )
+
+    df = to_dataframe(table, nullable=True)
+    assert df['a'].dtype == pd.Int64Dtype()
+    assert df['a'].tolist() == [2 ** 62 + 1, pd.NA, -2 ** 62 - 1]
+
+
+@pytest.mark.parametrize('null_density', [0.0, 0.9, 1.0])
+def test_raw_to_arrays_sparse(null_density):
+    dtypes = ['int64', 'float32', 'bool', 'datetime64[us]', 'object']
+    copy_data = generate_copy_data(1000, dtypes, null_density=null_density)
+    type_ids = tuple(
+        type_id if dtype == 'object' else (sparse_typeid, type_id)
+        for dtype, type_id in zip(dtypes, copy_data.type_ids)
+    )
+    stats = {}
+    out = raw_to_arrays(copy_data.buffer, type_ids, stats=stats)
+
+    for dtype, (values, indices), (expected, mask), null_count in zip(
+            dtypes,
+            out[:-1],
+            copy_data.columns,
+            stats['null_counts']):
+        assert values.dtype == np.dtype(dtype)
+        assert indices.dtype == np.dtype('int64')
+        np.testing.assert_array_equal(indices, np.flatnonzero(mask))
+        np.testing.assert_array_equal(values, expected[mask])
+        assert null_count == len(mask) - len(values)
+
+    # dense columns are unchanged
+    (text, text_mask), (expected, mask) = out[-1], copy_data.columns[-1]
+    assert (text_mask == mask).all()
+    assert list(text[mask]) == list(expected[mask])
+
+
+@pytest.mark.parametrize('type_ids', [
+    ((sparse_typeid, typeid_map['object']),),
+    ((sparse_typeid, text_typeid_map['lazy']),),
+    ((sparse_typeid, (sparse_typeid, typeid_map['int64'])),),
+    ((sparse_typeid, 1000),),
+    ((sparse_typeid,),),
+    (sparse_typeid,),
+])
+def test_sparse_invalid_type_id(type_ids):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(_pack_copy_data([], ()), type_ids)
+
+
+@pytest.mark.parametrize('nullable', [False, True])
+def test_arrays_to_dataframe_sparse(nullable):
+    dtypes = ['int64', 'float64', 'datetime64[us]', 'float64']
+    copy_data = generate_copy_data(1000, dtypes, null_density=0.9)
+    names = ['a', 'b', 'c', 'd']
+    type_ids = tuple(
+        (sparse_typeid, type_id) for type_id in copy_data.type_ids[:2]
+    ) + copy_data.type_ids[2:]
+    stats = {}
+    out = raw_to_arrays(
+        copy_data.buffer,
+        type_ids,
+        stats=stats,
+        null_masks=nullable,
+    )
+    sp_values = out[0][0]
+    df = _arrays_to_dataframe(
+        dict(zip(names, out)),
+        names,
+        null_counts=dict(zip(names, stats['null_counts'])),
+        nullable=nullable,
+        sparse=['a', 'b'],
+        sparse_threshold=0.5,
+        null_values={'d': -1.0},
+    )
+
+    assert list(df.dtypes) == [
+        pd.SparseDtype('int64', np.nan),
+        pd.SparseDtype('float64', np.nan),
+        pd.SparseDtype('datetime64[ns]', np.datetime64('nat', 'ns')),
+        pd.SparseDtype('float64', -1.0),
+    ]
+    # the decoded values are used in place
+    assert np.shares_memory(df['a'].array.sp_values, sp_values)
+    for name, (expected, mask) in zip(names, copy_data.columns):
+        column = df[name]
+        assert len(column) == len(mask)
+        np.testing.assert_array_equal(
+            column.array.sp_index.to_int_index().indices,
+            np.flatnonzero(mask),
+        )
+        assert (column[mask] == expected[mask]).all()
+
+
+@pytest.mark.parametrize('values,fill_value', [
+    (np.array([2 ** 62 + 1, -3]), None),
+    (np.array([1.5, -1.0]), -1.0),
+    (np.array([True, False]), None),
+    (np.array(['2014-01-01', '2015-01-01'], dtype='datetime64[us]'), None),
+])
+def test_sparse_array_dense_fallback(monkeypatch, values, fill_value):
+    indices = np.array([1, 4])
+    expected = _sparse_array(values, indices, 6, fill_value)
+    monkeypatch.setattr('warp_prism._IntIndex', None)
+    actual = _sparse_array(values, indices, 6, fill_value)
+
+    assert actual.dtype == expected.dtype
+    assert len(actual) == 6
+    np.testing.assert_array_equal(
+        np.asarray(actual[indices]),
+        np.asarray(expected[indices]),
+    )
+    assert pd.isna(actual[0]) == pd.isna(expected[0])
+
+
+def test_sparse_array_too_long():
+    # pandas keeps the row numbers of a sparse array as int32
+    with pytest.raises(OverflowError):
+        _sparse_array(np.array([1.0]), np.array([2 ** 31]), 2 ** 31 + 1, None)
+
+
+def test_arrays_to_dataframe_sparse_threshold():
+    copy_data = generate_copy_data(
+        1000,
+        ['float64', 'float64', 'object'],
+        null_density=0.5,
+    )
+    names = ['a', 'b', 'c']
+    (a, a_mask), b, c = raw_to_arrays(copy_data.buffer, copy_data.type_ids)
+    # make ``a`` mostly NULL
+    a_mask[100:] = False
+    df = _arrays_to_dataframe(
+        {'a': (a, a_mask), 'b': b, 'c': c},
+        names,
+        sparse_threshold=0.9,
+    )
+    assert isinstance(df['a'].dtype, pd.SparseDtype)
+    assert df['a'].isnull().sum() == len(a_mask) - a_mask.sum()
+    assert df['b'].dtype == np.dtype('float64')
+    assert df['c'].dtype == np.dtype(object)
+
+
+def test_sparse_capture():
+    type_ids = (
+        (sparse_typeid, typeid_map['float64']),
+        typeid_map['int64'],
+    )
+    buf = _pack_copy_data([(1.0, 1), (None, 2)], ('d', 'q'))
+    capture_file = BytesIO()
+    write_capture(capture_file, 'COPY', ['a', 'b'], type_ids, buf)
+    capture_file.seek(0)
+    capture = read_capture(capture_file)
+    assert capture.dtypes == [['sparse', 'float64'], 'int64']
+    assert capture.type_ids == type_ids
+
+
+def test_to_dataframe_sparse(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'a': [1.0, None, None, None],
+        'b': [None, None, None, 2.0],
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': Option('float64'), 'b': Option('float64')],
+    )
+
+    (values, indices), = to_arrays(table.select().with_only_columns(
+        [table.c.a],
+    ), sparse=['a']).values()
+    assert list(values) == [1.0]
+    assert list(indices) == [0]
+
+    with pytest.raises(ValueError):
+        to_arrays(table, sparse=['c'])
+
+    df = to_dataframe(table, sparse=['a'], sparse_threshold=0.5)
+    assert isinstance(df['a'].dtype, pd.SparseDtype)
+    assert isinstance(df['b'].dtype, pd.SparseDtype)
+    pd.util.testing.assert_frame_equal(
+        df.sparse.to_dense(),
+        input_dataframe,
+    )
+
+
+_pivot_rows = [
+    # (row key, column key, float value, int value)
+    (3, 10, 1.5, 7),
+    (1, 20, 2.5, None),
+    (3, 20, None, 9),
+    (None, 10, 1.0, 1),
+    (2, 30, 4.0, 4),
+    # replaces the second row
+    (1, 20, 5.0, 5),
+]
+_pivot_type_ids = (
+    typeid_map['int32'],
+    typeid_map['int64'],
+    typeid_map['float64'],
+    typeid_map['int64'],
+)
+
+
+def test_raw_to_pivot():
+    stats = {}
+    row_labels, column_labels, columns = raw_to_pivot(
+        _pack_copy_data(_pivot_rows, ('i', 'q', 'd', 'q')),
+        _pivot_type_ids,
+        0,
+        1,
+        stats=stats,
+    )
+    assert list(row_labels) == [1, 2, 3]
+    assert list(column_labels) == [10, 20, 30]
+    assert stats['rows'] == 6
+    assert stats['dropped_rows'] == 1
+
+    (floats, float_mask), (ints, int_mask) = columns
+    assert floats.shape == ints.shape == (3, 3)
+    np.testing.assert_array_equal(
+        np.where(float_mask, floats, np.nan),
+        [[np.nan, 5.0, np.nan],
+         [np.nan, np.nan, 4.0],
+         [1.5, np.nan, np.nan]],
+    )
+    np.testing.assert_array_equal(
+        int_mask,
+        [[False, True, False],
+         [False, False, True],
+         [True, True, False]],
+    )
+    assert ints.dtype == np.dtype('int64')
+    assert ints[int_mask].tolist() == [5, 4, 7, 9]
+
+
+def test_raw_to_pivot_labels():
+    stats = {}
+    row_labels, column_labels, columns = raw_to_pivot(
+        _pack_copy_data(_pivot_rows, ('i', 'q', 'd', 'q')),
+        _pivot_type_ids,
+        row_key=0,
+        column_key=1,
+        row_labels=[3, 1, 4],
+        column_labels=[20, 10],
+        stats=stats,
+    )
+    assert list(row_labels) == [3, 1, 4]
+    assert list(column_labels) == [20, 10]
+    # the NULL key and the key of 2 are dropped
+    assert stats['dropped_rows'] == 2
+
+    (floats, float_mask), _ = columns
+    np.testing.assert_array_equal(
+        np.where(float_mask, floats, np.nan),
+        [[np.nan, 1.5],
+         [5.0, np.nan],
+         [np.nan, np.nan]],
+    )
+
+    with pytest.raises(ValueError) as e:
+        raw_to_pivot(
+            _pack_copy_data(_pivot_rows, ('i', 'q', 'd', 'q')),
+            _pivot_type_ids,
+            0,
+            1,
+            column_labels=[10, 20, 10],
+        )
+    assert str(e.value) == 'duplicate column label: 10'
+
+
+def test_raw_to_pivot_matches_pandas():
+    copy_data = generate_copy_data(
+        5000,
+        ['int16', 'datetime64[D]', 'float32', 'datetime64[us]'],
+        null_density=0.1,
+        seed=2,
+    )
+    buf = copy_data.buffer
+    (sids, sid_mask), (dates, date_mask), _, _ = raw_to_arrays(
+        buf,
+        copy_data.type_ids,
+    )
+    row_labels, column_labels, columns = raw_to_pivot(
+        buf,
+        copy_data.type_ids,
+        1,
+        0,
+    )
+    assert row_labels.dtype == np.dtype('int64')
+
+    valid = sid_mask & date_mask
+    expected_rows = np.unique(dates[valid].view('int64'))
+    expected_columns = np.unique(sids[valid])
+    np.testing.assert_array_equal(row_labels, expected_rows)
+    np.testing.assert_array_equal(column_labels, expected_columns)
+
+    for (values, mask), (expected, expected_mask) in zip(
+            columns,
+            copy_data.columns[2:]):
+        assert values.shape == (len(row_labels), len(column_labels))
+        rows = np.searchsorted(row_labels, dates[valid].view('int64'))
+        cols = np.searchsorted(column_labels, sids[valid])
+        # the keys are random so each cell has at most one row
+        assert mask.sum() == (valid & expected_mask).sum()
+        assert (mask[rows, cols] == expected_mask[valid]).all()
+        np.testing.assert_array_equal(
+            values[rows, cols][expected_mask[valid]],
+            expected[valid & expected_mask],
+        )
+        if values.dtype.kind == 'M':
+            assert np.isnat(values[~mask]).all()
+
+
+@pytest.mark.parametrize('type_ids,row_key,column_key', [
+    (_pivot_type_ids, 0, 0),
+    (_pivot_type_ids, 0, 4),
+    (_pivot_type_ids, -1, 0),
+    (_pivot_type_ids, 0, 2),
+    (_pivot_type_ids[:3] + (typeid_map['object'],), 0, 1),
+    (_pivot_type_ids[:3] + (text_typeid_map['lazy'],), 0, 1),
+    (
+        _pivot_type_ids[:3] + ((sparse_typeid, typeid_map['float64']),),
+        0,
+        1,
+    ),
+])
+def test_raw_to_pivot_invalid(type_ids, row_key, column_key):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_pivot(
+            _pack_copy_data([], ()),
+            type_ids,
+            row_key,
+            column_key,
+        )
+
+
+def test_to_pivot(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'asof_date': pd.to_datetime(
+            ['2014-01-02', '2014-01-02', '2014-01-03'],
+        ),
+        'sid': [1, 2, 2],
+        'value': [1.0, 2.0, None],
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R[
+            'asof_date': 'datetime',
+            'sid': 'int64',
+            'value': Option('float64'),
+        ],
+    )
+
+    stats = {}
+    dates, sids, arrays = to_pivot(
+        table,
+        row_key='asof_date',
+        column_key='sid',
+        stats=stats,
+    )
+    assert dates.dtype == np.dtype('datetime64[us]')
+    assert list(dates) == list(
+        pd.to_datetime(['2014-01-02', '2014-01-03']).values.astype(
+            'datetime64[us]',
+        ),
+    )
+    assert list(sids) == [1, 2]
+    (values, mask), = arrays.values()
+    assert list(arrays) == ['value']
+    np.testing.assert_array_equal(mask, [[True, True], [False, False]])
+    np.testing.assert_array_equal(values[mask], [1.0, 2.0])
+    assert stats['rows'] == 3
+
+    dates, sids, arrays = to_pivot(
+        table,
+        row_key='asof_date',
+        column_key='sid',
+        row_labels=pd.to_datetime(['2014-01-03', '2014-01-02']),
+        column_labels=[2, 3],
+    )
+    (values, mask), = arrays.values()
+    np.testing.assert_array_equal(mask, [[False, False], [True, False]])
+    assert values[1, 0] == 2.0
+
+
+_asof_rows = [
+    # (sid, asof_date, timestamp, value)
+    (1, 10, 100, b'a'),
+    (2, 10, 100, b'b'),
+    (1, 10, 300, b'c'),
+    (1, 11, 200, b'd'),
+    # superseded by the row with timestamp 300
+    (1, 10, 200, b'e'),
+    # a NULL version is never the latest
+    (2, 10, None, b'f'),
+    # NULL keys are equal to each other
+    (None, 10, 100, b'g'),
+    (None, 10, 150, b'h'),
+    # the later row wins a tie
+    (2, 10, 100, b'i'),
+]
+_asof_type_ids = (
+    typeid_map['int64'],
+    typeid_map['int32'],
+    typeid_map['int64'],
+    typeid_map['object'],
+)
+_asof_formats = ('q', 'i', 'q', 's')
+
+
+@pytest.mark.parametrize('cutoff,expected', [
+    (None, ['c', 'd', 'h', 'i']),
+    (250, ['d', 'e', 'h', 'i']),
+    (100, ['a', 'g', 'i']),
+    (0, []),
+])
+def test_raw_to_arrays_asof(cutoff, expected):
+    stats = {}
+    out = raw_to_arrays(
+        _pack_copy_data(_asof_rows, _asof_formats),
+        _asof_type_ids,
+        stats=stats,
+        asof=((0, 1), 2, cutoff),
+    )
+    assert list(out[3][0]) == expected
+    assert stats['rows'] == len(expected)
+    assert stats['asof_dropped_rows'] == len(_asof_rows) - len(expected)
+
+
+def test_raw_to_arrays_asof_no_keys():
+    out = raw_to_arrays(
+        _pack_copy_data(_asof_rows, _asof_formats),
+        _asof_type_ids,
+        asof=((), 2, None),
+    )
+    assert list(out[3][0]) == ['c']
+
+
+@pytest.mark.parametrize('text_length', [4, 32])
+def test_raw_to_arrays_asof_matches_pandas(text_length):
+    random_state = np.random.RandomState(0)
+    n = 5000
+    input_dataframe = pd.DataFrame({
+        'sid': random_state.randint(0, 50, n),
+        'name': [
+            ('%d' % v).rjust(text_length, 'x').encode()
+            for v in random_state.randint(0, 20, n)
+        ],
+        'timestamp': random_state.randint(0, 100, n),
+        'value': np.arange(n),
+    })
+
+    out = raw_to_arrays(
+        _pack_copy_data(
+            input_dataframe.itertuples(index=False),
+            ('q', 's', 'q', 'q'),
+        ),
+        (
+            typeid_map['int64'],
+            typeid_map['object'],
+            typeid_map['int64'],
+            typeid_map['int64'],
+        ),
+        asof=((0, 1), 2, 80),
+    )
+
+    expected = input_dataframe[input_dataframe.timestamp <= 80].sort_values(
+        'timestamp',
+        kind='stable',
+    ).drop_duplicates(['sid', 'name'], keep='last')
+    np.testing.assert_array_equal(out[3][0], np.sort(expected.value.values))
+
+
+def test_raw_to_arrays_asof_lazy_text():
+    (values, mask), = raw_to_arrays(
+        _pack_copy_data(
+            [(b'a', None), (b'b', 1), (b'c', 2), (b'd', 2)],
+            ('s', 'q'),
+        ),
+        (text_typeid_map['lazy'], typeid_map['int64']),
+        asof=((), 1, None),
+    )[:1]
+    # the offsets point into the compacted data which the column keeps alive
+    assert list(LazyText(values, mask)) == ['d']
+
+
+@pytest.mark.parametrize('asof', [
+    ((0,), 4, None),
+    ((0,), -1, None),
+    ((4,), 2, None),
+    ((0,), 3, None),
+    ([0], 2, None),
+    ((0,), 2),
+    ((0,), 2, 'a'),
+])
+def test_raw_to_arrays_asof_invalid(asof):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(_pack_copy_data([], ()), _asof_type_ids, asof=asof)
+
+
+def test_to_dataframe_asof(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'sid': [1, 1, 2, 1],
+        'asof_date': pd.to_datetime(
+            ['2014-01-02', '2014-01-02', '2014-01-02', '2014-01-02'],
+        ),
+        'timestamp': pd.to_datetime(
+            ['2014-01-03', '2014-01-05', '2014-01-04', '2014-01-04'],
+        ),
+        'value': [1.0, 2.0, 3.0, 4.0],
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R[
+            'sid': 'int64',
+            'asof_date': 'datetime',
+            'timestamp': 'datetime',
+            'value': 'float64',
+        ],
+    )
+
+    stats = {}
+    df = to_dataframe(
+        table,
+        stats=stats,
+        asof_keys=['sid', 'asof_date'],
+        asof_version='timestamp',
+    )
+    assert df.value.tolist() == [2.0, 3.0]
+    assert stats['asof_dropped_rows'] == 2
+
+    df = to_dataframe(
+        table,
+        asof_keys=['sid', 'asof_date'],
+        asof_version='timestamp',
+        asof_cutoff=pd.Timestamp('2014-01-04'),
+    )
+    assert df.value.tolist() == [3.0, 4.0]
+
+    with pytest.raises(TypeError):
+        to_arrays(table, asof_keys=['sid'])
+
+    with pytest.raises(ValueError):
+        to_arrays(table, asof_keys=['sid'], asof_version='not_a_column')
+
+
+_groupby_rows = [
+    # (sid, asof_date, value, count, name)
+    (1, 10, 1.5, 3, b'a'),
+    (2, 10, 2.0, None, b'b'),
+    (1, 10, float('nan'), 4, None),
+    (None, 11, 4.0, 5, b'c'),
+    (1, 11, None, -1, b'd'),
+    (2, 10, -1.0, 7, b'e'),
+]
+_groupby_type_ids = (
+    typeid_map['int64'],
+    typeid_map['datetime64[D]'],
+    typeid_map['float64'],
+    typeid_map['int32'],
+    typeid_map['object'],
+)
+_groupby_formats = ('q', 'i', 'd', 'i', 's')
+
+
+def test_raw_to_groupby():
+    stats = {}
+    (sids, dates), aggregates = raw_to_groupby(
+        _pack_copy_data(_groupby_rows, _groupby_formats),
+        _groupby_type_ids,
+        (0, 1),
+        (
+            (2, 'sum'),
+            (2, 'mean'),
+            (2, 'count'),
+            (3, 'sum'),
+            (3, 'min'),
+            (3, 'max'),
+            (4, 'count'),
+            (1, 'max'),
+        ),
+        stats=stats,
+    )
+    assert stats['rows'] == 6
+    assert stats['groups'] == 4
+
+    # the groups are in the order they are first seen
+    np.testing.assert_array_equal(sids[1], [True, True, False, True])
+    assert sids[0][sids[1]].tolist() == [1, 2, 1]
+    assert dates[0].dtype == np.dtype('datetime64[D]')
+    np.testing.assert_array_equal(
+        dates[0] - np.datetime64('2000-01-01'),
+        np.array([10, 10, 11, 11], dtype='timedelta64[D]'),
+    )
+
+    (
+        (value_sum, value_sum_mask),
+        (value_mean, _),
+        (value_count, value_count_mask),
+        (count_sum, count_sum_mask),
+        (count_min, _),
+        (count_max, _),
+        (name_count, _),
+        (date_max, _),
+    ) = aggregates
+    # NULLs and NaNs are skipped
+    np.testing.assert_array_equal(value_sum, [1.5, 1.0, 4.0, 0.0])
+    np.testing.assert_array_equal(value_sum_mask, [True, True, True, False])
+    np.testing.assert_array_equal(value_mean, [1.5, 0.5, 4.0, np.nan])
+    np.testing.assert_array_equal(value_count, [1, 2, 1, 0])
+    assert value_count_mask.all()
+    assert count_sum.dtype == np.dtype('int64')
+    np.testing.assert_array_equal(count_sum, [7, 7, 5, -1])
+    np.testing.assert_array_equal(count_sum_mask, [True, True, True, True])
+    assert count_min.dtype == np.dtype('int32')
+    np.testing.assert_array_equal(count_min, [3, 7, 5, -1])
+    np.testing.assert_array_equal(count_max, [4, 7, 5, -1])
+    np.testing.assert_array_equal(name_count, [1, 2, 1, 1])
+    np.testing.assert_array_equal(date_max, dates[0])
+
+
+@pytest.mark.parametrize('cardinality', [1, 100, 20000])
+def test_raw_to_groupby_matches_pandas(cardinality):
+    random_state = np.random.RandomState(0)
+    n = 50000
+    input_dataframe = pd.DataFrame({
+        'sid': random_state.randint(0, cardinality, n),
+        'kind': random_state.randint(0, 3, n).astype('int16'),
+        'value': random_state.standard_normal(n),
+        'count': random_state.randint(-100, 100, n),
+    })
+
+    keys, aggregates = raw_to_groupby(
+        _pack_copy_data(
+            input_dataframe.itertuples(index=False),
+            ('q', 'h', 'd', 'q'),
+        ),
+        (
+            typeid_map['int64'],
+            typeid_map['int16'],
+            typeid_map['float64'],
+            typeid_map['int64'],
+        ),
+        (0, 1),
+        ((2, 'sum'), (2, 'mean'), (3, 'min'), (3, 'max'), (3, 'count')),
+    )
+    result = pd.DataFrame(
+        {
+            name: values
+            for name, (values, _) in zip(
+                ['sum', 'mean', 'min', 'max', 'count'],
+                aggregates,
+            )
+        },
+        index=pd.MultiIndex.from_arrays(
+            [values for values, _ in keys],
+            names=['sid', 'kind'],
+        ),
+    )
+
+    expected = input_dataframe.groupby(['sid', 'kind'], sort=False).agg(
+        sum=('value', 'sum'),
+        mean=('value', 'mean'),
+        min=('count', 'min'),
+        max=('count', 'max'),
+        count=('count', 'count'),
+    )
+    pd.testing.assert_frame_equal(result, expected)
+
+
+def test_raw_to_groupby_no_keys():
+    keys, ((total, mask),) = raw_to_groupby(
+        _pack_copy_data(_groupby_rows, _groupby_formats),
+        _groupby_type_ids,
+        (),
+        ((3, 'sum'),),
+    )
+    assert keys == ()
+    assert total.tolist() == [18]
+
+
+def test_raw_to_groupby_overflow():
+    with pytest.raises(OverflowError):
+        raw_to_groupby(
+            _pack_copy_data([(1, 2 ** 62), (1, 2 ** 62)], ('q', 'q')),
+            (typeid_map['int64'], typeid_map['int64']),
+            (0,),
+            ((1, 'sum'),),
+        )
+
+
+@pytest.mark.parametrize('keys,aggregations', [
+    ((5,), ()),
+    ((-1,), ()),
+    ((2,), ()),
+    ((4,), ()),
+    ((0,), ((5, 'sum'),)),
+    ((0,), ((2, 'median'),)),
+    ((0,), ((4, 'sum'),)),
+    ((0,), ((4, 'min'),)),
+    ((0,), ((1, 'mean'),)),
+    ((0,), ((2,),)),
+    ([0], ()),
+])
+def test_raw_to_groupby_invalid(keys, aggregations):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_groupby(
+            _pack_copy_data([], ()),
+            _groupby_type_ids,
+            keys,
+            aggregations,
+        )
+
+
+def test_to_groupby(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'sid': [2, 1, 2, 1],
+        'value': [1.0, 2.0, 3.0, None],
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['sid': 'int64', 'value': Option('float64')],
+    )
+
+    stats = {}
+    keys, aggregates = to_groupby(
+        table,
+        by='sid',
+        aggregations={
+            'total': ('value', 'sum'),
+            'values': ('value', 'count'),
+        },
+        stats=stats,
+    )
+    assert stats['groups'] == 2
+    assert list(keys) == ['sid']
+    assert keys['sid'][0].tolist() == [1, 2]
+    assert aggregates['total'][0].tolist() == [2.0, 4.0]
+    assert aggregates['values'][0].tolist() == [1, 2]
+
+    keys, _ = to_groupby(
+        table,
+        by=['sid'],
+        aggregations={},
+        sort=False,
+    )
+    assert keys['sid'][0].tolist() == [2, 1]
+
+    with pytest.raises(ValueError):
+        to_groupby(table, by='sid', aggregations={'x': ('nope', 'sum')})
+
+
+_split_rows = [
+    # (sid, value, name)
+    (3, 1.0, b'a'),
+    (1, 2.0, b'b'),
+    (None, 3.0, b'c'),
+    (3, None, b'd'),
+    (-5, 5.0, None),
+    (1, 6.0, b'f'),
+]
+_split_type_ids = (
+    typeid_map['int64'],
+    typeid_map['float64'],
+    typeid_map['object'],
+)
+_split_formats = ('q', 'd', 's')
+
+
+def test_raw_to_arrays_split():
+    stats = {}
+    labels, offsets, out = raw_to_arrays(
+        _pack_copy_data(_split_rows, _split_formats),
+        _split_type_ids,
+        stats=stats,
+        split=0,
+    )
+    assert labels.tolist() == [-5, 1, 3]
+    # the NULL keys are after the last offset
+    assert offsets.tolist() == [0, 1, 3, 5]
+    assert stats['rows'] == len(_split_rows)
+
+    sids, sid_mask = out[0]
+    assert sids[:5].tolist() == [-5, 1, 1, 3, 3]
+    assert sid_mask.tolist() == [True] * 5 + [False]
+    # the rows of each key keep their order
+    assert list(out[2][0]) == [None, 'b', 'f', 'a', 'd', 'c']
+    assert out[1][1].tolist() == [True, True, True, True, False, True]
+
+
+def test_raw_to_arrays_split_empty():
+    labels, offsets, out = raw_to_arrays(
+        _pack_copy_data([], _split_formats),
+        _split_type_ids,
+        split=0,
+    )
+    assert labels.tolist() == []
+    assert offsets.tolist() == [0]
+    assert len(out[0][0]) == 0
+
+
+@pytest.mark.parametrize('cardinality', [1, 100, 20000])
+def test_raw_to_arrays_split_matches_pandas(cardinality):
+    random_state = np.random.RandomState(0)
+    n = 50000
+    input_dataframe = pd.DataFrame({
+        'sid': random_state.randint(0, cardinality, n).astype('int32'),
+        'value': np.arange(n),
+    })
+
+    labels, offsets, out = raw_to_arrays(
+        _pack_copy_data(input_dataframe.itertuples(index=False), ('i', 'q')),
+        (typeid_map['int32'], typeid_map['int64']),
+        split=0,
+    )
+
+    groups = input_dataframe.groupby('sid').value
+    np.testing.assert_array_equal(labels, list(groups.groups))
+    assert offsets[-1] == n
+    for label, start, stop in zip(labels, offsets[:-1], offsets[1:]):
+        np.testing.assert_array_equal(
+            out[1][0][start:stop],
+            groups.get_group(label).values,
+        )
+
+
+def test_raw_to_arrays_split_asof_lazy_text():
+    (values, mask), _ = raw_to_arrays(
+        _pack_copy_data(
+            [(b'a', 2, 1), (b'b', 1, 1), (b'c', 2, 0), (b'd', 1, 0)],
+            ('s', 'q', 'q'),
+        ),
+        (text_typeid_map['lazy'], typeid_map['int64'], typeid_map['int64']),
+        asof=((1,), 2, None),
+        split=1,
+    )[2][:2]
+    # the offsets point into the reordered data which the column keeps alive
+    assert list(LazyText(values, mask)) == ['b', 'a']
+
+
+@pytest.mark.parametrize('split', [3, -1, 2, 'a'])
+def test_raw_to_arrays_split_invalid(split):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(
+            _pack_copy_data([], _split_formats),
+            _split_type_ids,
+            split=split,
+        )
+
+
+def test_to_arrays_split(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'sid': [2, 1, 2, 1],
+        'asof_date': pd.to_datetime(
+            ['2014-01-02', '2014-01-03', '2014-01-04', '2014-01-05'],
+        ),
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['sid': 'int64', 'asof_date': 'datetime'],
+    )
+
+    labels, offsets, arrays = to_arrays(table, split_by='asof_date')
+    assert labels.dtype == np.dtype('datetime64[us]')
+    assert offsets.tolist() == [0, 1, 2, 3, 4]
+    assert arrays['sid'][0].tolist() == [2, 1, 2, 1]
+
+    labels, offsets, arrays = to_arrays(table, split_by='sid')
+    assert labels.tolist() == [1, 2]
+    assert offsets.tolist() == [0, 2, 4]
+    assert arrays['asof_date'][0].tolist() == (
+        input_dataframe.asof_date.values[[1, 3, 0, 2]].tolist()
+    )
+
+    with pytest.raises(ValueError):
+        to_arrays(table, split_by='not_a_column')
+
+
+_sort_rows = [
+    # (sid, value, flag, name)
+    (3, 1.5, True, b'a'),
+    (-1, float('nan'), False, b'b'),
+    (None, -0.0, True, b'c'),
+    (3, float('-inf'), None, b'd'),
+    (-1, 0.0, False, b'e'),
+    (2, None, True, b'f'),
+    (-1, -2.5, True, b'g'),
+]
+_sort_type_ids = (
+    typeid_map['int32'],
+    typeid_map['float64'],
+    typeid_map['bool'],
+    typeid_map['object'],
+)
+_sort_formats = ('i', 'd', '?', 's')
+
+
+@pytest.mark.parametrize('sort,expected', [
+    ((0,), ['b', 'e', 'g', 'f', 'a', 'd', 'c']),
+    # -0.0 is equal to 0.0 and NaN is after the other values
+    ((1,), ['d', 'g', 'c', 'e', 'a', 'b', 'f']),
+    ((2, 0), ['b', 'e', 'g', 'f', 'a', 'c', 'd']),
+    ((0, 1), ['g', 'e', 'b', 'f', 'd', 'a', 'c']),
+    ((), ['a', 'b', 'c', 'd', 'e', 'f', 'g']),
+])
+def test_raw_to_arrays_sort(sort, expected):
+    out = raw_to_arrays(
+        _pack_copy_data(_sort_rows, _sort_formats),
+        _sort_type_ids,
+        sort=sort,
+    )
+    assert list(out[3][0]) == expected
+
+
+@pytest.mark.parametrize('dtype,format', [
+    ('int16', 'h'),
+    ('int64', 'q'),
+    ('float32', 'f'),
+    ('float64', 'd'),
+])
+def test_raw_to_arrays_sort_matches_pandas(dtype, format):
+    random_state = np.random.RandomState(0)
+    n = 50000
+    input_dataframe = pd.DataFrame({
+        'key': (random_state.randn(n) * 1000).astype(dtype),
+        'group': random_state.randint(0, 300, n),
+        'value': np.arange(n),
+    })
+    if dtype.startswith('float'):
+        input_dataframe.loc[::17, 'key'] = np.nan
+
+    out = raw_to_arrays(
+        _pack_copy_data(
+            input_dataframe.itertuples(index=False),
+            (format, 'q', 'q'),
+        ),
+        (typeid_map[dtype], typeid_map['int64'], typeid_map['int64']),
+        sort=(1, 0),
+    )
+
+    expected = input_dataframe.sort_values(['group', 'key'], kind='stable')
+    np.testing.assert_array_equal(out[2][0], expected.value.values)
+
+
+def test_raw_to_arrays_sort_threads():
+    random_state = np.random.RandomState(1)
+    # enough rows for a few sort threads, which do not split evenly
+    n = 3 * 2 ** 16 + 17
+    input_dataframe = pd.DataFrame({
+        'key': random_state.randn(n),
+        'group': random_state.randint(-3, 3, n).astype('int16'),
+        'text': random_state.randint(0, 1000, n).astype(str),
+    })
+    input_dataframe.loc[::13, 'key'] = np.nan
+    data = _pack_copy_data(
+        (
+            (key, group, text.encode())
+            for key, group, text in input_dataframe.itertuples(index=False)
+        ),
+        ('d', 'h', 's'),
+    )
+    expected = input_dataframe.sort_values(['group', 'key'], kind='stable')
+
+    old_threads = sort_threads()
+    try:
+        for nthreads in (1, 2, 3, 8, 0):
+            set_sort_threads(nthreads)
+            out = raw_to_arrays(
+                data,
+                (
+                    typeid_map['float64'],
+                    typeid_map['int16'],
+                    typeid_map['object'],
+                ),
+                sort=(1, 0),
+            )
+            np.testing.assert_array_equal(out[1][0], expected.group.values)
+            # the rows of every length are copied to the right place
+            np.testing.assert_array_equal(out[2][0], expected.text.values)
+    finally:
+        set_sort_threads(old_threads)
+
+    with pytest.raises(ValueError):
+        set_sort_threads(-1)
+
+
+def test_raw_to_arrays_sort_split():
+    labels, offsets, out = raw_to_arrays(
+        _pack_copy_data(_sort_rows, _sort_formats),
+        _sort_type_ids,
+        split=0,
+        sort=(1,),
+    )
+    assert labels.tolist() == [-1, 2, 3]
+    assert list(out[3][0]) == ['g', 'e', 'b', 'f', 'd', 'a', 'c']
+
+
+@pytest.mark.parametrize('sort', [(4,), (-1,), (3,), [0], ('a',)])
+def test_raw_to_arrays_sort_invalid(sort):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(
+            _pack_copy_data([], _sort_formats),
+            _sort_type_ids,
+            sort=sort,
+        )
+
+
+def test_to_arrays_sort(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'sid': [2, 1, 2, 1],
+        'value': [1.0, 2.0, 3.0, None],
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['sid': 'int64', 'value': Option('float64')],
+    )
+
+    arrays = to_arrays(table, sort_by='value')
+    assert arrays['sid'][0].tolist() == [2, 1, 2, 1]
+    assert arrays['value'][1].tolist() == [True, True, True, False]
+
+    arrays = to_arrays(table, sort_by=['sid', 'value'])
+    assert arrays['sid'][0].tolist() == [1, 1, 2, 2]
+    assert arrays['value'][0][[0, 2, 3]].tolist() == [2.0, 1.0, 3.0]
+    assert arrays['value'][1].tolist() == [True, False, True, True]
+
+    labels, offsets, arrays = to_arrays(
+        table,
+        split_by='sid',
+        sort_by='value',
+    )
+    assert offsets.tolist() == [0, 2, 4]
+    assert arrays['value'][1].tolist() == [True, False, True, True]
+
+    with pytest.raises(ValueError):
+        to_arrays(table, sort_by='not_a_column')
+
+
+@pytest.mark.parametrize('npartitions', [1, 3, 16])
+def test_raw_to_arrays_partition(npartitions):
+    random_state = np.random.RandomState(0)
+    n = 5000
+    input_dataframe = pd.DataFrame({
+        'sid': random_state.randint(0, 200, n),
+        'asof_date': random_state.randint(0, 30, n).astype('int32'),
+        'value': np.arange(n),
+    })
+
+    offsets, out = raw_to_arrays(
+        _pack_copy_data(
+            input_dataframe.itertuples(index=False),
+            ('q', 'i', 'q'),
+        ),
+        (
+            typeid_map['int64'],
+            typeid_map['datetime64[D]'],
+            typeid_map['int64'],
+        ),
+        partition=((0, 1), npartitions),
+    )
+    assert len(offsets) == npartitions + 1
+    assert offsets[-1] == n
+
+    partitions = hash_partitions(
+        [
+            input_dataframe.sid.values,
+            # postgres dates are days since 2000-01-01
+            (
+                input_dataframe.asof_date.values.astype('datetime64[D]') +
+                (np.datetime64('2000-01-01') - np.datetime64('1970-01-01'))
+            ),
+        ],
+        npartitions,
+    )
+    for partition, (start, stop) in enumerate(zip(offsets[:-1], offsets[1:])):
+        # the rows of each partition keep their order
+        np.testing.assert_array_equal(
+            out[2][0][start:stop],
+            input_dataframe.value.values[partitions == partition],
+        )
+
+
+def test_raw_to_arrays_partition_nulls():
+    offsets, out = raw_to_arrays(
+        _pack_copy_data(_split_rows, _split_formats),
+        _split_type_ids,
+        partition=((0,), 4),
+    )
+    partitions = hash_partitions(
+        [[0 if row[0] is None else row[0] for row in _split_rows]],
+        4,
+    )
+    expected = [
+        row[1] for partition in range(4)
+        for row, row_partition in zip(_split_rows, partitions)
+        if row_partition == partition
+    ]
+    np.testing.assert_array_equal(
+        np.where(out[1][1], out[1][0], None),
+        np.array(expected, dtype=object),
+    )
+    counts = np.bincount(partitions, minlength=4)
+    assert offsets.tolist() == [0, *np.cumsum(counts)]
+
+
+@pytest.mark.parametrize('partition', [
+    ((0,), 0),
+    ((3,), 2),
+    ((1,), 2),
+    ([0], 2),
+    ((0,),),
+    ((), 2),
+])
+def test_raw_to_arrays_partition_invalid(partition):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(
+            _pack_copy_data([], _split_formats),
+            _split_type_ids,
+            partition=partition,
+        )
+
+    with pytest.raises(TypeError):
+        raw_to_arrays(
+            _pack_copy_data([], _split_formats),
+            _split_type_ids,
+            split=0,
+            partition=((0,), 2),
+        )
+
+
+def test_to_arrays_partition(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'sid': np.arange(100),
+        'value': np.arange(100) * 0.5,
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['sid': 'int64', 'value': 'float64'],
+    )
+
+    partitions = to_arrays(table, partition_by='sid', npartitions=4)
+    assert len(partitions) == 4
+    expected = hash_partitions([input_dataframe.sid.values], 4)
+    for partition, arrays in enumerate(partitions):
+        np.testing.assert_array_equal(
+            arrays['sid'][0],
+            input_dataframe.sid.values[expected == partition],
+        )
+        assert arrays['value'][1].all()
+
+    with pytest.raises(TypeError):
+        to_arrays(table, partition_by='sid')
+
+    with pytest.raises(ValueError):
+        to_arrays(table, partition_by='not_a_column', npartitions=4)
+
+
+@pytest.mark.parametrize('max_rows', [0, 1, 4, 7, 100])
+@pytest.mark.parametrize('fixed_width', [True, False])
+def test_raw_to_arrays_max_rows(max_rows, fixed_width):
+    rows = [
+        (n, None if n % 3 else float(n), b'x' * n)
+        for n in range(7)
+    ]
+    type_ids = (
+        typeid_map['int64'],
+        typeid_map['float64'],
+        typeid_map['object'],
+    )
+    if fixed_width:
+        rows = [row[:2] for row in rows]
+        type_ids = type_ids[:2]
+
+    stats = {}
+    out = raw_to_arrays(
+        _pack_copy_data(rows, ('q', 'd', 's')[:len(type_ids)]),
+        type_ids,
+        stats=stats,
+        max_rows=max_rows,
+    )
+    expected = rows[:max_rows]
+    assert stats['rows'] == len(expected)
+    assert out[0][0].tolist() == [row[0] for row in expected]
+    assert out[1][1].tolist() == [row[1] is not None for row in expected]
+    if not fixed_width:
+        assert list(out[2][0]) == [row[2].decode() for row in expected]
+
+
+def test_raw_to_arrays_max_rows_asof():
+    # the limit applies to the rows which are read, before asof drops any
+    out = raw_to_arrays(
+        _pack_copy_data(_asof_rows, _asof_formats),
+        _asof_type_ids,
+        asof=((0, 1), 2, None),
+        max_rows=4,
+    )
+    assert list(out[3][0]) == ['b', 'c', 'd']
+
+
+@pytest.mark.parametrize('max_rows,exc', [
+    (-1, ValueError),
+    (-2, ValueError),
+    ('a', TypeError),
+])
+def test_raw_to_arrays_max_rows_invalid(max_rows, exc):
+    with pytest.raises(exc):
+        raw_to_arrays(
+            _pack_copy_data([], _split_formats),
+            _split_type_ids,
+            max_rows=max_rows,
+        )
+
+
+def test_to_arrays_max_rows_invalid():
+    table = sa.Table('t', sa.MetaData(), sa.Column('a', sa.Integer))
+    # this fails before the query runs, so no database is needed
+    with pytest.raises(ValueError):
+        to_arrays(table, bind='postgresql://invalid', max_rows=-5)
+
+
+@pytest.mark.parametrize('chunk_size', [1, 5, 4096])
+def test_count_rows(chunk_size):
+    data = _pack_copy_data(_split_rows, _split_formats)
+    header_len = len(postgres_signature) + 8
+    received = b''
+    cursor = -1
+    rows = 0
+    ended = False
+    for n in range(0, len(data), chunk_size):
+        received += data[n:n + chunk_size]
+        cursor, new_rows, ended = count_rows(received, cursor, 100)
+        rows += new_rows
+        if len(received) < header_len:
+            assert cursor == -1
+        else:
+            # the cursor only moves past whole rows
+            assert header_len <= cursor <= len(received)
+
+    assert ended
+    assert rows == len(_split_rows)
+    assert cursor == len(data) - 2
+
+    # the count stops at the limit
+    cursor, rows, ended = count_rows(data, -1, 2)
+    assert rows == 2
+    assert not ended
+    assert count_rows(data, cursor, 100)[1] == len(_split_rows) - 2
+
+    with pytest.raises(ValueError):
+        count_rows(b'not copy data' * 2, -1, 1)
+
+
+@pytest.mark.parametrize('max_rows', [0, 1, 5, 6, 10])
+@pytest.mark.parametrize('chunk_size', [1, 7, 4096])
+def test_row_limit_bytes_io(max_rows, chunk_size):
+    data = _pack_copy_data(_split_rows, _split_formats)
+    buf = _RowLimitBytesIO(max_rows)
+    stopped = False
+    try:
+        for n in range(0, len(data), chunk_size):
+            buf.write(data[n:n + chunk_size])
+    except _RowLimitReached:
+        stopped = True
+
+    # the copy only stops once a row past the limit arrives
+    assert stopped == (max_rows < len(_split_rows))
+    out = raw_to_arrays(buf.getbuffer(), _split_type_ids)
+    assert list(out[2][0]) == [
+        None if row[2] is None else row[2].decode()
+        for row in _split_rows[:max_rows]
+    ]
+
+
+def test_row_limit_bytes_io_exact():
+    rows = _split_rows[:5]
+    data = _pack_copy_data(rows, _split_formats)
+    buf = _RowLimitBytesIO(5)
+
+    # the end of the data is not a row past the limit
+    assert buf.write(data) == len(data)
+    assert bytes(buf.getbuffer()) == data
+    out = raw_to_arrays(buf.getbuffer(), _split_type_ids)
+    assert list(out[2][0]) == [
+        None if row[2] is None else row[2].decode() for row in rows
+    ]
+
+
+def test_to_arrays_max_rows(tmp_table_uri):
+    input_dataframe = pd.DataFrame({'a': np.arange(100000)})
+    table = odo(input_dataframe, tmp_table_uri, dshape=var * R['a': 'int64'])
+
+    arrays = to_arrays(table, max_rows=10)
+    assert arrays['a'][0].tolist() == list(range(10))
+
+    df = to_dataframe(table, max_rows=3)
+    assert df.a.tolist() == [0, 1, 2]
+
+    # the limit does not need to stop the copy
+    assert len(to_arrays(table, max_rows=200000)['a'][0]) == 100000
+
+
+_filter_rows = [
+    (n, None if n % 4 == 3 else n / 2, None if n % 5 == 4 else b'abc'[n % 3:],
+     n % 2 == 0)
+    for n in range(12)
+] + [(12, float('nan'), b'', None)]
+_filter_formats = ('i', 'd', 's', '?')
+_filter_type_ids = (
+    typeid_map['int32'],
+    typeid_map['float64'],
+    typeid_map['object'],
+    typeid_map['bool'],
+)
+
+
+def _filter_match(value, op, arg):
+    """Evaluate a filter in python, with NULLs only matching ``is null``.
+    """
+    if op == 'is null':
+        return value is None
+    if value is None:
+        return False
+    if op == 'is not null':
+        return True
+    if op == 'between':
+        return arg[0] <= value <= arg[1]
+    if op == 'in':
+        return value in arg
+    return {
+        '==': value == arg,
+        '!=': value != arg,
+        '<': value < arg,
+        '<=': value <= arg,
+        '>': value > arg,
+        '>=': value >= arg,
+    }[op]
+
+
+_filter_cases = [
+    ((0, '>', 3),),
+    ((0, '<=', 3), (0, '!=', 1)),
+    ((0, 'between', (2, 9)), (1, 'is not null')),
+    ((0, 'in', (11, 2, 5, 100)),),
+    ((0, 'in', ()),),
+    ((1, '>=', 2.0),),
+    ((1, '!=', 1.5),),
+    ((1, 'in', (0.5, 2.0)),),
+    ((1, 'is null'),),
+    ((2, '==', b'bc'),),
+    ((2, '<', b'b'),),
+    ((2, 'in', (b'c', b'')),),
+    ((2, 'is null'), (3, '==', 1)),
+    ((3, '!=', 0),),
+    ((0, '==', 100),),
+]
+
+
+# the fixed width variant drops the text column, so it only runs the filters
+# which do not use it
+@pytest.mark.parametrize('filters,fixed_width', [
+    (filters, fixed_width)
+    for filters in _filter_cases
+    for fixed_width in (True, False)
+    if not fixed_width or all(column != 2 for column, *_ in filters)
+])
+def test_raw_to_arrays_filters(filters, fixed_width):
+    rows = _filter_rows
+    formats = _filter_formats
+    type_ids = _filter_type_ids
+    if fixed_width:
+        rows = [row[:2] + row[3:] for row in rows]
+        formats = formats[:2] + formats[3:]
+        type_ids = type_ids[:2] + type_ids[3:]
+        filters = tuple(
+            (2,) + filter_[1:] if filter_[0] == 3 else filter_
+            for filter_ in filters
+        )
+
+    expected = [
+        row for row in rows
+        if all(
+            _filter_match(row[column], op, arg[0] if arg else None)
+            for column, op, *arg in filters
+        )
+    ]
+    stats = {}
+    out = raw_to_arrays(
+        _pack_copy_data(rows, formats),
+        type_ids,
+        stats=stats,
+        filters=filters,
+    )
+    assert stats['rows'] == len(expected)
+    assert stats['filtered_rows'] == len(rows) - len(expected)
+    assert out[0][0].tolist() == [row[0] for row in expected]
+    assert out[1][1].tolist() == [row[1] is not None for row in expected]
+    if not fixed_width:
+        assert list(out[2][0]) == [
+            None if row[2] is None else row[2].decode() for row in expected
+        ]
+
+
+def test_raw_to_arrays_filters_max_rows():
+    # the limit counts the matching rows
+    out = raw_to_arrays(
+        _pack_copy_data(_filter_rows, _filter_formats),
+        _filter_type_ids,
+        filters=((3, '==', 1),),
+        max_rows=3,
+    )
+    assert out[0][0].tolist() == [0, 2, 4]
+
+
+def test_raw_to_arrays_filters_lazy_text():
+    type_ids = list(_filter_type_ids)
+    type_ids[2] = text_typeid_map['lazy']
+    values, mask = raw_to_arrays(
+        _pack_copy_data(_filter_rows, _filter_formats),
+        tuple(type_ids),
+        filters=((0, '>=', 9),),
+    )[2]
+    # the offsets point into the filtered data which the column keeps alive
+    assert list(LazyText(values, mask)) == [None, 'bc', 'c', '']
+
+
+def test_raw_to_arrays_filters_invalid():
+    data = _pack_copy_data(_filter_rows, _filter_formats)
+    for filters, exc in [
+            ([(0, '==', 1)], TypeError),
+            (((4, '==', 1),), ValueError),
+            (((0, '~', 1),), ValueError),
+            (((0, '=='),), TypeError),
+            (((0, 'is null', 1),), TypeError),
+            (((0, 'between', (1,)),), TypeError),
+            (((0, 'in', [1]),), TypeError),
+            (((0, '==', 'a'),), TypeError),
+            (((2, '==', 'a'),), TypeError),
+            ((('a', '==', 1),), TypeError),
+    ]:
+        with pytest.raises(exc):
+            raw_to_arrays(data, _filter_type_ids, filters=filters)
+
+
+_int16_filter_values = [-32768, -1, 0, 1, 2, 3, 32767]
+
+
+@pytest.mark.parametrize('op,value,expected', [
+    # values outside of the column's range keep their value
+    ('<', 100000, _int16_filter_values),
+    ('>', -100000, _int16_filter_values),
+    ('>=', 2 ** 40, []),
+    ('in', [70000, 1], [1]),
+    ('between', (-70000, 0), [-32768, -1, 0]),
+    # integral floats are integers
+    ('==', 2.0, [2]),
+    ('!=', np.int64(2), [-32768, -1, 0, 1, 3, 32767]),
+])
+def test_filter_spec_int_values(op, value, expected):
+    filters = _filter_spec(['a'], (typeid_map['int16'],), [('a', op, value)])
+    values, _ = raw_to_arrays(
+        _pack_copy_data([(n,) for n in _int16_filter_values], ('h',)),
+        (typeid_map['int16'],),
+        filters=filters,
+    )[0]
+    assert values.tolist() == expected
+
+
+def test_filter_spec_invalid_values():
+    type_ids = (typeid_map['int16'], typeid_map['datetime64[D]'])
+    for filter_, exc in [
+            # fractional values are not truncated
+            (('a', '==', 2.5), ValueError),
+            (('a', 'in', [70000, 1.5]), ValueError),
+            (('a', '<', float('nan')), ValueError),
+            (('a', '<', 'a'), TypeError),
+            # dates are not truncated either
+            (('b', '<', pd.Timestamp('2014-01-01 12:00')), ValueError),
+            (('b', '==', np.datetime64('NaT')), ValueError),
+    ]:
+        with pytest.raises(exc):
+            _filter_spec(['a', 'b'], type_ids, [filter_])
+
+    assert _filter_spec(
+        ['a', 'b'],
+        type_ids,
+        [('b', '<', pd.Timestamp('2014-01-02')), ('b', '>', '2014-01-01')],
+    ) == ((1, '<', 16072), (1, '>', 16071))
+
+
+def test_int_keys():
+    assert _int_keys([1, 2.0], np.dtype('int16')).tolist() == [1, 2]
+    assert _int_keys(
+        np.array(['2014-01-01'], dtype='datetime64[ns]'),
+        np.dtype('datetime64[D]'),
+    ).tolist() == [16071]
+    # the labels are returned with the dtype of the column
+    for labels, dtype in [
+            ([70000], 'int16'),
+            ([1.5], 'int64'),
+            (np.array(['2014-01-01T12'], dtype='datetime64[ns]'),
+             'datetime64[D]'),
+    ]:
+        with pytest.raises(ValueError):
+            _int_keys(labels, np.dtype(dtype))
+
+
+def test_to_arrays_filters(tmp_table_uri):
+    input_dataframe = pd.DataFrame({
+        'a': np.arange(1000),
+        'b': pd.date_range('2014-01-01', periods=1000, freq='h'),
+        'c': ['x', 'y'] * 500,
+    })
+    table = odo(
+        input_dataframe,
+        tmp_table_uri,
+        dshape=var * R['a': 'int64', 'b': 'datetime', 'c': 'string'],
+    )
+
+    stats = {}
+    arrays = to_arrays(
+        table,
+        stats=stats,
+        filters=[
+            ('b', '>=', '2014-01-02'),
+            ('c', '==', 'y'),
+            ('a', '<', 100),
+        ],
+    )
+    expected = input_dataframe[
+        (input_dataframe.b >= '2014-01-02') &
+        (input_dataframe.c == 'y') &
+        (input_dataframe.a < 100)
+    ]
+    assert arrays['a'][0].tolist() == expected.a.tolist()
+    assert stats['filtered_rows'] == 1000 - len(expected)
+
+    df = to_dataframe(
+        table,
+        filters=[('a', 'in', [3, 500, 5000])],
+        max_rows=1,
+    )
+    assert df.a.tolist() == [3]
+
+    with pytest.raises(ValueError):
+        to_arrays(table, filters=[('not_a_column', 'is null')])
+
+
+_sample_type_ids = (typeid_map['int64'], typeid_map['object'])
+
+
+def _sample_data(nrows):
+    return _pack_copy_data(
+        [(n, None if n % 3 else str(n).encode()) for n in range(nrows)],
+        ('q', 's'),
+    )
+
+
+@pytest.mark.parametrize('size', [0, 1, 5, 19, 20, 100])
+def test_raw_to_arrays_sample_reservoir(size):
+    data = _sample_data(20)
+    stats = {}
+    (ints, _), (text, _) = raw_to_arrays(
+        data,
+        _sample_type_ids,
+        stats=stats,
+        sample=('reservoir', size, 1),
+    )
+    assert stats['rows'] == len(ints) == min(size, 20)
+    # the sampled rows keep their order and their values
+    assert (np.diff(ints) > 0).all()
+    assert list(text) == [None if n % 3 else str(n) for n in ints]
+
+    # the same seed picks the same rows
+    again, _ = raw_to_arrays(
+        data,
+        _sample_type_ids,
+        sample=('reservoir', size, 1),
+    )[0]
+    np.testing.assert_array_equal(ints, again)
+
+
+@pytest.mark.parametrize('rate', [0.0, 0.1, 0.5, 1.0])
+def test_raw_to_arrays_sample_bernoulli(rate):
+    (ints, _), (text, _) = raw_to_arrays(
+        _sample_data(1000),
+        _sample_type_ids,
+        sample=('bernoulli', rate, 2),
+    )
+    assert (np.diff(ints) > 0).all()
+    assert list(text) == [None if n % 3 else str(n) for n in ints]
+    if rate in (0.0, 1.0):
+        assert len(ints) == 1000 * rate
+    else:
+        assert abs(len(ints) - 1000 * rate) < 5 * np.sqrt(1000 * rate)
+
+
+@pytest.mark.parametrize('sample', [
+    ('reservoir', 5),
+    ('bernoulli', 0.25),
+])
+def test_raw_to_arrays_sample_uniform(sample):
+    data = _sample_data(10)
+    counts = np.zeros(10)
+    for seed in range(4000):
+        ints, _ = raw_to_arrays(
+            data,
+            _sample_type_ids,
+            sample=sample + (seed,),
+        )[0]
+        counts[ints] += 1
+
+    expected = 4000 * (sample[1] / 10 if sample[0] == 'reservoir' else 0.25)
+    assert (abs(counts - expected) < 5 * np.sqrt(expected)).all()
+
+
+def test_raw_to_arrays_sample_filters():
+    # the sample is taken from the rows which match the filters
+    ints, _ = raw_to_arrays(
+        _sample_data(100),
+        _sample_type_ids,
+        filters=((1, 'is not null'),),
+        sample=('reservoir', 10, 3),
+    )[0]
+    assert len(ints) == 10
+    assert (ints % 3 == 0).all()
+
+
+@pytest.mark.parametrize('sample', [
+    ['reservoir', 1, 0],
+    ('reservoir', 1),
+    ('reservoir', -1, 0),
+    ('reservoir', 1.5, 0),
+    ('bernoulli', 1.5, 0),
+    ('bernoulli', float('nan'), 0),
+    ('bernoulli', 'a', 0),
+    ('system', 0.5, 0),
+])
+def test_raw_to_arrays_sample_invalid(sample):
+    with pytest.raises((TypeError, ValueError)):
+        raw_to_arrays(_sample_data(3), _sample_type_ids, sample=sample)
+
+
+@pytest.mark.parametrize('sample', [
+    ('reservoir', 0, 5),
+    ('reservoir', 7, 5),
+    ('reservoir', 1000, 5),
+    ('bernoulli', 0.3, 5),
+])
+@pytest.mark.parametrize('filters', [None, ((1, 'is not null'),)])
+@pytest.mark.parametrize('chunk_size', [1, 7, 4096])
+def test_sample_bytes_io(sample, filters, chunk_size):
+    data = _sample_data(100)
+    buf = _SampleBytesIO(_sample_type_ids, sample, filters)
+    for n in range(0, len(data), chunk_size):
+        assert buf.write(data[n:n + chunk_size]) == len(data[n:n + chunk_size])
+
+    # the streamed sample is the same as sampling the whole buffer
+    stats = {}
+    expected = raw_to_arrays(
+        data,
+        _sample_type_ids,
+        stats=stats,
+        filters=filters,
+        sample=sample,
+    )
+    sampled = buf.getbuffer()
+    # only the sampled rows are kept
+    assert len(sampled) < len(data) or sample[1] == 1000 and not filters
+    actual = raw_to_arrays(sampled, _sample_type_ids)
+    for (values, mask), (expected_values, expected_mask) in zip(actual,
+                                                                expected):
+        np.testing.assert_array_equal(values, expected_values)
+        np.testing.assert_array_equal(mask, expected_mask)
+    if filters:
+        assert buf.filtered_rows == stats['filtered_rows'] == 66
+    else:
+        assert buf.filtered_rows == 0
+
+
+def test_sampler_invalid():
+    data = _sample_data(10)
+    with pytest.raises(TypeError):
+        sampler_write(object(), data)
+
+    with pytest.raises(TypeError):
+        sampler_result(b'not a sampler')
+
+    # the data ends part way through a row
+    sampler = new_sampler(_sample_type_ids, ('reservoir', 5, 0))
+    used = sampler_write(sampler, data[:-5])
+    assert used < len(data) - 5
+    with pytest.raises(ValueError):
+        sampler_result(sampler)
+
+    # the header never arrived
+    sampler = new_sampler(_sample_type_ids, ('reservoir', 5, 0))
+    assert sampler_write(sampler, data[:5]) == 0
+    with pytest.raises(ValueError):
+        sampler_result(sampler)
+
+    sampler = new_sampler(_sample_type_ids, ('reservoir', 5, 0))
+    with pytest.raises(ValueError):
+        sampler_write(sampler, b'not copy data' * 2)
+
+    with pytest.raises(ValueError):
+        new_sampler(_sample_type_ids, ('system', 0.5, 0))
+
+
+def test_raw_to_arrays_sample_max_rows():
+    data = _sample_data(10000)
+    means = []
+    for seed in range(200):
+        stats = {}
+        ints, _ = raw_to_arrays(
+            data,
+            _sample_type_ids,
+            stats=stats,
+            sample=('reservoir', 100, seed),
+            max_rows=10,
+        )[0]
+        assert stats['rows'] == len(ints) == 10
+        means.append(ints.mean())
+    # the limit shrinks the reservoir instead of keeping the first rows of
+    # the sample, which would be near the start of the data
+    assert abs(np.mean(means) - 4999.5) < 5 * 2887 / np.sqrt(10 * 200)
+
+    with pytest.raises(ValueError):
+        raw_to_arrays(
+            data,
+            _sample_type_ids,
+            sample=('bernoulli', 0.5, 0),
+            max_rows=10,
+        )
+
+
+def test_sample_spec():
+    assert _sample_spec(None, None, None, 10) is None
+    assert _sample_spec(100, None, 1, None) == ('reservoir', 100, 1)
+    assert _sample_spec(100, None, 1, 10) == ('reservoir', 10, 1)
+    assert _sample_spec(5, None, 1, 10) == ('reservoir', 5, 1)
+    assert _sample_spec(None, 0.5, 1, None) == ('bernoulli', 0.5, 1)
+    for size, rate, seed, max_rows in [
+            (1, 0.5, None, None),
+            (None, None, 1, None),
+            (None, 0.5, 1, 10),
+    ]:
+        with pytest.raises(TypeError):
+            _sample_spec(size, rate, seed, max_rows)
+
+
+def test_to_arrays_sample(tmp_table_uri):
+    input_dataframe = pd.DataFrame({'a': np.arange(10000)})
+    table = odo(input_dataframe, tmp_table_uri, dshape=var * R['a': 'int64'])
+
+    arrays = to_arrays(table, sample_size=100, sample_seed=4)
+    values = arrays['a'][0]
+    assert len(values) == 100
+    assert len(np.unique(values)) == 100
+    np.testing.assert_array_equal(
+        values,
+        to_arrays(table, sample_size=100, sample_seed=4)['a'][0],
+    )
+
+    df = to_dataframe(table, sample_size=100, sample_seed=4, max_rows=10)
+    assert len(df) == 10
+
+    with pytest.raises(TypeError):
+        to_arrays(table, sample_size=1, sample_rate=0.5)
+
+    with pytest.raises(TypeError):
+        to_arrays(table, sample_rate=0.5, max_rows=10)
+
+    with pytest.raises(TypeError):
+        to_arrays(table, sample_seed=1)